@@ -0,0 +1,138 @@
+/*
+ *  linux/arch/arm/lib/xor-neon.c
+ *
+ *  NEON versions of the xor_blocks() routines.  They are called through
+ *  the wrappers in <asm/xor.h>, which take care of kernel_neon_begin()
+ *  and kernel_neon_end().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/module.h>
+#include <linux/raid/xor.h>
+
+#include <arm_neon.h>
+
+#ifndef __ARM_NEON__
+#error You should compile this file with '-mfloat-abi=softfp -mfpu=neon'
+#endif
+
+MODULE_LICENSE("GPL");
+
+/* Each loop handles one 64 byte line held in four quad registers. */
+#define LINE_BYTES	64
+
+#define LOAD_LINE(p, a)				\
+	do {					\
+		a##0 = vld1q_u8((p) + 0);	\
+		a##1 = vld1q_u8((p) + 16);	\
+		a##2 = vld1q_u8((p) + 32);	\
+		a##3 = vld1q_u8((p) + 48);	\
+	} while (0)
+
+#define XOR_LINE(p)					\
+	do {						\
+		v0 = veorq_u8(v0, vld1q_u8((p) + 0));	\
+		v1 = veorq_u8(v1, vld1q_u8((p) + 16));	\
+		v2 = veorq_u8(v2, vld1q_u8((p) + 32));	\
+		v3 = veorq_u8(v3, vld1q_u8((p) + 48));	\
+	} while (0)
+
+#define STORE_LINE(p)				\
+	do {					\
+		vst1q_u8((p) + 0, v0);		\
+		vst1q_u8((p) + 16, v1);		\
+		vst1q_u8((p) + 32, v2);		\
+		vst1q_u8((p) + 48, v3);		\
+	} while (0)
+
+static void
+xor_neon_inner_2(unsigned long bytes, unsigned long *p1, unsigned long *p2)
+{
+	uint8_t *d = (uint8_t *)p1, *s1 = (uint8_t *)p2;
+	unsigned long lines = bytes / LINE_BYTES;
+	uint8x16_t v0, v1, v2, v3;
+
+	do {
+		LOAD_LINE(d, v);
+		XOR_LINE(s1);
+		STORE_LINE(d);
+		d += LINE_BYTES;
+		s1 += LINE_BYTES;
+	} while (--lines);
+}
+
+static void
+xor_neon_inner_3(unsigned long bytes, unsigned long *p1, unsigned long *p2,
+		 unsigned long *p3)
+{
+	uint8_t *d = (uint8_t *)p1, *s1 = (uint8_t *)p2, *s2 = (uint8_t *)p3;
+	unsigned long lines = bytes / LINE_BYTES;
+	uint8x16_t v0, v1, v2, v3;
+
+	do {
+		LOAD_LINE(d, v);
+		XOR_LINE(s1);
+		XOR_LINE(s2);
+		STORE_LINE(d);
+		d += LINE_BYTES;
+		s1 += LINE_BYTES;
+		s2 += LINE_BYTES;
+	} while (--lines);
+}
+
+static void
+xor_neon_inner_4(unsigned long bytes, unsigned long *p1, unsigned long *p2,
+		 unsigned long *p3, unsigned long *p4)
+{
+	uint8_t *d = (uint8_t *)p1, *s1 = (uint8_t *)p2, *s2 = (uint8_t *)p3;
+	uint8_t *s3 = (uint8_t *)p4;
+	unsigned long lines = bytes / LINE_BYTES;
+	uint8x16_t v0, v1, v2, v3;
+
+	do {
+		LOAD_LINE(d, v);
+		XOR_LINE(s1);
+		XOR_LINE(s2);
+		XOR_LINE(s3);
+		STORE_LINE(d);
+		d += LINE_BYTES;
+		s1 += LINE_BYTES;
+		s2 += LINE_BYTES;
+		s3 += LINE_BYTES;
+	} while (--lines);
+}
+
+static void
+xor_neon_inner_5(unsigned long bytes, unsigned long *p1, unsigned long *p2,
+		 unsigned long *p3, unsigned long *p4, unsigned long *p5)
+{
+	uint8_t *d = (uint8_t *)p1, *s1 = (uint8_t *)p2, *s2 = (uint8_t *)p3;
+	uint8_t *s3 = (uint8_t *)p4, *s4 = (uint8_t *)p5;
+	unsigned long lines = bytes / LINE_BYTES;
+	uint8x16_t v0, v1, v2, v3;
+
+	do {
+		LOAD_LINE(d, v);
+		XOR_LINE(s1);
+		XOR_LINE(s2);
+		XOR_LINE(s3);
+		XOR_LINE(s4);
+		STORE_LINE(d);
+		d += LINE_BYTES;
+		s1 += LINE_BYTES;
+		s2 += LINE_BYTES;
+		s3 += LINE_BYTES;
+		s4 += LINE_BYTES;
+	} while (--lines);
+}
+
+struct xor_block_template const xor_block_neon_inner = {
+	.name	= "__inner_neon__",
+	.do_2	= xor_neon_inner_2,
+	.do_3	= xor_neon_inner_3,
+	.do_4	= xor_neon_inner_4,
+	.do_5	= xor_neon_inner_5,
+};
+EXPORT_SYMBOL(xor_block_neon_inner);
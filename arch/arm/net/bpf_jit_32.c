@@ -0,0 +1,899 @@
+/*
+ * Just-In-Time compiler for BPF filters on 32bit ARM
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ */
+
+#include <linux/bitops.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/filter.h>
+#include <linux/moduleloader.h>
+#include <linux/netdevice.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <asm/cacheflush.h>
+#include <asm/thread_info.h>
+#include <asm/unaligned.h>
+
+#include "bpf_jit_32.h"
+
+/*
+ * ABI:
+ *
+ * r0	scratch register, also the return value
+ * r1	offset of a packet load, passed to the slow path helpers
+ * r2-r3 scratch registers
+ * r4	BPF register A
+ * r5	BPF register X
+ * r6	pointer to the skb
+ * r7	skb->data
+ * r8	skb_headlen(skb)
+ *
+ * M[] lives in BPF_MEMWORDS words below the saved registers.
+ *
+ * The generated code is always ARM, also on Thumb-2 kernels: the
+ * filter is entered and left through interworking branches.  Only
+ * little endian is supported.
+ */
+
+#define r_scratch	ARM_R0
+#define r_off		ARM_R1
+#define r_A		ARM_R4
+#define r_X		ARM_R5
+#define r_skb		ARM_R6
+#define r_skb_data	ARM_R7
+#define r_skb_hl	ARM_R8
+
+#define SEEN_MEM	(1 << 0)	/* uses M[] */
+#define SEEN_DATA	(1 << 1)	/* loads packet data */
+#define SEEN_SKB	(1 << 2)	/* reads skb fields */
+#define SEEN_X		(1 << 3)	/* uses X */
+#define SEEN_CALL	(1 << 4)	/* calls a helper */
+
+/* packet loads */
+#define LOAD_SLOW	0	/* offset is negative, always use the helper */
+#define LOAD_ABS	1	/* offset is known not to be negative */
+#define LOAD_IND	2	/* offset has to be checked at run time */
+
+struct jit_ctx {
+	const struct sk_filter *skf;
+	unsigned idx;
+	unsigned prologue_len;
+	u32 seen;
+	u32 *offsets;
+	u32 *target;
+};
+
+int bpf_jit_enable __read_mostly;
+
+/*
+ * Slow path for packet loads: the data is not in the linear part of the
+ * skb, or the offset is one of the negative SKF_NET_OFF/SKF_LL_OFF ones.
+ * Mirrors load_pointer() in net/core/filter.c.  The result comes back in
+ * r0 and a non-zero error flag in r1.
+ */
+static u64 jit_load_slow(struct sk_buff *skb, int offset, unsigned int size)
+{
+	u8 buf[4], *ptr = NULL;
+
+	if (offset >= 0) {
+		if (skb_copy_bits(skb, offset, buf, size))
+			return 1ULL << 32;
+		ptr = buf;
+	} else {
+		if (offset >= SKF_NET_OFF)
+			ptr = skb_network_header(skb) + offset - SKF_NET_OFF;
+		else if (offset >= SKF_LL_OFF)
+			ptr = skb_mac_header(skb) + offset - SKF_LL_OFF;
+
+		if (!ptr || ptr < skb->head ||
+		    ptr + size > skb_tail_pointer(skb))
+			return 1ULL << 32;
+	}
+
+	switch (size) {
+	case 1:
+		return *ptr;
+	case 2:
+		return get_unaligned_be16(ptr);
+	default:
+		return get_unaligned_be32(ptr);
+	}
+}
+
+static u64 jit_get_skb_b(struct sk_buff *skb, int offset)
+{
+	return jit_load_slow(skb, offset, 1);
+}
+
+static u64 jit_get_skb_h(struct sk_buff *skb, int offset)
+{
+	return jit_load_slow(skb, offset, 2);
+}
+
+static u64 jit_get_skb_w(struct sk_buff *skb, int offset)
+{
+	return jit_load_slow(skb, offset, 4);
+}
+
+/*
+ * Only ARMv7-R and some ARMv7-A cores have a hardware divider.
+ */
+static u32 jit_udiv(u32 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline void _emit(int cond, u32 inst, struct jit_ctx *ctx)
+{
+	if (ctx->target != NULL)
+		ctx->target[ctx->idx] = inst | (cond << 28);
+
+	ctx->idx++;
+}
+
+/*
+ * Emit an instruction that will be executed unconditionally.
+ */
+static inline void emit(u32 inst, struct jit_ctx *ctx)
+{
+	_emit(ARM_COND_AL, inst, ctx);
+}
+
+static u16 saved_regs(struct jit_ctx *ctx)
+{
+	u16 ret = 1 << r_A;
+	int reg;
+
+	if (ctx->seen & (SEEN_DATA | SEEN_SKB))
+		ret |= 1 << r_skb;
+	if (ctx->seen & SEEN_DATA)
+		ret |= (1 << r_skb_data) | (1 << r_skb_hl);
+	if (ctx->seen & SEEN_X)
+		ret |= 1 << r_X;
+	if (ctx->seen & SEEN_CALL)
+		ret |= 1 << ARM_LR;
+
+	/* the EABI wants an 8 byte aligned stack at calls */
+	if (hweight16(ret) & 1) {
+		for (reg = ARM_R4; reg <= ARM_R10; reg++) {
+			if (!(ret & (1 << reg))) {
+				ret |= 1 << reg;
+				break;
+			}
+		}
+	}
+
+	return ret;
+}
+
+static inline int mem_words_used(struct jit_ctx *ctx)
+{
+	return ctx->seen & SEEN_MEM ? BPF_MEMWORDS * 4 : 0;
+}
+
+static inline bool is_load_to_a(u16 inst)
+{
+	switch (inst) {
+	case BPF_S_LD_W_LEN:
+	case BPF_S_LD_W_ABS:
+	case BPF_S_LD_H_ABS:
+	case BPF_S_LD_B_ABS:
+	case BPF_S_ANC_CPU:
+	case BPF_S_ANC_IFINDEX:
+	case BPF_S_ANC_MARK:
+	case BPF_S_ANC_PROTOCOL:
+	case BPF_S_ANC_RXHASH:
+	case BPF_S_ANC_QUEUE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void build_prologue(struct jit_ctx *ctx)
+{
+	u16 reg_set = saved_regs(ctx);
+	u16 first_inst = ctx->skf->insns[0].code;
+
+	emit(ARM_PUSH(reg_set), ctx);
+
+	if (ctx->seen & SEEN_MEM)
+		emit(ARM_SUB_I(ARM_SP, ARM_SP, mem_words_used(ctx)), ctx);
+
+	if (ctx->seen & (SEEN_DATA | SEEN_SKB))
+		emit(ARM_MOV_R(r_skb, ARM_R0), ctx);
+
+	if (ctx->seen & SEEN_DATA) {
+		emit(ARM_LDR_I(r_skb_data, r_skb,
+			       offsetof(struct sk_buff, data)), ctx);
+		/* headlen = len - data_len */
+		emit(ARM_LDR_I(r_skb_hl, r_skb,
+			       offsetof(struct sk_buff, len)), ctx);
+		emit(ARM_LDR_I(r_scratch, r_skb,
+			       offsetof(struct sk_buff, data_len)), ctx);
+		emit(ARM_SUB_R(r_skb_hl, r_skb_hl, r_scratch), ctx);
+	}
+
+	/* make sure we dont leak kernel information to user */
+	if (ctx->seen & SEEN_X)
+		emit(ARM_MOV_I(r_X, 0), ctx);
+	if (!is_load_to_a(first_inst))
+		emit(ARM_MOV_I(r_A, 0), ctx);
+}
+
+static void build_epilogue(struct jit_ctx *ctx)
+{
+	u16 reg_set = saved_regs(ctx);
+
+	if (ctx->seen & SEEN_MEM)
+		emit(ARM_ADD_I(ARM_SP, ARM_SP, mem_words_used(ctx)), ctx);
+
+	if (reg_set & (1 << ARM_LR)) {
+		reg_set &= ~(1 << ARM_LR);
+		reg_set |= 1 << ARM_PC;
+		emit(ARM_POP(reg_set), ctx);
+	} else {
+		emit(ARM_POP(reg_set), ctx);
+#if __LINUX_ARM_ARCH__ < 5
+		emit(ARM_MOV_R(ARM_PC, ARM_LR), ctx);
+#else
+		emit(ARM_BX(ARM_LR), ctx);
+#endif
+	}
+}
+
+/*
+ * Encode @x as a data processing immediate: 8 bits rotated right by an
+ * even amount.  Returns -1 if that is not possible.
+ */
+static int imm8m(u32 x)
+{
+	u32 rot;
+
+	if (x <= 0xff)
+		return x;
+
+	for (rot = 1; rot < 16; rot++)
+		if ((x & ~ror32(0xff, 2 * rot)) == 0)
+			return rol32(x, 2 * rot) | (rot << 8);
+
+	return -1;
+}
+
+/*
+ * Load a constant.  The number of instructions depends only on @val, so
+ * both passes agree on the size.
+ */
+static void emit_mov_i(int rd, u32 val, struct jit_ctx *ctx)
+{
+	int imm12 = imm8m(val);
+#if __LINUX_ARM_ARCH__ < 7
+	int shift, first = 1;
+#endif
+
+	if (imm12 >= 0) {
+		emit(ARM_MOV_I(rd, imm12), ctx);
+		return;
+	}
+
+	imm12 = imm8m(~val);
+	if (imm12 >= 0) {
+		emit(ARM_MVN_I(rd, imm12), ctx);
+		return;
+	}
+
+#if __LINUX_ARM_ARCH__ < 7
+	/* one byte at a time, every byte is a valid immediate */
+	for (shift = 0; shift < 32; shift += 8) {
+		u32 byte = val & (0xff << shift);
+
+		if (!byte)
+			continue;
+		imm12 = imm8m(byte);
+		if (first)
+			emit(ARM_MOV_I(rd, imm12), ctx);
+		else
+			emit(ARM_ORR_I(rd, rd, imm12), ctx);
+		first = 0;
+	}
+#else
+	emit(ARM_MOVW(rd, val & 0xffff), ctx);
+	if (val > 0xffff)
+		emit(ARM_MOVT(rd, val >> 16), ctx);
+#endif
+}
+
+static void emit_blx_r(u8 tgt_reg, struct jit_ctx *ctx)
+{
+#if __LINUX_ARM_ARCH__ < 5
+	emit(ARM_MOV_R(ARM_LR, ARM_PC), ctx);
+	emit(ARM_MOV_R(ARM_PC, tgt_reg), ctx);
+#else
+	emit(ARM_BLX_R(tgt_reg), ctx);
+#endif
+}
+
+/*
+ * Offset for a branch from the current instruction to the start of BPF
+ * instruction @tgt; the epilogue counts as instruction skf->len.
+ */
+static inline int b_imm(unsigned tgt, struct jit_ctx *ctx)
+{
+	if (ctx->target == NULL)
+		return 0;
+
+	/* the PC reads two instructions ahead */
+	return ctx->prologue_len + ctx->offsets[tgt] - (ctx->idx + 2);
+}
+
+/*
+ * Return 0 from the filter.
+ */
+static inline void emit_err_ret(u8 cond, struct jit_ctx *ctx)
+{
+	_emit(cond, ARM_MOV_I(ARM_R0, 0), ctx);
+	_emit(cond, ARM_B(b_imm(ctx->skf->len, ctx)), ctx);
+}
+
+static void emit_load_be32(u8 cond, u8 r_res, u8 r_addr, struct jit_ctx *ctx)
+{
+#if __LINUX_ARM_ARCH__ < 6
+	_emit(cond, ARM_LDRB_I(ARM_R3, r_addr, 0), ctx);
+	_emit(cond, ARM_LDRB_I(ARM_R2, r_addr, 1), ctx);
+	_emit(cond, ARM_ORR_S(ARM_R3, ARM_R2, ARM_R3, SRTYPE_LSL, 8), ctx);
+	_emit(cond, ARM_LDRB_I(ARM_R2, r_addr, 2), ctx);
+	_emit(cond, ARM_ORR_S(ARM_R3, ARM_R2, ARM_R3, SRTYPE_LSL, 8), ctx);
+	_emit(cond, ARM_LDRB_I(ARM_R2, r_addr, 3), ctx);
+	_emit(cond, ARM_ORR_S(r_res, ARM_R2, ARM_R3, SRTYPE_LSL, 8), ctx);
+#else
+	/* ARMv6 handles unaligned word and halfword loads itself */
+	_emit(cond, ARM_LDR_I(r_res, r_addr, 0), ctx);
+	_emit(cond, ARM_REV(r_res, r_res), ctx);
+#endif
+}
+
+static void emit_load_be16(u8 cond, u8 r_res, u8 r_addr, struct jit_ctx *ctx)
+{
+#if __LINUX_ARM_ARCH__ < 6
+	_emit(cond, ARM_LDRB_I(ARM_R3, r_addr, 0), ctx);
+	_emit(cond, ARM_LDRB_I(ARM_R2, r_addr, 1), ctx);
+	_emit(cond, ARM_ORR_S(r_res, ARM_R2, ARM_R3, SRTYPE_LSL, 8), ctx);
+#else
+	_emit(cond, ARM_LDRH_I(r_res, r_addr, 0), ctx);
+	_emit(cond, ARM_REV16(r_res, r_res), ctx);
+#endif
+}
+
+static void emit_swap16(u8 r_dst, u8 r_src, struct jit_ctx *ctx)
+{
+#if __LINUX_ARM_ARCH__ < 6
+	emit(ARM_LSR_I(ARM_R3, r_src, 8), ctx);
+	emit(ARM_AND_I(r_dst, r_src, 0xff), ctx);
+	emit(ARM_ORR_S(r_dst, ARM_R3, r_dst, SRTYPE_LSL, 8), ctx);
+#else
+	emit(ARM_REV16(r_dst, r_src), ctx);
+#endif
+}
+
+/*
+ * ldrh only has an 8 bit offset.
+ */
+static void emit_ldrh_field(u8 rd, u8 rn, u32 off, struct jit_ctx *ctx)
+{
+	if (off <= 0xff) {
+		emit(ARM_LDRH_I(rd, rn, off), ctx);
+	} else {
+		emit_mov_i(ARM_R3, off, ctx);
+		emit(ARM_LDRH_R(rd, rn, ARM_R3), ctx);
+	}
+}
+
+/*
+ * Load 1 << @order bytes from packet offset r_off into @rd, in host
+ * order.  Offsets inside the linear data are read inline, everything
+ * else goes through the jit_get_skb_*() helpers.  If those fail the
+ * filter returns 0, as the interpreter does.
+ */
+static void emit_load_skb(u8 order, u8 rd, int mode, struct jit_ctx *ctx)
+{
+	static void * const helpers[] = {
+		jit_get_skb_b, jit_get_skb_h, jit_get_skb_w
+	};
+	unsigned skip = 0;
+
+	ctx->seen |= SEEN_DATA | SEEN_CALL;
+
+	if (mode != LOAD_SLOW) {
+		/* inline if 0 <= offset <= headlen - size */
+		emit(ARM_SUB_I(r_scratch, r_skb_hl, 1 << order), ctx);
+		if (mode == LOAD_IND) {
+			emit(ARM_CMP_I(r_off, 0), ctx);
+			_emit(ARM_COND_GE, ARM_CMP_R(r_scratch, r_off), ctx);
+		} else {
+			emit(ARM_CMP_R(r_scratch, r_off), ctx);
+		}
+		_emit(ARM_COND_GE, ARM_ADD_R(r_scratch, r_off, r_skb_data),
+		      ctx);
+		if (order == 0)
+			_emit(ARM_COND_GE, ARM_LDRB_I(rd, r_scratch, 0), ctx);
+		else if (order == 1)
+			emit_load_be16(ARM_COND_GE, rd, r_scratch, ctx);
+		else
+			emit_load_be32(ARM_COND_GE, rd, r_scratch, ctx);
+		/* branch over the slow path, patched below */
+		skip = ctx->idx;
+		_emit(ARM_COND_GE, ARM_B(0), ctx);
+	}
+
+	/* the offset is already in r1 */
+	emit(ARM_MOV_R(ARM_R0, r_skb), ctx);
+	emit_mov_i(ARM_R3, (u32)helpers[order], ctx);
+	emit_blx_r(ARM_R3, ctx);
+	emit(ARM_CMP_I(ARM_R1, 0), ctx);
+	emit_err_ret(ARM_COND_NE, ctx);
+	emit(ARM_MOV_R(rd, ARM_R0), ctx);
+
+	if (mode != LOAD_SLOW && ctx->target != NULL)
+		ctx->target[skip] |= ARM_B(ctx->idx - (skip + 2));
+}
+
+/*
+ * A = A <op> K, with K as an immediate operand if it fits.
+ */
+static void emit_alu_k(u32 inst_i, u32 inst_r, u32 k, struct jit_ctx *ctx)
+{
+	int imm12 = imm8m(k);
+
+	if (imm12 >= 0) {
+		emit(inst_i | r_A << 12 | r_A << 16 | imm12, ctx);
+	} else {
+		emit_mov_i(r_scratch, k, ctx);
+		emit(inst_r | r_A << 12 | r_A << 16 | r_scratch, ctx);
+	}
+}
+
+static int build_body(struct jit_ctx *ctx)
+{
+	const struct sk_filter *prog = ctx->skf;
+	const struct sock_filter *inst;
+	unsigned i, load_order, condt;
+	int imm12;
+	u32 k;
+
+	for (i = 0; i < prog->len; i++) {
+		inst = &(prog->insns[i]);
+		k = inst->k;
+
+		ctx->offsets[i] = ctx->idx - ctx->prologue_len;
+
+		switch (inst->code) {
+		case BPF_S_LD_IMM:
+			emit_mov_i(r_A, k, ctx);
+			break;
+		case BPF_S_LD_W_LEN:
+			ctx->seen |= SEEN_SKB;
+			BUILD_BUG_ON(FIELD_SIZEOF(struct sk_buff, len) != 4);
+			emit(ARM_LDR_I(r_A, r_skb,
+				       offsetof(struct sk_buff, len)), ctx);
+			break;
+		case BPF_S_LD_MEM:
+			/* A = scratch[k] */
+			ctx->seen |= SEEN_MEM;
+			emit(ARM_LDR_I(r_A, ARM_SP, k * 4), ctx);
+			break;
+		case BPF_S_LD_W_ABS:
+			load_order = 2;
+			goto load_abs;
+		case BPF_S_LD_H_ABS:
+			load_order = 1;
+			goto load_abs;
+		case BPF_S_LD_B_ABS:
+			load_order = 0;
+load_abs:
+			emit_mov_i(r_off, k, ctx);
+			emit_load_skb(load_order, r_A,
+				      (int)k < 0 ? LOAD_SLOW : LOAD_ABS, ctx);
+			break;
+		case BPF_S_LD_W_IND:
+			load_order = 2;
+			goto load_ind;
+		case BPF_S_LD_H_IND:
+			load_order = 1;
+			goto load_ind;
+		case BPF_S_LD_B_IND:
+			load_order = 0;
+load_ind:
+			/* offset = X + k, may come out negative */
+			ctx->seen |= SEEN_X;
+			imm12 = imm8m(k);
+			if (imm12 >= 0) {
+				emit(ARM_ADD_I(r_off, r_X, imm12), ctx);
+			} else {
+				emit_mov_i(r_off, k, ctx);
+				emit(ARM_ADD_R(r_off, r_off, r_X), ctx);
+			}
+			emit_load_skb(load_order, r_A, LOAD_IND, ctx);
+			break;
+		case BPF_S_LDX_IMM:
+			ctx->seen |= SEEN_X;
+			emit_mov_i(r_X, k, ctx);
+			break;
+		case BPF_S_LDX_W_LEN:
+			ctx->seen |= SEEN_X | SEEN_SKB;
+			emit(ARM_LDR_I(r_X, r_skb,
+				       offsetof(struct sk_buff, len)), ctx);
+			break;
+		case BPF_S_LDX_MEM:
+			ctx->seen |= SEEN_X | SEEN_MEM;
+			emit(ARM_LDR_I(r_X, ARM_SP, k * 4), ctx);
+			break;
+		case BPF_S_LDX_B_MSH:
+			/* x = ((*(frame + k)) & 0xf) << 2; */
+			ctx->seen |= SEEN_X;
+			emit_mov_i(r_off, k, ctx);
+			emit_load_skb(0, r_X,
+				      (int)k < 0 ? LOAD_SLOW : LOAD_ABS, ctx);
+			emit(ARM_AND_I(r_X, r_X, 0x0f), ctx);
+			emit(ARM_LSL_I(r_X, r_X, 2), ctx);
+			break;
+		case BPF_S_ST:
+			ctx->seen |= SEEN_MEM;
+			emit(ARM_STR_I(r_A, ARM_SP, k * 4), ctx);
+			break;
+		case BPF_S_STX:
+			ctx->seen |= SEEN_MEM | SEEN_X;
+			emit(ARM_STR_I(r_X, ARM_SP, k * 4), ctx);
+			break;
+		case BPF_S_ALU_ADD_K:
+			/* A += K */
+			imm12 = imm8m(-k);
+			if (imm8m(k) < 0 && imm12 >= 0)
+				emit(ARM_SUB_I(r_A, r_A, imm12), ctx);
+			else
+				emit_alu_k(ARM_INST_ADD_I, ARM_INST_ADD_R, k,
+					   ctx);
+			break;
+		case BPF_S_ALU_ADD_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_ADD_R(r_A, r_A, r_X), ctx);
+			break;
+		case BPF_S_ALU_SUB_K:
+			/* A -= K */
+			imm12 = imm8m(-k);
+			if (imm8m(k) < 0 && imm12 >= 0)
+				emit(ARM_ADD_I(r_A, r_A, imm12), ctx);
+			else
+				emit_alu_k(ARM_INST_SUB_I, ARM_INST_SUB_R, k,
+					   ctx);
+			break;
+		case BPF_S_ALU_SUB_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_SUB_R(r_A, r_A, r_X), ctx);
+			break;
+		case BPF_S_ALU_MUL_K:
+			/* A *= K */
+			emit_mov_i(ARM_R3, k, ctx);
+			emit(ARM_MUL(r_A, ARM_R3, r_A), ctx);
+			break;
+		case BPF_S_ALU_MUL_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_MUL(r_A, r_X, r_A), ctx);
+			break;
+		case BPF_S_ALU_DIV_K:
+			/*
+			 * sk_chk_filter() replaced K by its reciprocal:
+			 * A = ((u64)A * K) >> 32
+			 */
+			emit_mov_i(ARM_R3, k, ctx);
+			emit(ARM_UMULL(ARM_R2, ARM_R1, r_A, ARM_R3), ctx);
+			emit(ARM_MOV_R(r_A, ARM_R1), ctx);
+			break;
+		case BPF_S_ALU_DIV_X:
+			ctx->seen |= SEEN_X | SEEN_CALL;
+			emit(ARM_CMP_I(r_X, 0), ctx);
+			emit_err_ret(ARM_COND_EQ, ctx);
+			emit(ARM_MOV_R(ARM_R0, r_A), ctx);
+			emit(ARM_MOV_R(ARM_R1, r_X), ctx);
+			emit_mov_i(ARM_R3, (u32)jit_udiv, ctx);
+			emit_blx_r(ARM_R3, ctx);
+			emit(ARM_MOV_R(r_A, ARM_R0), ctx);
+			break;
+		case BPF_S_ALU_OR_K:
+			/* A |= K */
+			emit_alu_k(ARM_INST_ORR_I, ARM_INST_ORR_R, k, ctx);
+			break;
+		case BPF_S_ALU_OR_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_ORR_R(r_A, r_A, r_X), ctx);
+			break;
+		case BPF_S_ALU_AND_K:
+			/* A &= K */
+			imm12 = imm8m(~k);
+			if (imm8m(k) < 0 && imm12 >= 0)
+				emit(ARM_BIC_I(r_A, r_A, imm12), ctx);
+			else
+				emit_alu_k(ARM_INST_AND_I, ARM_INST_AND_R, k,
+					   ctx);
+			break;
+		case BPF_S_ALU_AND_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_AND_R(r_A, r_A, r_X), ctx);
+			break;
+		case BPF_S_ALU_LSH_K:
+			/*
+			 * Shifts by 32 or more behave as the interpreter's
+			 * register shifts do.
+			 */
+			if (k < 32) {
+				emit(ARM_LSL_I(r_A, r_A, k), ctx);
+			} else {
+				emit_mov_i(r_scratch, k, ctx);
+				emit(ARM_LSL_R(r_A, r_A, r_scratch), ctx);
+			}
+			break;
+		case BPF_S_ALU_LSH_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_LSL_R(r_A, r_A, r_X), ctx);
+			break;
+		case BPF_S_ALU_RSH_K:
+			if (k == 0)
+				break;
+			if (k < 32) {
+				emit(ARM_LSR_I(r_A, r_A, k), ctx);
+			} else {
+				emit_mov_i(r_scratch, k, ctx);
+				emit(ARM_LSR_R(r_A, r_A, r_scratch), ctx);
+			}
+			break;
+		case BPF_S_ALU_RSH_X:
+			ctx->seen |= SEEN_X;
+			emit(ARM_LSR_R(r_A, r_A, r_X), ctx);
+			break;
+		case BPF_S_ALU_NEG:
+			/* A = -A */
+			emit(ARM_RSB_I(r_A, r_A, 0), ctx);
+			break;
+		case BPF_S_JMP_JA:
+			/* pc += K */
+			emit(ARM_B(b_imm(i + k + 1, ctx)), ctx);
+			break;
+		case BPF_S_JMP_JEQ_K:
+			/* pc += (A == K) ? pc->jt : pc->jf */
+			condt = ARM_COND_EQ;
+			goto cmp_imm;
+		case BPF_S_JMP_JGT_K:
+			/* pc += (A > K) ? pc->jt : pc->jf */
+			condt = ARM_COND_HI;
+			goto cmp_imm;
+		case BPF_S_JMP_JGE_K:
+			/* pc += (A >= K) ? pc->jt : pc->jf */
+			condt = ARM_COND_HS;
+cmp_imm:
+			imm12 = imm8m(k);
+			if (imm12 < 0) {
+				emit_mov_i(r_scratch, k, ctx);
+				emit(ARM_CMP_R(r_A, r_scratch), ctx);
+			} else {
+				emit(ARM_CMP_I(r_A, imm12), ctx);
+			}
+cond_jump:
+			if (inst->jt)
+				_emit(condt, ARM_B(b_imm(i + inst->jt + 1,
+						   ctx)), ctx);
+			/* the opposite condition differs in the low bit */
+			if (inst->jf)
+				_emit(condt ^ 1, ARM_B(b_imm(i + inst->jf + 1,
+						       ctx)), ctx);
+			break;
+		case BPF_S_JMP_JEQ_X:
+			/* pc += (A == X) ? pc->jt : pc->jf */
+			condt = ARM_COND_EQ;
+			goto cmp_x;
+		case BPF_S_JMP_JGT_X:
+			/* pc += (A > X) ? pc->jt : pc->jf */
+			condt = ARM_COND_HI;
+			goto cmp_x;
+		case BPF_S_JMP_JGE_X:
+			/* pc += (A >= X) ? pc->jt : pc->jf */
+			condt = ARM_COND_HS;
+cmp_x:
+			ctx->seen |= SEEN_X;
+			emit(ARM_CMP_R(r_A, r_X), ctx);
+			goto cond_jump;
+		case BPF_S_JMP_JSET_K:
+			/* pc += (A & K) ? pc->jt : pc->jf */
+			condt = ARM_COND_NE;
+			imm12 = imm8m(k);
+			if (imm12 < 0) {
+				emit_mov_i(r_scratch, k, ctx);
+				emit(ARM_TST_R(r_A, r_scratch), ctx);
+			} else {
+				emit(ARM_TST_I(r_A, imm12), ctx);
+			}
+			goto cond_jump;
+		case BPF_S_JMP_JSET_X:
+			/* pc += (A & X) ? pc->jt : pc->jf */
+			ctx->seen |= SEEN_X;
+			condt = ARM_COND_NE;
+			emit(ARM_TST_R(r_A, r_X), ctx);
+			goto cond_jump;
+		case BPF_S_RET_A:
+			emit(ARM_MOV_R(ARM_R0, r_A), ctx);
+			goto b_epilogue;
+		case BPF_S_RET_K:
+			emit_mov_i(ARM_R0, k, ctx);
+b_epilogue:
+			if (i != ctx->skf->len - 1)
+				emit(ARM_B(b_imm(prog->len, ctx)), ctx);
+			break;
+		case BPF_S_MISC_TAX:
+			/* X = A */
+			ctx->seen |= SEEN_X;
+			emit(ARM_MOV_R(r_X, r_A), ctx);
+			break;
+		case BPF_S_MISC_TXA:
+			/* A = X */
+			ctx->seen |= SEEN_X;
+			emit(ARM_MOV_R(r_A, r_X), ctx);
+			break;
+		case BPF_S_ANC_PROTOCOL:
+			/* A = ntohs(skb->protocol) */
+			ctx->seen |= SEEN_SKB;
+			BUILD_BUG_ON(FIELD_SIZEOF(struct sk_buff,
+						  protocol) != 2);
+			emit_ldrh_field(r_A, r_skb,
+					offsetof(struct sk_buff, protocol),
+					ctx);
+			emit_swap16(r_A, r_A, ctx);
+			break;
+		case BPF_S_ANC_CPU:
+#ifdef CONFIG_SMP
+			/* thread_info sits at the bottom of the stack */
+			emit(ARM_MOV_R(r_scratch, ARM_SP), ctx);
+			emit(ARM_LSR_I(r_scratch, r_scratch,
+				       THREAD_SIZE_ORDER + PAGE_SHIFT), ctx);
+			emit(ARM_LSL_I(r_scratch, r_scratch,
+				       THREAD_SIZE_ORDER + PAGE_SHIFT), ctx);
+			BUILD_BUG_ON(FIELD_SIZEOF(struct thread_info,
+						  cpu) != 4);
+			emit(ARM_LDR_I(r_A, r_scratch,
+				       offsetof(struct thread_info, cpu)), ctx);
+#else
+			emit(ARM_MOV_I(r_A, 0), ctx);
+#endif
+			break;
+		case BPF_S_ANC_IFINDEX:
+		case BPF_S_ANC_HATYPE:
+			/* A = skb->dev->ifindex or skb->dev->type */
+			ctx->seen |= SEEN_SKB;
+			emit(ARM_LDR_I(r_scratch, r_skb,
+				       offsetof(struct sk_buff, dev)), ctx);
+			emit(ARM_CMP_I(r_scratch, 0), ctx);
+			emit_err_ret(ARM_COND_EQ, ctx);
+
+			if (inst->code == BPF_S_ANC_IFINDEX) {
+				BUILD_BUG_ON(FIELD_SIZEOF(struct net_device,
+							  ifindex) != 4);
+				emit(ARM_LDR_I(r_A, r_scratch,
+					       offsetof(struct net_device,
+							ifindex)), ctx);
+			} else {
+				BUILD_BUG_ON(FIELD_SIZEOF(struct net_device,
+							  type) != 2);
+				emit_ldrh_field(r_A, r_scratch,
+						offsetof(struct net_device,
+							 type), ctx);
+			}
+			break;
+		case BPF_S_ANC_MARK:
+			ctx->seen |= SEEN_SKB;
+			BUILD_BUG_ON(FIELD_SIZEOF(struct sk_buff, mark) != 4);
+			emit(ARM_LDR_I(r_A, r_skb,
+				       offsetof(struct sk_buff, mark)), ctx);
+			break;
+		case BPF_S_ANC_RXHASH:
+			ctx->seen |= SEEN_SKB;
+			BUILD_BUG_ON(FIELD_SIZEOF(struct sk_buff, rxhash) != 4);
+			emit(ARM_LDR_I(r_A, r_skb,
+				       offsetof(struct sk_buff, rxhash)), ctx);
+			break;
+		case BPF_S_ANC_QUEUE:
+			ctx->seen |= SEEN_SKB;
+			BUILD_BUG_ON(FIELD_SIZEOF(struct sk_buff,
+						  queue_mapping) != 2);
+			emit_ldrh_field(r_A, r_skb,
+					offsetof(struct sk_buff, queue_mapping),
+					ctx);
+			break;
+		default:
+			/* leave the rest to the interpreter */
+			return -1;
+		}
+	}
+
+	/* the epilogue follows the last instruction */
+	ctx->offsets[i] = ctx->idx - ctx->prologue_len;
+
+	return 0;
+}
+
+
+void bpf_jit_compile(struct sk_filter *fp)
+{
+	struct jit_ctx ctx;
+	unsigned tmp_idx;
+	unsigned alloc_size;
+
+	if (!bpf_jit_enable)
+		return;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.skf		= fp;
+
+	ctx.offsets = kzalloc(4 * (ctx.skf->len + 1), GFP_KERNEL);
+	if (ctx.offsets == NULL)
+		return;
+
+	/* fake pass to fill in ctx.seen and ctx.offsets */
+	if (build_body(&ctx) < 0)
+		goto out;
+
+	tmp_idx = ctx.idx;
+	build_prologue(&ctx);
+	ctx.prologue_len = ctx.idx - tmp_idx;
+	build_epilogue(&ctx);
+
+	alloc_size = 4 * ctx.idx;
+	ctx.target = module_alloc(max(sizeof(struct work_struct),
+				      alloc_size));
+	if (unlikely(ctx.target == NULL))
+		goto out;
+
+	ctx.idx = 0;
+	build_prologue(&ctx);
+	build_body(&ctx);
+	build_epilogue(&ctx);
+
+	if (WARN_ON(4 * ctx.idx != alloc_size)) {
+		module_free(NULL, ctx.target);
+		goto out;
+	}
+
+	flush_icache_range((u32)ctx.target, (u32)(ctx.target + ctx.idx));
+
+	if (bpf_jit_enable > 1) {
+		pr_err("flen=%d proglen=%u image=%p\n",
+		       fp->len, alloc_size, ctx.target);
+		print_hex_dump(KERN_ERR, "JIT code: ", DUMP_PREFIX_ADDRESS,
+			       16, 4, ctx.target, alloc_size, false);
+	}
+
+	fp->bpf_func = (void *)ctx.target;
+out:
+	kfree(ctx.offsets);
+	return;
+}
+
+static void bpf_jit_free_worker(struct work_struct *work)
+{
+	module_free(NULL, work);
+}
+
+/* run from softirq, we must use a work_struct to call
+ * module_free() from process context
+ */
+void bpf_jit_free(struct sk_filter *fp)
+{
+	struct work_struct *work;
+
+	if (fp->bpf_func != sk_run_filter) {
+		work = (struct work_struct *)fp->bpf_func;
+
+		INIT_WORK(work, bpf_jit_free_worker);
+		schedule_work(work);
+	}
+}
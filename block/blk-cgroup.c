@@ -180,6 +180,23 @@ static inline void blkio_update_group_iops(struct blkio_group *blkg,
 	}
 }
 
+static inline void blkio_update_group_latency_target(struct blkio_group *blkg,
+			u64 target)
+{
+	struct blkio_policy_type *blkiop;
+
+	list_for_each_entry(blkiop, &blkio_list, list) {
+
+		/* If this policy does not own the blkg, do not send updates */
+		if (blkiop->plid != blkg->plid)
+			continue;
+
+		if (blkiop->ops.blkio_update_group_latency_target_fn)
+			blkiop->ops.blkio_update_group_latency_target_fn(
+							blkg->key, blkg, target);
+	}
+}
+
 /*
  * Add to the appropriate stat variable depending on the request type.
  * This should be called with the blkg->stats_lock held.
@@ -856,6 +873,11 @@ static int blkio_policy_parse_and_set(char *buf,
 			break;
 		}
 		break;
+	case BLKIO_POLICY_LAT:
+		newpn->plid = plid;
+		newpn->fileid = fileid;
+		newpn->val.target = temp;
+		break;
 	default:
 		BUG();
 	}
@@ -951,6 +973,24 @@ unsigned int blkcg_get_write_iops(struct blkio_cgroup *blkcg, dev_t dev)
 	return iops;
 }
 
+/* Returns the completion latency target in usec, 0 if there is none */
+u64 blkcg_get_latency_target(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+	unsigned long flags;
+	u64 target = 0;
+
+	spin_lock_irqsave(&blkcg->lock, flags);
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_LAT,
+				BLKIO_LAT_target_device);
+	if (pn)
+		target = pn->val.target;
+	spin_unlock_irqrestore(&blkcg->lock, flags);
+
+	return target;
+}
+EXPORT_SYMBOL_GPL(blkcg_get_latency_target);
+
 /* Checks whether user asked for deleting a policy rule */
 static bool blkio_delete_rule_command(struct blkio_policy_node *pn)
 {
@@ -972,6 +1012,10 @@ static bool blkio_delete_rule_command(struct blkio_policy_node *pn)
 				return 1;
 		}
 		break;
+	case BLKIO_POLICY_LAT:
+		if (pn->val.target == 0)
+			return 1;
+		break;
 	default:
 		BUG();
 	}
@@ -997,6 +1041,9 @@ static void blkio_update_policy_rule(struct blkio_policy_node *oldpn,
 			oldpn->val.iops = newpn->val.iops;
 		}
 		break;
+	case BLKIO_POLICY_LAT:
+		oldpn->val.target = newpn->val.target;
+		break;
 	default:
 		BUG();
 	}
@@ -1032,6 +1079,9 @@ static void blkio_update_blkg_policy(struct blkio_cgroup *blkcg,
 			break;
 		}
 		break;
+	case BLKIO_POLICY_LAT:
+		blkio_update_group_latency_target(blkg, pn->val.target);
+		break;
 	default:
 		BUG();
 	}
@@ -1143,6 +1193,10 @@ blkio_print_policy_node(struct seq_file *m, struct blkio_policy_node *pn)
 				break;
 			}
 			break;
+		case BLKIO_POLICY_LAT:
+			seq_printf(m, "%u:%u\t%llu\n", MAJOR(pn->dev),
+				MINOR(pn->dev), pn->val.target);
+			break;
 		default:
 			BUG();
 	}
@@ -1196,6 +1250,15 @@ static int blkiocg_file_read(struct cgroup *cgrp, struct cftype *cft,
 			BUG();
 		}
 		break;
+	case BLKIO_POLICY_LAT:
+		switch(name) {
+		case BLKIO_LAT_target_device:
+			blkio_read_policy_node_files(cft, blkcg, m);
+			return 0;
+		default:
+			BUG();
+		}
+		break;
 	default:
 		BUG();
 	}
@@ -1500,6 +1563,17 @@ struct cftype blkio_files[] = {
 	},
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+#if defined(CONFIG_IOSCHED_LATENCY) || defined(CONFIG_IOSCHED_LATENCY_MODULE)
+	{
+		.name = "latency.target_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_LAT,
+				BLKIO_LAT_target_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
+#endif
+
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	{
 		.name = "avg_queue_size",
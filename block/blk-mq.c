@@ -0,0 +1,1028 @@
+/*
+ * Block multiqueue core code
+ *
+ * Requests are staged on per-cpu software queues (struct blk_mq_ctx) and
+ * handed to the driver from one or more hardware dispatch queues (struct
+ * blk_mq_hw_ctx).  Requests are preallocated per hardware queue and their
+ * index doubles as the tag, so neither submission nor completion touches
+ * q->queue_lock or an I/O scheduler.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/completion.h>
+#include <linux/writeback.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+
+static struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return per_cpu_ptr(q->queue_ctx, get_cpu());
+}
+
+static void blk_mq_put_ctx(struct blk_mq_ctx *ctx)
+{
+	put_cpu();
+}
+
+/**
+ * blk_mq_map_queue - default cpu to hardware queue mapping
+ * @q:		request queue
+ * @cpu:	submitting cpu
+ */
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+static inline struct blk_mq_hw_ctx *blk_mq_rq_hctx(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	return q->mq_ops->map_queue(q, rq->mq_ctx->cpu);
+}
+
+/*
+ * A set bit in tag_map marks the request of that index busy.  Each cpu
+ * starts searching where its last allocation left off, which keeps
+ * cpus from all hammering the first word of the map.
+ */
+static int blk_mq_get_tag(struct blk_mq_hw_ctx *hctx, unsigned int *hint)
+{
+	unsigned int depth = hctx->queue_depth;
+	unsigned int tag = *hint < depth ? *hint : 0;
+	bool wrapped = false;
+
+	for (;;) {
+		tag = find_next_zero_bit(hctx->tag_map, depth, tag);
+		if (tag >= depth) {
+			if (wrapped)
+				return -1;
+			wrapped = true;
+			tag = 0;
+			continue;
+		}
+		if (!test_and_set_bit(tag, hctx->tag_map)) {
+			*hint = tag + 1;
+			return tag;
+		}
+		tag++;
+	}
+}
+
+static void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	clear_bit(tag, hctx->tag_map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&hctx->tag_wait))
+		wake_up(&hctx->tag_wait);
+}
+
+static struct request *__blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					      struct blk_mq_ctx *ctx,
+					      unsigned int rw_flags)
+{
+	struct request_queue *q = hctx->queue;
+	struct request *rq;
+	int tag;
+
+	tag = blk_mq_get_tag(hctx, &ctx->last_tag);
+	if (tag < 0)
+		return NULL;
+
+	rq = hctx->rqs[tag];
+	blk_rq_init(q, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	rq->cmd_flags = rw_flags;
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+
+	return rq;
+}
+
+/*
+ * Get a free request from the hardware queue the current cpu maps to.
+ * With __GFP_WAIT this sleeps until a tag is released and can not fail.
+ */
+static struct request *blk_mq_get_request(struct request_queue *q,
+					  struct bio *bio,
+					  unsigned int rw_flags, gfp_t gfp)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	DEFINE_WAIT(wait);
+
+	for (;;) {
+		/* blk_mq_drain_queue() is waiting for the tags to go idle */
+		if (unlikely(test_bit(QUEUE_FLAG_DEAD, &q->queue_flags)))
+			return NULL;
+
+		ctx = blk_mq_get_ctx(q);
+		hctx = q->mq_ops->map_queue(q, ctx->cpu);
+		rq = __blk_mq_alloc_request(hctx, ctx, rw_flags);
+		blk_mq_put_ctx(ctx);
+		if (rq || !(gfp & __GFP_WAIT))
+			break;
+
+		/* all tags are in flight, make sure they get a chance to end */
+		blk_mq_run_hw_queue(hctx, false);
+
+		prepare_to_wait_exclusive(&hctx->tag_wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		rq = __blk_mq_alloc_request(hctx, ctx, rw_flags);
+		if (!rq) {
+			trace_block_sleeprq(q, bio, rw_flags & 1);
+			io_schedule();
+		}
+		finish_wait(&hctx->tag_wait, &wait);
+		if (rq)
+			break;
+	}
+
+	if (rq)
+		trace_block_getrq(q, bio, rw_flags & 1);
+	return rq;
+}
+
+/**
+ * blk_mq_alloc_request - allocate a request for a multiqueue device
+ * @q:		request queue
+ * @rw:		READ or WRITE
+ * @gfp:	allocation flags, only __GFP_WAIT is looked at
+ *
+ * Returns %NULL if no tag is free and @gfp does not allow sleeping, or if
+ * @q is being torn down.
+ */
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	return blk_mq_get_request(q, NULL, rw, gfp);
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+/**
+ * blk_mq_free_request - return a request to its hardware queue
+ * @rq:		request, with all bios already ended
+ */
+void blk_mq_free_request(struct request *rq)
+{
+	blk_mq_put_tag(blk_mq_rq_hctx(rq), rq->tag);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+/**
+ * blk_mq_end_io - end all of a request's I/O and release it
+ * @rq:		request to finish
+ * @error:	%0 for success, < %0 for error
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	if (unlikely(laptop_mode) && rq->cmd_type == REQ_TYPE_FS)
+		laptop_io_completion(&rq->q->backing_dev_info);
+
+	blk_account_io_done(rq);
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void __blk_mq_complete_request(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	if (q->mq_ops->complete)
+		q->mq_ops->complete(rq);
+	else
+		blk_mq_end_io(rq, rq->errors);
+}
+
+#if defined(CONFIG_SMP) && defined(CONFIG_USE_GENERIC_SMP_HELPERS)
+static void blk_mq_complete_remote(void *data)
+{
+	__blk_mq_complete_request(data);
+}
+
+/*
+ * Bounce completion to the cpu the request was submitted from, following
+ * the same rq_affinity rules as blk_complete_request().
+ */
+static bool blk_mq_complete_steer(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	int cpu, ccpu = rq->mq_ctx->cpu;
+	bool remote = false;
+
+	if (!test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
+		return false;
+
+	cpu = get_cpu();
+	if (cpu != ccpu && cpu_online(ccpu) &&
+	    (test_bit(QUEUE_FLAG_SAME_FORCE, &q->queue_flags) ||
+	     blk_cpu_to_group(cpu) != blk_cpu_to_group(ccpu))) {
+		rq->csd.func = blk_mq_complete_remote;
+		rq->csd.info = rq;
+		rq->csd.flags = 0;
+		__smp_call_function_single(ccpu, &rq->csd, 0);
+		remote = true;
+	}
+	put_cpu();
+
+	return remote;
+}
+#else
+static bool blk_mq_complete_steer(struct request *rq)
+{
+	return false;
+}
+#endif
+
+/**
+ * blk_mq_complete_request - end I/O on a request from the driver's
+ *			     completion path
+ * @rq:		the request being processed
+ *
+ * Description:
+ *     Runs ->complete() (or ends the request with rq->errors) on the
+ *     submitting cpu when the queue asks for completion affinity.
+ *     May be called from hard interrupt context.
+ */
+void blk_mq_complete_request(struct request *rq)
+{
+	if (!blk_mq_complete_steer(rq))
+		__blk_mq_complete_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_complete_request);
+
+static void blk_mq_start_request(struct request *rq)
+{
+	trace_block_rq_issue(rq->q, rq);
+	set_io_start_time_ns(rq);
+}
+
+/*
+ * Move everything pending on the software queues of @hctx to the driver,
+ * after whatever it pushed back last time.  Software and dispatch queue
+ * locks are taken without disabling interrupts, so this only ever runs
+ * in process context; other callers must ask for an async run.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit, ret;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		clear_bit(bit, hctx->ctx_map);
+		ctx = hctx->ctxs[bit];
+
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		rq = list_entry_rq(rq_list.next);
+		list_del_init(&rq->queuelist);
+
+		blk_mq_start_request(rq);
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK)
+			continue;
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+
+		WARN_ON_ONCE(ret != BLK_MQ_RQ_QUEUE_ERROR);
+		rq->errors = -EIO;
+		blk_mq_end_io(rq, rq->errors);
+	}
+
+	if (list_empty(&rq_list))
+		return;
+
+	/*
+	 * The driver is out of resources and should have stopped the queue;
+	 * park the rest until it is restarted.  If the restart already
+	 * happened, it may have missed these, so go again.
+	 */
+	spin_lock(&hctx->lock);
+	list_splice(&rq_list, &hctx->dispatch);
+	spin_unlock(&hctx->lock);
+
+	smp_mb();
+	if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		blk_mq_run_hw_queue(hctx, true);
+}
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+/**
+ * blk_mq_run_hw_queue - dispatch pending requests of a hardware queue
+ * @hctx:	hardware queue to run
+ * @async:	punt the run to kblockd
+ *
+ * Description:
+ *     @async must be set unless called from process context.
+ */
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (!async)
+		__blk_mq_run_hw_queue(hctx);
+	else
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->run_work, 0);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return !list_empty_careful(&hctx->dispatch) ||
+		find_first_bit(hctx->ctx_map, hctx->nr_ctx) < hctx->nr_ctx;
+}
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (blk_mq_hctx_has_pending(hctx))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+/**
+ * blk_mq_stop_hw_queue - stop dispatching to a hardware queue
+ * @hctx:	hardware queue
+ *
+ * Description:
+ *     For drivers that ran out of resources in ->queue_rq(); the queue is
+ *     restarted with blk_mq_start_stopped_hw_queues().  Safe to call from
+ *     ->queue_rq() and from interrupt context.
+ */
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	__cancel_delayed_work(&hctx->run_work);
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+/**
+ * blk_mq_start_stopped_hw_queues - restart stopped hardware queues
+ * @q:		request queue
+ *
+ * Description:
+ *     The queues are run from kblockd, so this may be called from the
+ *     driver's completion interrupt.
+ */
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (test_and_clear_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			blk_mq_run_hw_queue(hctx, true);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq, bool at_head)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+	trace_block_rq_insert(hctx->queue, rq);
+
+	spin_lock(&ctx->lock);
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	spin_unlock(&ctx->lock);
+
+	if (!test_bit(ctx->index_hw, hctx->ctx_map))
+		set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+/**
+ * blk_mq_insert_request - queue a prepared request
+ * @rq:		request from blk_mq_alloc_request()
+ * @at_head:	insert at the head of its software queue
+ * @run_queue:	run the hardware queue afterwards
+ * @async:	run it from kblockd
+ */
+void blk_mq_insert_request(struct request *rq, bool at_head, bool run_queue,
+			   bool async)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_rq_hctx(rq);
+
+	__blk_mq_insert_request(hctx, rq, at_head);
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+void blk_mq_flush_plug_list(struct blk_plug *plug, bool from_schedule)
+{
+	struct blk_mq_hw_ctx *hctx = NULL, *this_hctx;
+	struct request *rq;
+	LIST_HEAD(list);
+
+	list_splice_init(&plug->mq_list, &list);
+
+	while (!list_empty(&list)) {
+		rq = list_entry_rq(list.next);
+		list_del_init(&rq->queuelist);
+
+		this_hctx = blk_mq_rq_hctx(rq);
+		if (hctx && hctx != this_hctx)
+			blk_mq_run_hw_queue(hctx, from_schedule);
+		hctx = this_hctx;
+
+		__blk_mq_insert_request(hctx, rq, false);
+	}
+
+	if (hctx)
+		blk_mq_run_hw_queue(hctx, from_schedule);
+}
+
+/*
+ * Try to merge @bio into the newest request still waiting on this cpu's
+ * software queue.  Holding ctx->lock keeps it from being dispatched.
+ */
+static bool blk_mq_attempt_merge(struct request_queue *q,
+				 struct blk_mq_ctx *ctx, struct bio *bio)
+{
+	struct request *rq;
+	bool merged = false;
+
+	spin_lock(&ctx->lock);
+	if (!list_empty(&ctx->rq_list)) {
+		rq = list_entry_rq(ctx->rq_list.prev);
+
+		switch (elv_try_merge(rq, bio)) {
+		case ELEVATOR_BACK_MERGE:
+			merged = bio_attempt_back_merge(q, rq, bio);
+			break;
+		case ELEVATOR_FRONT_MERGE:
+			merged = bio_attempt_front_merge(q, rq, bio);
+			break;
+		}
+	}
+	spin_unlock(&ctx->lock);
+
+	return merged;
+}
+
+struct blk_mq_flush_wait {
+	struct completion	done;
+	int			error;
+	bio_end_io_t		*end_io;
+	void			*private;
+};
+
+static void blk_mq_flush_end_io(struct request *rq, int error)
+{
+	struct blk_mq_flush_wait *w = rq->end_io_data;
+
+	w->error = error;
+	blk_mq_free_request(rq);
+	complete(&w->done);
+}
+
+static int blk_mq_issue_flush(struct request_queue *q)
+{
+	struct blk_mq_flush_wait w;
+	struct request *rq;
+
+	rq = blk_mq_get_request(q, NULL, WRITE_FLUSH, GFP_NOIO);
+	if (!rq)
+		return -ENODEV;
+	rq->cmd_type = REQ_TYPE_FS;
+	rq->end_io = blk_mq_flush_end_io;
+	rq->end_io_data = &w;
+
+	init_completion(&w.done);
+	blk_mq_insert_request(rq, false, true, false);
+	wait_for_completion(&w.done);
+
+	return w.error;
+}
+
+static void blk_mq_fua_end_io(struct bio *bio, int error)
+{
+	struct blk_mq_flush_wait *w = bio->bi_private;
+
+	w->error = error;
+	complete(&w->done);
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio);
+
+/*
+ * REQ_FLUSH and REQ_FUA.  Instead of the flush state machine in
+ * blk-flush.c, which runs under q->queue_lock, the preflush and emulated
+ * postflush are issued synchronously by the submitter; cache flushes are
+ * rare enough for that not to matter.
+ *
+ * Returns %true if @bio has been completed, %false if it should be queued
+ * with whatever flags the device can not handle stripped.
+ */
+static bool blk_mq_flush_bio(struct request_queue *q, struct bio *bio)
+{
+	struct blk_mq_flush_wait w;
+	int error;
+
+	/* an empty flush is passed to the driver as is */
+	if ((bio->bi_rw & REQ_FLUSH) && bio->bi_size) {
+		error = blk_mq_issue_flush(q);
+		if (error) {
+			bio_endio(bio, error);
+			return true;
+		}
+		bio->bi_rw &= ~REQ_FLUSH;
+	}
+
+	if (!(bio->bi_rw & REQ_FUA) || (q->flush_flags & REQ_FUA))
+		return false;
+
+	bio->bi_rw &= ~REQ_FUA;
+	if (!bio->bi_size)
+		return false;
+
+	/* no FUA support: write the data, then flush the cache behind it */
+	init_completion(&w.done);
+	w.end_io = bio->bi_end_io;
+	w.private = bio->bi_private;
+	bio->bi_end_io = blk_mq_fua_end_io;
+	bio->bi_private = &w;
+
+	blk_mq_make_request(q, bio);
+	wait_for_completion(&w.done);
+
+	bio->bi_end_io = w.end_io;
+	bio->bi_private = w.private;
+
+	error = w.error;
+	if (!error)
+		error = blk_mq_issue_flush(q);
+	bio_endio(bio, error);
+	return true;
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	const bool sync = !!(bio->bi_rw & REQ_SYNC);
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct blk_plug *plug;
+	unsigned int request_count = 0;
+	unsigned int rw_flags;
+	struct request *rq;
+
+	blk_queue_bounce(q, &bio);
+
+	if (unlikely(bio->bi_rw & (REQ_FLUSH | REQ_FUA))) {
+		if (blk_mq_flush_bio(q, bio))
+			return;
+	} else if (blk_attempt_plug_merge(q, bio, &request_count))
+		return;
+
+	if (unlikely(test_bit(QUEUE_FLAG_DEAD, &q->queue_flags))) {
+		bio_endio(bio, -ENODEV);
+		return;
+	}
+
+	if (!blk_queue_nomerges(q) && !(bio->bi_rw & REQ_FLUSH)) {
+		ctx = blk_mq_get_ctx(q);
+		hctx = q->mq_ops->map_queue(q, ctx->cpu);
+		if ((hctx->flags & BLK_MQ_F_SHOULD_MERGE) &&
+		    !list_empty_careful(&ctx->rq_list) &&
+		    blk_mq_attempt_merge(q, ctx, bio)) {
+			blk_mq_put_ctx(ctx);
+			return;
+		}
+		blk_mq_put_ctx(ctx);
+	}
+
+	rw_flags = bio_data_dir(bio);
+	if (sync)
+		rw_flags |= REQ_SYNC;
+
+	rq = blk_mq_get_request(q, bio, rw_flags, GFP_NOIO);
+	if (unlikely(!rq)) {
+		bio_endio(bio, -ENODEV);
+		return;
+	}
+	init_request_from_bio(rq, bio);
+	drive_stat_acct(rq, 1);
+
+	/* before the request is queued, it may complete and free the bio */
+	bio->bi_cookie = blk_tag_to_qc_t(rq->tag, blk_mq_rq_hctx(rq)->queue_num);
+
+	plug = current->plug;
+	if (plug) {
+		if (list_empty(&plug->mq_list))
+			trace_block_plug(q);
+		else if (request_count >= BLK_MAX_REQUEST_COUNT) {
+			blk_flush_plug_list(plug, false);
+			trace_block_plug(q);
+		}
+		list_add_tail(&rq->queuelist, &plug->mq_list);
+		return;
+	}
+
+	blk_mq_insert_request(rq, false, true, false);
+}
+
+/*
+ * Hybrid polling: rather than spin for the whole of a request's service
+ * time, sleep first, and only then start spinning.  Only the first poll of
+ * a request sleeps, either for a fixed time or for as long as polls on this
+ * hardware queue have recently had to spin.  The latter settles at about
+ * half the service time: sleeping longer shortens the spins that follow.
+ *
+ * Returns %true if we slept.
+ */
+static bool blk_mq_poll_hybrid_sleep(struct request_queue *q,
+				     struct blk_mq_hw_ctx *hctx,
+				     struct request *rq)
+{
+	struct hrtimer_sleeper hs;
+	unsigned int nsecs;
+
+	if (q->poll_nsec < 0 || (rq->cmd_flags & REQ_POLL_SLEPT))
+		return false;
+
+	nsecs = q->poll_nsec ? q->poll_nsec : hctx->poll_mean_nsec;
+	if (!nsecs)
+		return false;
+
+	rq->cmd_flags |= REQ_POLL_SLEPT;
+
+	/*
+	 * The caller set the task state before deciding to poll, so the
+	 * completion waking us cuts the sleep short.
+	 */
+	hrtimer_init_on_stack(&hs.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_init_sleeper(&hs, current);
+	hrtimer_start(&hs.timer, ns_to_ktime(nsecs), HRTIMER_MODE_REL);
+	if (hs.task)
+		io_schedule();
+	hrtimer_cancel(&hs.timer);
+	destroy_hrtimer_on_stack(&hs.timer);
+
+	__set_current_state(TASK_RUNNING);
+	return true;
+}
+
+static void blk_mq_poll_update_mean(struct blk_mq_hw_ctx *hctx, s64 nsecs)
+{
+	unsigned int mean = hctx->poll_mean_nsec;
+
+	if (nsecs > INT_MAX)
+		nsecs = INT_MAX;
+	hctx->poll_mean_nsec = mean ? mean - mean / 8 + nsecs / 8 : nsecs;
+}
+
+/**
+ * blk_poll - spin for completion of a request
+ * @q:		request queue the bio was submitted to
+ * @cookie:	the bio's ->bi_cookie, read after submit_bio()
+ *
+ * Description:
+ *     For submitters that would otherwise sleep until a single request
+ *     completes: reaps completions from the driver in the caller's
+ *     context instead of waiting for its interrupt.  The caller must set
+ *     its task state before calling, like before schedule(), and have the
+ *     completion wake it; polling stops when the task is woken, or
+ *     when it should reschedule.
+ *
+ *     Returns %true if the caller should check for completion again,
+ *     %false if it should go to sleep as usual.  Polling is enabled per
+ *     queue through the io_poll sysfs attribute.
+ */
+bool blk_poll(struct request_queue *q, blk_qc_t cookie)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_plug *plug;
+	struct request *rq;
+	ktime_t start;
+	long state;
+
+	if (!q->mq_ops || !q->mq_ops->poll || !blk_qc_t_valid(cookie) ||
+	    !blk_queue_poll(q))
+		return false;
+
+	plug = current->plug;
+	if (plug)
+		blk_flush_plug_list(plug, false);
+
+	hctx = q->queue_hw_ctx[blk_qc_t_to_queue_num(cookie)];
+	rq = hctx->rqs[blk_qc_t_to_tag(cookie)];
+
+	if (blk_mq_poll_hybrid_sleep(q, hctx, rq))
+		return true;
+
+	start = ktime_get();
+	state = current->state;
+	while (!need_resched()) {
+		int ret = q->mq_ops->poll(hctx, rq->tag);
+
+		if (ret > 0) {
+			blk_mq_poll_update_mean(hctx,
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
+			__set_current_state(TASK_RUNNING);
+			return true;
+		}
+
+		if (signal_pending_state(state, current))
+			__set_current_state(TASK_RUNNING);
+		if (current->state == TASK_RUNNING)
+			return true;
+		if (ret < 0)
+			break;
+		cpu_relax();
+	}
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
+/**
+ * blk_mq_init_commands - one-time setup of the driver data of each request
+ * @q:		request queue from blk_mq_init_queue()
+ * @init:	called for every preallocated request
+ * @data:	passed to @init
+ */
+void blk_mq_init_commands(struct request_queue *q,
+			  void (*init)(void *data, struct blk_mq_hw_ctx *,
+				       struct request *, unsigned int),
+			  void *data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int j;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		for (j = 0; j < hctx->queue_depth; j++)
+			init(data, hctx, hctx->rqs[j], j);
+	}
+}
+EXPORT_SYMBOL(blk_mq_init_commands);
+
+/*
+ * Called by blk_cleanup_queue() once @q is DEAD: no new tags are handed
+ * out, so run the hardware queues until every request that got one has
+ * been dispatched and completed.  Requests sitting on a plug are flushed
+ * when their task next schedules.  @q may be only partially set up if
+ * blk_mq_init_queue() failed.
+ */
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	bool busy;
+	int i;
+
+	if (!q->queue_hw_ctx)
+		return;
+
+	for (;;) {
+		busy = false;
+		queue_for_each_hw_ctx(q, hctx, i) {
+			if (!hctx)
+				continue;
+
+			/* let allocators sleeping for a tag see DEAD */
+			wake_up_all(&hctx->tag_wait);
+			if (blk_mq_hctx_has_pending(hctx))
+				blk_mq_run_hw_queue(hctx, false);
+			if (find_first_bit(hctx->tag_map, hctx->queue_depth) <
+			    hctx->queue_depth)
+				busy = true;
+		}
+		if (!busy)
+			break;
+		msleep(10);
+	}
+}
+
+void blk_mq_sync_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	if (!q->queue_hw_ctx)
+		return;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (hctx)
+			cancel_delayed_work_sync(&hctx->run_work);
+	}
+}
+
+static void blk_mq_free_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	kfree(hctx->tag_map);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	kfree(hctx);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_alloc_hctx(struct request_queue *q,
+					       struct blk_mq_reg *reg,
+					       unsigned int num,
+					       void *driver_data)
+{
+	const int node = reg->numa_node;
+	const unsigned int depth = reg->queue_depth;
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, node);
+	if (!hctx)
+		return NULL;
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_DELAYED_WORK(&hctx->run_work, blk_mq_run_work_fn);
+	init_waitqueue_head(&hctx->tag_wait);
+	hctx->flags = reg->flags;
+	hctx->queue = q;
+	hctx->driver_data = driver_data;
+	hctx->queue_num = num;
+	hctx->queue_depth = depth;
+
+	hctx->ctxs = kzalloc_node(nr_cpu_ids * sizeof(void *), GFP_KERNEL,
+				  node);
+	hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+				     sizeof(unsigned long), GFP_KERNEL, node);
+	hctx->tag_map = kzalloc_node(BITS_TO_LONGS(depth) *
+				     sizeof(unsigned long), GFP_KERNEL, node);
+	hctx->rqs = kzalloc_node(depth * sizeof(void *), GFP_KERNEL, node);
+	if (!hctx->ctxs || !hctx->ctx_map || !hctx->tag_map || !hctx->rqs)
+		goto err;
+
+	for (i = 0; i < depth; i++) {
+		hctx->rqs[i] = kzalloc_node(sizeof(struct request) +
+					    reg->cmd_size, GFP_KERNEL, node);
+		if (!hctx->rqs[i])
+			goto err;
+		hctx->rqs[i]->tag = i;
+	}
+
+	return hctx;
+err:
+	blk_mq_free_hctx(hctx);
+	return NULL;
+}
+
+/*
+ * Give every hardware queue a contiguous range of cpu numbers.
+ */
+static void blk_mq_map_cpus(unsigned int *map, unsigned int nr_queues)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		map[cpu] = cpu * nr_queues / nr_cpu_ids;
+}
+
+/**
+ * blk_mq_init_queue - allocate a multiqueue request queue
+ * @reg:	queue geometry and driver operations
+ * @driver_data: stored in each hardware context's ->driver_data
+ *
+ * Description:
+ *    The returned queue has no I/O scheduler: bios are turned into
+ *    requests on the submitting cpu and passed to ->queue_rq() straight
+ *    away, or when the task's plug is flushed.  Request timeouts are not
+ *    handled, drivers needing them must keep their own timers.
+ *
+ *    Returns %NULL on failure.  Must be paired with blk_cleanup_queue().
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	unsigned int nr_hw_queues = min_t(unsigned int, reg->nr_hw_queues,
+					   nr_cpu_ids);
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request_queue *q;
+	unsigned int i;
+	int cpu;
+
+	if (!nr_hw_queues || !reg->queue_depth ||
+	    reg->queue_depth > BLK_MQ_MAX_DEPTH ||
+	    !reg->ops->queue_rq || !reg->ops->map_queue)
+		return NULL;
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return NULL;
+
+	q->mq_ops = reg->ops;
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(unsigned int),
+				 GFP_KERNEL, reg->numa_node);
+	q->queue_hw_ctx = kzalloc_node(nr_hw_queues * sizeof(void *),
+				       GFP_KERNEL, reg->numa_node);
+	if (!q->queue_ctx || !q->mq_map || !q->queue_hw_ctx)
+		goto err;
+
+	q->nr_hw_queues = nr_hw_queues;
+	for (i = 0; i < nr_hw_queues; i++) {
+		q->queue_hw_ctx[i] = blk_mq_alloc_hctx(q, reg, i, driver_data);
+		if (!q->queue_hw_ctx[i])
+			goto err;
+	}
+
+	blk_mq_map_cpus(q->mq_map, nr_hw_queues);
+
+	for_each_possible_cpu(cpu) {
+		ctx = per_cpu_ptr(q->queue_ctx, cpu);
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = q->mq_ops->map_queue(q, cpu);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->queue_flags |= QUEUE_FLAG_MQ_DEFAULT;
+	q->poll_nsec = -1;
+	q->sg_reserved_size = INT_MAX;
+
+	return q;
+err:
+	blk_cleanup_queue(q);
+	return NULL;
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+void blk_mq_free_queue(struct request_queue *q)
+{
+	unsigned int i;
+
+	if (q->queue_hw_ctx) {
+		for (i = 0; i < q->nr_hw_queues; i++)
+			if (q->queue_hw_ctx[i])
+				blk_mq_free_hctx(q->queue_hw_ctx[i]);
+		kfree(q->queue_hw_ctx);
+	}
+	kfree(q->mq_map);
+	free_percpu(q->queue_ctx);
+}
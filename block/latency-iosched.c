@@ -0,0 +1,618 @@
+/*
+ *  Latency target I/O scheduler
+ *
+ *  Requests are queued per blkio cgroup and dispatched round robin, one
+ *  at a time, from every group that has room below its dispatch depth.
+ *  A group can be given a completion latency target through
+ *  blkio.latency.target_device.  Completion latencies are averaged over
+ *  a window; when a group misses its target, every group with a looser
+ *  target or none at all has its depth halved.  Once all targets are met
+ *  the depths grow back.  The scheduler never idles.
+ *
+ *  This file is released under the GPL.
+ */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include "blk-cgroup.h"
+
+/*
+ * tunables
+ */
+static const int lat_window_usec = 50000;	/* averaging window */
+static const int lat_max_depth = 64;		/* max requests in driver per group */
+
+struct lat_group {
+	/* group queued for dispatch on lat_data->active_list */
+	struct list_head active_node;
+	/* requests waiting for dispatch, oldest first */
+	struct list_head fifo;
+	/* group on lat_data->group_list */
+	struct hlist_node ld_node;
+	int ref;
+
+	unsigned int depth;
+	unsigned int in_flight;
+	bool throttled;
+
+	/* completion latency target, 0 if none */
+	u64 target_ns;
+	/* completion latencies seen in the current window */
+	u64 lat_sum_ns;
+	unsigned int nr_samples;
+
+	struct blkio_group blkg;
+};
+
+struct lat_data {
+	struct request_queue *queue;
+
+	struct list_head active_list;
+	struct hlist_head group_list;
+	unsigned int nr_blkcg_linked_grps;
+	struct lat_group root_group;
+
+	u64 window_start;
+	struct work_struct unplug_work;
+
+	/*
+	 * settings that change how the i/o scheduler behaves
+	 */
+	unsigned int window_usec;
+	unsigned int max_depth;
+};
+
+static inline struct lat_group *lat_group_of_blkg(struct blkio_group *blkg)
+{
+	if (blkg)
+		return container_of(blkg, struct lat_group, blkg);
+	return NULL;
+}
+
+static inline struct lat_group *rq_lat_group(struct request *rq)
+{
+	return rq->elevator_private[0];
+}
+
+static void lat_init_group(struct lat_data *ld, struct lat_group *lg)
+{
+	INIT_LIST_HEAD(&lg->active_node);
+	INIT_LIST_HEAD(&lg->fifo);
+	lg->depth = ld->max_depth;
+}
+
+/*
+ * Allocation of the per cpu stats can block, so this must be called
+ * without the queue lock.
+ */
+static struct lat_group *lat_alloc_group(struct lat_data *ld)
+{
+	struct lat_group *lg;
+
+	lg = kzalloc_node(sizeof(*lg), GFP_KERNEL, ld->queue->node);
+	if (!lg)
+		return NULL;
+
+	lat_init_group(ld, lg);
+
+	/*
+	 * The initial reference is shared by the cgroup and the elevator and
+	 * is dropped by whichever of them goes away first.
+	 */
+	lg->ref = 1;
+
+	if (blkio_alloc_blkg_stats(&lg->blkg)) {
+		kfree(lg);
+		return NULL;
+	}
+
+	return lg;
+}
+
+static void lat_update_blkg_dev(struct lat_data *ld, struct lat_group *lg,
+				struct blkio_cgroup *blkcg)
+{
+	struct backing_dev_info *bdi = &ld->queue->backing_dev_info;
+	unsigned int major, minor;
+
+	/*
+	 * bdi->dev may not be registered yet when the group is created; fill
+	 * in the device, and with it the latency target, on first use after
+	 * it is.
+	 */
+	if (lg->blkg.dev || !bdi->dev || !dev_name(bdi->dev))
+		return;
+
+	sscanf(dev_name(bdi->dev), "%u:%u", &major, &minor);
+	lg->blkg.dev = MKDEV(major, minor);
+	lg->target_ns = blkcg_get_latency_target(blkcg, lg->blkg.dev) *
+			NSEC_PER_USEC;
+}
+
+static struct lat_group *
+lat_find_group(struct lat_data *ld, struct blkio_cgroup *blkcg)
+{
+	struct lat_group *lg;
+
+	if (blkcg == &blkio_root_cgroup)
+		lg = &ld->root_group;
+	else
+		lg = lat_group_of_blkg(blkiocg_lookup_group(blkcg, ld));
+
+	if (lg)
+		lat_update_blkg_dev(ld, lg, blkcg);
+
+	return lg;
+}
+
+/*
+ * Returns the group of the current task, creating it if need be.  Called
+ * with the queue lock held, which is dropped around the allocation when
+ * @gfp_mask allows it.  Falls back to the root group if that fails.
+ */
+static struct lat_group *lat_get_group(struct lat_data *ld, gfp_t gfp_mask)
+{
+	struct request_queue *q = ld->queue;
+	struct blkio_cgroup *blkcg;
+	struct lat_group *lg, *__lg;
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	lg = lat_find_group(ld, blkcg);
+	rcu_read_unlock();
+	if (lg)
+		return lg;
+
+	if (!(gfp_mask & __GFP_WAIT))
+		return &ld->root_group;
+
+	spin_unlock_irq(q->queue_lock);
+	lg = lat_alloc_group(ld);
+	spin_lock_irq(q->queue_lock);
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+
+	/*
+	 * Someone else may have added the group while the queue lock was
+	 * dropped.
+	 */
+	__lg = lat_find_group(ld, blkcg);
+	if (__lg || !lg) {
+		rcu_read_unlock();
+		if (lg) {
+			free_percpu(lg->blkg.stats_cpu);
+			kfree(lg);
+		}
+		return __lg ? __lg : &ld->root_group;
+	}
+
+	blkiocg_add_blkio_group(blkcg, &lg->blkg, ld, 0, BLKIO_POLICY_LAT);
+	ld->nr_blkcg_linked_grps++;
+	lat_update_blkg_dev(ld, lg, blkcg);
+	rcu_read_unlock();
+
+	hlist_add_head(&lg->ld_node, &ld->group_list);
+	return lg;
+}
+
+static void lat_put_group(struct lat_group *lg)
+{
+	BUG_ON(lg->ref <= 0);
+	if (--lg->ref)
+		return;
+
+	BUG_ON(!list_empty(&lg->fifo));
+	free_percpu(lg->blkg.stats_cpu);
+	kfree(lg);
+}
+
+static void lat_destroy_group(struct lat_data *ld, struct lat_group *lg)
+{
+	BUG_ON(hlist_unhashed(&lg->ld_node));
+	hlist_del_init(&lg->ld_node);
+
+	BUG_ON(ld->nr_blkcg_linked_grps <= 0);
+	ld->nr_blkcg_linked_grps--;
+
+	/* drop the creation reference, requests still queued hold theirs */
+	lat_put_group(lg);
+}
+
+static void lat_release_groups(struct lat_data *ld)
+{
+	struct hlist_node *pos, *n;
+	struct lat_group *lg;
+
+	hlist_for_each_entry_safe(lg, pos, n, &ld->group_list, ld_node) {
+		/*
+		 * If the cgroup removal path got to the group first, it
+		 * destroys it.
+		 */
+		if (!blkiocg_del_blkio_group(&lg->blkg))
+			lat_destroy_group(ld, lg);
+	}
+}
+
+/*
+ * The cgroup of @blkg is going away.  Called under rcu_read_lock(), which
+ * keeps @key, our lat_data, valid.
+ */
+static void lat_unlink_blkio_group(void *key, struct blkio_group *blkg)
+{
+	struct lat_data *ld = key;
+	unsigned long flags;
+
+	spin_lock_irqsave(ld->queue->queue_lock, flags);
+	lat_destroy_group(ld, lat_group_of_blkg(blkg));
+	spin_unlock_irqrestore(ld->queue->queue_lock, flags);
+}
+
+static void lat_update_blkio_group_target(void *key, struct blkio_group *blkg,
+					  u64 target)
+{
+	lat_group_of_blkg(blkg)->target_ns = target * NSEC_PER_USEC;
+}
+
+static void lat_schedule_dispatch(struct lat_data *ld)
+{
+	kblockd_schedule_work(ld->queue, &ld->unplug_work);
+}
+
+static void lat_kick_queue(struct work_struct *work)
+{
+	struct lat_data *ld = container_of(work, struct lat_data, unplug_work);
+	struct request_queue *q = ld->queue;
+
+	spin_lock_irq(q->queue_lock);
+	__blk_run_queue(q);
+	spin_unlock_irq(q->queue_lock);
+}
+
+/*
+ * Close the current window.  If some group missed its target, every
+ * group with a looser target or none loses half its depth, so the tighter
+ * target gets more of the device.  The groups that missed are left alone.
+ * If every target was met, all depths grow back by a quarter.
+ */
+static void lat_adjust_depths(struct lat_data *ld, u64 now)
+{
+	struct lat_group *lg;
+	struct hlist_node *pos;
+	u64 missed = 0;
+
+	hlist_for_each_entry(lg, pos, &ld->group_list, ld_node) {
+		u64 avg;
+
+		if (!lg->target_ns || !lg->nr_samples)
+			continue;
+
+		avg = div_u64(lg->lat_sum_ns, lg->nr_samples);
+		if (avg > lg->target_ns && (!missed || lg->target_ns < missed))
+			missed = lg->target_ns;
+	}
+
+	hlist_for_each_entry(lg, pos, &ld->group_list, ld_node) {
+		if (missed) {
+			if (!lg->target_ns || lg->target_ns > missed)
+				lg->depth = max(lg->depth / 2, 1U);
+		} else if (lg->depth < ld->max_depth)
+			lg->depth = min(lg->depth + max(lg->depth / 4, 1U),
+					ld->max_depth);
+
+		lg->lat_sum_ns = 0;
+		lg->nr_samples = 0;
+	}
+
+	ld->window_start = now;
+}
+
+static void lat_add_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	struct lat_group *lg = rq_lat_group(rq);
+
+	list_add_tail(&rq->queuelist, &lg->fifo);
+	if (list_empty(&lg->active_node))
+		list_add_tail(&lg->active_node, &ld->active_list);
+}
+
+static void lat_merged_requests(struct request_queue *q, struct request *rq,
+				struct request *next)
+{
+	list_del_init(&next->queuelist);
+}
+
+/*
+ * Don't let a bio from one group ride on a request of another, or the
+ * latency of one would be charged to the other.
+ */
+static int lat_allow_merge(struct request_queue *q, struct request *rq,
+			   struct bio *bio)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	struct lat_group *lg;
+
+	rcu_read_lock();
+	lg = lat_find_group(ld, task_blkio_cgroup(current));
+	rcu_read_unlock();
+
+	return (lg ? lg : &ld->root_group) == rq_lat_group(rq);
+}
+
+static int lat_dispatch_requests(struct request_queue *q, int force)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	struct lat_group *lg, *next;
+	struct request *rq;
+
+	list_for_each_entry_safe(lg, next, &ld->active_list, active_node) {
+		if (!force && lg->in_flight >= lg->depth) {
+			lg->throttled = true;
+			continue;
+		}
+
+		rq = list_entry(lg->fifo.next, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		elv_dispatch_add_tail(q, rq);
+		lg->in_flight++;
+
+		/* round robin between groups */
+		list_del_init(&lg->active_node);
+		if (!list_empty(&lg->fifo))
+			list_add_tail(&lg->active_node, &ld->active_list);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void lat_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	struct lat_group *lg = rq_lat_group(rq);
+	u64 now = sched_clock();
+
+	WARN_ON(!lg->in_flight);
+	lg->in_flight--;
+
+	if (time_after64(now, rq_start_time_ns(rq))) {
+		lg->lat_sum_ns += now - rq_start_time_ns(rq);
+		lg->nr_samples++;
+	}
+
+	if (now - ld->window_start >= (u64)ld->window_usec * NSEC_PER_USEC)
+		lat_adjust_depths(ld, now);
+
+	/*
+	 * Not every driver runs the queue when a request completes, so make
+	 * sure a group held back by its depth gets going again.
+	 */
+	if (lg->throttled && lg->in_flight < lg->depth) {
+		lg->throttled = false;
+		lat_schedule_dispatch(ld);
+	}
+}
+
+static int
+lat_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	struct lat_group *lg;
+	unsigned long flags;
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	lg = lat_get_group(ld, gfp_mask);
+	lg->ref++;
+	rq->elevator_private[0] = lg;
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	return 0;
+}
+
+static void lat_put_request(struct request *rq)
+{
+	struct lat_group *lg = rq_lat_group(rq);
+
+	if (lg) {
+		rq->elevator_private[0] = NULL;
+		lat_put_group(lg);
+	}
+}
+
+static struct request *
+lat_former_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_group *lg = rq_lat_group(rq);
+
+	if (rq->queuelist.prev == &lg->fifo)
+		return NULL;
+	return list_entry(rq->queuelist.prev, struct request, queuelist);
+}
+
+static struct request *
+lat_latter_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_group *lg = rq_lat_group(rq);
+
+	if (rq->queuelist.next == &lg->fifo)
+		return NULL;
+	return list_entry(rq->queuelist.next, struct request, queuelist);
+}
+
+static void lat_exit_queue(struct elevator_queue *e)
+{
+	struct lat_data *ld = e->elevator_data;
+	struct request_queue *q = ld->queue;
+	bool wait;
+
+	cancel_work_sync(&ld->unplug_work);
+
+	spin_lock_irq(q->queue_lock);
+	BUG_ON(!list_empty(&ld->active_list));
+	lat_release_groups(ld);
+
+	/*
+	 * Groups the cgroup removal path claimed first may still be using
+	 * ld as their key; wait for them to drop out of their grace period.
+	 */
+	wait = ld->nr_blkcg_linked_grps;
+	spin_unlock_irq(q->queue_lock);
+
+	if (wait)
+		synchronize_rcu();
+
+	free_percpu(ld->root_group.blkg.stats_cpu);
+	kfree(ld);
+}
+
+static void *lat_init_queue(struct request_queue *q)
+{
+	struct lat_data *ld;
+	struct lat_group *lg;
+
+	ld = kmalloc_node(sizeof(*ld), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!ld)
+		return NULL;
+
+	ld->queue = q;
+	INIT_LIST_HEAD(&ld->active_list);
+	INIT_HLIST_HEAD(&ld->group_list);
+	INIT_WORK(&ld->unplug_work, lat_kick_queue);
+	ld->window_usec = lat_window_usec;
+	ld->max_depth = lat_max_depth;
+	ld->window_start = sched_clock();
+
+	lg = &ld->root_group;
+	lat_init_group(ld, lg);
+
+	/*
+	 * One reference is dropped by lat_release_groups(), the other keeps
+	 * the embedded root group from ever being freed.
+	 */
+	lg->ref = 2;
+
+	if (blkio_alloc_blkg_stats(&lg->blkg)) {
+		kfree(ld);
+		return NULL;
+	}
+
+	rcu_read_lock();
+	blkiocg_add_blkio_group(&blkio_root_cgroup, &lg->blkg, ld, 0,
+				BLKIO_POLICY_LAT);
+	rcu_read_unlock();
+	ld->nr_blkcg_linked_grps++;
+	hlist_add_head(&lg->ld_node, &ld->group_list);
+
+	return ld;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+lat_var_show(unsigned int var, char *page)
+{
+	return sprintf(page, "%u\n", var);
+}
+
+static ssize_t
+lat_var_store(unsigned int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtoul(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR)					\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct lat_data *ld = e->elevator_data;				\
+	return lat_var_show(__VAR, (page));				\
+}
+SHOW_FUNCTION(lat_window_usec_show, ld->window_usec);
+SHOW_FUNCTION(lat_max_depth_show, ld->max_depth);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX)				\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct lat_data *ld = e->elevator_data;				\
+	unsigned int __data;						\
+	int ret = lat_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	*(__PTR) = __data;						\
+	return ret;							\
+}
+STORE_FUNCTION(lat_window_usec_store, &ld->window_usec, 1000, UINT_MAX);
+STORE_FUNCTION(lat_max_depth_store, &ld->max_depth, 1, UINT_MAX);
+#undef STORE_FUNCTION
+
+#define LAT_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, lat_##name##_show, lat_##name##_store)
+
+static struct elv_fs_entry lat_attrs[] = {
+	LAT_ATTR(window_usec),
+	LAT_ATTR(max_depth),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_latency = {
+	.ops = {
+		.elevator_merge_req_fn =	lat_merged_requests,
+		.elevator_allow_merge_fn =	lat_allow_merge,
+		.elevator_dispatch_fn =		lat_dispatch_requests,
+		.elevator_add_req_fn =		lat_add_request,
+		.elevator_completed_req_fn =	lat_completed_request,
+		.elevator_former_req_fn =	lat_former_request,
+		.elevator_latter_req_fn =	lat_latter_request,
+		.elevator_set_req_fn =		lat_set_request,
+		.elevator_put_req_fn =		lat_put_request,
+		.elevator_init_fn =		lat_init_queue,
+		.elevator_exit_fn =		lat_exit_queue,
+	},
+
+	.elevator_attrs = lat_attrs,
+	.elevator_name = "latency",
+	.elevator_owner = THIS_MODULE,
+};
+
+static struct blkio_policy_type blkio_policy_lat = {
+	.ops = {
+		.blkio_unlink_group_fn =		lat_unlink_blkio_group,
+		.blkio_update_group_latency_target_fn =	lat_update_blkio_group_target,
+	},
+	.plid = BLKIO_POLICY_LAT,
+};
+
+static int __init lat_init(void)
+{
+	elv_register(&iosched_latency);
+	blkio_policy_register(&blkio_policy_lat);
+
+	return 0;
+}
+
+static void __exit lat_exit(void)
+{
+	blkio_policy_unregister(&blkio_policy_lat);
+	elv_unregister(&iosched_latency);
+}
+
+module_init(lat_init);
+module_exit(lat_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Latency target IO scheduler");
@@ -13,10 +13,12 @@
 #include <linux/moduleparam.h>
 #include <linux/major.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/bio.h>
 #include <linux/highmem.h>
 #include <linux/mutex.h>
 #include <linux/radix-tree.h>
+#include <linux/hrtimer.h>
 #include <linux/buffer_head.h> /* invalidate_bh_lrus() */
 #include <linux/slab.h>
 
@@ -361,6 +363,99 @@ out:
 	bio_endio(bio, err);
 }
 
+/*
+ * With completion_nsec set, use_mq requests are done at once but only
+ * completed when a timer fires that long after, standing in for the
+ * completion interrupt of a real device.
+ */
+static unsigned long completion_nsec;
+
+struct brd_cmd {
+	struct hrtimer		timer;
+};
+
+static enum hrtimer_restart brd_cmd_timer_fn(struct hrtimer *timer)
+{
+	struct brd_cmd *cmd = container_of(timer, struct brd_cmd, timer);
+
+	blk_mq_complete_request(blk_mq_rq_from_pdu(cmd));
+	return HRTIMER_NORESTART;
+}
+
+static void brd_init_cmd(void *data, struct blk_mq_hw_ctx *hctx,
+			 struct request *rq, unsigned int tag)
+{
+	struct brd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cmd->timer.function = brd_cmd_timer_fn;
+}
+
+static int brd_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	struct brd_device *brd = hctx->driver_data;
+	sector_t sector = blk_rq_pos(rq);
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	int rw = rq_data_dir(rq);
+	int err = 0;
+
+	if (sector + blk_rq_sectors(rq) > get_capacity(brd->brd_disk)) {
+		err = -EIO;
+		goto out;
+	}
+
+	if (unlikely(rq->cmd_flags & REQ_DISCARD)) {
+		discard_from_brd(brd, sector, blk_rq_bytes(rq));
+		goto out;
+	}
+
+	rq_for_each_segment(bvec, rq, iter) {
+		unsigned int len = bvec->bv_len;
+		err = brd_do_bvec(brd, bvec->bv_page, len,
+					bvec->bv_offset, rw, sector);
+		if (err)
+			break;
+		sector += len >> SECTOR_SHIFT;
+	}
+
+out:
+	if (!completion_nsec) {
+		blk_mq_end_io(rq, err);
+	} else {
+		struct brd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+		rq->errors = err;
+		hrtimer_start(&cmd->timer, ns_to_ktime(completion_nsec),
+			      HRTIMER_MODE_REL);
+	}
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+/*
+ * A request whose time is up can be completed by the poller, provided
+ * it gets to the timer before the timer fires.
+ */
+static int brd_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	struct request *rq = hctx->rqs[tag];
+	struct brd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (ktime_to_ns(hrtimer_get_remaining(&cmd->timer)) > 0)
+		return 0;
+	if (hrtimer_try_to_cancel(&cmd->timer) != 1)
+		return 0;
+
+	blk_mq_end_io(rq, rq->errors);
+	return 1;
+}
+
+static struct blk_mq_ops brd_mq_ops = {
+	.queue_rq	= brd_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.poll		= brd_poll,
+};
+
 #ifdef CONFIG_BLK_DEV_XIP
 static int brd_direct_access(struct block_device *bdev, sector_t sector,
 			void **kaddr, unsigned long *pfn)
@@ -434,12 +529,20 @@ static int rd_nr;
 int rd_size = CONFIG_BLK_DEV_RAM_SIZE;
 static int max_part;
 static int part_shift;
+static bool use_mq;
+static int hw_queues;
 module_param(rd_nr, int, S_IRUGO);
 MODULE_PARM_DESC(rd_nr, "Maximum number of brd devices");
 module_param(rd_size, int, S_IRUGO);
 MODULE_PARM_DESC(rd_size, "Size of each RAM disk in kbytes.");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per RAM disk");
+module_param(use_mq, bool, S_IRUGO);
+MODULE_PARM_DESC(use_mq, "Use the multiqueue block layer");
+module_param(hw_queues, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queues, "Hardware queues for use_mq (default: online cpus)");
+module_param(completion_nsec, ulong, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Simulated completion latency for use_mq, in nsecs (default: 0, complete inline)");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(RAMDISK_MAJOR);
 MODULE_ALIAS("rd");
@@ -473,10 +576,27 @@ static struct brd_device *brd_alloc(int i)
 	spin_lock_init(&brd->brd_lock);
 	INIT_RADIX_TREE(&brd->brd_pages, GFP_ATOMIC);
 
-	brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
-	if (!brd->brd_queue)
-		goto out_free_dev;
-	blk_queue_make_request(brd->brd_queue, brd_make_request);
+	if (use_mq) {
+		struct blk_mq_reg reg = {
+			.ops		= &brd_mq_ops,
+			.nr_hw_queues	= hw_queues > 0 ? hw_queues :
+					  num_online_cpus(),
+			.queue_depth	= 64,
+			.cmd_size	= sizeof(struct brd_cmd),
+			.numa_node	= NUMA_NO_NODE,
+			.flags		= BLK_MQ_F_SHOULD_MERGE,
+		};
+
+		brd->brd_queue = blk_mq_init_queue(&reg, brd);
+		if (!brd->brd_queue)
+			goto out_free_dev;
+		blk_mq_init_commands(brd->brd_queue, brd_init_cmd, NULL);
+	} else {
+		brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
+		if (!brd->brd_queue)
+			goto out_free_dev;
+		blk_queue_make_request(brd->brd_queue, brd_make_request);
+	}
 	blk_queue_max_hw_sectors(brd->brd_queue, 1024);
 	blk_queue_bounce_limit(brd->brd_queue, BLK_BOUNCE_ANY);
 
@@ -77,6 +77,9 @@
 #include <linux/sysfs.h>
 #include <linux/miscdevice.h>
 #include <linux/falloc.h>
+#include <linux/fiemap.h>
+#include <linux/seq_file.h>
+#include <linux/mempool.h>
 
 #include <asm/uaccess.h>
 
@@ -86,6 +89,9 @@ static DEFINE_MUTEX(loop_index_mutex);
 static int max_part;
 static int part_shift;
 
+static struct bio_set *loop_bio_set;
+static mempool_t *loop_dio_pool;
+
 /*
  * Transfer functions
  */
@@ -418,20 +424,31 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 				ret = -EIO;
 				goto out;
 			}
+			/* direct writes went around the filesystem */
+			if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+				ret = blkdev_issue_flush(lo->lo_dio_bdev,
+							 GFP_NOIO, NULL);
+				if (unlikely(ret && ret != -EOPNOTSUPP)) {
+					ret = -EIO;
+					goto out;
+				}
+			}
 		}
 
 		/*
 		 * We use punch hole to reclaim the free space used by the
 		 * image a.k.a. discard. However we do not support discard if
 		 * encryption is enabled, because it may give an attacker
-		 * useful information.
+		 * useful information, nor in direct I/O mode, where freeing
+		 * blocks would leave the extent map pointing at them.
 		 */
 		if (bio->bi_rw & REQ_DISCARD) {
 			struct file *file = lo->lo_backing_file;
 			int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
 
 			if ((!file->f_op->fallocate) ||
-			    lo->lo_encrypt_key_size) {
+			    lo->lo_encrypt_key_size ||
+			    (lo->lo_flags & LO_FLAGS_DIRECT_IO)) {
 				ret = -EOPNOTSUPP;
 				goto out;
 			}
@@ -457,6 +474,510 @@ out:
 	return ret;
 }
 
+/*
+ * Direct I/O mode.
+ *
+ * The backing file's block map is taken once, when the mode is switched
+ * on, and bios that fall entirely inside mapped extents are remapped and
+ * submitted straight to the device underneath the filesystem, much like
+ * swap does for swap files.  Any number of them can be in flight and none
+ * of the data goes through the backing file's page cache.
+ *
+ * Holes, unwritten and otherwise unusual extents are left out of the map;
+ * bios touching them, flushes and the switch bio still go through
+ * loop_thread(), which drops the page cache for the range afterwards so
+ * that the two paths never see stale data from each other.
+ *
+ * A bio that fits in one clone for the lower device is sent on straight
+ * from loop_make_request().  One that has to be split is handed to
+ * loop_thread() first: clones issued from inside generic_make_request()
+ * are only queued, so a second allocation from loop_bio_set there could
+ * wait forever for a clone that has not even been submitted yet.
+ */
+struct loop_dio {
+	struct loop_device	*lo;
+	struct bio		*bio;		/* the loop bio */
+	atomic_t		remaining;
+	int			error;
+};
+
+#define LOOP_FIEMAP_BATCH	32
+
+/* extents whose blocks we can not address or must not write behind the fs */
+#define LOOP_FIEMAP_UNUSABLE	(FIEMAP_EXTENT_UNKNOWN |		\
+				 FIEMAP_EXTENT_DELALLOC |		\
+				 FIEMAP_EXTENT_ENCODED |		\
+				 FIEMAP_EXTENT_DATA_ENCRYPTED |		\
+				 FIEMAP_EXTENT_NOT_ALIGNED |		\
+				 FIEMAP_EXTENT_DATA_INLINE |		\
+				 FIEMAP_EXTENT_DATA_TAIL |		\
+				 FIEMAP_EXTENT_UNWRITTEN |		\
+				 FIEMAP_EXTENT_SHARED)
+
+static int loop_add_extent(struct loop_extent **map, unsigned int *nr,
+			   unsigned int *max, const struct fiemap_extent *fe)
+{
+	struct loop_extent *e;
+
+	if (*nr) {
+		e = &(*map)[*nr - 1];
+		if (e->pos + e->len == fe->fe_logical &&
+		    ((loff_t)e->sector << 9) + e->len == fe->fe_physical) {
+			e->len += fe->fe_length;
+			return 0;
+		}
+	}
+
+	if (*nr == *max) {
+		unsigned int n = *max ? *max * 2 : 64;
+
+		e = krealloc(*map, n * sizeof(*e), GFP_KERNEL);
+		if (!e)
+			return -ENOMEM;
+		*map = e;
+		*max = n;
+	}
+
+	e = &(*map)[(*nr)++];
+	e->pos = fe->fe_logical;
+	e->len = fe->fe_length;
+	e->sector = fe->fe_physical >> 9;
+	return 0;
+}
+
+/*
+ * Build the extent map of a regular backing file from ->fiemap(), which
+ * unlike ->bmap() tells us about unwritten and shared extents.
+ */
+static int loop_map_extents(struct inode *inode, struct loop_extent **mapp,
+			    unsigned int *nrp)
+{
+	loff_t size = i_size_read(inode);
+	struct loop_extent *map = NULL;
+	unsigned int nr = 0, max = 0;
+	struct fiemap_extent *fe;
+	mm_segment_t old_fs;
+	u64 start = 0;
+	int err = 0;
+
+	fe = kmalloc(LOOP_FIEMAP_BATCH * sizeof(*fe), GFP_KERNEL);
+	if (!fe)
+		return -ENOMEM;
+
+	while (start < size) {
+		struct fiemap_extent_info fieinfo = {
+			.fi_extents_max		= LOOP_FIEMAP_BATCH,
+			.fi_extents_start	=
+				(struct fiemap_extent __user *)fe,
+		};
+		unsigned int i;
+
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		err = inode->i_op->fiemap(inode, &fieinfo, start, size - start);
+		set_fs(old_fs);
+		if (err || !fieinfo.fi_extents_mapped)
+			break;
+
+		for (i = 0; i < fieinfo.fi_extents_mapped; i++) {
+			const struct fiemap_extent *f = &fe[i];
+
+			if (f->fe_logical < start)
+				continue;
+			if (!(f->fe_flags & LOOP_FIEMAP_UNUSABLE) &&
+			    !((f->fe_logical | f->fe_physical |
+			       f->fe_length) & 511)) {
+				err = loop_add_extent(&map, &nr, &max, f);
+				if (err)
+					goto out;
+			}
+			start = f->fe_logical + f->fe_length;
+			if (f->fe_flags & FIEMAP_EXTENT_LAST)
+				goto out;
+		}
+	}
+out:
+	kfree(fe);
+	if (err) {
+		kfree(map);
+		return err;
+	}
+	*mapp = map;
+	*nrp = nr;
+	return 0;
+}
+
+/*
+ * Filesystems known to keep the data of a regular file on s_bdev and to
+ * never write it from anywhere but the page cache, which direct I/O
+ * bypasses.  XFS is not one of them: realtime files live on another
+ * device.  ext3 and ext4 qualify only without data journalling, or a
+ * checkpoint would later copy stale journalled blocks over our writes.
+ */
+static const char * const loop_dio_fs[] = { "ext2", "ext3", "ext4", NULL };
+
+static bool loop_dio_journals_data(struct file *file)
+{
+	struct super_block *sb = file->f_mapping->host->i_sb;
+	struct seq_file m = { .size = PAGE_SIZE };
+	mm_segment_t old_fs;
+	int flags = 0;
+	bool ret = true;
+	int err;
+
+	/* chattr +j */
+	if (!file->f_op->unlocked_ioctl)
+		return true;
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	err = file->f_op->unlocked_ioctl(file, FS_IOC_GETFLAGS,
+					 (unsigned long)&flags);
+	set_fs(old_fs);
+	if (err || (flags & FS_JOURNAL_DATA_FL))
+		return true;
+
+	/* mounted with data=journal */
+	if (!sb->s_op->show_options)
+		return false;
+	m.buf = kmalloc(m.size, GFP_KERNEL);
+	if (!m.buf)
+		return true;
+	err = sb->s_op->show_options(&m, file->f_path.mnt);
+	if (!err && m.count < m.size) {
+		m.buf[m.count] = '\0';
+		ret = strstr(m.buf, ",data=journal") != NULL;
+	}
+	kfree(m.buf);
+	return ret;
+}
+
+static bool loop_dio_fs_ok(struct file *file)
+{
+	const char *name = file->f_mapping->host->i_sb->s_type->name;
+	int i;
+
+	for (i = 0; loop_dio_fs[i]; i++)
+		if (!strcmp(name, loop_dio_fs[i]))
+			return !loop_dio_journals_data(file);
+	return false;
+}
+
+/*
+ * The extent map is only good as long as the file keeps its blocks, so
+ * while direct I/O is on a regular backing file is pinned the way swapon
+ * pins a swap file: S_SWAPFILE refuses truncation, unlinking and online
+ * defragmentation, and write access is denied to everyone else, so that
+ * nobody can punch holes in it or have it reallocated by writing to it.
+ * Our own open for writing, if any, is folded into that denial.
+ */
+static int loop_dio_pin(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct inode *inode = file->f_mapping->host;
+	int err = 0;
+
+	if (!S_ISREG(inode->i_mode))
+		return 0;
+
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode)) {
+		err = -EBUSY;
+	} else if (file->f_mode & FMODE_WRITE) {
+		if (atomic_cmpxchg(&inode->i_writecount, 1, -1) != 1)
+			err = -ETXTBSY;
+	} else {
+		err = deny_write_access(file);
+	}
+	if (!err)
+		inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+static void loop_dio_unpin(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct inode *inode = file->f_mapping->host;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	mutex_lock(&inode->i_mutex);
+	inode->i_flags &= ~S_SWAPFILE;
+	atomic_add(file->f_mode & FMODE_WRITE ? 2 : 1, &inode->i_writecount);
+	mutex_unlock(&inode->i_mutex);
+}
+
+/*
+ * Called from loop_thread() through loop_switch_dio(), so everything
+ * queued before has been written by the time the page cache is dropped.
+ */
+static int loop_dio_enable(struct loop_device *lo)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct block_device *bdev;
+	struct loop_extent *map;
+	unsigned int nr;
+	int err;
+
+	err = loop_dio_pin(lo);
+	if (err)
+		return err;
+
+	err = filemap_write_and_wait(mapping);
+	if (err)
+		goto out_unpin;
+
+	if (S_ISBLK(inode->i_mode)) {
+		err = -ENOMEM;
+		map = kmalloc(sizeof(*map), GFP_KERNEL);
+		if (!map)
+			goto out_unpin;
+		map->pos = 0;
+		map->len = i_size_read(inode);
+		map->sector = 0;
+		nr = 1;
+		bdev = I_BDEV(inode);
+	} else {
+		err = loop_map_extents(inode, &map, &nr);
+		if (err)
+			goto out_unpin;
+		bdev = inode->i_sb->s_bdev;
+	}
+
+	err = invalidate_inode_pages2(mapping);
+	if (err) {
+		kfree(map);
+		goto out_unpin;
+	}
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_extents = map;
+	lo->lo_nr_extents = nr;
+	lo->lo_dio_bdev = bdev;
+	lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+	return 0;
+
+out_unpin:
+	loop_dio_unpin(lo);
+	return err;
+}
+
+/*
+ * Called from loop_thread() through loop_switch_dio(), or once the thread
+ * is gone, so that no flush still uses lo_dio_bdev.
+ */
+static void loop_dio_disable(struct loop_device *lo)
+{
+	if (!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return;
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+
+	/* nobody looks at the map once the last direct bio is done */
+	wait_event(lo->lo_event, !atomic_read(&lo->lo_dio_pending));
+
+	kfree(lo->lo_extents);
+	lo->lo_extents = NULL;
+	lo->lo_nr_extents = 0;
+	lo->lo_dio_bdev = NULL;
+	loop_dio_unpin(lo);
+}
+
+static struct loop_extent *loop_find_extent(struct loop_device *lo,
+					    loff_t pos)
+{
+	unsigned int l = 0, h = lo->lo_nr_extents;
+
+	while (l < h) {
+		unsigned int m = (l + h) / 2;
+		struct loop_extent *e = &lo->lo_extents[m];
+
+		if (pos < e->pos)
+			h = m;
+		else if (pos >= e->pos + e->len)
+			l = m + 1;
+		else
+			return e;
+	}
+	return NULL;
+}
+
+/* Called with lo_lock held: can @bio be sent to lo_dio_bdev as a whole? */
+static bool loop_dio_mapped(struct loop_device *lo, struct bio *bio)
+{
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	loff_t end = pos + bio->bi_size;
+	struct loop_extent *e;
+
+	if (!bio->bi_size || (bio->bi_rw & (REQ_FLUSH | REQ_DISCARD)))
+		return false;
+
+	while (pos < end) {
+		e = loop_find_extent(lo, pos);
+		if (!e)
+			return false;
+		pos = e->pos + e->len;
+	}
+	return true;
+}
+
+/*
+ * Called with lo_lock held on a mapped @bio: will loop_dio_submit() get
+ * away with a single clone, that is a single allocation from loop_bio_set?
+ */
+static bool loop_dio_one_clone(struct loop_device *lo, struct bio *bio)
+{
+	struct request_queue *q = bdev_get_queue(lo->lo_dio_bdev);
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	struct loop_extent *e = loop_find_extent(lo, pos);
+
+	return pos + bio->bi_size <= e->pos + e->len && !q->merge_bvec_fn &&
+	       bio->bi_vcnt <= queue_max_segments(q) &&
+	       bio_sectors(bio) <= queue_max_sectors(q);
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+
+	if (!atomic_dec_and_test(&dio->remaining))
+		return;
+
+	bio_endio(dio->bio, dio->error);
+	mempool_free(dio, loop_dio_pool);
+
+	if (atomic_dec_and_test(&lo->lo_dio_pending))
+		wake_up(&lo->lo_event);
+}
+
+static void loop_dio_end_io(struct bio *clone, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (!test_bit(BIO_UPTODATE, &clone->bi_flags) && !error)
+		error = -EIO;
+	if (error)
+		dio->error = error;
+
+	bio_put(clone);
+	loop_dio_put(dio);
+}
+
+static void loop_bio_destructor(struct bio *bio)
+{
+	bio_free(bio, loop_bio_set);
+}
+
+static struct bio *loop_dio_alloc(struct loop_dio *dio, struct loop_extent *e,
+				  loff_t pos, int nr_vecs)
+{
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(GFP_NOIO, min(nr_vecs, BIO_MAX_PAGES),
+				 loop_bio_set);
+	clone->bi_destructor = loop_bio_destructor;
+	clone->bi_sector = e->sector + ((pos - e->pos) >> 9);
+	clone->bi_bdev = dio->lo->lo_dio_bdev;
+	clone->bi_rw = dio->bio->bi_rw;
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+	return clone;
+}
+
+static void loop_dio_issue(struct loop_dio *dio, struct bio *clone)
+{
+	if (!clone)
+		return;
+	atomic_inc(&dio->remaining);
+	generic_make_request(clone);
+}
+
+/*
+ * Split @bio along extent boundaries (and whatever bio_add_page() of the
+ * lower queue refuses) and send the pieces to lo_dio_bdev.
+ */
+static void loop_dio_submit(struct loop_device *lo, struct bio *bio)
+{
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	struct loop_extent *e = NULL;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	struct loop_dio *dio;
+	loff_t left = 0;
+	int i;
+
+	dio = mempool_alloc(loop_dio_pool, GFP_NOIO);
+	dio->lo = lo;
+	dio->bio = bio;
+	dio->error = 0;
+	atomic_set(&dio->remaining, 1);
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int off = bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		while (len) {
+			unsigned int n;
+
+			if (!left) {
+				loop_dio_issue(dio, clone);
+				clone = NULL;
+				e = loop_find_extent(lo, pos);
+				left = e->pos + e->len - pos;
+			}
+			if (!clone)
+				clone = loop_dio_alloc(dio, e, pos,
+						       bio->bi_vcnt - i);
+
+			n = min_t(loff_t, len, left);
+			if (bio_add_page(clone, bvec->bv_page, n, off) < n) {
+				loop_dio_issue(dio, clone);
+				clone = loop_dio_alloc(dio, e, pos,
+						       bio->bi_vcnt - i);
+				if (bio_add_page(clone, bvec->bv_page,
+						 n, off) < n) {
+					bio_put(clone);
+					clone = NULL;
+					dio->error = -EIO;
+					goto out;
+				}
+			}
+
+			pos += n;
+			off += n;
+			len -= n;
+			left -= n;
+		}
+	}
+	loop_dio_issue(dio, clone);
+out:
+	loop_dio_put(dio);
+}
+
+/*
+ * A bio that went through the backing file while direct I/O is on: push
+ * what it left in the page cache out and drop it, so later direct bios
+ * neither miss nor get overwritten by it.
+ */
+static void loop_dio_drop_cache(struct loop_device *lo, struct bio *bio)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	loff_t end = pos + bio->bi_size - 1;
+
+	if (!bio->bi_size || (bio->bi_rw & REQ_DISCARD))
+		return;
+
+	filemap_write_and_wait_range(mapping, pos, end);
+	invalidate_inode_pages2_range(mapping, pos >> PAGE_CACHE_SHIFT,
+				      end >> PAGE_CACHE_SHIFT);
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -488,6 +1009,13 @@ static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) &&
+	    loop_dio_mapped(lo, old_bio) && loop_dio_one_clone(lo, old_bio)) {
+		atomic_inc(&lo->lo_dio_pending);
+		spin_unlock_irq(&lo->lo_lock);
+		loop_dio_submit(lo, old_bio);
+		return;
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -500,6 +1028,8 @@ out:
 
 struct switch_request {
 	struct file *file;
+	int dio;		/* switch direct I/O on (> 0) or off (< 0) */
+	int error;
 	struct completion wait;
 };
 
@@ -507,11 +1037,28 @@ static void do_loop_switch(struct loop_device *, struct switch_request *);
 
 static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 {
+	bool dio = false;
+
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+		return;
+	}
+
+	/* split here, where the clones are submitted as we go */
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		spin_lock_irq(&lo->lo_lock);
+		dio = loop_dio_mapped(lo, bio);
+		spin_unlock_irq(&lo->lo_lock);
+	}
+	if (dio) {
+		atomic_inc(&lo->lo_dio_pending);
+		loop_dio_submit(lo, bio);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
+
+		if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+			loop_dio_drop_cache(lo, bio);
 		bio_endio(bio, ret);
 	}
 }
@@ -559,19 +1106,32 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct switch_request *w)
 {
-	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
 	if (!bio)
 		return -ENOMEM;
-	init_completion(&w.wait);
-	w.file = file;
-	bio->bi_private = &w;
+	init_completion(&w->wait);
+	w->error = 0;
+	bio->bi_private = w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
-	wait_for_completion(&w.wait);
-	return 0;
+	wait_for_completion(&w->wait);
+	return w->error;
+}
+
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	struct switch_request w = { .file = file };
+
+	return __loop_switch(lo, &w);
+}
+
+static int loop_switch_dio(struct loop_device *lo, bool on)
+{
+	struct switch_request w = { .dio = on ? 1 : -1 };
+
+	return __loop_switch(lo, &w);
 }
 
 /*
@@ -595,6 +1155,15 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	if (p->dio > 0) {
+		p->error = loop_dio_enable(lo);
+		goto out;
+	}
+	if (p->dio < 0) {
+		loop_dio_disable(lo);
+		goto out;
+	}
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -630,9 +1199,10 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (lo->lo_state != Lo_bound)
 		goto out;
 
-	/* the loop device has to be read-only */
+	/* the loop device has to be read-only, and not doing direct I/O */
 	error = -EINVAL;
-	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
+	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY) ||
+	    (lo->lo_flags & LO_FLAGS_DIRECT_IO))
 		goto out;
 
 	error = -EBADF;
@@ -742,11 +1312,19 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RO(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -754,6 +1332,7 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -784,10 +1363,11 @@ static void loop_config_discard(struct loop_device *lo)
 	 * We use punch hole to reclaim the free space used by the
 	 * image a.k.a. discard. However we do support discard if
 	 * encryption is enabled, because it may give an attacker
-	 * useful information.
+	 * useful information, or in direct I/O mode.
 	 */
 	if ((!file->f_op->fallocate) ||
-	    lo->lo_encrypt_key_size) {
+	    lo->lo_encrypt_key_size ||
+	    (lo->lo_flags & LO_FLAGS_DIRECT_IO)) {
 		q->limits.discard_granularity = 0;
 		q->limits.discard_alignment = 0;
 		q->limits.max_discard_sectors = 0;
@@ -986,6 +1566,7 @@ static int loop_clr_fd(struct loop_device *lo)
 	spin_unlock_irq(&lo->lo_lock);
 
 	kthread_stop(lo->lo_thread);
+	loop_dio_disable(lo);
 
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
@@ -1047,6 +1628,10 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		return -ENXIO;
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
+	/* direct I/O bypasses the transfer functions */
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) &&
+	    (info->lo_encrypt_type || (info->lo_offset & 511)))
+		return -EINVAL;
 
 	err = loop_release_xfer(lo);
 	if (err)
@@ -1272,6 +1857,45 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	return err;
 }
 
+/*
+ * Switch direct I/O on or off.  It lets the loop device write to blocks
+ * of the filesystem underneath directly, hence CAP_SYS_ADMIN rather than
+ * just a writable loop device.
+ */
+static int loop_set_dio(struct loop_device *lo, unsigned long arg)
+{
+	struct file *file = lo->lo_backing_file;
+	struct inode *inode;
+	int err;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+	if (!arg == !(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+
+	if (!arg) {
+		err = loop_switch_dio(lo, false);
+		if (err)
+			return err;
+		loop_config_discard(lo);
+		return 0;
+	}
+
+	inode = file->f_mapping->host;
+	if (lo->lo_encryption || (lo->lo_offset & 511))
+		return -EINVAL;
+	if (S_ISREG(inode->i_mode) &&
+	    (!inode->i_sb->s_bdev || !file->f_mapping->a_ops->bmap ||
+	     !inode->i_op->fiemap || !loop_dio_fs_ok(file)))
+		return -EINVAL;
+
+	err = loop_switch_dio(lo, true);
+	if (err)
+		return err;
+	loop_config_discard(lo);
+	return 0;
+}
+
 static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 	unsigned int cmd, unsigned long arg)
 {
@@ -1315,6 +1939,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if (capable(CAP_SYS_ADMIN))
+			err = loop_set_dio(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1469,6 +2098,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1661,6 +2291,7 @@ static int loop_add(struct loop_device **l, int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	atomic_set(&lo->lo_dio_pending, 0);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -1858,8 +2489,21 @@ static int __init loop_init(void)
 		range = 1UL << MINORBITS;
 	}
 
-	if (register_blkdev(LOOP_MAJOR, "loop"))
+	loop_bio_set = bioset_create(BIO_POOL_SIZE, 0);
+	if (!loop_bio_set)
+		return -ENOMEM;
+	loop_dio_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						    sizeof(struct loop_dio));
+	if (!loop_dio_pool) {
+		bioset_free(loop_bio_set);
+		return -ENOMEM;
+	}
+
+	if (register_blkdev(LOOP_MAJOR, "loop")) {
+		mempool_destroy(loop_dio_pool);
+		bioset_free(loop_bio_set);
 		return -EIO;
+	}
 
 	blk_register_region(MKDEV(LOOP_MAJOR, 0), range,
 				  THIS_MODULE, loop_probe, NULL, NULL);
@@ -1895,6 +2539,9 @@ static void __exit loop_exit(void)
 	blk_unregister_region(MKDEV(LOOP_MAJOR, 0), range);
 	unregister_blkdev(LOOP_MAJOR, "loop");
 
+	mempool_destroy(loop_dio_pool);
+	bioset_free(loop_bio_set);
+
 	misc_deregister(&loop_misc);
 }
 
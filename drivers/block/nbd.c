@@ -77,6 +77,7 @@ static const char *ioctl_cmd_to_ascii(int cmd)
 {
 	switch (cmd) {
 	case NBD_SET_SOCK: return "set-sock";
+	case NBD_ADD_SOCK: return "add-sock";
 	case NBD_SET_BLKSIZE: return "set-blksize";
 	case NBD_SET_SIZE: return "set-size";
 	case NBD_DO_IT: return "do-it";
@@ -102,23 +103,37 @@ static const char *nbdcmd_to_ascii(int cmd)
 }
 #endif /* NDEBUG */
 
+/*
+ * Tags index lo->inflight and go out as the request handle, so a reply is
+ * matched with a single lookup whichever connection it arrives on.  They
+ * are handed out in do_nbd_request() and returned here, both under the
+ * queue lock.
+ */
 static void nbd_end_request(struct request *req)
 {
 	int error = req->errors ? -EIO : 0;
 	struct request_queue *q = req->q;
+	struct nbd_device *lo = req->rq_disk->private_data;
 	unsigned long flags;
 
 	dprintk(DBG_BLKDEV, "%s: request %p: %s\n", req->rq_disk->disk_name,
 			req, error ? "failed" : "done");
 
 	spin_lock_irqsave(q->queue_lock, flags);
+	__clear_bit(req->tag, lo->tag_map);
+	if (lo->tag_starved) {
+		lo->tag_starved = 0;
+		blk_run_queue_async(q);
+	}
 	__blk_end_request_all(req, error);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
 static void sock_shutdown(struct nbd_device *lo, int lock)
 {
-	/* Forcibly shutdown the socket causing all listeners
+	int i;
+
+	/* Forcibly shutdown the sockets causing all listeners
 	 * to error
 	 *
 	 * FIXME: This code is duplicated from sys_shutdown, but
@@ -126,10 +141,15 @@ static void sock_shutdown(struct nbd_device *lo, int lock)
 	 * calling socket ops directly here */
 	if (lock)
 		mutex_lock(&lo->tx_lock);
-	if (lo->sock) {
+	for (i = 0; i < lo->num_socks; i++) {
+		struct nbd_sock *nsock = &lo->socks[i];
+		struct socket *sock = nsock->sock;
+
+		if (!sock)
+			continue;
 		dev_warn(disk_to_dev(lo->disk), "shutting down socket\n");
-		kernel_sock_shutdown(lo->sock, SHUT_RDWR);
-		lo->sock = NULL;
+		kernel_sock_shutdown(sock, SHUT_RDWR);
+		nsock->sock = NULL;
 	}
 	if (lock)
 		mutex_unlock(&lo->tx_lock);
@@ -146,11 +166,14 @@ static void nbd_xmit_timeout(unsigned long arg)
 
 /*
  *  Send or receive packet.
+ *
+ *  nsock->sock may be cleared under us by sock_shutdown(); the socket
+ *  itself stays around as long as nsock->file does.
  */
-static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
-		int msg_flags)
+static int sock_xmit(struct nbd_device *lo, struct nbd_sock *nsock, int send,
+		void *buf, int size, int msg_flags)
 {
-	struct socket *sock = lo->sock;
+	struct socket *sock = nsock->sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
@@ -219,35 +242,38 @@ static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *lo, struct bio_vec *bvec,
-		int flags)
+static inline int sock_send_bvec(struct nbd_device *lo, struct nbd_sock *nsock,
+		struct bio_vec *bvec, int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 1, kaddr + bvec->bv_offset, bvec->bv_len, flags);
+	result = sock_xmit(lo, nsock, 1, kaddr + bvec->bv_offset,
+			   bvec->bv_len, flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *lo, struct request *req)
+/* always call with the nsock->tx_lock held */
+static int nbd_send_req(struct nbd_device *lo, struct nbd_sock *nsock,
+			struct request *req)
 {
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
+	u64 handle = req->tag;
 
 	request.magic = htonl(NBD_REQUEST_MAGIC);
 	request.type = htonl(nbd_cmd(req));
 	request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
 	request.len = htonl(size);
-	memcpy(request.handle, &req, sizeof(req));
+	memcpy(request.handle, &handle, sizeof(handle));
 
 	dprintk(DBG_TX, "%s: request %p: sending control (%s@%llu,%uB)\n",
 			lo->disk->disk_name, req,
 			nbdcmd_to_ascii(nbd_cmd(req)),
 			(unsigned long long)blk_rq_pos(req) << 9,
 			blk_rq_bytes(req));
-	result = sock_xmit(lo, 1, &request, sizeof(request),
+	result = sock_xmit(lo, nsock, 1, &request, sizeof(request),
 			(nbd_cmd(req) == NBD_CMD_WRITE) ? MSG_MORE : 0);
 	if (result <= 0) {
 		dev_err(disk_to_dev(lo->disk),
@@ -268,7 +294,7 @@ static int nbd_send_req(struct nbd_device *lo, struct request *req)
 				flags = MSG_MORE;
 			dprintk(DBG_TX, "%s: request %p: sending %d bytes data\n",
 					lo->disk->disk_name, req, bvec->bv_len);
-			result = sock_send_bvec(lo, bvec, flags);
+			result = sock_send_bvec(lo, nsock, bvec, flags);
 			if (result <= 0) {
 				dev_err(disk_to_dev(lo->disk),
 					"Send data failed (result %d)\n",
@@ -284,50 +310,48 @@ error_out:
 }
 
 static struct request *nbd_find_request(struct nbd_device *lo,
-					struct request *xreq)
+					struct nbd_sock *nsock, u64 handle)
 {
-	struct request *req, *tmp;
+	struct request *req;
 	int err;
 
-	err = wait_event_interruptible(lo->active_wq, lo->active_req != xreq);
-	if (unlikely(err))
-		goto out;
-
-	spin_lock(&lo->queue_lock);
-	list_for_each_entry_safe(req, tmp, &lo->queue_head, queuelist) {
-		if (req != xreq)
-			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&lo->queue_lock);
-		return req;
-	}
-	spin_unlock(&lo->queue_lock);
+	if (handle >= NBD_QUEUE_DEPTH)
+		return ERR_PTR(-ENOENT);
 
-	err = -ENOENT;
+	/* the server may answer before the sender is done with req */
+	req = ACCESS_ONCE(lo->inflight[handle]);
+	err = wait_event_interruptible(lo->active_wq,
+				       nsock->active_req != req);
+	if (unlikely(err))
+		return ERR_PTR(err);
 
-out:
-	return ERR_PTR(err);
+	if (!req || cmpxchg(&lo->inflight[handle], req, NULL) != req)
+		return ERR_PTR(-ENOENT);
+	return req;
 }
 
-static inline int sock_recv_bvec(struct nbd_device *lo, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_device *lo, struct nbd_sock *nsock,
+		struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 0, kaddr + bvec->bv_offset, bvec->bv_len,
+	result = sock_xmit(lo, nsock, 0, kaddr + bvec->bv_offset, bvec->bv_len,
 			MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
 /* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *lo)
+static struct request *nbd_read_stat(struct nbd_device *lo,
+				     struct nbd_sock *nsock)
 {
 	int result;
 	struct nbd_reply reply;
 	struct request *req;
+	u64 handle;
 
 	reply.magic = 0;
-	result = sock_xmit(lo, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(lo, nsock, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
 		dev_err(disk_to_dev(lo->disk),
 			"Receive control failed (result %d)\n", result);
@@ -341,14 +365,15 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 		goto harderror;
 	}
 
-	req = nbd_find_request(lo, *(struct request **)reply.handle);
+	memcpy(&handle, reply.handle, sizeof(handle));
+	req = nbd_find_request(lo, nsock, handle);
 	if (IS_ERR(req)) {
 		result = PTR_ERR(req);
 		if (result != -ENOENT)
 			goto harderror;
 
-		dev_err(disk_to_dev(lo->disk), "Unexpected reply (%p)\n",
-			reply.handle);
+		dev_err(disk_to_dev(lo->disk), "Unexpected reply (%llu)\n",
+			(unsigned long long)handle);
 		result = -EBADR;
 		goto harderror;
 	}
@@ -367,7 +392,7 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 		struct bio_vec *bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(lo, bvec);
+			result = sock_recv_bvec(lo, nsock, bvec);
 			if (result <= 0) {
 				dev_err(disk_to_dev(lo->disk), "Receive data failed (result %d)\n",
 					result);
@@ -380,7 +405,9 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 	}
 	return req;
 harderror:
-	lo->harderror = result;
+	/* the first failing connection takes the others down, keep its error */
+	if (!lo->harderror)
+		lo->harderror = result;
 	return NULL;
 }
 
@@ -398,10 +425,39 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
+/* Reply loop for all connections but the first one */
+static int nbd_recv_thread(void *data)
+{
+	struct nbd_sock *nsock = data;
+	struct nbd_device *lo = nsock->lo;
+	struct request *req;
+
+	while ((req = nbd_read_stat(lo, nsock)) != NULL)
+		nbd_end_request(req);
+
+	sock_shutdown(lo, 1);
+	return 0;
+}
+
+static void nbd_stop_receivers(struct nbd_device *lo)
+{
+	int i;
+
+	for (i = 1; i < lo->num_socks; i++) {
+		struct task_struct *task = lo->socks[i].recv_task;
+
+		if (!task)
+			continue;
+		kthread_stop(task);
+		put_task_struct(task);
+		lo->socks[i].recv_task = NULL;
+	}
+}
+
 static int nbd_do_it(struct nbd_device *lo)
 {
 	struct request *req;
-	int ret;
+	int ret, i;
 
 	BUG_ON(lo->magic != LO_MAGIC);
 
@@ -413,9 +469,29 @@ static int nbd_do_it(struct nbd_device *lo)
 		return ret;
 	}
 
-	while ((req = nbd_read_stat(lo)) != NULL)
+	lo->harderror = 0;
+	for (i = 1; i < lo->num_socks; i++) {
+		struct task_struct *task;
+
+		task = kthread_run(nbd_recv_thread, &lo->socks[i], "%s-r%d",
+				   lo->disk->disk_name, i);
+		if (IS_ERR(task)) {
+			/* nobody would read its replies, give up */
+			lo->harderror = PTR_ERR(task);
+			sock_shutdown(lo, 1);
+			break;
+		}
+		/* the thread may be gone before kthread_stop() */
+		get_task_struct(task);
+		lo->socks[i].recv_task = task;
+	}
+
+	while ((req = nbd_read_stat(lo, &lo->socks[0])) != NULL)
 		nbd_end_request(req);
 
+	sock_shutdown(lo, 1);
+	nbd_stop_receivers(lo);
+
 	device_remove_file(disk_to_dev(lo->disk), &pid_attr);
 	lo->pid = 0;
 	return 0;
@@ -424,31 +500,33 @@ static int nbd_do_it(struct nbd_device *lo)
 static void nbd_clear_que(struct nbd_device *lo)
 {
 	struct request *req;
+	int i, tag;
 
 	BUG_ON(lo->magic != LO_MAGIC);
 
 	/*
-	 * Because we have set lo->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
-	 *
-	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
+	 * All sockets have been shut down, so nothing new is sent; wait for
+	 * senders that were in the middle of a request.  A receiver may
+	 * still be picking up a last reply, which is why the table entries
+	 * are claimed with xchg() like nbd_find_request() does.
 	 */
-	BUG_ON(lo->sock);
-	BUG_ON(lo->active_req);
+	for (i = 0; i < lo->num_socks; i++) {
+		mutex_lock(&lo->socks[i].tx_lock);
+		mutex_unlock(&lo->socks[i].tx_lock);
+	}
 
-	while (!list_empty(&lo->queue_head)) {
-		req = list_entry(lo->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
+	for (tag = 0; tag < NBD_QUEUE_DEPTH; tag++) {
+		req = xchg(&lo->inflight[tag], NULL);
+		if (!req)
+			continue;
 		req->errors++;
 		nbd_end_request(req);
 	}
 }
 
 
-static void nbd_handle_req(struct nbd_device *lo, struct request *req)
+static void nbd_handle_req(struct nbd_device *lo, struct nbd_sock *nsock,
+			   struct request *req)
 {
 	if (req->cmd_type != REQ_TYPE_FS)
 		goto error_out;
@@ -465,28 +543,27 @@ static void nbd_handle_req(struct nbd_device *lo, struct request *req)
 
 	req->errors = 0;
 
-	mutex_lock(&lo->tx_lock);
-	if (unlikely(!lo->sock)) {
-		mutex_unlock(&lo->tx_lock);
+	mutex_lock(&nsock->tx_lock);
+	if (unlikely(!nsock->sock)) {
+		mutex_unlock(&nsock->tx_lock);
 		dev_err(disk_to_dev(lo->disk),
 			"Attempted send on closed socket\n");
 		goto error_out;
 	}
 
-	lo->active_req = req;
+	nsock->active_req = req;
+	lo->inflight[req->tag] = req;
 
-	if (nbd_send_req(lo, req) != 0) {
+	if (nbd_send_req(lo, nsock, req) != 0) {
 		dev_err(disk_to_dev(lo->disk), "Request send failed\n");
-		req->errors++;
-		nbd_end_request(req);
-	} else {
-		spin_lock(&lo->queue_lock);
-		list_add(&req->queuelist, &lo->queue_head);
-		spin_unlock(&lo->queue_lock);
+		if (cmpxchg(&lo->inflight[req->tag], req, NULL) == req) {
+			req->errors++;
+			nbd_end_request(req);
+		}
 	}
 
-	lo->active_req = NULL;
-	mutex_unlock(&lo->tx_lock);
+	nsock->active_req = NULL;
+	mutex_unlock(&nsock->tx_lock);
 	wake_up_all(&lo->active_wq);
 
 	return;
@@ -496,9 +573,14 @@ error_out:
 	nbd_end_request(req);
 }
 
+/*
+ * One sender per connection, all feeding off lo->waiting_queue, so a
+ * request goes out on whichever socket is free first.
+ */
 static int nbd_thread(void *data)
 {
-	struct nbd_device *lo = data;
+	struct nbd_sock *nsock = data;
+	struct nbd_device *lo = nsock->lo;
 	struct request *req;
 
 	set_user_nice(current, -20);
@@ -509,17 +591,48 @@ static int nbd_thread(void *data)
 					 !list_empty(&lo->waiting_queue));
 
 		/* extract request */
-		if (list_empty(&lo->waiting_queue))
-			continue;
-
 		spin_lock_irq(&lo->queue_lock);
+		if (list_empty(&lo->waiting_queue)) {
+			spin_unlock_irq(&lo->queue_lock);
+			continue;
+		}
 		req = list_entry(lo->waiting_queue.next, struct request,
 				 queuelist);
 		list_del_init(&req->queuelist);
 		spin_unlock_irq(&lo->queue_lock);
 
 		/* handle request */
-		nbd_handle_req(lo, req);
+		nbd_handle_req(lo, nsock, req);
+	}
+	return 0;
+}
+
+static void nbd_stop_senders(struct nbd_device *lo)
+{
+	int i;
+
+	for (i = 0; i < lo->num_socks; i++) {
+		if (!lo->socks[i].send_task)
+			continue;
+		kthread_stop(lo->socks[i].send_task);
+		lo->socks[i].send_task = NULL;
+	}
+}
+
+static int nbd_start_senders(struct nbd_device *lo)
+{
+	struct task_struct *thread;
+	int i;
+
+	for (i = 0; i < lo->num_socks; i++) {
+		thread = kthread_create(nbd_thread, &lo->socks[i], "%s-%d",
+					lo->disk->disk_name, i);
+		if (IS_ERR(thread)) {
+			nbd_stop_senders(lo);
+			return PTR_ERR(thread);
+		}
+		lo->socks[i].send_task = thread;
+		wake_up_process(thread);
 	}
 	return 0;
 }
@@ -535,19 +648,30 @@ static void do_nbd_request(struct request_queue *q)
 {
 	struct request *req;
 	
-	while ((req = blk_fetch_request(q)) != NULL) {
+	while ((req = blk_peek_request(q)) != NULL) {
 		struct nbd_device *lo;
+		int tag;
+
+		lo = req->rq_disk->private_data;
+
+		BUG_ON(lo->magic != LO_MAGIC);
+
+		/* nbd_end_request() restarts us once a tag is freed */
+		tag = find_first_zero_bit(lo->tag_map, NBD_QUEUE_DEPTH);
+		if (tag >= NBD_QUEUE_DEPTH) {
+			lo->tag_starved = 1;
+			break;
+		}
+		__set_bit(tag, lo->tag_map);
+		req->tag = tag;
+		blk_start_request(req);
 
 		spin_unlock_irq(q->queue_lock);
 
 		dprintk(DBG_BLKDEV, "%s: request %p: dequeued (flags=%x)\n",
 				req->rq_disk->disk_name, req, req->cmd_type);
 
-		lo = req->rq_disk->private_data;
-
-		BUG_ON(lo->magic != LO_MAGIC);
-
-		if (unlikely(!lo->sock)) {
+		if (unlikely(!lo->num_socks)) {
 			dev_err(disk_to_dev(lo->disk),
 				"Attempted send on closed socket\n");
 			req->errors++;
@@ -566,6 +690,50 @@ static void do_nbd_request(struct request_queue *q)
 	}
 }
 
+static int nbd_add_sock(struct nbd_device *lo, struct block_device *bdev,
+			unsigned long arg)
+{
+	struct nbd_sock *nsock;
+	struct inode *inode;
+	struct file *file;
+
+	if (lo->num_socks == NBD_MAX_SOCKS)
+		return -EINVAL;
+
+	file = fget(arg);
+	if (!file)
+		return -EINVAL;
+
+	inode = file->f_path.dentry->d_inode;
+	if (!S_ISSOCK(inode->i_mode)) {
+		fput(file);
+		return -EINVAL;
+	}
+
+	nsock = &lo->socks[lo->num_socks++];
+	nsock->file = file;
+	nsock->sock = SOCKET_I(inode);
+	if (max_part > 0)
+		bdev->bd_invalidated = 1;
+	return 0;
+}
+
+/* Drop the sockets; their threads must be gone by now */
+static void nbd_release_socks(struct nbd_device *lo)
+{
+	int i;
+
+	for (i = 0; i < lo->num_socks; i++) {
+		struct nbd_sock *nsock = &lo->socks[i];
+
+		nsock->sock = NULL;
+		if (nsock->file)
+			fput(nsock->file);
+		nsock->file = NULL;
+	}
+	lo->num_socks = 0;
+}
+
 /* Must be called with tx_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
@@ -574,50 +742,46 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 	switch (cmd) {
 	case NBD_DISCONNECT: {
 		struct request sreq;
+		int i, sent = 0;
 
 		dev_info(disk_to_dev(lo->disk), "NBD_DISCONNECT\n");
 
 		blk_rq_init(NULL, &sreq);
 		sreq.cmd_type = REQ_TYPE_SPECIAL;
 		nbd_cmd(&sreq) = NBD_CMD_DISC;
-		if (!lo->sock)
+		/* every connection gets one, the server closes each */
+		for (i = 0; i < lo->num_socks; i++) {
+			struct nbd_sock *nsock = &lo->socks[i];
+
+			mutex_lock(&nsock->tx_lock);
+			if (nsock->sock) {
+				nbd_send_req(lo, nsock, &sreq);
+				sent++;
+			}
+			mutex_unlock(&nsock->tx_lock);
+		}
+		if (!sent)
 			return -EINVAL;
-		nbd_send_req(lo, &sreq);
                 return 0;
 	}
  
-	case NBD_CLEAR_SOCK: {
-		struct file *file;
-
-		lo->sock = NULL;
-		file = lo->file;
-		lo->file = NULL;
+	case NBD_CLEAR_SOCK:
+		sock_shutdown(lo, 0);
 		nbd_clear_que(lo);
-		BUG_ON(!list_empty(&lo->queue_head));
-		if (file)
-			fput(file);
+		/* NBD_DO_IT drops the sockets once its threads are gone */
+		if (!lo->pid)
+			nbd_release_socks(lo);
 		return 0;
-	}
 
-	case NBD_SET_SOCK: {
-		struct file *file;
-		if (lo->file)
+	case NBD_SET_SOCK:
+		if (lo->num_socks)
 			return -EBUSY;
-		file = fget(arg);
-		if (file) {
-			struct inode *inode = file->f_path.dentry->d_inode;
-			if (S_ISSOCK(inode->i_mode)) {
-				lo->file = file;
-				lo->sock = SOCKET_I(inode);
-				if (max_part > 0)
-					bdev->bd_invalidated = 1;
-				return 0;
-			} else {
-				fput(file);
-			}
-		}
-		return -EINVAL;
-	}
+		return nbd_add_sock(lo, bdev, arg);
+
+	case NBD_ADD_SOCK:
+		if (lo->pid)
+			return -EBUSY;
+		return nbd_add_sock(lo, bdev, arg);
 
 	case NBD_SET_BLKSIZE:
 		lo->blksize = arg;
@@ -646,36 +810,30 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct file *file;
 		int error;
 
 		if (lo->pid)
 			return -EBUSY;
-		if (!lo->file)
+		if (!lo->num_socks)
 			return -EINVAL;
 
 		mutex_unlock(&lo->tx_lock);
 
-		thread = kthread_create(nbd_thread, lo, lo->disk->disk_name);
-		if (IS_ERR(thread)) {
+		error = nbd_start_senders(lo);
+		if (error) {
 			mutex_lock(&lo->tx_lock);
-			return PTR_ERR(thread);
+			return error;
 		}
-		wake_up_process(thread);
 		error = nbd_do_it(lo);
-		kthread_stop(thread);
+		nbd_stop_senders(lo);
 
 		mutex_lock(&lo->tx_lock);
 		if (error)
 			return error;
 		sock_shutdown(lo, 0);
-		file = lo->file;
-		lo->file = NULL;
 		nbd_clear_que(lo);
 		dev_warn(disk_to_dev(lo->disk), "queue cleared\n");
-		if (file)
-			fput(file);
+		nbd_release_socks(lo);
 		lo->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
 		set_capacity(lo->disk, 0);
@@ -689,14 +847,13 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		 * This is for compatibility only.  The queue is always cleared
 		 * by NBD_DO_IT or NBD_CLEAR_SOCK.
 		 */
-		BUG_ON(!lo->sock && !list_empty(&lo->queue_head));
 		return 0;
 
 	case NBD_PRINT_DEBUG:
 		dev_info(disk_to_dev(lo->disk),
-			"next = %p, prev = %p, head = %p\n",
-			lo->queue_head.next, lo->queue_head.prev,
-			&lo->queue_head);
+			"sockets = %d, requests in flight = %d\n",
+			lo->num_socks,
+			bitmap_weight(lo->tag_map, NBD_QUEUE_DEPTH));
 		return 0;
 	}
 	return -ENOTTY;
@@ -774,9 +931,19 @@ static int __init nbd_init(void)
 		return -EINVAL;
 
 	for (i = 0; i < nbds_max; i++) {
-		struct gendisk *disk = alloc_disk(1 << part_shift);
+		struct gendisk *disk;
+
+		nbd_dev[i].socks = kcalloc(NBD_MAX_SOCKS,
+					   sizeof(struct nbd_sock), GFP_KERNEL);
+		nbd_dev[i].inflight = kcalloc(NBD_QUEUE_DEPTH,
+					      sizeof(struct request *),
+					      GFP_KERNEL);
+		if (!nbd_dev[i].socks || !nbd_dev[i].inflight)
+			goto out_free;
+
+		disk = alloc_disk(1 << part_shift);
 		if (!disk)
-			goto out;
+			goto out_free;
 		nbd_dev[i].disk = disk;
 		/*
 		 * The new linux 2.5 block layer implementation requires
@@ -786,7 +953,7 @@ static int __init nbd_init(void)
 		disk->queue = blk_init_queue(do_nbd_request, &nbd_lock);
 		if (!disk->queue) {
 			put_disk(disk);
-			goto out;
+			goto out_free;
 		}
 		/*
 		 * Tell the block layer that we are not a rotational device
@@ -804,12 +971,17 @@ static int __init nbd_init(void)
 
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].file = NULL;
+		int j;
+
+		nbd_dev[i].num_socks = 0;
+		for (j = 0; j < NBD_MAX_SOCKS; j++) {
+			nbd_dev[i].socks[j].lo = &nbd_dev[i];
+			mutex_init(&nbd_dev[i].socks[j].tx_lock);
+		}
 		nbd_dev[i].magic = LO_MAGIC;
 		nbd_dev[i].flags = 0;
 		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
 		spin_lock_init(&nbd_dev[i].queue_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
 		mutex_init(&nbd_dev[i].tx_lock);
 		init_waitqueue_head(&nbd_dev[i].active_wq);
 		init_waitqueue_head(&nbd_dev[i].waiting_wq);
@@ -825,10 +997,15 @@ static int __init nbd_init(void)
 	}
 
 	return 0;
+out_free:
+	kfree(nbd_dev[i].inflight);
+	kfree(nbd_dev[i].socks);
 out:
 	while (i--) {
 		blk_cleanup_queue(nbd_dev[i].disk->queue);
 		put_disk(nbd_dev[i].disk);
+		kfree(nbd_dev[i].inflight);
+		kfree(nbd_dev[i].socks);
 	}
 	kfree(nbd_dev);
 	return err;
@@ -845,6 +1022,8 @@ static void __exit nbd_cleanup(void)
 			blk_cleanup_queue(disk->queue);
 			put_disk(disk);
 		}
+		kfree(nbd_dev[i].inflight);
+		kfree(nbd_dev[i].socks);
 	}
 	unregister_blkdev(NBD_MAJOR, "nbd");
 	kfree(nbd_dev);
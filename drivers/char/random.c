@@ -95,6 +95,17 @@
  * Nonetheless, these numbers should be useful for the vast majority
  * of purposes.
  *
+ * Output that does not have to be backed by the entropy estimate, that
+ * is get_random_bytes() and /dev/urandom, comes from a ChaCha20 based
+ * CRNG instead of from a hash of a pool.  A base key is seeded from
+ * the input pool at boot, again once the pool has collected enough
+ * entropy, and every five minutes after that.  Each CPU derives its
+ * own key from the base key, so readers on different CPUs never share
+ * a lock.  Whenever a key is used it is immediately replaced with the
+ * first half of a fresh ChaCha20 block ("fast key erasure"), and the
+ * request is served from a key made of the other half, so a later
+ * compromise of the kernel state reveals nothing about earlier output.
+ *
  * Exported interfaces ---- output
  * ===============================
  *
@@ -248,6 +259,7 @@
 #include <linux/percpu.h>
 #include <linux/cryptohash.h>
 #include <linux/fips.h>
+#include <crypto/chacha20.h>
 
 #ifdef CONFIG_GENERIC_HARDIRQS
 # include <linux/irq.h>
@@ -265,6 +277,7 @@
 #define OUTPUT_POOL_WORDS 32
 #define SEC_XFER_SIZE 512
 #define EXTRACT_SIZE 10
+#define CRNG_RESEED_INTERVAL (300 * HZ)
 
 /*
  * The minimum number of bits of entropy before we wake up a read on
@@ -395,7 +408,7 @@ module_param(debug, bool, 0644);
 		fmt,\
 		input_pool.entropy_count,\
 		blocking_pool.entropy_count,\
-		nonblocking_pool.entropy_count,\
+		crng_init,\
 		## arg); } while (0)
 #else
 #define DEBUG_ENT(fmt, arg...) do {} while (0)
@@ -427,7 +440,6 @@ struct entropy_store {
 
 static __u32 input_pool_data[INPUT_POOL_WORDS];
 static __u32 blocking_pool_data[OUTPUT_POOL_WORDS];
-static __u32 nonblocking_pool_data[OUTPUT_POOL_WORDS];
 
 static struct entropy_store input_pool = {
 	.poolinfo = &poolinfo_table[0],
@@ -446,14 +458,34 @@ static struct entropy_store blocking_pool = {
 	.pool = blocking_pool_data
 };
 
-static struct entropy_store nonblocking_pool = {
-	.poolinfo = &poolinfo_table[1],
-	.name = "nonblocking",
-	.pull = &input_pool,
-	.lock = __SPIN_LOCK_UNLOCKED(&nonblocking_pool.lock),
-	.pool = nonblocking_pool_data
+/*
+ * The CRNG base key.  The generation changes on every reseed, which
+ * tells the per-CPU keys to derive themselves again.
+ */
+static struct {
+	__u8 key[CHACHA20_KEY_SIZE];
+	unsigned long generation;
+	unsigned long birth;
+	spinlock_t lock;
+} base_crng = {
+	.lock = __SPIN_LOCK_UNLOCKED(&base_crng.lock),
 };
 
+struct crng {
+	__u8 key[CHACHA20_KEY_SIZE];
+	unsigned long generation;
+};
+
+static DEFINE_PER_CPU(struct crng, crngs);
+
+/*
+ * 0: per-CPU keys not usable yet, 1: seeded from the input pool,
+ * 2: seeded once the input pool held enough entropy.
+ */
+static int crng_init;
+
+static void crng_reseed(void);
+
 /*
  * This function adds bytes into the entropy "pool".  It does not
  * update the entropy estimate.  The caller should call
@@ -557,6 +589,13 @@ static void credit_entropy_bits(struct entropy_store *r, int nbits)
 		kill_fasync(&fasync, SIGIO, POLL_IN);
 	}
 	spin_unlock_irqrestore(&r->lock, flags);
+
+	/* reseed the CRNG as soon as the pool is worth it */
+	if (r == &input_pool && entropy_count >= 128 &&
+	    cmpxchg(&crng_init, 1, 2) == 1) {
+		crng_reseed();
+		printk(KERN_NOTICE "random: crng init done\n");
+	}
 }
 
 /*********************************************************************
@@ -757,6 +796,8 @@ static void xfer_secondary_pool(struct entropy_store *r, size_t nbytes)
 
 		bytes = extract_entropy(r->pull, tmp, bytes,
 					random_read_wakeup_thresh / 8, rsvd);
+		if (bytes <= 0)
+			return;
 		mix_pool_bytes(r, tmp, bytes);
 		credit_entropy_bits(r, bytes*8);
 	}
@@ -925,6 +966,187 @@ static ssize_t extract_entropy_user(struct entropy_store *r, void __user *buf,
 	return ret;
 }
 
+/*********************************************************************
+ *
+ * CRNG using ChaCha20
+ *
+ *********************************************************************/
+
+/*
+ * Replace the base key with material from the input pool.  The pool is
+ * debited for it, but like the old nonblocking pool we leave enough
+ * for a /dev/random reader to be woken up.
+ */
+static void crng_reseed(void)
+{
+	__u8 seed[roundup(CHACHA20_KEY_SIZE, EXTRACT_SIZE)]
+		__aligned(sizeof(long));
+	unsigned long flags, next_gen, v;
+	int i;
+
+	account(&input_pool, CHACHA20_KEY_SIZE, 0,
+		random_read_wakeup_thresh / 4);
+	for (i = 0; i < sizeof(seed); i += EXTRACT_SIZE)
+		extract_buf(&input_pool, seed + i);
+	for (i = 0; i + sizeof(v) <= CHACHA20_KEY_SIZE; i += sizeof(v)) {
+		if (!arch_get_random_long(&v))
+			break;
+		*(unsigned long *)(seed + i) ^= v;
+	}
+
+	spin_lock_irqsave(&base_crng.lock, flags);
+	for (i = 0; i < CHACHA20_KEY_SIZE; i++)
+		base_crng.key[i] ^= seed[i];
+	/* per-CPU keys start out at generation 0, never hand that out */
+	next_gen = base_crng.generation + 1;
+	if (!next_gen)
+		next_gen = 1;
+	base_crng.generation = next_gen;
+	base_crng.birth = jiffies;
+	spin_unlock_irqrestore(&base_crng.lock, flags);
+
+	memset(seed, 0, sizeof(seed));
+}
+
+/*
+ * Generate one block from @key, overwrite @key with its first half and
+ * return up to the other half in @out.  @state is left keyed with the
+ * old key, so callers must load a new key before using it further.
+ */
+static void crng_fast_key_erasure(__u8 key[CHACHA20_KEY_SIZE],
+				  __u32 state[CHACHA20_STATE_WORDS],
+				  __u8 *out, size_t len)
+{
+	__u8 first_block[CHACHA20_BLOCK_SIZE];
+
+	BUG_ON(len > CHACHA20_BLOCK_SIZE - CHACHA20_KEY_SIZE);
+
+	state[0] = 0x61707865;	/* "expand 32-byte k" */
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	memcpy(&state[4], key, CHACHA20_KEY_SIZE);
+	memset(&state[12], 0, 4 * sizeof(__u32));
+
+	chacha20_block(state, first_block);
+	memcpy(key, first_block, CHACHA20_KEY_SIZE);
+	memcpy(out, first_block + CHACHA20_KEY_SIZE, len);
+	memset(first_block, 0, sizeof(first_block));
+}
+
+/*
+ * Produce @len <= 32 bytes of output in @out, using this CPU's key.
+ * Passing &state[4] for a 32 byte @out leaves @state keyed for
+ * generating a longer stream with chacha20_block().
+ */
+static void crng_make_state(__u32 state[CHACHA20_STATE_WORDS],
+			    __u8 *out, size_t len)
+{
+	unsigned long flags, birth;
+	struct crng *crng;
+
+	/*
+	 * Until rand_initialize() has run, the per-CPU areas may not be
+	 * set up yet; use the base key directly.
+	 */
+	if (unlikely(!crng_init)) {
+		if (!base_crng.generation)
+			crng_reseed();
+		spin_lock_irqsave(&base_crng.lock, flags);
+		crng_fast_key_erasure(base_crng.key, state, out, len);
+		spin_unlock_irqrestore(&base_crng.lock, flags);
+		return;
+	}
+
+	/*
+	 * The first caller to see the base key expire claims the reseed by
+	 * moving its birth forward; everybody else keeps using the old key
+	 * until crng_reseed() bumps the generation.
+	 */
+	birth = ACCESS_ONCE(base_crng.birth);
+	if (unlikely(time_after(jiffies, birth + CRNG_RESEED_INTERVAL)) &&
+	    cmpxchg(&base_crng.birth, birth, jiffies) == birth)
+		crng_reseed();
+
+	local_irq_save(flags);
+	crng = &__get_cpu_var(crngs);
+	if (unlikely(crng->generation != ACCESS_ONCE(base_crng.generation))) {
+		spin_lock(&base_crng.lock);
+		crng_fast_key_erasure(base_crng.key, state, crng->key,
+				      sizeof(crng->key));
+		crng->generation = base_crng.generation;
+		spin_unlock(&base_crng.lock);
+	}
+	crng_fast_key_erasure(crng->key, state, out, len);
+	local_irq_restore(flags);
+}
+
+static void extract_crng(void *buf, size_t nbytes)
+{
+	__u32 state[CHACHA20_STATE_WORDS];
+	__u8 tmp[CHACHA20_BLOCK_SIZE];
+
+	if (nbytes <= CHACHA20_KEY_SIZE) {
+		crng_make_state(state, buf, nbytes);
+		goto out;
+	}
+
+	crng_make_state(state, (__u8 *)&state[4], CHACHA20_KEY_SIZE);
+	while (nbytes >= CHACHA20_BLOCK_SIZE) {
+		chacha20_block(state, buf);
+		buf += CHACHA20_BLOCK_SIZE;
+		nbytes -= CHACHA20_BLOCK_SIZE;
+	}
+	if (nbytes) {
+		chacha20_block(state, tmp);
+		memcpy(buf, tmp, nbytes);
+		memset(tmp, 0, sizeof(tmp));
+	}
+out:
+	memset(state, 0, sizeof(state));
+}
+
+static ssize_t extract_crng_user(void __user *buf, size_t nbytes)
+{
+	__u32 state[CHACHA20_STATE_WORDS];
+	__u8 tmp[CHACHA20_BLOCK_SIZE];
+	ssize_t ret = 0, i;
+
+	if (!nbytes)
+		return 0;
+
+	crng_make_state(state, (__u8 *)&state[4], CHACHA20_KEY_SIZE);
+
+	while (nbytes) {
+		if (need_resched()) {
+			if (signal_pending(current)) {
+				if (ret == 0)
+					ret = -ERESTARTSYS;
+				break;
+			}
+			schedule();
+		}
+
+		chacha20_block(state, tmp);
+		/* 2^32 blocks is more than a single read can ask for */
+		i = min_t(size_t, nbytes, CHACHA20_BLOCK_SIZE);
+		if (copy_to_user(buf, tmp, i)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		nbytes -= i;
+		buf += i;
+		ret += i;
+	}
+
+	/* Wipe data just returned from memory */
+	memset(tmp, 0, sizeof(tmp));
+	memset(state, 0, sizeof(state));
+
+	return ret;
+}
+
 /*
  * This function is the exported kernel interface.  It returns some
  * number of good random numbers, suitable for seeding TCP sequence
@@ -946,7 +1168,8 @@ void get_random_bytes(void *buf, int nbytes)
 		nbytes -= chunk;
 	}
 
-	extract_entropy(&nonblocking_pool, p, nbytes, 0, 0);
+	if (nbytes > 0)
+		extract_crng(p, nbytes);
 }
 EXPORT_SYMBOL(get_random_bytes);
 
@@ -973,14 +1196,22 @@ static void init_std_data(struct entropy_store *r)
 	mix_pool_bytes(r, utsname(), sizeof(*(utsname())));
 }
 
-static int rand_initialize(void)
+static void init_std_pools(void)
 {
 	init_std_data(&input_pool);
 	init_std_data(&blocking_pool);
-	init_std_data(&nonblocking_pool);
+}
+
+static int rand_initialize(void)
+{
+	init_std_pools();
+
+	/* also invalidates per-CPU keys derived before per-CPU setup */
+	crng_reseed();
+	cmpxchg(&crng_init, 0, 1);
 	return 0;
 }
-module_init(rand_initialize);
+early_initcall(rand_initialize);
 
 void rand_initialize_irq(int irq)
 {
@@ -1074,7 +1305,7 @@ random_read(struct file *file, char __user *buf, size_t nbytes, loff_t *ppos)
 static ssize_t
 urandom_read(struct file *file, char __user *buf, size_t nbytes, loff_t *ppos)
 {
-	return extract_entropy_user(&nonblocking_pool, buf, nbytes);
+	return extract_crng_user(buf, nbytes);
 }
 
 static unsigned int
@@ -1122,7 +1353,7 @@ static ssize_t random_write(struct file *file, const char __user *buffer,
 	ret = write_pool(&blocking_pool, buffer, count);
 	if (ret)
 		return ret;
-	ret = write_pool(&nonblocking_pool, buffer, count);
+	ret = write_pool(&input_pool, buffer, count);
 	if (ret)
 		return ret;
 
@@ -1168,7 +1399,7 @@ static long random_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 		/* Clear the entropy pool counters. */
 		if (!capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		rand_initialize();
+		init_std_pools();
 		return 0;
 	default:
 		return -EINVAL;
@@ -0,0 +1,23 @@
+/*
+ * Block index types shared by the cache target, its metadata and policies.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef DM_CACHE_BLOCK_TYPES_H
+#define DM_CACHE_BLOCK_TYPES_H
+
+#include "persistent-data/dm-block-manager.h"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * An oblock indexes the origin device and a cblock the cache device,
+ * both in units of the cache block size.
+ */
+typedef dm_block_t dm_oblock_t;
+typedef uint32_t dm_cblock_t;
+
+/*----------------------------------------------------------------*/
+
+#endif
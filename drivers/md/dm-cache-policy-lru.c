@@ -0,0 +1,294 @@
+/*
+ * LRU promotion policy for the cache target.
+ *
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-policy.h"
+
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache-policy-lru"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Every miss promotes its block, evicting the least recently used clean
+ * block once the cache is full.  This makes a good baseline and suits
+ * workloads whose working set fits in the cache, but a single scan of
+ * the origin will flush it; use mq for anything else.
+ */
+struct lru_entry {
+	struct hlist_node hlist;
+	struct list_head list;		/* free, clean or dirty list */
+	dm_oblock_t oblock;
+	dm_cblock_t cblock;
+	unsigned dirty:1;
+};
+
+struct lru_policy {
+	struct dm_cache_policy policy;
+
+	dm_cblock_t cache_size;
+	dm_cblock_t nr_allocated;
+	struct lru_entry *entries;
+
+	struct list_head free;
+	struct list_head clean;
+	struct list_head dirty;
+
+	unsigned hash_bits;
+	struct hlist_head *table;
+};
+
+static struct lru_policy *to_lru_policy(struct dm_cache_policy *p)
+{
+	return container_of(p, struct lru_policy, policy);
+}
+
+static struct hlist_head *bucket(struct lru_policy *lru, dm_oblock_t oblock)
+{
+	return lru->table + hash_64(oblock, lru->hash_bits);
+}
+
+static struct lru_entry *lookup(struct lru_policy *lru, dm_oblock_t oblock)
+{
+	struct lru_entry *e;
+	struct hlist_node *tmp;
+
+	hlist_for_each_entry(e, tmp, bucket(lru, oblock), hlist)
+		if (e->oblock == oblock)
+			return e;
+
+	return NULL;
+}
+
+static void insert(struct lru_policy *lru, struct lru_entry *e,
+		   dm_oblock_t oblock, int dirty)
+{
+	e->oblock = oblock;
+	e->dirty = dirty ? 1 : 0;
+	hlist_add_head(&e->hlist, bucket(lru, oblock));
+	list_add_tail(&e->list, dirty ? &lru->dirty : &lru->clean);
+}
+
+static void touch(struct lru_policy *lru, struct lru_entry *e)
+{
+	list_move_tail(&e->list, e->dirty ? &lru->dirty : &lru->clean);
+}
+
+/*----------------------------------------------------------------*/
+
+static int lru_map(struct dm_cache_policy *p, dm_oblock_t oblock,
+		   int can_migrate, struct bio *bio,
+		   struct policy_result *result)
+{
+	struct lru_policy *lru = to_lru_policy(p);
+	struct lru_entry *e = lookup(lru, oblock);
+
+	if (e) {
+		touch(lru, e);
+		result->op = POLICY_HIT;
+		result->cblock = e->cblock;
+		return 0;
+	}
+
+	if (!list_empty(&lru->free)) {
+		if (!can_migrate)
+			return -EWOULDBLOCK;
+
+		e = list_first_entry(&lru->free, struct lru_entry, list);
+		list_del(&e->list);
+		lru->nr_allocated++;
+		result->op = POLICY_NEW;
+
+	} else if (!list_empty(&lru->clean)) {
+		if (!can_migrate)
+			return -EWOULDBLOCK;
+
+		e = list_first_entry(&lru->clean, struct lru_entry, list);
+		list_del(&e->list);
+		hlist_del_init(&e->hlist);
+		result->op = POLICY_REPLACE;
+		result->old_oblock = e->oblock;
+
+	} else {
+		result->op = POLICY_MISS;
+		return 0;
+	}
+
+	/* Dirty until the target has copied it in. */
+	insert(lru, e, oblock, 1);
+	result->cblock = e->cblock;
+
+	return 0;
+}
+
+static int lru_load_mapping(struct dm_cache_policy *p, dm_oblock_t oblock,
+			    dm_cblock_t cblock, int dirty)
+{
+	struct lru_policy *lru = to_lru_policy(p);
+	struct lru_entry *e;
+
+	if (cblock >= lru->cache_size || lookup(lru, oblock))
+		return -EINVAL;
+
+	e = lru->entries + cblock;
+	if (!hlist_unhashed(&e->hlist))
+		return -EINVAL;
+
+	list_del(&e->list);
+	lru->nr_allocated++;
+	insert(lru, e, oblock, dirty);
+
+	return 0;
+}
+
+static void lru_remove_mapping(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	struct lru_policy *lru = to_lru_policy(p);
+	struct lru_entry *e = lookup(lru, oblock);
+
+	BUG_ON(!e);
+
+	hlist_del_init(&e->hlist);
+	list_move(&e->list, &lru->free);
+	lru->nr_allocated--;
+}
+
+static void set_dirty(struct lru_policy *lru, dm_oblock_t oblock, int dirty)
+{
+	struct lru_entry *e = lookup(lru, oblock);
+
+	BUG_ON(!e);
+
+	if (e->dirty != dirty) {
+		e->dirty = dirty;
+		touch(lru, e);
+	}
+}
+
+static void lru_set_dirty(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	set_dirty(to_lru_policy(p), oblock, 1);
+}
+
+static void lru_clear_dirty(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	set_dirty(to_lru_policy(p), oblock, 0);
+}
+
+static int lru_writeback_work(struct dm_cache_policy *p, dm_oblock_t *oblock,
+			      dm_cblock_t *cblock)
+{
+	struct lru_policy *lru = to_lru_policy(p);
+	struct lru_entry *e;
+
+	if (list_empty(&lru->dirty))
+		return -ENODATA;
+
+	e = list_first_entry(&lru->dirty, struct lru_entry, list);
+	list_move_tail(&e->list, &lru->dirty);
+
+	*oblock = e->oblock;
+	*cblock = e->cblock;
+
+	return 0;
+}
+
+static dm_cblock_t lru_residency(struct dm_cache_policy *p)
+{
+	return to_lru_policy(p)->nr_allocated;
+}
+
+static void lru_destroy(struct dm_cache_policy *p)
+{
+	struct lru_policy *lru = to_lru_policy(p);
+
+	vfree(lru->table);
+	vfree(lru->entries);
+	kfree(lru);
+}
+
+static struct dm_cache_policy *lru_create(dm_cblock_t cache_size,
+					  sector_t origin_size,
+					  sector_t block_size)
+{
+	unsigned i, nr_buckets;
+	struct lru_policy *lru = kzalloc(sizeof(*lru), GFP_KERNEL);
+
+	if (!lru)
+		return NULL;
+
+	lru->policy.destroy = lru_destroy;
+	lru->policy.map = lru_map;
+	lru->policy.load_mapping = lru_load_mapping;
+	lru->policy.remove_mapping = lru_remove_mapping;
+	lru->policy.set_dirty = lru_set_dirty;
+	lru->policy.clear_dirty = lru_clear_dirty;
+	lru->policy.writeback_work = lru_writeback_work;
+	lru->policy.residency = lru_residency;
+
+	lru->cache_size = cache_size;
+	INIT_LIST_HEAD(&lru->free);
+	INIT_LIST_HEAD(&lru->clean);
+	INIT_LIST_HEAD(&lru->dirty);
+
+	lru->entries = vzalloc(sizeof(*lru->entries) * cache_size);
+	if (!lru->entries)
+		goto bad_entries;
+
+	for (i = 0; i < cache_size; i++) {
+		INIT_HLIST_NODE(&lru->entries[i].hlist);
+		lru->entries[i].cblock = i;
+		list_add_tail(&lru->entries[i].list, &lru->free);
+	}
+
+	nr_buckets = roundup_pow_of_two(max(cache_size / 2, 16u));
+	lru->hash_bits = ffs(nr_buckets) - 1;
+	lru->table = vmalloc(sizeof(*lru->table) * nr_buckets);
+	if (!lru->table)
+		goto bad_table;
+	for (i = 0; i < nr_buckets; i++)
+		INIT_HLIST_HEAD(lru->table + i);
+
+	return &lru->policy;
+
+bad_table:
+	vfree(lru->entries);
+bad_entries:
+	kfree(lru);
+	return NULL;
+}
+
+/*----------------------------------------------------------------*/
+
+static struct dm_cache_policy_type lru_policy_type = {
+	.name = "lru",
+	.owner = THIS_MODULE,
+	.create = lru_create
+};
+
+static int __init lru_init(void)
+{
+	int r = dm_cache_policy_register(&lru_policy_type);
+
+	if (r)
+		DMERR("register failed %d", r);
+
+	return r;
+}
+
+static void __exit lru_exit(void)
+{
+	dm_cache_policy_unregister(&lru_policy_type);
+}
+
+module_init(lru_init);
+module_exit(lru_exit);
+
+MODULE_DESCRIPTION(DM_NAME " cache policy lru");
+MODULE_LICENSE("GPL");
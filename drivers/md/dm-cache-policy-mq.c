@@ -0,0 +1,661 @@
+/*
+ * Multiqueue promotion policy for the cache target.
+ *
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-policy.h"
+
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache-policy-mq"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * The mq policy keeps a hit count for every block it knows about, both
+ * the ones in the cache and a similar number of recently seen origin
+ * blocks that aren't (the pre-cache).  Entries are kept on multiple
+ * queues, one per power of two of hits, each in LRU order.  An origin
+ * block is promoted once it has been hit promote_threshold times, and it
+ * replaces the least recently used clean block on the lowest level that
+ * has been hit no more often than it has.
+ *
+ * Dirty blocks are never chosen as victims; they have to be written back
+ * by the target first.
+ *
+ * Hit counts are halved by a slow clock that sweeps all entries, so that
+ * blocks that were hot a long time ago eventually become eligible for
+ * eviction.
+ *
+ * Long runs of sequential io are left on the origin: spinning disks
+ * stream well, and copying them would flush the cache.
+ */
+#define NR_QUEUE_LEVELS 16
+#define DEFAULT_SEQUENTIAL_THRESHOLD 512
+#define DEFAULT_RANDOM_THRESHOLD 4
+#define DEFAULT_PROMOTE_THRESHOLD 2
+#define ENTRIES_AGED_PER_MAP 2
+
+struct queue {
+	struct list_head qs[NR_QUEUE_LEVELS];
+};
+
+static void queue_init(struct queue *q)
+{
+	unsigned i;
+
+	for (i = 0; i < NR_QUEUE_LEVELS; i++)
+		INIT_LIST_HEAD(q->qs + i);
+}
+
+static void queue_push(struct queue *q, unsigned level, struct list_head *elt)
+{
+	list_add_tail(elt, q->qs + level);
+}
+
+/*
+ * Returns the least recently used element on the lowest populated level,
+ * without removing it.
+ */
+static struct list_head *queue_peek(struct queue *q)
+{
+	unsigned i;
+
+	for (i = 0; i < NR_QUEUE_LEVELS; i++)
+		if (!list_empty(q->qs + i))
+			return q->qs[i].next;
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------*/
+
+enum io_pattern {
+	PATTERN_SEQUENTIAL,
+	PATTERN_RANDOM
+};
+
+struct io_tracker {
+	enum io_pattern pattern;
+
+	unsigned nr_seq_samples;
+	unsigned nr_rand_samples;
+	unsigned thresholds[2];
+
+	sector_t last_end_sector;
+};
+
+static void iot_init(struct io_tracker *t)
+{
+	t->pattern = PATTERN_RANDOM;
+	t->nr_seq_samples = 0;
+	t->nr_rand_samples = 0;
+	t->thresholds[PATTERN_SEQUENTIAL] = DEFAULT_SEQUENTIAL_THRESHOLD;
+	t->thresholds[PATTERN_RANDOM] = DEFAULT_RANDOM_THRESHOLD;
+	t->last_end_sector = 0;
+}
+
+static void iot_update(struct io_tracker *t, struct bio *bio)
+{
+	/*
+	 * Only an unbroken run of the other pattern counts towards
+	 * switching.
+	 */
+	if (bio->bi_sector == t->last_end_sector + 1) {
+		t->nr_seq_samples++;
+		if (t->pattern == PATTERN_SEQUENTIAL)
+			t->nr_rand_samples = 0;
+	} else {
+		t->nr_rand_samples++;
+		if (t->pattern == PATTERN_RANDOM)
+			t->nr_seq_samples = 0;
+	}
+
+	t->last_end_sector = bio->bi_sector + bio_sectors(bio) - 1;
+
+	switch (t->pattern) {
+	case PATTERN_SEQUENTIAL:
+		if (t->nr_rand_samples >= t->thresholds[PATTERN_RANDOM]) {
+			t->pattern = PATTERN_RANDOM;
+			t->nr_seq_samples = t->nr_rand_samples = 0;
+		}
+		break;
+
+	case PATTERN_RANDOM:
+		if (t->nr_seq_samples >= t->thresholds[PATTERN_SEQUENTIAL]) {
+			t->pattern = PATTERN_SEQUENTIAL;
+			t->nr_seq_samples = t->nr_rand_samples = 0;
+		}
+		break;
+	}
+}
+
+/*----------------------------------------------------------------*/
+
+struct entry {
+	struct hlist_node hlist;
+	struct list_head list;		/* free list or one of the queues */
+	dm_oblock_t oblock;
+	dm_cblock_t cblock;		/* only meaningful for cache entries */
+	unsigned hit_count;
+	unsigned in_cache:1;
+	unsigned dirty:1;
+};
+
+struct mq_policy {
+	struct dm_cache_policy policy;
+
+	struct io_tracker tracker;
+	unsigned promote_threshold;
+
+	/*
+	 * Entries for blocks in the cache, indexed by cblock, and a pool of
+	 * the same size for the pre-cache.
+	 */
+	dm_cblock_t cache_size;
+	struct entry *cache_entries;
+	struct entry *pre_cache_entries;
+	struct list_head free_cache;
+	struct list_head free_pre_cache;
+	dm_cblock_t nr_allocated;
+
+	struct queue pre_cache;
+	struct queue cache_clean;
+	struct queue cache_dirty;
+
+	/* Position of the aging clock hand, over both entry arrays. */
+	unsigned age_cursor;
+
+	unsigned hash_bits;
+	struct hlist_head *table;
+};
+
+static struct mq_policy *to_mq_policy(struct dm_cache_policy *p)
+{
+	return container_of(p, struct mq_policy, policy);
+}
+
+static unsigned queue_level(struct entry *e)
+{
+	return min_t(unsigned, fls(e->hit_count), NR_QUEUE_LEVELS - 1);
+}
+
+static struct queue *entry_queue(struct mq_policy *mq, struct entry *e)
+{
+	if (!e->in_cache)
+		return &mq->pre_cache;
+
+	return e->dirty ? &mq->cache_dirty : &mq->cache_clean;
+}
+
+static void push(struct mq_policy *mq, struct entry *e)
+{
+	queue_push(entry_queue(mq, e), queue_level(e), &e->list);
+}
+
+static void requeue(struct mq_policy *mq, struct entry *e)
+{
+	list_del(&e->list);
+	push(mq, e);
+}
+
+/*----------------------------------------------------------------*/
+
+static struct hlist_head *bucket(struct mq_policy *mq, dm_oblock_t oblock)
+{
+	return mq->table + hash_64(oblock, mq->hash_bits);
+}
+
+static void hash_insert(struct mq_policy *mq, struct entry *e)
+{
+	hlist_add_head(&e->hlist, bucket(mq, e->oblock));
+}
+
+static struct entry *hash_lookup(struct mq_policy *mq, dm_oblock_t oblock)
+{
+	struct entry *e;
+	struct hlist_node *tmp;
+
+	hlist_for_each_entry(e, tmp, bucket(mq, oblock), hlist)
+		if (e->oblock == oblock)
+			return e;
+
+	return NULL;
+}
+
+/*
+ * Removes an entry from the hash and whichever queue it is on.
+ */
+static void del(struct entry *e)
+{
+	hlist_del_init(&e->hlist);
+	list_del(&e->list);
+}
+
+static void hit(struct mq_policy *mq, struct entry *e)
+{
+	if (e->hit_count != UINT_MAX)
+		e->hit_count++;
+	requeue(mq, e);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Halves the hit counts of a couple of entries each time we're called, so
+ * every entry is aged once for each (2 * cache_size / ENTRIES_AGED_PER_MAP)
+ * bios mapped.
+ */
+static void age_entries(struct mq_policy *mq)
+{
+	unsigned i;
+	struct entry *e;
+
+	for (i = 0; i < ENTRIES_AGED_PER_MAP; i++) {
+		if (mq->age_cursor < mq->cache_size)
+			e = mq->cache_entries + mq->age_cursor;
+		else
+			e = mq->pre_cache_entries +
+				(mq->age_cursor - mq->cache_size);
+
+		if (++mq->age_cursor == 2 * mq->cache_size)
+			mq->age_cursor = 0;
+
+		if (hlist_unhashed(&e->hlist) || !e->hit_count)
+			continue;
+
+		e->hit_count >>= 1;
+		requeue(mq, e);
+	}
+}
+
+/*
+ * Finds a pre-cache entry for a block we haven't seen recently, recycling
+ * the coldest one if the pool is empty.
+ */
+static struct entry *alloc_pre_cache_entry(struct mq_policy *mq,
+					   dm_oblock_t oblock)
+{
+	struct entry *e;
+	struct list_head *elt;
+
+	if (!list_empty(&mq->free_pre_cache)) {
+		e = list_first_entry(&mq->free_pre_cache, struct entry, list);
+		list_del(&e->list);
+	} else {
+		elt = queue_peek(&mq->pre_cache);
+		BUG_ON(!elt);
+		e = list_entry(elt, struct entry, list);
+		del(e);
+	}
+
+	e->oblock = oblock;
+	e->hit_count = 0;
+	e->in_cache = 0;
+	e->dirty = 0;
+	hash_insert(mq, e);
+	push(mq, e);
+
+	return e;
+}
+
+static struct entry *find_victim(struct mq_policy *mq, struct entry *e)
+{
+	struct list_head *elt = queue_peek(&mq->cache_clean);
+	struct entry *victim;
+
+	if (!elt)
+		return NULL;
+
+	victim = list_entry(elt, struct entry, list);
+	return queue_level(victim) > queue_level(e) ? NULL : victim;
+}
+
+static int promote(struct mq_policy *mq, struct entry *e, int can_migrate,
+		   struct policy_result *result)
+{
+	struct entry *ce;
+
+	if (!list_empty(&mq->free_cache)) {
+		if (!can_migrate)
+			return -EWOULDBLOCK;
+
+		ce = list_first_entry(&mq->free_cache, struct entry, list);
+		list_del(&ce->list);
+		mq->nr_allocated++;
+		result->op = POLICY_NEW;
+
+	} else {
+		ce = find_victim(mq, e);
+		if (!ce) {
+			result->op = POLICY_MISS;
+			return 0;
+		}
+
+		if (!can_migrate)
+			return -EWOULDBLOCK;
+
+		del(ce);
+		result->op = POLICY_REPLACE;
+		result->old_oblock = ce->oblock;
+	}
+
+	ce->oblock = e->oblock;
+	ce->hit_count = e->hit_count;
+	ce->in_cache = 1;
+	ce->dirty = 1;		/* until the target has copied it in */
+	hash_insert(mq, ce);
+	push(mq, ce);
+	result->cblock = ce->cblock;
+
+	del(e);
+	list_add(&e->list, &mq->free_pre_cache);
+
+	return 0;
+}
+
+static int mq_map(struct dm_cache_policy *p, dm_oblock_t oblock,
+		  int can_migrate, struct bio *bio,
+		  struct policy_result *result)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	age_entries(mq);
+
+	if (bio)
+		iot_update(&mq->tracker, bio);
+
+	e = hash_lookup(mq, oblock);
+	if (e && e->in_cache) {
+		if (bio)
+			hit(mq, e);
+		result->op = POLICY_HIT;
+		result->cblock = e->cblock;
+		return 0;
+	}
+
+	if (mq->tracker.pattern == PATTERN_SEQUENTIAL) {
+		result->op = POLICY_MISS;
+		return 0;
+	}
+
+	if (!e)
+		e = alloc_pre_cache_entry(mq, oblock);
+
+	if (bio)
+		hit(mq, e);
+
+	if (e->hit_count < mq->promote_threshold) {
+		result->op = POLICY_MISS;
+		return 0;
+	}
+
+	return promote(mq, e, can_migrate, result);
+}
+
+static int mq_load_mapping(struct dm_cache_policy *p, dm_oblock_t oblock,
+			   dm_cblock_t cblock, int dirty)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e, *pe;
+
+	if (cblock >= mq->cache_size)
+		return -EINVAL;
+
+	e = mq->cache_entries + cblock;
+	if (!hlist_unhashed(&e->hlist))
+		return -EINVAL;
+
+	/* Stale pre-cache entries can't exist yet, but be safe. */
+	pe = hash_lookup(mq, oblock);
+	if (pe)
+		return -EINVAL;
+
+	list_del(&e->list);
+	mq->nr_allocated++;
+
+	e->oblock = oblock;
+	e->hit_count = 0;
+	e->in_cache = 1;
+	e->dirty = dirty ? 1 : 0;
+	hash_insert(mq, e);
+	push(mq, e);
+
+	return 0;
+}
+
+static void mq_remove_mapping(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e = hash_lookup(mq, oblock);
+
+	BUG_ON(!e || !e->in_cache);
+
+	del(e);
+	e->in_cache = 0;
+	list_add(&e->list, &mq->free_cache);
+	mq->nr_allocated--;
+}
+
+static void set_dirty(struct mq_policy *mq, dm_oblock_t oblock, int dirty)
+{
+	struct entry *e = hash_lookup(mq, oblock);
+
+	BUG_ON(!e || !e->in_cache);
+
+	if (e->dirty != dirty) {
+		e->dirty = dirty;
+		requeue(mq, e);
+	}
+}
+
+static void mq_set_dirty(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	set_dirty(to_mq_policy(p), oblock, 1);
+}
+
+static void mq_clear_dirty(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	set_dirty(to_mq_policy(p), oblock, 0);
+}
+
+static int mq_writeback_work(struct dm_cache_policy *p, dm_oblock_t *oblock,
+			     dm_cblock_t *cblock)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct list_head *elt = queue_peek(&mq->cache_dirty);
+	struct entry *e;
+
+	if (!elt)
+		return -ENODATA;
+
+	/*
+	 * Rotate the entry so a block the target is busy with doesn't get
+	 * handed out again straight away.
+	 */
+	e = list_entry(elt, struct entry, list);
+	requeue(mq, e);
+
+	*oblock = e->oblock;
+	*cblock = e->cblock;
+
+	return 0;
+}
+
+static dm_cblock_t mq_residency(struct dm_cache_policy *p)
+{
+	return to_mq_policy(p)->nr_allocated;
+}
+
+static int mq_emit_config_values(struct dm_cache_policy *p, char *result,
+				 unsigned maxlen)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	unsigned sz = 0;
+
+	DMEMIT("6 sequential_threshold %u random_threshold %u "
+	       "promote_threshold %u",
+	       mq->tracker.thresholds[PATTERN_SEQUENTIAL],
+	       mq->tracker.thresholds[PATTERN_RANDOM],
+	       mq->promote_threshold);
+
+	return 0;
+}
+
+static int mq_set_config_value(struct dm_cache_policy *p,
+			       const char *key, const char *value)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	unsigned tmp;
+
+	if (kstrtouint(value, 10, &tmp) || !tmp)
+		return -EINVAL;
+
+	if (!strcasecmp(key, "sequential_threshold"))
+		mq->tracker.thresholds[PATTERN_SEQUENTIAL] = tmp;
+	else if (!strcasecmp(key, "random_threshold"))
+		mq->tracker.thresholds[PATTERN_RANDOM] = tmp;
+	else if (!strcasecmp(key, "promote_threshold"))
+		mq->promote_threshold = tmp;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static void mq_destroy(struct dm_cache_policy *p)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+
+	vfree(mq->table);
+	vfree(mq->pre_cache_entries);
+	vfree(mq->cache_entries);
+	kfree(mq);
+}
+
+static void init_entries(struct entry *entries, dm_cblock_t nr,
+			 struct list_head *free)
+{
+	dm_cblock_t i;
+
+	for (i = 0; i < nr; i++) {
+		INIT_HLIST_NODE(&entries[i].hlist);
+		entries[i].cblock = i;
+		list_add_tail(&entries[i].list, free);
+	}
+}
+
+static struct dm_cache_policy *mq_create(dm_cblock_t cache_size,
+					 sector_t origin_size,
+					 sector_t block_size)
+{
+	unsigned i, nr_buckets;
+	struct mq_policy *mq = kzalloc(sizeof(*mq), GFP_KERNEL);
+
+	if (!mq)
+		return NULL;
+
+	mq->policy.destroy = mq_destroy;
+	mq->policy.map = mq_map;
+	mq->policy.load_mapping = mq_load_mapping;
+	mq->policy.remove_mapping = mq_remove_mapping;
+	mq->policy.set_dirty = mq_set_dirty;
+	mq->policy.clear_dirty = mq_clear_dirty;
+	mq->policy.writeback_work = mq_writeback_work;
+	mq->policy.residency = mq_residency;
+	mq->policy.emit_config_values = mq_emit_config_values;
+	mq->policy.set_config_value = mq_set_config_value;
+
+	iot_init(&mq->tracker);
+	mq->promote_threshold = DEFAULT_PROMOTE_THRESHOLD;
+
+	mq->cache_size = cache_size;
+	INIT_LIST_HEAD(&mq->free_cache);
+	INIT_LIST_HEAD(&mq->free_pre_cache);
+	queue_init(&mq->pre_cache);
+	queue_init(&mq->cache_clean);
+	queue_init(&mq->cache_dirty);
+
+	mq->cache_entries = vzalloc(sizeof(struct entry) * cache_size);
+	if (!mq->cache_entries)
+		goto bad_cache;
+	init_entries(mq->cache_entries, cache_size, &mq->free_cache);
+
+	mq->pre_cache_entries = vzalloc(sizeof(struct entry) * cache_size);
+	if (!mq->pre_cache_entries)
+		goto bad_pre_cache;
+	init_entries(mq->pre_cache_entries, cache_size, &mq->free_pre_cache);
+
+	nr_buckets = roundup_pow_of_two(max(cache_size, 16u));
+	mq->hash_bits = ffs(nr_buckets) - 1;
+	mq->table = vmalloc(sizeof(*mq->table) * nr_buckets);
+	if (!mq->table)
+		goto bad_table;
+	for (i = 0; i < nr_buckets; i++)
+		INIT_HLIST_HEAD(mq->table + i);
+
+	return &mq->policy;
+
+bad_table:
+	vfree(mq->pre_cache_entries);
+bad_pre_cache:
+	vfree(mq->cache_entries);
+bad_cache:
+	kfree(mq);
+	return NULL;
+}
+
+/*----------------------------------------------------------------*/
+
+static struct dm_cache_policy_type mq_policy_type = {
+	.name = "mq",
+	.owner = THIS_MODULE,
+	.create = mq_create
+};
+
+/*
+ * "default" is an alias, so tables can ask for whatever the kernel thinks
+ * is best without naming it.
+ */
+static struct dm_cache_policy_type default_policy_type = {
+	.name = "default",
+	.owner = THIS_MODULE,
+	.create = mq_create
+};
+
+static int __init mq_init(void)
+{
+	int r;
+
+	r = dm_cache_policy_register(&mq_policy_type);
+	if (r) {
+		DMERR("register failed %d", r);
+		return r;
+	}
+
+	r = dm_cache_policy_register(&default_policy_type);
+	if (r) {
+		DMERR("register failed (as default) %d", r);
+		dm_cache_policy_unregister(&mq_policy_type);
+	}
+
+	return r;
+}
+
+static void __exit mq_exit(void)
+{
+	dm_cache_policy_unregister(&mq_policy_type);
+	dm_cache_policy_unregister(&default_policy_type);
+}
+
+module_init(mq_init);
+module_exit(mq_exit);
+
+MODULE_DESCRIPTION(DM_NAME " cache policy mq");
+MODULE_LICENSE("GPL");
+MODULE_ALIAS("dm-cache-default");
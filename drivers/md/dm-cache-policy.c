@@ -0,0 +1,133 @@
+/*
+ * Promotion policy registration for the cache target.
+ *
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-policy.h"
+
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#define DM_MSG_PREFIX "cache-policy"
+
+static LIST_HEAD(_policy_types);
+static DECLARE_RWSEM(_policy_lock);
+
+struct policy_internal {
+	struct dm_cache_policy_type *type;
+	struct list_head list;
+};
+
+static struct policy_internal *__find_policy(const char *name)
+{
+	struct policy_internal *pi;
+
+	list_for_each_entry(pi, &_policy_types, list)
+		if (!strcmp(pi->type->name, name))
+			return pi;
+
+	return NULL;
+}
+
+static struct dm_cache_policy_type *get_policy_once(const char *name)
+{
+	struct policy_internal *pi;
+	struct dm_cache_policy_type *type = NULL;
+
+	down_read(&_policy_lock);
+	pi = __find_policy(name);
+	if (pi && try_module_get(pi->type->owner))
+		type = pi->type;
+	up_read(&_policy_lock);
+
+	return type;
+}
+
+static struct dm_cache_policy_type *get_policy(const char *name)
+{
+	struct dm_cache_policy_type *type;
+
+	type = get_policy_once(name);
+	if (!type) {
+		request_module("dm-cache-%s", name);
+		type = get_policy_once(name);
+	}
+
+	return type;
+}
+
+int dm_cache_policy_register(struct dm_cache_policy_type *type)
+{
+	int r = 0;
+	struct policy_internal *pi = kmalloc(sizeof(*pi), GFP_KERNEL);
+
+	if (!pi)
+		return -ENOMEM;
+
+	pi->type = type;
+
+	down_write(&_policy_lock);
+	if (__find_policy(type->name)) {
+		DMWARN("attempt to register policy under duplicate name %s",
+		       type->name);
+		kfree(pi);
+		r = -EEXIST;
+	} else
+		list_add(&pi->list, &_policy_types);
+	up_write(&_policy_lock);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_cache_policy_register);
+
+void dm_cache_policy_unregister(struct dm_cache_policy_type *type)
+{
+	struct policy_internal *pi;
+
+	down_write(&_policy_lock);
+	pi = __find_policy(type->name);
+	if (pi) {
+		list_del(&pi->list);
+		kfree(pi);
+	}
+	up_write(&_policy_lock);
+}
+EXPORT_SYMBOL_GPL(dm_cache_policy_unregister);
+
+struct dm_cache_policy *dm_cache_policy_create(const char *name,
+					       dm_cblock_t cache_size,
+					       sector_t origin_size,
+					       sector_t block_size)
+{
+	struct dm_cache_policy *p;
+	struct dm_cache_policy_type *type;
+
+	type = get_policy(name);
+	if (!type) {
+		DMWARN("unknown policy type %s", name);
+		return NULL;
+	}
+
+	p = type->create(cache_size, origin_size, block_size);
+	if (!p) {
+		module_put(type->owner);
+		return NULL;
+	}
+	p->type = type;
+
+	return p;
+}
+
+void dm_cache_policy_destroy(struct dm_cache_policy *p)
+{
+	struct dm_cache_policy_type *type = p->type;
+
+	p->destroy(p);
+	module_put(type->owner);
+}
+
+const char *dm_cache_policy_get_name(struct dm_cache_policy *p)
+{
+	return p->type->name;
+}
@@ -0,0 +1,216 @@
+/*
+ * Promotion policies for the cache target.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef DM_CACHE_POLICY_H
+#define DM_CACHE_POLICY_H
+
+#include "dm-cache-block-types.h"
+
+#include <linux/device-mapper.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * The policy decides which origin blocks are worth holding on the cache
+ * device.  The target asks it what to do with every bio it maps, and the
+ * policy answers with one of the operations below:
+ *
+ * POLICY_HIT:
+ *   The block is already in the cache at result->cblock.
+ *
+ * POLICY_MISS:
+ *   The block isn't cached and should stay that way for now; the bio goes
+ *   to the origin.
+ *
+ * POLICY_NEW:
+ *   Promote the block into the free cache block result->cblock.
+ *
+ * POLICY_REPLACE:
+ *   Promote the block into result->cblock, which currently holds
+ *   result->old_oblock.  Only clean blocks are replaced, so the old
+ *   contents can simply be dropped.
+ *
+ * The policy updates its own mapping as soon as it returns NEW or
+ * REPLACE.  The new block counts as dirty, so it can't be picked as a
+ * victim while the target is still copying it in, until the target calls
+ * clear_dirty() on success or remove_mapping() on failure.
+ *
+ * All methods are called with the cache target's spinlock held and
+ * interrupts disabled, so they must not block or allocate with
+ * anything but GFP_ATOMIC.  Policies need no locking of their own.
+ */
+enum policy_operation {
+	POLICY_HIT,
+	POLICY_MISS,
+	POLICY_NEW,
+	POLICY_REPLACE
+};
+
+struct policy_result {
+	enum policy_operation op;
+	dm_oblock_t old_oblock;	/* POLICY_REPLACE */
+	dm_cblock_t cblock;	/* POLICY_HIT, POLICY_NEW, POLICY_REPLACE */
+};
+
+struct dm_cache_policy {
+	void (*destroy)(struct dm_cache_policy *p);
+
+	/*
+	 * Looks up @oblock on behalf of @bio.  When @can_migrate is zero
+	 * the target can't act on NEW or REPLACE right now, and the policy
+	 * should return -EWOULDBLOCK rather than pick one of them.  The
+	 * target will call again with @can_migrate set from its worker.
+	 *
+	 * @bio is NULL when the target asks again about a bio the policy has
+	 * already seen, so it isn't counted twice.
+	 *
+	 * Returns 0 with @result filled in, or -EWOULDBLOCK.
+	 */
+	int (*map)(struct dm_cache_policy *p, dm_oblock_t oblock,
+		   int can_migrate, struct bio *bio,
+		   struct policy_result *result);
+
+	/*
+	 * Called for each mapping read back from the metadata on table load.
+	 */
+	int (*load_mapping)(struct dm_cache_policy *p, dm_oblock_t oblock,
+			    dm_cblock_t cblock, int dirty);
+
+	void (*remove_mapping)(struct dm_cache_policy *p, dm_oblock_t oblock);
+
+	/*
+	 * The target owns the dirty state but tells the policy about it, so
+	 * that the policy prefers clean blocks when choosing a victim and
+	 * can hand out dirty blocks for writeback.
+	 */
+	void (*set_dirty)(struct dm_cache_policy *p, dm_oblock_t oblock);
+	void (*clear_dirty)(struct dm_cache_policy *p, dm_oblock_t oblock);
+
+	/*
+	 * Picks the least recently used dirty block for background
+	 * writeback.  Returns -ENODATA if every block is clean.
+	 */
+	int (*writeback_work)(struct dm_cache_policy *p, dm_oblock_t *oblock,
+			      dm_cblock_t *cblock);
+
+	/*
+	 * The number of cache blocks in use.
+	 */
+	dm_cblock_t (*residency)(struct dm_cache_policy *p);
+
+	/*
+	 * Tunables, reported as "<#values> <key> <value>..." in the status
+	 * line and set through the target's message interface.
+	 */
+	int (*emit_config_values)(struct dm_cache_policy *p, char *result,
+				  unsigned maxlen);
+	int (*set_config_value)(struct dm_cache_policy *p,
+				const char *key, const char *value);
+
+	/* Set by dm_cache_policy_create(). */
+	struct dm_cache_policy_type *type;
+};
+
+/*----------------------------------------------------------------*/
+
+struct dm_cache_policy_type {
+	char name[16];
+	struct module *owner;
+
+	/*
+	 * @cache_size is in cache blocks, @origin_size and @block_size in
+	 * sectors.
+	 */
+	struct dm_cache_policy *(*create)(dm_cblock_t cache_size,
+					  sector_t origin_size,
+					  sector_t block_size);
+};
+
+int dm_cache_policy_register(struct dm_cache_policy_type *type);
+void dm_cache_policy_unregister(struct dm_cache_policy_type *type);
+
+/*
+ * Looks up the named policy, loading "dm-cache-<name>" if necessary, and
+ * creates an instance of it.  The instance holds a reference on the
+ * policy module until dm_cache_policy_destroy().
+ */
+struct dm_cache_policy *dm_cache_policy_create(const char *name,
+					       dm_cblock_t cache_size,
+					       sector_t origin_size,
+					       sector_t block_size);
+void dm_cache_policy_destroy(struct dm_cache_policy *p);
+
+const char *dm_cache_policy_get_name(struct dm_cache_policy *p);
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Wrappers, so the target reads naturally.
+ */
+static inline int policy_map(struct dm_cache_policy *p, dm_oblock_t oblock,
+			     int can_migrate, struct bio *bio,
+			     struct policy_result *result)
+{
+	return p->map(p, oblock, can_migrate, bio, result);
+}
+
+static inline int policy_load_mapping(struct dm_cache_policy *p,
+				      dm_oblock_t oblock, dm_cblock_t cblock,
+				      int dirty)
+{
+	return p->load_mapping(p, oblock, cblock, dirty);
+}
+
+static inline void policy_remove_mapping(struct dm_cache_policy *p,
+					 dm_oblock_t oblock)
+{
+	p->remove_mapping(p, oblock);
+}
+
+static inline void policy_set_dirty(struct dm_cache_policy *p,
+				    dm_oblock_t oblock)
+{
+	p->set_dirty(p, oblock);
+}
+
+static inline void policy_clear_dirty(struct dm_cache_policy *p,
+				      dm_oblock_t oblock)
+{
+	p->clear_dirty(p, oblock);
+}
+
+static inline int policy_writeback_work(struct dm_cache_policy *p,
+					dm_oblock_t *oblock,
+					dm_cblock_t *cblock)
+{
+	return p->writeback_work(p, oblock, cblock);
+}
+
+static inline dm_cblock_t policy_residency(struct dm_cache_policy *p)
+{
+	return p->residency(p);
+}
+
+static inline int policy_emit_config_values(struct dm_cache_policy *p,
+					    char *result, unsigned maxlen)
+{
+	if (p->emit_config_values)
+		return p->emit_config_values(p, result, maxlen);
+
+	if (maxlen)
+		snprintf(result, maxlen, "0");
+	return 0;
+}
+
+static inline int policy_set_config_value(struct dm_cache_policy *p,
+					  const char *key, const char *value)
+{
+	return p->set_config_value ? p->set_config_value(p, key, value) : -EINVAL;
+}
+
+/*----------------------------------------------------------------*/
+
+#endif
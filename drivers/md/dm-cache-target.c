@@ -0,0 +1,1432 @@
+/*
+ * Device-mapper target that uses a fast device to cache a slow one.
+ *
+ * This file is released under the GPL.
+ */
+
+#include "dm-bio-prison.h"
+#include "dm-bio-record.h"
+#include "dm-cache-metadata.h"
+#include "dm-cache-policy.h"
+
+#include <linux/device-mapper.h>
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/init.h>
+#include <linux/jiffies.h>
+#include <linux/mempool.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Glossary:
+ *
+ * oblock: index of an origin block
+ * cblock: index of a cache block
+ * promotion: copying a block from the origin to the cache
+ * demotion: dropping a clean block from the cache to make room
+ * writeback: copying a dirty block back to the origin so it becomes clean
+ * migration: any of the above
+ *
+ * The policy only ever evicts clean blocks, so a demotion never has to
+ * move any data; the mapping is removed from the metadata and committed
+ * before the block is overwritten.  Dirty blocks are cleaned by a
+ * background writeback that runs when the cache is idle or more than
+ * half dirty.
+ *
+ * Before the target copies into or out of a cache block it marks the
+ * block busy, which holds back new io to it, and waits for io already
+ * in flight to drain using a deferred set covering all io the target
+ * has remapped.
+ */
+
+/*
+ * Tunable constants
+ */
+#define ENDIO_HOOK_POOL_SIZE 1024
+#define MIGRATION_POOL_SIZE 128
+#define MAX_CONCURRENT_MIGRATIONS 64
+#define MAX_CONCURRENT_WRITEBACKS 4
+#define COMMIT_PERIOD HZ
+
+/*
+ * The block size of the cache must be between 32KB and 1GB.
+ */
+#define DATA_DEV_BLOCK_SIZE_MIN_SECTORS (32 * 1024 >> SECTOR_SHIFT)
+#define DATA_DEV_BLOCK_SIZE_MAX_SECTORS (1024 * 1024 * 1024 >> SECTOR_SHIFT)
+
+/*
+ * The metadata device is limited in size the same way as the thin
+ * provisioning one, since it uses the same space map.
+ */
+#define METADATA_DEV_MAX_SECTORS (255 * (1 << 14) * (DM_CACHE_METADATA_BLOCK_SIZE / (1 << SECTOR_SHIFT)))
+
+/*----------------------------------------------------------------*/
+
+struct cache_stats {
+	atomic_t read_hit;
+	atomic_t read_miss;
+	atomic_t write_hit;
+	atomic_t write_miss;
+	atomic_t demotion;
+	atomic_t promotion;
+	atomic_t writeback;
+};
+
+struct cache {
+	struct dm_target *ti;
+	struct dm_target_callbacks callbacks;
+
+	struct dm_dev *metadata_dev;
+	struct dm_dev *origin_dev;
+	struct dm_dev *cache_dev;
+
+	struct dm_cache_metadata *cmd;
+	struct dm_cache_policy *policy;
+
+	sector_t origin_sectors;
+	dm_cblock_t cache_size;
+	sector_t sectors_per_block;
+	int sectors_per_block_shift;
+	unsigned writethrough:1;
+
+	spinlock_t lock;
+	struct bio_list deferred_bios;
+	struct bio_list deferred_writethrough_bios;
+	struct bio_list blocked_bios;
+	struct list_head quiesced_migrations;
+	struct list_head completed_migrations;
+	unsigned nr_migrations;
+	unsigned nr_writebacks;
+	int quiescing;
+	wait_queue_head_t migration_wait;
+
+	/*
+	 * Bitsets indexed by cblock.  'changed' records dirty bits that
+	 * haven't been written to the metadata yet.
+	 */
+	unsigned long *dirty_bitset;
+	unsigned long *changed_bitset;
+	unsigned long *busy_bitset;
+	dm_cblock_t nr_dirty;
+
+	struct dm_kcopyd_client *copier;
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+	unsigned long last_commit_jiffies;
+	unsigned long last_io_jiffies;
+
+	struct dm_deferred_set *all_io_ds;
+	mempool_t *endio_hook_pool;
+	mempool_t *migration_pool;
+	struct dm_cache_migration *next_migration;
+
+	struct cache_stats stats;
+};
+
+/*
+ * The bio_details are only needed, and only allocated, in writethrough
+ * mode.
+ */
+struct per_bio_data {
+	struct cache *cache;
+	struct dm_deferred_entry *all_io_entry;
+	unsigned policy_seen:1;
+
+	dm_cblock_t cblock;
+	bio_end_io_t *saved_bi_end_io;
+	struct dm_bio_details bio_details;
+};
+
+struct dm_cache_migration {
+	struct list_head list;
+	struct cache *cache;
+
+	dm_oblock_t old_oblock;
+	dm_oblock_t new_oblock;
+	dm_cblock_t cblock;
+
+	unsigned promote:1;
+	unsigned demote:1;
+	unsigned writeback:1;
+	unsigned err:1;
+};
+
+static void wake_worker(struct cache *cache)
+{
+	queue_work(cache->wq, &cache->worker);
+}
+
+/*----------------------------------------------------------------*/
+
+static unsigned long *alloc_bitset(dm_cblock_t nr_entries)
+{
+	return vzalloc(BITS_TO_LONGS(nr_entries) * sizeof(unsigned long));
+}
+
+static void free_bitset(unsigned long *bits)
+{
+	vfree(bits);
+}
+
+/*----------------------------------------------------------------*/
+
+static dm_oblock_t get_bio_block(struct cache *cache, struct bio *bio)
+{
+	return dm_target_offset(cache->ti, bio->bi_sector) >>
+		cache->sectors_per_block_shift;
+}
+
+static void remap_to_origin(struct cache *cache, struct bio *bio)
+{
+	bio->bi_bdev = cache->origin_dev->bdev;
+	bio->bi_sector = dm_target_offset(cache->ti, bio->bi_sector);
+}
+
+static void remap_to_cache(struct cache *cache, struct bio *bio,
+			   dm_cblock_t cblock)
+{
+	sector_t offset = dm_target_offset(cache->ti, bio->bi_sector) &
+		(cache->sectors_per_block - 1);
+
+	bio->bi_bdev = cache->cache_dev->bdev;
+	bio->bi_sector = ((sector_t)cblock << cache->sectors_per_block_shift) |
+		offset;
+}
+
+static struct per_bio_data *get_per_bio_data(struct bio *bio)
+{
+	return dm_get_mapinfo(bio)->ptr;
+}
+
+/*
+ * Io that is remapped holds an entry in the all_io deferred set until it
+ * completes, so migrations can wait for it to drain.
+ */
+static void __inc_all_io_entry(struct cache *cache, struct bio *bio)
+{
+	struct per_bio_data *pb = get_per_bio_data(bio);
+
+	BUG_ON(pb->all_io_entry);
+	pb->all_io_entry = dm_deferred_entry_inc(cache->all_io_ds);
+}
+
+static void defer_bio(struct cache *cache, struct bio *bio)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_add(&cache->deferred_bios, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * In writethrough mode a write hit goes to the origin first.  When that
+ * completes, the worker sends the same bio on to the cache.
+ */
+static void writethrough_endio(struct bio *bio, int err)
+{
+	struct per_bio_data *pb = get_per_bio_data(bio);
+	struct cache *cache = pb->cache;
+	unsigned long flags;
+
+	bio->bi_end_io = pb->saved_bi_end_io;
+
+	if (err) {
+		bio_endio(bio, err);
+		return;
+	}
+
+	dm_bio_restore(&pb->bio_details, bio);
+	remap_to_cache(cache, bio, pb->cblock);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_add(&cache->deferred_writethrough_bios, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void remap_to_origin_then_cache(struct cache *cache, struct bio *bio,
+				       dm_cblock_t cblock)
+{
+	struct per_bio_data *pb = get_per_bio_data(bio);
+
+	pb->cblock = cblock;
+	pb->saved_bi_end_io = bio->bi_end_io;
+	dm_bio_record(&pb->bio_details, bio);
+	bio->bi_end_io = writethrough_endio;
+
+	remap_to_origin(cache, bio);
+}
+
+/*
+ * Sends a hit to the cache.  Must be called with cache->lock held.
+ */
+static void __remap_hit(struct cache *cache, struct bio *bio,
+			dm_oblock_t oblock, dm_cblock_t cblock)
+{
+	if (bio_data_dir(bio) == READ) {
+		atomic_inc(&cache->stats.read_hit);
+		remap_to_cache(cache, bio, cblock);
+		return;
+	}
+
+	atomic_inc(&cache->stats.write_hit);
+
+	if (cache->writethrough) {
+		remap_to_origin_then_cache(cache, bio, cblock);
+		return;
+	}
+
+	if (!test_and_set_bit(cblock, cache->dirty_bitset)) {
+		cache->nr_dirty++;
+		set_bit(cblock, cache->changed_bitset);
+		policy_set_dirty(cache->policy, oblock);
+	}
+	remap_to_cache(cache, bio, cblock);
+}
+
+static void __remap_miss(struct cache *cache, struct bio *bio)
+{
+	if (bio_data_dir(bio) == READ)
+		atomic_inc(&cache->stats.read_miss);
+	else
+		atomic_inc(&cache->stats.write_miss);
+
+	remap_to_origin(cache, bio);
+}
+
+/*----------------------------------------------------------------
+ * Migration processing
+ *--------------------------------------------------------------*/
+
+static int ensure_next_migration(struct cache *cache)
+{
+	if (cache->next_migration)
+		return 0;
+
+	cache->next_migration = mempool_alloc(cache->migration_pool, GFP_NOWAIT);
+
+	return cache->next_migration ? 0 : -ENOMEM;
+}
+
+static struct dm_cache_migration *get_next_migration(struct cache *cache)
+{
+	struct dm_cache_migration *mg = cache->next_migration;
+
+	BUG_ON(!mg);
+	cache->next_migration = NULL;
+
+	memset(mg, 0, sizeof(*mg));
+	INIT_LIST_HEAD(&mg->list);
+	mg->cache = cache;
+
+	return mg;
+}
+
+/*
+ * Queues a migration once all io in flight at the time of the call has
+ * completed.
+ */
+static void quiesce_migration(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	if (!dm_deferred_set_add_work(cache->all_io_ds, &mg->list)) {
+		spin_lock_irqsave(&cache->lock, flags);
+		list_add_tail(&mg->list, &cache->quiesced_migrations);
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+}
+
+static void copy_complete(int read_err, unsigned long write_err, void *context)
+{
+	unsigned long flags;
+	struct dm_cache_migration *mg = context;
+	struct cache *cache = mg->cache;
+
+	if (read_err || write_err)
+		mg->err = 1;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_add_tail(&mg->list, &cache->completed_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void issue_copy(struct dm_cache_migration *mg)
+{
+	int r;
+	struct dm_io_region o_region, c_region;
+	struct cache *cache = mg->cache;
+	dm_oblock_t oblock = mg->writeback ? mg->old_oblock : mg->new_oblock;
+
+	o_region.bdev = cache->origin_dev->bdev;
+	o_region.sector = oblock << cache->sectors_per_block_shift;
+	o_region.count = min(cache->sectors_per_block,
+			     cache->origin_sectors - o_region.sector);
+
+	c_region.bdev = cache->cache_dev->bdev;
+	c_region.sector = (sector_t)mg->cblock << cache->sectors_per_block_shift;
+	c_region.count = o_region.count;
+
+	if (mg->writeback)
+		r = dm_kcopyd_copy(cache->copier, &c_region, 1, &o_region,
+				   0, copy_complete, mg);
+	else
+		r = dm_kcopyd_copy(cache->copier, &o_region, 1, &c_region,
+				   0, copy_complete, mg);
+
+	if (r < 0) {
+		DMERR_LIMIT("dm_kcopyd_copy() failed");
+		copy_complete(1, 0, mg);
+	}
+}
+
+static void complete_migration(struct dm_cache_migration *mg)
+{
+	int r;
+	unsigned long flags;
+	struct cache *cache = mg->cache;
+
+	if (mg->promote) {
+		if (!mg->err) {
+			r = dm_cache_insert_mapping(cache->cmd, mg->cblock,
+						    mg->new_oblock);
+			if (r) {
+				DMERR_LIMIT("dm_cache_insert_mapping() failed, error = %d", r);
+				mg->err = 1;
+			}
+		} else
+			DMWARN_LIMIT("promotion failed; couldn't copy block");
+
+		spin_lock_irqsave(&cache->lock, flags);
+		if (mg->err)
+			policy_remove_mapping(cache->policy, mg->new_oblock);
+		else
+			policy_clear_dirty(cache->policy, mg->new_oblock);
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		if (!mg->err) {
+			atomic_inc(&cache->stats.promotion);
+			if (mg->demote)
+				atomic_inc(&cache->stats.demotion);
+		}
+	}
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (mg->writeback) {
+		if (mg->err)
+			DMWARN_LIMIT("writeback failed; couldn't copy block");
+
+		else if (test_and_clear_bit(mg->cblock, cache->dirty_bitset)) {
+			cache->nr_dirty--;
+			set_bit(mg->cblock, cache->changed_bitset);
+			policy_clear_dirty(cache->policy, mg->old_oblock);
+			atomic_inc(&cache->stats.writeback);
+		}
+		cache->nr_writebacks--;
+	}
+
+	clear_bit(mg->cblock, cache->busy_bitset);
+	cache->nr_migrations--;
+
+	/*
+	 * The blocked bios are mapped again; any still waiting for another
+	 * migration will end up back on the blocked list.
+	 */
+	bio_list_merge(&cache->deferred_bios, &cache->blocked_bios);
+	bio_list_init(&cache->blocked_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_up(&cache->migration_wait);
+	mempool_free(mg, cache->migration_pool);
+	wake_worker(cache);
+}
+
+static void process_quiesced_migrations(struct cache *cache)
+{
+	int r, need_commit = 0;
+	unsigned long flags;
+	struct list_head list;
+	struct dm_cache_migration *mg, *tmp;
+
+	INIT_LIST_HEAD(&list);
+	spin_lock_irqsave(&cache->lock, flags);
+	list_splice_init(&cache->quiesced_migrations, &list);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	/*
+	 * The old mappings of blocks being replaced must be gone from the
+	 * metadata before anything is copied over them.  One commit covers
+	 * the whole batch.
+	 */
+	list_for_each_entry(mg, &list, list) {
+		if (!mg->demote)
+			continue;
+
+		r = dm_cache_remove_mapping(cache->cmd, mg->cblock);
+		if (r) {
+			DMERR_LIMIT("dm_cache_remove_mapping() failed, error = %d", r);
+			mg->err = 1;
+		} else
+			need_commit = 1;
+	}
+
+	if (need_commit) {
+		r = dm_cache_commit(cache->cmd);
+		if (r) {
+			DMERR_LIMIT("dm_cache_commit() failed, error = %d", r);
+			list_for_each_entry(mg, &list, list)
+				if (mg->demote)
+					mg->err = 1;
+		} else
+			cache->last_commit_jiffies = jiffies;
+	}
+
+	list_for_each_entry_safe(mg, tmp, &list, list) {
+		list_del_init(&mg->list);
+		if (mg->err)
+			complete_migration(mg);
+		else
+			issue_copy(mg);
+	}
+}
+
+static void process_completed_migrations(struct cache *cache)
+{
+	unsigned long flags;
+	struct list_head list;
+	struct dm_cache_migration *mg, *tmp;
+
+	INIT_LIST_HEAD(&list);
+	spin_lock_irqsave(&cache->lock, flags);
+	list_splice_init(&cache->completed_migrations, &list);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	list_for_each_entry_safe(mg, tmp, &list, list) {
+		list_del_init(&mg->list);
+		complete_migration(mg);
+	}
+}
+
+/*----------------------------------------------------------------
+ * Bio processing
+ *--------------------------------------------------------------*/
+
+static int __can_migrate(struct cache *cache)
+{
+	return !cache->quiescing &&
+		cache->nr_migrations < MAX_CONCURRENT_MIGRATIONS;
+}
+
+/*
+ * Maps a bio from the worker, where the policy is allowed to ask for a
+ * promotion.  Returns 1 if the bio was remapped and should be issued, 0 if
+ * it is blocked behind a migration.
+ */
+static int process_bio(struct cache *cache, struct bio *bio)
+{
+	int r;
+	unsigned long flags;
+	struct per_bio_data *pb = get_per_bio_data(bio);
+	dm_oblock_t oblock = get_bio_block(cache, bio);
+	struct policy_result result;
+	struct dm_cache_migration *mg = NULL;
+	int can_migrate;
+
+	ensure_next_migration(cache);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	can_migrate = cache->next_migration && __can_migrate(cache);
+	r = policy_map(cache->policy, oblock, can_migrate,
+		       pb->policy_seen ? NULL : bio, &result);
+	pb->policy_seen = 1;
+
+	if (r)
+		result.op = POLICY_MISS;
+
+	switch (result.op) {
+	case POLICY_HIT:
+		if (test_bit(result.cblock, cache->busy_bitset)) {
+			bio_list_add(&cache->blocked_bios, bio);
+			spin_unlock_irqrestore(&cache->lock, flags);
+			return 0;
+		}
+		__remap_hit(cache, bio, oblock, result.cblock);
+		break;
+
+	case POLICY_MISS:
+		__remap_miss(cache, bio);
+		break;
+
+	case POLICY_NEW:
+	case POLICY_REPLACE:
+		BUG_ON(test_bit(result.cblock, cache->busy_bitset));
+		BUG_ON(test_bit(result.cblock, cache->dirty_bitset));
+
+		set_bit(result.cblock, cache->busy_bitset);
+		cache->nr_migrations++;
+		bio_list_add(&cache->blocked_bios, bio);
+
+		mg = get_next_migration(cache);
+		mg->promote = 1;
+		mg->demote = result.op == POLICY_REPLACE;
+		mg->old_oblock = result.old_oblock;
+		mg->new_oblock = oblock;
+		mg->cblock = result.cblock;
+		break;
+	}
+
+	if (!mg)
+		__inc_all_io_entry(cache, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (mg) {
+		quiesce_migration(mg);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * An empty flush is sent to the origin and to the cache device, once each,
+ * by dm core.
+ */
+static void remap_flush(struct cache *cache, struct bio *bio)
+{
+	if (!dm_get_mapinfo(bio)->target_request_nr)
+		remap_to_origin(cache, bio);
+	else
+		bio->bi_bdev = cache->cache_dev->bdev;
+}
+
+static void write_dirty_bits(struct cache *cache)
+{
+	int r;
+	dm_cblock_t cblock = 0;
+
+	while ((cblock = find_next_bit(cache->changed_bitset, cache->cache_size,
+				       cblock)) < cache->cache_size) {
+		if (test_and_clear_bit(cblock, cache->changed_bitset)) {
+			r = dm_cache_set_dirty(cache->cmd, cblock,
+					       test_bit(cblock, cache->dirty_bitset));
+			/*
+			 * A block demoted since it was cleaned has no
+			 * mapping left to update.
+			 */
+			if (r && r != -ENODATA)
+				DMERR_LIMIT("dm_cache_set_dirty() failed, error = %d", r);
+		}
+		cblock++;
+	}
+}
+
+static int commit(struct cache *cache)
+{
+	int r;
+
+	write_dirty_bits(cache);
+
+	r = dm_cache_commit(cache->cmd);
+	if (r)
+		DMERR_LIMIT("dm_cache_commit() failed, error = %d", r);
+	else
+		cache->last_commit_jiffies = jiffies;
+
+	return r;
+}
+
+static void process_deferred_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio_list bios, commit_bios;
+	struct bio *bio;
+
+	bio_list_init(&bios);
+	bio_list_init(&commit_bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_bios);
+	bio_list_init(&cache->deferred_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios))) {
+		if (bio->bi_rw & REQ_FLUSH && !bio_sectors(bio)) {
+			remap_flush(cache, bio);
+			bio_list_add(&commit_bios, bio);
+
+		} else if (process_bio(cache, bio)) {
+			/*
+			 * The dirty bit for a FUA write must reach the
+			 * metadata before the write is acknowledged.
+			 */
+			if (bio->bi_rw & REQ_FUA)
+				bio_list_add(&commit_bios, bio);
+			else
+				generic_make_request(bio);
+		}
+	}
+
+	if (bio_list_empty(&commit_bios))
+		return;
+
+	if (commit(cache)) {
+		while ((bio = bio_list_pop(&commit_bios)))
+			bio_io_error(bio);
+		return;
+	}
+
+	while ((bio = bio_list_pop(&commit_bios)))
+		generic_make_request(bio);
+}
+
+static void process_deferred_writethrough_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio_list bios;
+	struct bio *bio;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_writethrough_bios);
+	bio_list_init(&cache->deferred_writethrough_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+}
+
+/*
+ * Dirty blocks are written back when the cache has been idle for a
+ * second, or regardless once more than half the cache is dirty.
+ */
+static int __need_writeback(struct cache *cache)
+{
+	if (!cache->nr_dirty || !__can_migrate(cache) ||
+	    cache->nr_writebacks >= MAX_CONCURRENT_WRITEBACKS)
+		return 0;
+
+	return cache->nr_dirty > cache->cache_size / 2 ||
+		time_after(jiffies, cache->last_io_jiffies + HZ);
+}
+
+static void start_writebacks(struct cache *cache)
+{
+	unsigned long flags;
+	dm_oblock_t oblock;
+	dm_cblock_t cblock;
+	struct dm_cache_migration *mg;
+
+	while (!ensure_next_migration(cache)) {
+		spin_lock_irqsave(&cache->lock, flags);
+		if (!__need_writeback(cache) ||
+		    policy_writeback_work(cache->policy, &oblock, &cblock) ||
+		    test_bit(cblock, cache->busy_bitset)) {
+			spin_unlock_irqrestore(&cache->lock, flags);
+			break;
+		}
+
+		set_bit(cblock, cache->busy_bitset);
+		cache->nr_migrations++;
+		cache->nr_writebacks++;
+
+		mg = get_next_migration(cache);
+		mg->writeback = 1;
+		mg->old_oblock = oblock;
+		mg->cblock = cblock;
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		quiesce_migration(mg);
+	}
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(ws, struct cache, worker);
+
+	process_deferred_bios(cache);
+	start_writebacks(cache);
+	process_quiesced_migrations(cache);
+	process_completed_migrations(cache);
+	process_deferred_writethrough_bios(cache);
+
+	if (time_after(jiffies, cache->last_commit_jiffies + COMMIT_PERIOD))
+		commit(cache);
+}
+
+/*
+ * We want to commit periodically, and kick off writeback when idle.
+ */
+static void do_waker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(to_delayed_work(ws), struct cache,
+					   waker);
+
+	wake_worker(cache);
+	queue_delayed_work(cache->wq, &cache->waker, COMMIT_PERIOD);
+}
+
+/*----------------------------------------------------------------*/
+
+static int is_congested(struct dm_dev *dev, int bdi_bits)
+{
+	struct request_queue *q = bdev_get_queue(dev->bdev);
+
+	return bdi_congested(&q->backing_dev_info, bdi_bits);
+}
+
+static int cache_is_congested(struct dm_target_callbacks *cb, int bdi_bits)
+{
+	struct cache *cache = container_of(cb, struct cache, callbacks);
+
+	return is_congested(cache->origin_dev, bdi_bits) ||
+		is_congested(cache->cache_dev, bdi_bits);
+}
+
+/*----------------------------------------------------------------
+ * Target methods
+ *--------------------------------------------------------------*/
+
+static void destroy(struct cache *cache)
+{
+	if (cache->next_migration)
+		mempool_free(cache->next_migration, cache->migration_pool);
+	if (cache->migration_pool)
+		mempool_destroy(cache->migration_pool);
+	if (cache->endio_hook_pool)
+		mempool_destroy(cache->endio_hook_pool);
+	if (cache->all_io_ds)
+		dm_deferred_set_destroy(cache->all_io_ds);
+	if (cache->wq)
+		destroy_workqueue(cache->wq);
+	if (cache->copier)
+		dm_kcopyd_client_destroy(cache->copier);
+	if (cache->policy)
+		dm_cache_policy_destroy(cache->policy);
+	if (cache->cmd)
+		dm_cache_metadata_close(cache->cmd);
+
+	free_bitset(cache->busy_bitset);
+	free_bitset(cache->changed_bitset);
+	free_bitset(cache->dirty_bitset);
+
+	if (cache->cache_dev)
+		dm_put_device(cache->ti, cache->cache_dev);
+	if (cache->origin_dev)
+		dm_put_device(cache->ti, cache->origin_dev);
+	if (cache->metadata_dev)
+		dm_put_device(cache->ti, cache->metadata_dev);
+
+	kfree(cache);
+}
+
+static void cache_dtr(struct dm_target *ti)
+{
+	destroy(ti->private);
+}
+
+static sector_t get_dev_size(struct dm_dev *dev)
+{
+	return i_size_read(dev->bdev->bd_inode) >> SECTOR_SHIFT;
+}
+
+static int parse_features(struct cache *cache, struct dm_arg_set *as,
+			  char **error)
+{
+	int r;
+	unsigned argc;
+	const char *arg;
+
+	static struct dm_arg _args[] = {
+		{0, 1, "Invalid number of cache feature arguments"},
+	};
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r)
+		return -EINVAL;
+
+	while (argc--) {
+		arg = dm_shift_arg(as);
+
+		if (!strcasecmp(arg, "writeback"))
+			cache->writethrough = 0;
+
+		else if (!strcasecmp(arg, "writethrough"))
+			cache->writethrough = 1;
+
+		else {
+			*error = "Unrecognised cache feature requested";
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_policy(struct cache *cache, struct dm_arg_set *as,
+			char **error)
+{
+	int r;
+	unsigned argc;
+	const char *name, *key, *value;
+
+	static struct dm_arg _args[] = {
+		{0, 1024, "Invalid number of policy arguments"},
+	};
+
+	name = dm_shift_arg(as);
+	if (!name) {
+		*error = "No cache policy specified";
+		return -EINVAL;
+	}
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r)
+		return -EINVAL;
+
+	if (argc & 1) {
+		*error = "Policy arguments must be <key> <value> pairs";
+		return -EINVAL;
+	}
+
+	cache->policy = dm_cache_policy_create(name, cache->cache_size,
+					       cache->origin_sectors,
+					       cache->sectors_per_block);
+	if (!cache->policy) {
+		*error = "Error creating cache's policy";
+		return -ENOMEM;
+	}
+
+	while (argc) {
+		key = dm_shift_arg(as);
+		value = dm_shift_arg(as);
+		argc -= 2;
+
+		r = policy_set_config_value(cache->policy, key, value);
+		if (r) {
+			*error = "Invalid policy argument";
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static int load_mapping(void *context, dm_oblock_t oblock,
+			dm_cblock_t cblock, int dirty)
+{
+	struct cache *cache = context;
+	int r;
+
+	r = policy_load_mapping(cache->policy, oblock, cblock, dirty);
+	if (r)
+		return r;
+
+	if (dirty) {
+		set_bit(cblock, cache->dirty_bitset);
+		cache->nr_dirty++;
+	}
+
+	return 0;
+}
+
+/*
+ * cache <metadata dev> <cache dev> <origin dev> <block size>
+ *       <#feature args> [<feature arg>]*
+ *       <policy> <#policy args> [<key> <value>]*
+ *
+ * Optional feature arguments are:
+ *       writeback: write hits only go to the cache (the default).
+ *       writethrough: write hits go to the origin and then the cache.
+ */
+static int cache_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r;
+	struct cache *cache;
+	struct dm_arg_set as;
+	unsigned long block_size;
+	sector_t cache_sectors;
+	size_t hook_size;
+
+	if (argc < 7) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+	as.argc = argc;
+	as.argv = argv;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		ti->error = "Error allocating cache context";
+		return -ENOMEM;
+	}
+	cache->ti = ti;
+	ti->private = cache;
+
+	r = dm_get_device(ti, argv[0], FMODE_READ | FMODE_WRITE,
+			  &cache->metadata_dev);
+	if (r) {
+		ti->error = "Error opening metadata device";
+		goto bad;
+	}
+
+	if (get_dev_size(cache->metadata_dev) > METADATA_DEV_MAX_SECTORS) {
+		ti->error = "Metadata device is too large";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	r = dm_get_device(ti, argv[1], FMODE_READ | FMODE_WRITE,
+			  &cache->cache_dev);
+	if (r) {
+		ti->error = "Error opening cache device";
+		goto bad;
+	}
+
+	r = dm_get_device(ti, argv[2], dm_table_get_mode(ti->table),
+			  &cache->origin_dev);
+	if (r) {
+		ti->error = "Error opening origin device";
+		goto bad;
+	}
+
+	cache->origin_sectors = get_dev_size(cache->origin_dev);
+	if (ti->len > cache->origin_sectors) {
+		ti->error = "Device size larger than cached device";
+		r = -EINVAL;
+		goto bad;
+	}
+	cache->origin_sectors = ti->len;
+
+	if (kstrtoul(argv[3], 10, &block_size) ||
+	    block_size < DATA_DEV_BLOCK_SIZE_MIN_SECTORS ||
+	    block_size > DATA_DEV_BLOCK_SIZE_MAX_SECTORS ||
+	    !is_power_of_2(block_size)) {
+		ti->error = "Invalid block size";
+		r = -EINVAL;
+		goto bad;
+	}
+	cache->sectors_per_block = block_size;
+	cache->sectors_per_block_shift = __ffs(block_size);
+
+	cache_sectors = get_dev_size(cache->cache_dev);
+	if (cache_sectors < block_size ||
+	    (cache_sectors >> cache->sectors_per_block_shift) > UINT_MAX) {
+		ti->error = "Invalid cache device size";
+		r = -EINVAL;
+		goto bad;
+	}
+	cache->cache_size = cache_sectors >> cache->sectors_per_block_shift;
+
+	dm_consume_args(&as, 4);
+	r = parse_features(cache, &as, &ti->error);
+	if (r)
+		goto bad;
+
+	r = parse_policy(cache, &as, &ti->error);
+	if (r)
+		goto bad;
+
+	if (as.argc) {
+		ti->error = "Too many arguments";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	cache->dirty_bitset = alloc_bitset(cache->cache_size);
+	cache->changed_bitset = alloc_bitset(cache->cache_size);
+	cache->busy_bitset = alloc_bitset(cache->cache_size);
+	if (!cache->dirty_bitset || !cache->changed_bitset ||
+	    !cache->busy_bitset) {
+		ti->error = "Error allocating cache bitsets";
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	cache->cmd = dm_cache_metadata_open(cache->metadata_dev->bdev,
+					    block_size, cache->cache_size);
+	if (IS_ERR(cache->cmd)) {
+		ti->error = "Error creating metadata object";
+		r = PTR_ERR(cache->cmd);
+		cache->cmd = NULL;
+		goto bad;
+	}
+
+	r = dm_cache_load_mappings(cache->cmd, load_mapping, cache);
+	if (r) {
+		ti->error = "Couldn't load cache mappings";
+		goto bad;
+	}
+
+	spin_lock_init(&cache->lock);
+	bio_list_init(&cache->deferred_bios);
+	bio_list_init(&cache->deferred_writethrough_bios);
+	bio_list_init(&cache->blocked_bios);
+	INIT_LIST_HEAD(&cache->quiesced_migrations);
+	INIT_LIST_HEAD(&cache->completed_migrations);
+	init_waitqueue_head(&cache->migration_wait);
+
+	atomic_set(&cache->stats.read_hit, 0);
+	atomic_set(&cache->stats.read_miss, 0);
+	atomic_set(&cache->stats.write_hit, 0);
+	atomic_set(&cache->stats.write_miss, 0);
+	atomic_set(&cache->stats.demotion, 0);
+	atomic_set(&cache->stats.promotion, 0);
+	atomic_set(&cache->stats.writeback, 0);
+
+	cache->copier = dm_kcopyd_client_create();
+	if (IS_ERR(cache->copier)) {
+		ti->error = "Couldn't create kcopyd client";
+		r = PTR_ERR(cache->copier);
+		cache->copier = NULL;
+		goto bad;
+	}
+
+	cache->wq = alloc_ordered_workqueue("dm-" DM_MSG_PREFIX, WQ_MEM_RECLAIM);
+	if (!cache->wq) {
+		ti->error = "Couldn't create workqueue for cache";
+		r = -ENOMEM;
+		goto bad;
+	}
+	INIT_WORK(&cache->worker, do_worker);
+	INIT_DELAYED_WORK(&cache->waker, do_waker);
+	cache->last_commit_jiffies = jiffies;
+	cache->last_io_jiffies = jiffies;
+
+	cache->all_io_ds = dm_deferred_set_create();
+	if (!cache->all_io_ds) {
+		ti->error = "Couldn't create all_io deferred set";
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	hook_size = cache->writethrough ? sizeof(struct per_bio_data) :
+		offsetof(struct per_bio_data, bio_details);
+	cache->endio_hook_pool =
+		mempool_create_kmalloc_pool(ENDIO_HOOK_POOL_SIZE, hook_size);
+	if (!cache->endio_hook_pool) {
+		ti->error = "Error creating cache's endio_hook mempool";
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	cache->migration_pool =
+		mempool_create_kmalloc_pool(MIGRATION_POOL_SIZE,
+					    sizeof(struct dm_cache_migration));
+	if (!cache->migration_pool) {
+		ti->error = "Error creating cache's migration mempool";
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	ti->split_io = cache->sectors_per_block;
+	ti->num_flush_requests = 2;
+	ti->num_discard_requests = 0;
+
+	cache->callbacks.congested_fn = cache_is_congested;
+	dm_table_add_target_callbacks(ti->table, &cache->callbacks);
+
+	return 0;
+
+bad:
+	destroy(cache);
+	return r;
+}
+
+static int cache_map(struct dm_target *ti, struct bio *bio,
+		     union map_info *map_context)
+{
+	int r;
+	unsigned long flags;
+	struct cache *cache = ti->private;
+	struct per_bio_data *pb;
+	struct policy_result result;
+	dm_oblock_t oblock;
+
+	pb = mempool_alloc(cache->endio_hook_pool, GFP_NOIO);
+	pb->cache = cache;
+	pb->all_io_entry = NULL;
+	pb->policy_seen = 0;
+	map_context->ptr = pb;
+
+	cache->last_io_jiffies = jiffies;
+
+	/*
+	 * Flushes and FUA writes need a metadata commit, which has to be
+	 * done from the worker.
+	 */
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+		defer_bio(cache, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	oblock = get_bio_block(cache, bio);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	r = policy_map(cache->policy, oblock, 0, bio, &result);
+	if (r == -EWOULDBLOCK) {
+		/*
+		 * The policy wants to promote this block; the worker
+		 * will ask it again.
+		 */
+		pb->policy_seen = 1;
+		bio_list_add(&cache->deferred_bios, bio);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		wake_worker(cache);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	if (r) {
+		spin_unlock_irqrestore(&cache->lock, flags);
+		DMERR_LIMIT("unexpected return from cache replacement policy: %d", r);
+		return -EIO;
+	}
+
+	BUG_ON(result.op != POLICY_HIT && result.op != POLICY_MISS);
+
+	if (result.op == POLICY_HIT) {
+		if (test_bit(result.cblock, cache->busy_bitset)) {
+			pb->policy_seen = 1;
+			bio_list_add(&cache->blocked_bios, bio);
+			spin_unlock_irqrestore(&cache->lock, flags);
+			return DM_MAPIO_SUBMITTED;
+		}
+		__remap_hit(cache, bio, oblock, result.cblock);
+	} else
+		__remap_miss(cache, bio);
+
+	__inc_all_io_entry(cache, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return DM_MAPIO_REMAPPED;
+}
+
+static int cache_end_io(struct dm_target *ti, struct bio *bio,
+			int error, union map_info *map_context)
+{
+	unsigned long flags;
+	struct list_head work;
+	struct cache *cache = ti->private;
+	struct per_bio_data *pb = map_context->ptr;
+
+	if (pb->all_io_entry) {
+		INIT_LIST_HEAD(&work);
+		dm_deferred_entry_dec(pb->all_io_entry, &work);
+
+		if (!list_empty(&work)) {
+			spin_lock_irqsave(&cache->lock, flags);
+			list_splice_tail(&work, &cache->quiesced_migrations);
+			spin_unlock_irqrestore(&cache->lock, flags);
+			wake_worker(cache);
+		}
+	}
+
+	mempool_free(pb, cache->endio_hook_pool);
+
+	return 0;
+}
+
+static void cache_postsuspend(struct dm_target *ti)
+{
+	int r;
+	unsigned long flags;
+	struct cache *cache = ti->private;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->quiescing = 1;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	cancel_delayed_work_sync(&cache->waker);
+	wait_event(cache->migration_wait, !cache->nr_migrations);
+	flush_workqueue(cache->wq);
+
+	write_dirty_bits(cache);
+	r = dm_cache_commit(cache->cmd);
+	if (r)
+		DMERR("%s: dm_cache_commit() failed, error = %d", __func__, r);
+}
+
+static void cache_resume(struct dm_target *ti)
+{
+	unsigned long flags;
+	struct cache *cache = ti->private;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->quiescing = 0;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	do_waker(&cache->waker.work);
+}
+
+/*
+ * Status line is:
+ *    <used metadata blocks>/<total metadata blocks>
+ *    <read hits> <read misses> <write hits> <write misses>
+ *    <demotions> <promotions> <writebacks>
+ *    <resident blocks>/<cache blocks> <dirty blocks>
+ *    <policy name> <#policy args> [<key> <value>]*
+ */
+static int cache_status(struct dm_target *ti, status_type_t type,
+			char *result, unsigned maxlen)
+{
+	int r;
+	unsigned sz = 0;
+	unsigned long flags;
+	dm_block_t nr_free_blocks_metadata = 0;
+	dm_block_t nr_blocks_metadata = 0;
+	dm_cblock_t residency, nr_dirty;
+	char buf[BDEVNAME_SIZE];
+	struct cache *cache = ti->private;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		r = dm_cache_get_free_metadata_block_count(cache->cmd,
+							   &nr_free_blocks_metadata);
+		if (r)
+			return r;
+
+		r = dm_cache_get_metadata_dev_size(cache->cmd, &nr_blocks_metadata);
+		if (r)
+			return r;
+
+		spin_lock_irqsave(&cache->lock, flags);
+		residency = policy_residency(cache->policy);
+		nr_dirty = cache->nr_dirty;
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		DMEMIT("%llu/%llu %u %u %u %u %u %u %u %u/%u %u ",
+		       (unsigned long long)(nr_blocks_metadata - nr_free_blocks_metadata),
+		       (unsigned long long)nr_blocks_metadata,
+		       (unsigned)atomic_read(&cache->stats.read_hit),
+		       (unsigned)atomic_read(&cache->stats.read_miss),
+		       (unsigned)atomic_read(&cache->stats.write_hit),
+		       (unsigned)atomic_read(&cache->stats.write_miss),
+		       (unsigned)atomic_read(&cache->stats.demotion),
+		       (unsigned)atomic_read(&cache->stats.promotion),
+		       (unsigned)atomic_read(&cache->stats.writeback),
+		       residency, cache->cache_size, nr_dirty);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s ", format_dev_t(buf, cache->metadata_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->cache_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->origin_dev->bdev->bd_dev));
+		DMEMIT("%llu 1 %s ", (unsigned long long)cache->sectors_per_block,
+		       cache->writethrough ? "writethrough" : "writeback");
+		break;
+	}
+
+	DMEMIT("%s ", dm_cache_policy_get_name(cache->policy));
+
+	spin_lock_irqsave(&cache->lock, flags);
+	r = policy_emit_config_values(cache->policy, result + sz, maxlen - sz);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return r;
+}
+
+/*
+ * Messages supported:
+ *   <key> <value>
+ *
+ * The key value pair is passed on to the policy, see its documentation for
+ * the tunables it understands.
+ */
+static int cache_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r;
+	unsigned long flags;
+	struct cache *cache = ti->private;
+
+	if (argc != 2) {
+		DMWARN("Unrecognised cache message received");
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&cache->lock, flags);
+	r = policy_set_config_value(cache->policy, argv[0], argv[1]);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (r)
+		DMWARN("Unrecognised cache policy setting: %s %s",
+		       argv[0], argv[1]);
+
+	return r;
+}
+
+static int cache_iterate_devices(struct dm_target *ti,
+				 iterate_devices_callout_fn fn, void *data)
+{
+	int r;
+	struct cache *cache = ti->private;
+
+	r = fn(ti, cache->cache_dev, 0, get_dev_size(cache->cache_dev), data);
+	if (!r)
+		r = fn(ti, cache->origin_dev, 0, ti->len, data);
+
+	return r;
+}
+
+static void cache_io_hints(struct dm_target *ti, struct queue_limits *limits)
+{
+	struct cache *cache = ti->private;
+
+	blk_limits_io_min(limits, 0);
+	blk_limits_io_opt(limits, cache->sectors_per_block << SECTOR_SHIFT);
+}
+
+static struct target_type cache_target = {
+	.name = "cache",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr = cache_ctr,
+	.dtr = cache_dtr,
+	.map = cache_map,
+	.end_io = cache_end_io,
+	.postsuspend = cache_postsuspend,
+	.resume = cache_resume,
+	.status = cache_status,
+	.message = cache_message,
+	.iterate_devices = cache_iterate_devices,
+	.io_hints = cache_io_hints,
+};
+
+static int __init dm_cache_init(void)
+{
+	int r;
+
+	r = dm_register_target(&cache_target);
+	if (r) {
+		DMERR("cache target registration failed: %d", r);
+		return r;
+	}
+
+	return 0;
+}
+
+static void __exit dm_cache_exit(void)
+{
+	dm_unregister_target(&cache_target);
+}
+
+module_init(dm_cache_init);
+module_exit(dm_cache_exit);
+
+MODULE_DESCRIPTION(DM_NAME " cache target");
+MODULE_LICENSE("GPL");
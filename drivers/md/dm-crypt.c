@@ -11,6 +11,9 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/cpu.h>
+#include <linux/rbtree.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/mempool.h>
@@ -42,6 +45,7 @@ struct convert_context {
 	unsigned int offset_out;
 	unsigned int idx_in;
 	unsigned int idx_out;
+	unsigned int idx_end;
 	sector_t sector;
 	atomic_t pending;
 };
@@ -60,6 +64,20 @@ struct dm_crypt_io {
 	int error;
 	sector_t sector;
 	struct dm_crypt_io *base_io;
+
+	/* part of base_bio handled by this io, see kcryptd_crypt_split() */
+	unsigned int idx;
+	unsigned int idx_end;
+	unsigned int size;
+};
+
+/*
+ * Clones are allocated with room for this in the bioset front pad,
+ * the rb_node sorts encrypted writes for the write thread.
+ */
+struct dm_crypt_clone {
+	struct rb_node rb_node;
+	struct bio bio;
 };
 
 struct dm_crypt_request {
@@ -102,7 +120,7 @@ struct iv_lmk_private {
  * Crypt: maps a linear range of a block device
  * and encrypts / decrypts at the same time.
  */
-enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID };
+enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID, DM_CRYPT_NO_OFFLOAD };
 
 /*
  * Duplicated per-CPU state for cipher.
@@ -134,6 +152,14 @@ struct crypt_config {
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
 
+	/*
+	 * Encrypted writes waiting for dmcrypt_write, sorted by sector
+	 */
+	struct task_struct *write_thread;
+	wait_queue_head_t write_thread_wait;
+	spinlock_t write_lock;
+	struct rb_root write_tree;
+
 	char *cipher;
 	char *cipher_string;
 
@@ -177,11 +203,13 @@ struct crypt_config {
 #define MIN_IOS        16
 #define MIN_POOL_PAGES 32
 #define MIN_BIO_PAGES  8
+#define MIN_SPLIT_PAGES 16
 
 static struct kmem_cache *_crypt_io_pool;
 
 static void clone_init(struct dm_crypt_io *, struct bio *);
 static void kcryptd_queue_crypt(struct dm_crypt_io *io);
+static void kcryptd_queue_crypt_on(struct dm_crypt_io *io, int cpu);
 static u8 *iv_of_dmreq(struct crypt_config *cc, struct dm_crypt_request *dmreq);
 
 static struct crypt_cpu *this_crypt_config(struct crypt_config *cc)
@@ -665,6 +693,7 @@ static void crypt_convert_init(struct crypt_config *cc,
 	ctx->offset_out = 0;
 	ctx->idx_in = bio_in ? bio_in->bi_idx : 0;
 	ctx->idx_out = bio_out ? bio_out->bi_idx : 0;
+	ctx->idx_end = bio_in ? bio_in->bi_vcnt : 0;
 	ctx->sector = sector + cc->iv_offset;
 	init_completion(&ctx->restart);
 }
@@ -772,7 +801,7 @@ static int crypt_convert(struct crypt_config *cc,
 
 	atomic_set(&ctx->pending, 1);
 
-	while(ctx->idx_in < ctx->bio_in->bi_vcnt &&
+	while(ctx->idx_in < ctx->idx_end &&
 	      ctx->idx_out < ctx->bio_out->bi_vcnt) {
 
 		crypt_alloc_req(cc, ctx);
@@ -887,17 +916,24 @@ static void crypt_free_buffer_pages(struct crypt_config *cc, struct bio *clone)
 }
 
 static struct dm_crypt_io *crypt_io_alloc(struct dm_target *ti,
-					  struct bio *bio, sector_t sector)
+					  struct bio *bio, sector_t sector,
+					  gfp_t gfp)
 {
 	struct crypt_config *cc = ti->private;
 	struct dm_crypt_io *io;
 
-	io = mempool_alloc(cc->io_pool, GFP_NOIO);
+	io = mempool_alloc(cc->io_pool, gfp);
+	if (!io)
+		return NULL;
+
 	io->target = ti;
 	io->base_bio = bio;
 	io->sector = sector;
 	io->error = 0;
 	io->base_io = NULL;
+	io->idx = bio->bi_idx;
+	io->idx_end = bio->bi_vcnt;
+	io->size = bio->bi_size;
 	atomic_set(&io->pending, 0);
 
 	return io;
@@ -935,14 +971,19 @@ static void crypt_dec_pending(struct dm_crypt_io *io)
 }
 
 /*
- * kcryptd/kcryptd_io:
+ * kcryptd/kcryptd_io/dmcrypt_write:
  *
  * Needed because it would be very unwise to do decryption in an
  * interrupt context.
  *
- * kcryptd performs the actual encryption or decryption.
+ * kcryptd performs the actual encryption or decryption.  Large bios
+ * are split and the pieces are queued to kcryptd on the other CPUs.
  *
- * kcryptd_io performs the IO submission.
+ * kcryptd_io submits reads that could not be allocated in crypt_map.
+ *
+ * dmcrypt_write submits the encrypted writes.  They finish encryption
+ * in no particular order, so it keeps them sorted by sector and issues
+ * everything that has accumulated as one plugged batch.
  *
  * They must be separated as otherwise the final stages could be
  * starved by new requests which can block in the first stages due
@@ -1019,23 +1060,14 @@ static int kcryptd_io_read(struct dm_crypt_io *io, gfp_t gfp)
 	return 0;
 }
 
-static void kcryptd_io_write(struct dm_crypt_io *io)
-{
-	struct bio *clone = io->ctx.bio_out;
-	generic_make_request(clone);
-}
-
 static void kcryptd_io(struct work_struct *work)
 {
 	struct dm_crypt_io *io = container_of(work, struct dm_crypt_io, work);
 
-	if (bio_data_dir(io->base_bio) == READ) {
-		crypt_inc_pending(io);
-		if (kcryptd_io_read(io, GFP_NOIO))
-			io->error = -ENOMEM;
-		crypt_dec_pending(io);
-	} else
-		kcryptd_io_write(io);
+	crypt_inc_pending(io);
+	if (kcryptd_io_read(io, GFP_NOIO))
+		io->error = -ENOMEM;
+	crypt_dec_pending(io);
 }
 
 static void kcryptd_queue_io(struct dm_crypt_io *io)
@@ -1046,6 +1078,75 @@ static void kcryptd_queue_io(struct dm_crypt_io *io)
 	queue_work(cc->io_queue, &io->work);
 }
 
+static struct rb_node *clone_rb_node(struct bio *clone)
+{
+	return &container_of(clone, struct dm_crypt_clone, bio)->rb_node;
+}
+
+static struct bio *rb_node_clone(struct rb_node *node)
+{
+	return &rb_entry(node, struct dm_crypt_clone, rb_node)->bio;
+}
+
+static int dmcrypt_write(void *data)
+{
+	struct crypt_config *cc = data;
+	struct rb_root write_tree;
+	struct rb_node *node;
+	struct blk_plug plug;
+
+	for (;;) {
+		wait_event_interruptible(cc->write_thread_wait,
+					 !RB_EMPTY_ROOT(&cc->write_tree) ||
+					 kthread_should_stop());
+
+		spin_lock_irq(&cc->write_lock);
+		write_tree = cc->write_tree;
+		cc->write_tree = RB_ROOT;
+		spin_unlock_irq(&cc->write_lock);
+
+		if (RB_EMPTY_ROOT(&write_tree)) {
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+
+		blk_start_plug(&plug);
+		while ((node = rb_first(&write_tree))) {
+			rb_erase(node, &write_tree);
+			generic_make_request(rb_node_clone(node));
+		}
+		blk_finish_plug(&plug);
+	}
+
+	return 0;
+}
+
+static void kcryptd_queue_write(struct crypt_config *cc, struct bio *clone)
+{
+	struct rb_node **p, *parent = NULL;
+	unsigned long flags;
+	int empty;
+
+	spin_lock_irqsave(&cc->write_lock, flags);
+	empty = RB_EMPTY_ROOT(&cc->write_tree);
+	p = &cc->write_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		if (clone->bi_sector < rb_node_clone(parent)->bi_sector)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(clone_rb_node(clone), parent, p);
+	rb_insert_color(clone_rb_node(clone), &cc->write_tree);
+	spin_unlock_irqrestore(&cc->write_lock, flags);
+
+	/* a non-empty tree means the write thread has already been woken */
+	if (empty)
+		wake_up(&cc->write_thread_wait);
+}
+
 static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
 					  int error, int async)
 {
@@ -1065,10 +1166,12 @@ static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
 
 	clone->bi_sector = cc->start + io->sector;
 
-	if (async)
-		kcryptd_queue_io(io);
-	else
+	if (!async && test_bit(DM_CRYPT_NO_OFFLOAD, &cc->flags)) {
 		generic_make_request(clone);
+		return;
+	}
+
+	kcryptd_queue_write(cc, clone);
 }
 
 static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
@@ -1078,7 +1181,7 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 	struct dm_crypt_io *new_io;
 	int crypt_finished;
 	unsigned out_of_pages = 0;
-	unsigned remaining = io->base_bio->bi_size;
+	unsigned remaining = io->size;
 	sector_t sector = io->sector;
 	int r;
 
@@ -1087,6 +1190,8 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 	 */
 	crypt_inc_pending(io);
 	crypt_convert_init(cc, &io->ctx, NULL, io->base_bio, sector);
+	io->ctx.idx_in = io->idx;
+	io->ctx.idx_end = io->idx_end;
 
 	/*
 	 * The allocated buffers can be smaller than the whole bio,
@@ -1136,11 +1241,12 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 		 */
 		if (unlikely(!crypt_finished && remaining)) {
 			new_io = crypt_io_alloc(io->target, io->base_bio,
-						sector);
+						sector, GFP_NOIO);
 			crypt_inc_pending(new_io);
 			crypt_convert_init(cc, &new_io->ctx, NULL,
 					   io->base_bio, sector);
 			new_io->ctx.idx_in = io->ctx.idx_in;
+			new_io->ctx.idx_end = io->ctx.idx_end;
 			new_io->ctx.offset_in = io->ctx.offset_in;
 
 			/*
@@ -1179,6 +1285,8 @@ static void kcryptd_crypt_read_convert(struct dm_crypt_io *io)
 
 	crypt_convert_init(cc, &io->ctx, io->base_bio, io->base_bio,
 			   io->sector);
+	io->ctx.idx_in = io->ctx.idx_out = io->idx;
+	io->ctx.idx_end = io->idx_end;
 
 	r = crypt_convert(cc, &io->ctx);
 
@@ -1215,14 +1323,117 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 		kcryptd_crypt_write_io_submit(io, error, 1);
 }
 
+/*
+ * Return the bvec index where a piece of at least @chunk bytes starting
+ * at @idx ends, and its length in @size.
+ */
+static unsigned int crypt_split_point(struct bio *bio, unsigned int idx,
+				      unsigned int idx_end, unsigned int chunk,
+				      unsigned int *size)
+{
+	unsigned int len = 0;
+
+	while (idx < idx_end && len < chunk)
+		len += bio_iovec_idx(bio, idx++)->bv_len;
+
+	*size = len;
+	return idx;
+}
+
+static int crypt_next_cpu(int cpu)
+{
+	cpu = cpumask_next(cpu, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+
+	return cpu;
+}
+
+/*
+ * Cut a large bio at bvec boundaries into one piece per online CPU and
+ * queue all but the first to kcryptd on the other CPUs, so that they are
+ * encrypted or decrypted in parallel.  The pieces are fragments with
+ * base_io pointing at io, which keeps the first piece for itself.
+ *
+ * Fragments are allocated without waiting; whatever could not get one
+ * is left to the last piece that did.
+ */
+static void kcryptd_crypt_split(struct dm_crypt_io *io)
+{
+	struct bio *base_bio = io->base_bio;
+	struct dm_crypt_io *frag, *last = io;
+	unsigned int idx, idx_end = io->idx_end;
+	unsigned int total = io->size, done, chunk, nr_cpus;
+	int cpu;
+
+	if (io->base_io || total < (2 * MIN_SPLIT_PAGES) << PAGE_SHIFT)
+		return;
+
+	get_online_cpus();
+
+	nr_cpus = num_online_cpus();
+	if (nr_cpus < 2)
+		goto out;
+
+	chunk = max_t(unsigned int, DIV_ROUND_UP(total, nr_cpus),
+		      MIN_SPLIT_PAGES << PAGE_SHIFT);
+	idx = crypt_split_point(base_bio, io->idx, idx_end, chunk, &io->size);
+	io->idx_end = idx;
+	done = io->size;
+	cpu = raw_smp_processor_id();
+
+	while (idx < idx_end) {
+		frag = crypt_io_alloc(io->target, base_bio,
+				      io->sector + (done >> SECTOR_SHIFT),
+				      GFP_NOWAIT);
+		if (!frag)
+			break;
+
+		frag->base_io = io;
+		crypt_inc_pending(io);
+
+		frag->idx = idx;
+		idx = crypt_split_point(base_bio, idx, idx_end, chunk,
+					&frag->size);
+		frag->idx_end = idx;
+		done += frag->size;
+
+		if (last != io) {
+			cpu = crypt_next_cpu(cpu);
+			kcryptd_queue_crypt_on(last, cpu);
+		}
+		last = frag;
+	}
+
+	last->idx_end = idx_end;
+	last->size += total - done;
+
+	if (last != io) {
+		cpu = crypt_next_cpu(cpu);
+		kcryptd_queue_crypt_on(last, cpu);
+	}
+out:
+	put_online_cpus();
+}
+
 static void kcryptd_crypt(struct work_struct *work)
 {
 	struct dm_crypt_io *io = container_of(work, struct dm_crypt_io, work);
 
+	/*
+	 * Fragments queued by the split may complete before the first
+	 * piece is even started, keep io around until it is done.
+	 */
+	crypt_inc_pending(io);
+
+	kcryptd_crypt_split(io);
+
 	if (bio_data_dir(io->base_bio) == READ)
 		kcryptd_crypt_read_convert(io);
 	else
 		kcryptd_crypt_write_convert(io);
+
+	crypt_dec_pending(io);
 }
 
 static void kcryptd_queue_crypt(struct dm_crypt_io *io)
@@ -1233,6 +1444,14 @@ static void kcryptd_queue_crypt(struct dm_crypt_io *io)
 	queue_work(cc->crypt_queue, &io->work);
 }
 
+static void kcryptd_queue_crypt_on(struct dm_crypt_io *io, int cpu)
+{
+	struct crypt_config *cc = io->target->private;
+
+	INIT_WORK(&io->work, kcryptd_crypt);
+	queue_work_on(cpu, cc->crypt_queue, &io->work);
+}
+
 /*
  * Decode key from its hex representation
  */
@@ -1367,6 +1586,9 @@ static void crypt_dtr(struct dm_target *ti)
 	if (!cc)
 		return;
 
+	if (cc->write_thread)
+		kthread_stop(cc->write_thread);
+
 	if (cc->io_queue)
 		destroy_workqueue(cc->io_queue);
 	if (cc->crypt_queue)
@@ -1581,7 +1803,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	const char *opt_string;
 
 	static struct dm_arg _args[] = {
-		{0, 1, "Invalid number of feature args"},
+		{0, 2, "Invalid number of feature args"},
 	};
 
 	if (argc < 5) {
@@ -1629,7 +1851,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
-	cc->bs = bioset_create(MIN_IOS, 0);
+	cc->bs = bioset_create(MIN_IOS, offsetof(struct dm_crypt_clone, bio));
 	if (!cc->bs) {
 		ti->error = "Cannot allocate crypt bioset";
 		goto bad;
@@ -1665,15 +1887,23 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		if (ret)
 			goto bad;
 
-		opt_string = dm_shift_arg(&as);
+		ret = -EINVAL;
+		while (opt_params--) {
+			opt_string = dm_shift_arg(&as);
+			if (!opt_string) {
+				ti->error = "Not enough feature arguments";
+				goto bad;
+			}
 
-		if (opt_params == 1 && opt_string &&
-		    !strcasecmp(opt_string, "allow_discards"))
-			ti->num_discard_requests = 1;
-		else if (opt_params) {
-			ret = -EINVAL;
-			ti->error = "Invalid feature arguments";
-			goto bad;
+			if (!strcasecmp(opt_string, "allow_discards"))
+				ti->num_discard_requests = 1;
+			else if (!strcasecmp(opt_string,
+					     "submit_from_crypt_cpus"))
+				set_bit(DM_CRYPT_NO_OFFLOAD, &cc->flags);
+			else {
+				ti->error = "Invalid feature arguments";
+				goto bad;
+			}
 		}
 	}
 
@@ -1697,6 +1927,18 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	init_waitqueue_head(&cc->write_thread_wait);
+	spin_lock_init(&cc->write_lock);
+	cc->write_tree = RB_ROOT;
+
+	cc->write_thread = kthread_run(dmcrypt_write, cc, "dmcrypt_write");
+	if (IS_ERR(cc->write_thread)) {
+		ret = PTR_ERR(cc->write_thread);
+		cc->write_thread = NULL;
+		ti->error = "Couldn't spawn write thread";
+		goto bad;
+	}
+
 	ti->num_flush_requests = 1;
 	ti->discard_zeroes_data_unsupported = 1;
 
@@ -1726,7 +1968,8 @@ static int crypt_map(struct dm_target *ti, struct bio *bio,
 		return DM_MAPIO_REMAPPED;
 	}
 
-	io = crypt_io_alloc(ti, bio, dm_target_offset(ti, bio->bi_sector));
+	io = crypt_io_alloc(ti, bio, dm_target_offset(ti, bio->bi_sector),
+			    GFP_NOIO);
 
 	if (bio_data_dir(io->base_bio) == READ) {
 		if (kcryptd_io_read(io, GFP_NOWAIT))
@@ -1742,6 +1985,7 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 {
 	struct crypt_config *cc = ti->private;
 	unsigned int sz = 0;
+	unsigned num_feature_args;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
@@ -1766,8 +2010,15 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 		DMEMIT(" %llu %s %llu", (unsigned long long)cc->iv_offset,
 				cc->dev->name, (unsigned long long)cc->start);
 
-		if (ti->num_discard_requests)
-			DMEMIT(" 1 allow_discards");
+		num_feature_args = !!ti->num_discard_requests +
+				   test_bit(DM_CRYPT_NO_OFFLOAD, &cc->flags);
+		if (num_feature_args) {
+			DMEMIT(" %u", num_feature_args);
+			if (ti->num_discard_requests)
+				DMEMIT(" allow_discards");
+			if (test_bit(DM_CRYPT_NO_OFFLOAD, &cc->flags))
+				DMEMIT(" submit_from_crypt_cpus");
+		}
 
 		break;
 	}
@@ -1865,7 +2116,7 @@ static int crypt_iterate_devices(struct dm_target *ti,
 
 static struct target_type crypt_target = {
 	.name   = "crypt",
-	.version = {1, 11, 0},
+	.version = {1, 12, 0},
 	.module = THIS_MODULE,
 	.ctr    = crypt_ctr,
 	.dtr    = crypt_dtr,
@@ -295,7 +295,18 @@ static void do_region(int rw, unsigned region, struct dm_io_region *where,
 	unsigned long len;
 	unsigned offset;
 	unsigned num_bvecs;
+	sector_t discard_sectors;
 	sector_t remaining = where->count;
+	struct request_queue *q = bdev_get_queue(where->bdev);
+
+	/*
+	 * Reject discards the device can't handle rather than letting
+	 * the block layer fail every bio.
+	 */
+	if ((rw & REQ_DISCARD) && !blk_queue_discard(q)) {
+		dec_count(io, region, -EOPNOTSUPP);
+		return;
+	}
 
 	/*
 	 * where->count may be zero if rw holds a flush and we need to
@@ -303,11 +314,16 @@ static void do_region(int rw, unsigned region, struct dm_io_region *where,
 	 */
 	do {
 		/*
-		 * Allocate a suitably sized-bio.
+		 * Allocate a suitably sized-bio.  Discards carry no pages.
 		 */
-		num_bvecs = dm_sector_div_up(remaining,
-					     (PAGE_SIZE >> SECTOR_SHIFT));
-		num_bvecs = min_t(int, bio_get_nr_vecs(where->bdev), num_bvecs);
+		if (rw & REQ_DISCARD)
+			num_bvecs = 1;
+		else {
+			num_bvecs = dm_sector_div_up(remaining,
+						     (PAGE_SIZE >> SECTOR_SHIFT));
+			num_bvecs = min_t(int, bio_get_nr_vecs(where->bdev),
+					  num_bvecs);
+		}
 		bio = bio_alloc_bioset(GFP_NOIO, num_bvecs, io->client->bios);
 		bio->bi_sector = where->sector + (where->count - remaining);
 		bio->bi_bdev = where->bdev;
@@ -315,18 +331,26 @@ static void do_region(int rw, unsigned region, struct dm_io_region *where,
 		bio->bi_destructor = dm_bio_destructor;
 		store_io_and_region_in_bio(bio, io, region);
 
-		/*
-		 * Try and add as many pages as possible.
-		 */
-		while (remaining) {
-			dp->get_page(dp, &page, &len, &offset);
-			len = min(len, to_bytes(remaining));
-			if (!bio_add_page(bio, page, len, offset))
-				break;
-
-			offset = 0;
-			remaining -= to_sector(len);
-			dp->next_page(dp);
+		if (rw & REQ_DISCARD) {
+			discard_sectors = min_t(sector_t,
+						q->limits.max_discard_sectors,
+						remaining);
+			bio->bi_size = to_bytes(discard_sectors);
+			remaining -= discard_sectors;
+		} else {
+			/*
+			 * Try and add as many pages as possible.
+			 */
+			while (remaining) {
+				dp->get_page(dp, &page, &len, &offset);
+				len = min(len, to_bytes(remaining));
+				if (!bio_add_page(bio, page, len, offset))
+					break;
+
+				offset = 0;
+				remaining -= to_sector(len);
+				dp->next_page(dp);
+			}
 		}
 
 		atomic_inc(&io->count);
@@ -349,7 +349,18 @@ static void complete_io(unsigned long error, void *context)
 	struct dm_kcopyd_client *kc = job->kc;
 
 	if (error) {
-		if (job->rw == WRITE)
+		if (job->rw & REQ_DISCARD) {
+			/*
+			 * Zeroing by discard failed, fall back to
+			 * writing out the zero page.
+			 */
+			job->rw = WRITE;
+			push(&kc->io_jobs, job);
+			wake(kc);
+			return;
+		}
+
+		if (job->rw & WRITE)
 			job->write_err |= error;
 		else
 			job->read_err = 1;
@@ -361,7 +372,7 @@ static void complete_io(unsigned long error, void *context)
 		}
 	}
 
-	if (job->rw == WRITE)
+	if (job->rw & WRITE)
 		push(&kc->complete_jobs, job);
 
 	else {
@@ -432,7 +443,7 @@ static int process_jobs(struct list_head *jobs, struct dm_kcopyd_client *kc,
 
 		if (r < 0) {
 			/* error this rogue job */
-			if (job->rw == WRITE)
+			if (job->rw & WRITE)
 				job->write_err = (unsigned long) -1L;
 			else
 				job->read_err = 1;
@@ -580,6 +591,39 @@ static void split_job(struct kcopyd_job *master_job)
 	}
 }
 
+/*
+ * A discard zeroes a region, without any data being written, if the
+ * device promises that discarded sectors read back as zeroes and the
+ * region is aligned to the discard granularity.  Otherwise the device
+ * may keep parts of the region it couldn't discard.
+ */
+static int discard_zeroes_region(struct dm_io_region *region)
+{
+	struct request_queue *q = bdev_get_queue(region->bdev);
+	unsigned granularity;
+	sector_t start, count;
+
+	if (!q || !blk_queue_discard(q) || !queue_discard_zeroes_data(q))
+		return 0;
+
+	granularity = max(q->limits.discard_granularity >> SECTOR_SHIFT, 1U);
+	start = region->sector + get_start_sect(region->bdev);
+	count = region->count;
+
+	return !sector_div(start, granularity) && !sector_div(count, granularity);
+}
+
+static int zero_by_discard(unsigned num_dests, struct dm_io_region *dests)
+{
+	unsigned i;
+
+	for (i = 0; i < num_dests; i++)
+		if (!discard_zeroes_region(dests + i))
+			return 0;
+
+	return 1;
+}
+
 int dm_kcopyd_copy(struct dm_kcopyd_client *kc, struct dm_io_region *from,
 		   unsigned int num_dests, struct dm_io_region *dests,
 		   unsigned int flags, dm_kcopyd_notify_fn fn, void *context)
@@ -612,13 +656,20 @@ int dm_kcopyd_copy(struct dm_kcopyd_client *kc, struct dm_io_region *from,
 		job->source.count = job->dests[0].count;
 		job->pages = &zero_page_list;
 		job->rw = WRITE;
+
+		if (zero_by_discard(num_dests, job->dests))
+			job->rw |= REQ_DISCARD;
 	}
 
 	job->fn = fn;
 	job->context = context;
 	job->master_job = job;
 
-	if (job->source.count <= SUB_JOB_SIZE)
+	/*
+	 * A discard moves no data, so there's nothing to gain from
+	 * splitting it up.
+	 */
+	if (job->source.count <= SUB_JOB_SIZE || (job->rw & REQ_DISCARD))
 		dispatch_job(job);
 	else {
 		mutex_init(&job->lock);
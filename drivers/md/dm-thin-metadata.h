@@ -124,6 +124,12 @@ int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 
 int dm_thin_remove_block(struct dm_thin_device *td, dm_block_t block);
 
+/*
+ * Queries whether any mappings have been inserted or removed since the
+ * last commit.  Blocks allocated but not yet mapped don't count.
+ */
+bool dm_pool_changed_this_transaction(struct dm_pool_metadata *pmd);
+
 /*
  * Queries.
  */
@@ -5,6 +5,7 @@
  */
 
 #include "dm-thin-metadata.h"
+#include "dm-bio-prison.h"
 
 #include <linux/device-mapper.h>
 #include <linux/dm-io.h>
@@ -20,7 +21,6 @@
  * Tunable constants
  */
 #define ENDIO_HOOK_POOL_SIZE 10240
-#define DEFERRED_SET_SIZE 64
 #define MAPPING_POOL_SIZE 1024
 #define PRISON_CELLS 1024
 
@@ -106,242 +106,6 @@
 
 /*----------------------------------------------------------------*/
 
-/*
- * Sometimes we can't deal with a bio straight away.  We put them in prison
- * where they can't cause any mischief.  Bios are put in a cell identified
- * by a key, multiple bios can be in the same cell.  When the cell is
- * subsequently unlocked the bios become available.
- */
-struct bio_prison;
-
-struct cell_key {
-	int virtual;
-	dm_thin_id dev;
-	dm_block_t block;
-};
-
-struct cell {
-	struct hlist_node list;
-	struct bio_prison *prison;
-	struct cell_key key;
-	unsigned count;
-	struct bio_list bios;
-};
-
-struct bio_prison {
-	spinlock_t lock;
-	mempool_t *cell_pool;
-
-	unsigned nr_buckets;
-	unsigned hash_mask;
-	struct hlist_head *cells;
-};
-
-static uint32_t calc_nr_buckets(unsigned nr_cells)
-{
-	uint32_t n = 128;
-
-	nr_cells /= 4;
-	nr_cells = min(nr_cells, 8192u);
-
-	while (n < nr_cells)
-		n <<= 1;
-
-	return n;
-}
-
-/*
- * @nr_cells should be the number of cells you want in use _concurrently_.
- * Don't confuse it with the number of distinct keys.
- */
-static struct bio_prison *prison_create(unsigned nr_cells)
-{
-	unsigned i;
-	uint32_t nr_buckets = calc_nr_buckets(nr_cells);
-	size_t len = sizeof(struct bio_prison) +
-		(sizeof(struct hlist_head) * nr_buckets);
-	struct bio_prison *prison = kmalloc(len, GFP_KERNEL);
-
-	if (!prison)
-		return NULL;
-
-	spin_lock_init(&prison->lock);
-	prison->cell_pool = mempool_create_kmalloc_pool(nr_cells,
-							sizeof(struct cell));
-	if (!prison->cell_pool) {
-		kfree(prison);
-		return NULL;
-	}
-
-	prison->nr_buckets = nr_buckets;
-	prison->hash_mask = nr_buckets - 1;
-	prison->cells = (struct hlist_head *) (prison + 1);
-	for (i = 0; i < nr_buckets; i++)
-		INIT_HLIST_HEAD(prison->cells + i);
-
-	return prison;
-}
-
-static void prison_destroy(struct bio_prison *prison)
-{
-	mempool_destroy(prison->cell_pool);
-	kfree(prison);
-}
-
-static uint32_t hash_key(struct bio_prison *prison, struct cell_key *key)
-{
-	const unsigned long BIG_PRIME = 4294967291UL;
-	uint64_t hash = key->block * BIG_PRIME;
-
-	return (uint32_t) (hash & prison->hash_mask);
-}
-
-static int keys_equal(struct cell_key *lhs, struct cell_key *rhs)
-{
-	       return (lhs->virtual == rhs->virtual) &&
-		       (lhs->dev == rhs->dev) &&
-		       (lhs->block == rhs->block);
-}
-
-static struct cell *__search_bucket(struct hlist_head *bucket,
-				    struct cell_key *key)
-{
-	struct cell *cell;
-	struct hlist_node *tmp;
-
-	hlist_for_each_entry(cell, tmp, bucket, list)
-		if (keys_equal(&cell->key, key))
-			return cell;
-
-	return NULL;
-}
-
-/*
- * This may block if a new cell needs allocating.  You must ensure that
- * cells will be unlocked even if the calling thread is blocked.
- *
- * Returns the number of entries in the cell prior to the new addition
- * or < 0 on failure.
- */
-static int bio_detain(struct bio_prison *prison, struct cell_key *key,
-		      struct bio *inmate, struct cell **ref)
-{
-	int r;
-	unsigned long flags;
-	uint32_t hash = hash_key(prison, key);
-	struct cell *uninitialized_var(cell), *cell2 = NULL;
-
-	BUG_ON(hash > prison->nr_buckets);
-
-	spin_lock_irqsave(&prison->lock, flags);
-	cell = __search_bucket(prison->cells + hash, key);
-
-	if (!cell) {
-		/*
-		 * Allocate a new cell
-		 */
-		spin_unlock_irqrestore(&prison->lock, flags);
-		cell2 = mempool_alloc(prison->cell_pool, GFP_NOIO);
-		spin_lock_irqsave(&prison->lock, flags);
-
-		/*
-		 * We've been unlocked, so we have to double check that
-		 * nobody else has inserted this cell in the meantime.
-		 */
-		cell = __search_bucket(prison->cells + hash, key);
-
-		if (!cell) {
-			cell = cell2;
-			cell2 = NULL;
-
-			cell->prison = prison;
-			memcpy(&cell->key, key, sizeof(cell->key));
-			cell->count = 0;
-			bio_list_init(&cell->bios);
-			hlist_add_head(&cell->list, prison->cells + hash);
-		}
-	}
-
-	r = cell->count++;
-	bio_list_add(&cell->bios, inmate);
-	spin_unlock_irqrestore(&prison->lock, flags);
-
-	if (cell2)
-		mempool_free(cell2, prison->cell_pool);
-
-	*ref = cell;
-
-	return r;
-}
-
-/*
- * @inmates must have been initialised prior to this call
- */
-static void __cell_release(struct cell *cell, struct bio_list *inmates)
-{
-	struct bio_prison *prison = cell->prison;
-
-	hlist_del(&cell->list);
-
-	if (inmates)
-		bio_list_merge(inmates, &cell->bios);
-
-	mempool_free(cell, prison->cell_pool);
-}
-
-static void cell_release(struct cell *cell, struct bio_list *bios)
-{
-	unsigned long flags;
-	struct bio_prison *prison = cell->prison;
-
-	spin_lock_irqsave(&prison->lock, flags);
-	__cell_release(cell, bios);
-	spin_unlock_irqrestore(&prison->lock, flags);
-}
-
-/*
- * There are a couple of places where we put a bio into a cell briefly
- * before taking it out again.  In these situations we know that no other
- * bio may be in the cell.  This function releases the cell, and also does
- * a sanity check.
- */
-static void cell_release_singleton(struct cell *cell, struct bio *bio)
-{
-	struct bio_prison *prison = cell->prison;
-	struct bio_list bios;
-	struct bio *b;
-	unsigned long flags;
-
-	bio_list_init(&bios);
-
-	spin_lock_irqsave(&prison->lock, flags);
-	__cell_release(cell, &bios);
-	spin_unlock_irqrestore(&prison->lock, flags);
-
-	b = bio_list_pop(&bios);
-	BUG_ON(b != bio);
-	BUG_ON(!bio_list_empty(&bios));
-}
-
-static void cell_error(struct cell *cell)
-{
-	struct bio_prison *prison = cell->prison;
-	struct bio_list bios;
-	struct bio *bio;
-	unsigned long flags;
-
-	bio_list_init(&bios);
-
-	spin_lock_irqsave(&prison->lock, flags);
-	__cell_release(cell, &bios);
-	spin_unlock_irqrestore(&prison->lock, flags);
-
-	while ((bio = bio_list_pop(&bios)))
-		bio_io_error(bio);
-}
-
-/*----------------------------------------------------------------*/
-
 /*
  * We use the deferred set to keep track of pending reads to shared blocks.
  * We do this to ensure the new mapping caused by a write isn't performed
@@ -349,106 +113,11 @@ static void cell_error(struct cell *cell)
  * new mapping could free the old block that the read bios are mapped to.
  */
 
-struct deferred_set;
-struct deferred_entry {
-	struct deferred_set *ds;
-	unsigned count;
-	struct list_head work_items;
-};
-
-struct deferred_set {
-	spinlock_t lock;
-	unsigned current_entry;
-	unsigned sweeper;
-	struct deferred_entry entries[DEFERRED_SET_SIZE];
-};
-
-static void ds_init(struct deferred_set *ds)
-{
-	int i;
-
-	spin_lock_init(&ds->lock);
-	ds->current_entry = 0;
-	ds->sweeper = 0;
-	for (i = 0; i < DEFERRED_SET_SIZE; i++) {
-		ds->entries[i].ds = ds;
-		ds->entries[i].count = 0;
-		INIT_LIST_HEAD(&ds->entries[i].work_items);
-	}
-}
-
-static struct deferred_entry *ds_inc(struct deferred_set *ds)
-{
-	unsigned long flags;
-	struct deferred_entry *entry;
-
-	spin_lock_irqsave(&ds->lock, flags);
-	entry = ds->entries + ds->current_entry;
-	entry->count++;
-	spin_unlock_irqrestore(&ds->lock, flags);
-
-	return entry;
-}
-
-static unsigned ds_next(unsigned index)
-{
-	return (index + 1) % DEFERRED_SET_SIZE;
-}
-
-static void __sweep(struct deferred_set *ds, struct list_head *head)
-{
-	while ((ds->sweeper != ds->current_entry) &&
-	       !ds->entries[ds->sweeper].count) {
-		list_splice_init(&ds->entries[ds->sweeper].work_items, head);
-		ds->sweeper = ds_next(ds->sweeper);
-	}
-
-	if ((ds->sweeper == ds->current_entry) && !ds->entries[ds->sweeper].count)
-		list_splice_init(&ds->entries[ds->sweeper].work_items, head);
-}
-
-static void ds_dec(struct deferred_entry *entry, struct list_head *head)
-{
-	unsigned long flags;
-
-	spin_lock_irqsave(&entry->ds->lock, flags);
-	BUG_ON(!entry->count);
-	--entry->count;
-	__sweep(entry->ds, head);
-	spin_unlock_irqrestore(&entry->ds->lock, flags);
-}
-
-/*
- * Returns 1 if deferred or 0 if no pending items to delay job.
- */
-static int ds_add_work(struct deferred_set *ds, struct list_head *work)
-{
-	int r = 1;
-	unsigned long flags;
-	unsigned next_entry;
-
-	spin_lock_irqsave(&ds->lock, flags);
-	if ((ds->sweeper == ds->current_entry) &&
-	    !ds->entries[ds->current_entry].count)
-		r = 0;
-	else {
-		list_add(work, &ds->entries[ds->current_entry].work_items);
-		next_entry = ds_next(ds->current_entry);
-		if (!ds->entries[next_entry].count)
-			ds->current_entry = next_entry;
-	}
-	spin_unlock_irqrestore(&ds->lock, flags);
-
-	return r;
-}
-
-/*----------------------------------------------------------------*/
-
 /*
  * Key building.
  */
 static void build_data_key(struct dm_thin_device *td,
-			   dm_block_t b, struct cell_key *key)
+			   dm_block_t b, struct dm_cell_key *key)
 {
 	key->virtual = 0;
 	key->dev = dm_thin_dev_id(td);
@@ -456,7 +125,7 @@ static void build_data_key(struct dm_thin_device *td,
 }
 
 static void build_virtual_key(struct dm_thin_device *td, dm_block_t b,
-			      struct cell_key *key)
+			      struct dm_cell_key *key)
 {
 	key->virtual = 1;
 	key->dev = dm_thin_dev_id(td);
@@ -485,10 +154,12 @@ struct pool {
 	dm_block_t low_water_blocks;
 
 	unsigned zero_new_blocks:1;
+	unsigned discard_enabled:1;
+	unsigned discard_passdown:1;
 	unsigned low_water_triggered:1;	/* A dm event has been sent */
 	unsigned no_free_space:1;	/* A -ENOSPC warning has been issued */
 
-	struct bio_prison *prison;
+	struct dm_bio_prison *prison;
 	struct dm_kcopyd_client *copier;
 
 	struct workqueue_struct *wq;
@@ -500,10 +171,12 @@ struct pool {
 	struct bio_list deferred_bios;
 	struct bio_list deferred_flush_bios;
 	struct list_head prepared_mappings;
+	struct list_head prepared_discards;
 
 	struct bio_list retry_on_resume_list;
 
-	struct deferred_set ds;	/* FIXME: move to thin_c */
+	struct dm_deferred_set *ds;	/* FIXME: move to thin_c */
+	struct dm_deferred_set *all_io_ds;
 
 	struct new_mapping *next_mapping;
 	mempool_t *mapping_pool;
@@ -522,6 +195,8 @@ struct pool_c {
 
 	dm_block_t low_water_blocks;
 	unsigned zero_new_blocks:1;
+	unsigned discard_enabled:1;
+	unsigned discard_passdown:1;
 };
 
 /*
@@ -597,6 +272,17 @@ static struct pool *__pool_table_lookup_metadata_dev(struct block_device *md_dev
 
 /*----------------------------------------------------------------*/
 
+/*
+ * Every bio mapped by a thin device carries one of these in its
+ * map_context, until thin_endio() frees it.
+ */
+struct endio_hook {
+	struct thin_c *tc;
+	struct dm_deferred_entry *shared_read_entry;
+	struct dm_deferred_entry *all_io_entry;
+	struct new_mapping *mapping;	/* waiting for this bio to complete */
+};
+
 static void __requeue_bio_list(struct thin_c *tc, struct bio_list *master)
 {
 	struct bio *bio;
@@ -607,7 +293,9 @@ static void __requeue_bio_list(struct thin_c *tc, struct bio_list *master)
 	bio_list_init(master);
 
 	while ((bio = bio_list_pop(&bios))) {
-		if (dm_get_mapinfo(bio)->ptr == tc)
+		struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+		if (h->tc == tc)
 			bio_endio(bio, DM_ENDIO_REQUEUE);
 		else
 			bio_list_add(master, bio);
@@ -646,6 +334,22 @@ static void remap(struct thin_c *tc, struct bio *bio, dm_block_t block)
 		(bio->bi_sector & pool->offset_mask);
 }
 
+/*
+ * Discards of whole blocks wait on pool->all_io_ds for any io already
+ * issued to the data device, so every bio except a discard must be
+ * counted there before it's issued.
+ */
+static void inc_all_io_entry(struct pool *pool, struct bio *bio)
+{
+	struct endio_hook *h;
+
+	if (bio->bi_rw & REQ_DISCARD)
+		return;
+
+	h = dm_get_mapinfo(bio)->ptr;
+	h->all_io_entry = dm_deferred_entry_inc(pool->all_io_ds);
+}
+
 static void remap_and_issue(struct thin_c *tc, struct bio *bio,
 			    dm_block_t block)
 {
@@ -653,6 +357,7 @@ static void remap_and_issue(struct thin_c *tc, struct bio *bio,
 	unsigned long flags;
 
 	remap(tc, bio, block);
+	inc_all_io_entry(pool, bio);
 
 	/*
 	 * Batch together any FUA/FLUSH bios we find and then issue
@@ -680,21 +385,16 @@ static void wake_worker(struct pool *pool)
 /*
  * Bio endio functions.
  */
-struct endio_hook {
-	struct thin_c *tc;
-	bio_end_io_t *saved_bi_end_io;
-	struct deferred_entry *entry;
-};
-
 struct new_mapping {
 	struct list_head list;
 
 	int prepared;
+	int pass_discard;
 
 	struct thin_c *tc;
 	dm_block_t virt_block;
 	dm_block_t data_block;
-	struct cell *cell;
+	struct dm_bio_prison_cell *cell, *cell2;
 	int err;
 
 	/*
@@ -707,6 +407,13 @@ struct new_mapping {
 	bio_end_io_t *saved_bi_end_io;
 };
 
+static void save_and_set_endio(struct bio *bio, bio_end_io_t **save,
+			       bio_end_io_t *fn)
+{
+	*save = bio->bi_end_io;
+	bio->bi_end_io = fn;
+}
+
 static void __maybe_add_mapping(struct new_mapping *m)
 {
 	struct pool *pool = m->tc->pool;
@@ -734,7 +441,8 @@ static void copy_complete(int read_err, unsigned long write_err, void *context)
 static void overwrite_endio(struct bio *bio, int err)
 {
 	unsigned long flags;
-	struct new_mapping *m = dm_get_mapinfo(bio)->ptr;
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+	struct new_mapping *m = h->mapping;
 	struct pool *pool = m->tc->pool;
 
 	m->err = err;
@@ -745,29 +453,23 @@ static void overwrite_endio(struct bio *bio, int err)
 	spin_unlock_irqrestore(&pool->lock, flags);
 }
 
-static void shared_read_endio(struct bio *bio, int err)
+/*
+ * The discard of a whole block has reached the data device.
+ */
+static void passdown_endio(struct bio *bio, int err)
 {
-	struct list_head mappings;
-	struct new_mapping *m, *tmp;
-	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
 	unsigned long flags;
-	struct pool *pool = h->tc->pool;
-
-	bio->bi_end_io = h->saved_bi_end_io;
-	bio_endio(bio, err);
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+	struct new_mapping *m = h->mapping;
+	struct pool *pool = m->tc->pool;
 
-	INIT_LIST_HEAD(&mappings);
-	ds_dec(h->entry, &mappings);
+	m->err = err;
 
 	spin_lock_irqsave(&pool->lock, flags);
-	list_for_each_entry_safe(m, tmp, &mappings, list) {
-		list_del(&m->list);
-		INIT_LIST_HEAD(&m->list);
-		__maybe_add_mapping(m);
-	}
+	list_add(&m->list, &pool->prepared_discards);
 	spin_unlock_irqrestore(&pool->lock, flags);
 
-	mempool_free(h, pool->endio_hook_pool);
+	wake_worker(pool);
 }
 
 /*----------------------------------------------------------------*/
@@ -783,14 +485,14 @@ static void shared_read_endio(struct bio *bio, int err)
 /*
  * This sends the bios in the cell back to the deferred_bios list.
  */
-static void cell_defer(struct thin_c *tc, struct cell *cell,
+static void cell_defer(struct thin_c *tc, struct dm_bio_prison_cell *cell,
 		       dm_block_t data_block)
 {
 	struct pool *pool = tc->pool;
 	unsigned long flags;
 
 	spin_lock_irqsave(&pool->lock, flags);
-	cell_release(cell, &pool->deferred_bios);
+	dm_cell_release(cell, &pool->deferred_bios);
 	spin_unlock_irqrestore(&tc->pool->lock, flags);
 
 	wake_worker(pool);
@@ -798,26 +500,31 @@ static void cell_defer(struct thin_c *tc, struct cell *cell,
 
 /*
  * Same as cell_defer above, except it omits one particular detainee,
- * a write bio that covers the block and has already been processed.
+ * a bio that has already been dealt with.  The worker is only woken if
+ * other bios were waiting in the cell.
  */
-static void cell_defer_except(struct thin_c *tc, struct cell *cell,
+static void cell_defer_except(struct thin_c *tc, struct dm_bio_prison_cell *cell,
 			      struct bio *exception)
 {
 	struct bio_list bios;
 	struct bio *bio;
 	struct pool *pool = tc->pool;
 	unsigned long flags;
+	int requeued = 0;
 
 	bio_list_init(&bios);
-	cell_release(cell, &bios);
+	dm_cell_release(cell, &bios);
 
 	spin_lock_irqsave(&pool->lock, flags);
 	while ((bio = bio_list_pop(&bios)))
-		if (bio != exception)
+		if (bio != exception) {
 			bio_list_add(&pool->deferred_bios, bio);
+			requeued = 1;
+		}
 	spin_unlock_irqrestore(&pool->lock, flags);
 
-	wake_worker(pool);
+	if (requeued)
+		wake_worker(pool);
 }
 
 static void process_prepared_mapping(struct new_mapping *m)
@@ -831,7 +538,7 @@ static void process_prepared_mapping(struct new_mapping *m)
 		bio->bi_end_io = m->saved_bi_end_io;
 
 	if (m->err) {
-		cell_error(m->cell);
+		dm_cell_error(m->cell);
 		return;
 	}
 
@@ -843,7 +550,7 @@ static void process_prepared_mapping(struct new_mapping *m)
 	r = dm_thin_insert_block(tc->td, m->virt_block, m->data_block);
 	if (r) {
 		DMERR("dm_thin_insert_block() failed");
-		cell_error(m->cell);
+		dm_cell_error(m->cell);
 		return;
 	}
 
@@ -863,7 +570,49 @@ static void process_prepared_mapping(struct new_mapping *m)
 	mempool_free(m, tc->pool->mapping_pool);
 }
 
-static void process_prepared_mappings(struct pool *pool)
+/*
+ * All io to the block has completed, so it can be unmapped.  If the
+ * discard is being passed down, the data block stays mapped, and the
+ * cells held, until the discard has reached the data device; once
+ * unmapped the block may be reallocated and we mustn't discard its
+ * new contents.
+ */
+static void process_prepared_discard(struct new_mapping *m)
+{
+	int r;
+	struct thin_c *tc = m->tc;
+	struct bio *bio = m->bio;
+
+	list_del(&m->list);
+
+	if (m->pass_discard) {
+		struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+		m->pass_discard = 0;
+		h->mapping = m;
+		save_and_set_endio(bio, &m->saved_bi_end_io, passdown_endio);
+		remap_and_issue(tc, bio, m->data_block);
+		return;
+	}
+
+	if (m->saved_bi_end_io)
+		bio->bi_end_io = m->saved_bi_end_io;
+
+	r = dm_thin_remove_block(tc->td, m->virt_block);
+	if (r) {
+		DMERR("dm_thin_remove_block() failed");
+		m->err = r;
+	}
+
+	cell_defer_except(tc, m->cell2, bio);
+	cell_defer_except(tc, m->cell, bio);
+	bio_endio(bio, m->err);
+
+	mempool_free(m, tc->pool->mapping_pool);
+}
+
+static void process_prepared(struct pool *pool, struct list_head *head,
+			     void (*fn)(struct new_mapping *))
 {
 	unsigned long flags;
 	struct list_head maps;
@@ -871,28 +620,25 @@ static void process_prepared_mappings(struct pool *pool)
 
 	INIT_LIST_HEAD(&maps);
 	spin_lock_irqsave(&pool->lock, flags);
-	list_splice_init(&pool->prepared_mappings, &maps);
+	list_splice_init(head, &maps);
 	spin_unlock_irqrestore(&pool->lock, flags);
 
 	list_for_each_entry_safe(m, tmp, &maps, list)
-		process_prepared_mapping(m);
+		fn(m);
 }
 
 /*
  * Deferred bio jobs.
  */
-static int io_overwrites_block(struct pool *pool, struct bio *bio)
+static int io_overlaps_block(struct pool *pool, struct bio *bio)
 {
-	return ((bio_data_dir(bio) == WRITE) &&
-		!(bio->bi_sector & pool->offset_mask)) &&
+	return !(bio->bi_sector & pool->offset_mask) &&
 		(bio->bi_size == (pool->sectors_per_block << SECTOR_SHIFT));
 }
 
-static void save_and_set_endio(struct bio *bio, bio_end_io_t **save,
-			       bio_end_io_t *fn)
+static int io_overwrites_block(struct pool *pool, struct bio *bio)
 {
-	*save = bio->bi_end_io;
-	bio->bi_end_io = fn;
+	return (bio_data_dir(bio) == WRITE) && io_overlaps_block(pool, bio);
 }
 
 static int ensure_next_mapping(struct pool *pool)
@@ -918,7 +664,7 @@ static struct new_mapping *get_next_mapping(struct pool *pool)
 
 static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 			  dm_block_t data_origin, dm_block_t data_dest,
-			  struct cell *cell, struct bio *bio)
+			  struct dm_bio_prison_cell *cell, struct bio *bio)
 {
 	int r;
 	struct pool *pool = tc->pool;
@@ -933,7 +679,7 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 	m->err = 0;
 	m->bio = NULL;
 
-	ds_add_work(&pool->ds, &m->list);
+	dm_deferred_set_add_work(pool->ds, &m->list);
 
 	/*
 	 * IO to pool_dev remaps to the pool target's data_dev.
@@ -942,9 +688,11 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 	 * bio immediately. Otherwise we use kcopyd to clone the data first.
 	 */
 	if (io_overwrites_block(pool, bio)) {
+		struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+		h->mapping = m;
 		m->bio = bio;
 		save_and_set_endio(bio, &m->saved_bi_end_io, overwrite_endio);
-		dm_get_mapinfo(bio)->ptr = m;
 		remap_and_issue(tc, bio, data_dest);
 	} else {
 		struct dm_io_region from, to;
@@ -962,13 +710,13 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 		if (r < 0) {
 			mempool_free(m, pool->mapping_pool);
 			DMERR("dm_kcopyd_copy() failed");
-			cell_error(cell);
+			dm_cell_error(cell);
 		}
 	}
 }
 
 static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
-			  dm_block_t data_block, struct cell *cell,
+			  dm_block_t data_block, struct dm_bio_prison_cell *cell,
 			  struct bio *bio)
 {
 	struct pool *pool = tc->pool;
@@ -992,9 +740,11 @@ static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
 		process_prepared_mapping(m);
 
 	else if (io_overwrites_block(pool, bio)) {
+		struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+		h->mapping = m;
 		m->bio = bio;
 		save_and_set_endio(bio, &m->saved_bi_end_io, overwrite_endio);
-		dm_get_mapinfo(bio)->ptr = m;
 		remap_and_issue(tc, bio, data_block);
 
 	} else {
@@ -1009,7 +759,7 @@ static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
 		if (r < 0) {
 			mempool_free(m, pool->mapping_pool);
 			DMERR("dm_kcopyd_zero() failed");
-			cell_error(cell);
+			dm_cell_error(cell);
 		}
 	}
 }
@@ -1081,8 +831,8 @@ static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
  */
 static void retry_on_resume(struct bio *bio)
 {
-	struct thin_c *tc = dm_get_mapinfo(bio)->ptr;
-	struct pool *pool = tc->pool;
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+	struct pool *pool = h->tc->pool;
 	unsigned long flags;
 
 	spin_lock_irqsave(&pool->lock, flags);
@@ -1090,22 +840,22 @@ static void retry_on_resume(struct bio *bio)
 	spin_unlock_irqrestore(&pool->lock, flags);
 }
 
-static void no_space(struct cell *cell)
+static void no_space(struct dm_bio_prison_cell *cell)
 {
 	struct bio *bio;
 	struct bio_list bios;
 
 	bio_list_init(&bios);
-	cell_release(cell, &bios);
+	dm_cell_release(cell, &bios);
 
 	while ((bio = bio_list_pop(&bios)))
 		retry_on_resume(bio);
 }
 
 static void break_sharing(struct thin_c *tc, struct bio *bio, dm_block_t block,
-			  struct cell_key *key,
+			  struct dm_cell_key *key,
 			  struct dm_thin_lookup_result *lookup_result,
-			  struct cell *cell)
+			  struct dm_bio_prison_cell *cell)
 {
 	int r;
 	dm_block_t data_block;
@@ -1123,7 +873,94 @@ static void break_sharing(struct thin_c *tc, struct bio *bio, dm_block_t block,
 
 	default:
 		DMERR("%s: alloc_data_block() failed, error = %d", __func__, r);
-		cell_error(cell);
+		dm_cell_error(cell);
+		break;
+	}
+}
+
+/*
+ * A discard that covers a whole block unmaps it, once all io already
+ * issued to the block has completed, and is passed down to the data
+ * device unless the block is shared with another thin device.  Discards
+ * of part of a block can't unmap anything, they're just passed down.
+ * dm splits discards on block boundaries for us (ti->split_io and
+ * ti->split_discard_requests), so a bio never spans two blocks.
+ */
+static void process_discard(struct thin_c *tc, struct bio *bio)
+{
+	int r;
+	unsigned long flags;
+	struct pool *pool = tc->pool;
+	struct dm_bio_prison_cell *cell, *cell2;
+	struct dm_cell_key key, key2;
+	dm_block_t block = get_bio_block(tc, bio);
+	struct dm_thin_lookup_result lookup_result;
+	struct new_mapping *m;
+	int pass_discard;
+
+	build_virtual_key(tc->td, block, &key);
+	if (dm_bio_detain(pool->prison, &key, bio, &cell))
+		return;
+
+	r = dm_thin_find_block(tc->td, block, 1, &lookup_result);
+	switch (r) {
+	case 0:
+		/*
+		 * Check nobody is fiddling with this pool block.  This can
+		 * happen if someone's in the process of breaking sharing
+		 * on this block.
+		 */
+		build_data_key(tc->td, lookup_result.block, &key2);
+		if (dm_bio_detain(pool->prison, &key2, bio, &cell2)) {
+			cell_defer_except(tc, cell, bio);
+			break;
+		}
+
+		pass_discard = !lookup_result.shared && pool->discard_passdown;
+
+		if (io_overlaps_block(pool, bio)) {
+			m = get_next_mapping(pool);
+			INIT_LIST_HEAD(&m->list);
+			m->prepared = 0;
+			m->pass_discard = pass_discard;
+			m->tc = tc;
+			m->virt_block = block;
+			m->data_block = lookup_result.block;
+			m->cell = cell;
+			m->cell2 = cell2;
+			m->err = 0;
+			m->bio = bio;
+			m->saved_bi_end_io = NULL;
+
+			if (!dm_deferred_set_add_work(pool->all_io_ds, &m->list)) {
+				spin_lock_irqsave(&pool->lock, flags);
+				list_add(&m->list, &pool->prepared_discards);
+				spin_unlock_irqrestore(&pool->lock, flags);
+				wake_worker(pool);
+			}
+		} else {
+			cell_defer_except(tc, cell2, bio);
+			cell_defer_except(tc, cell, bio);
+
+			if (pass_discard)
+				remap_and_issue(tc, bio, lookup_result.block);
+			else
+				bio_endio(bio, 0);
+		}
+		break;
+
+	case -ENODATA:
+		/*
+		 * It isn't provisioned, just forget it.
+		 */
+		cell_defer_except(tc, cell, bio);
+		bio_endio(bio, 0);
+		break;
+
+	default:
+		DMERR("discard: dm_thin_find_block() failed, error = %d", r);
+		cell_defer_except(tc, cell, bio);
+		bio_io_error(bio);
 		break;
 	}
 }
@@ -1132,36 +969,32 @@ static void process_shared_bio(struct thin_c *tc, struct bio *bio,
 			       dm_block_t block,
 			       struct dm_thin_lookup_result *lookup_result)
 {
-	struct cell *cell;
+	struct dm_bio_prison_cell *cell;
 	struct pool *pool = tc->pool;
-	struct cell_key key;
+	struct dm_cell_key key;
 
 	/*
 	 * If cell is already occupied, then sharing is already in the process
 	 * of being broken so we have nothing further to do here.
 	 */
 	build_data_key(tc->td, lookup_result->block, &key);
-	if (bio_detain(pool->prison, &key, bio, &cell))
+	if (dm_bio_detain(pool->prison, &key, bio, &cell))
 		return;
 
 	if (bio_data_dir(bio) == WRITE)
 		break_sharing(tc, bio, block, &key, lookup_result, cell);
 	else {
-		struct endio_hook *h;
-		h = mempool_alloc(pool->endio_hook_pool, GFP_NOIO);
+		struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
 
-		h->tc = tc;
-		h->entry = ds_inc(&pool->ds);
-		save_and_set_endio(bio, &h->saved_bi_end_io, shared_read_endio);
-		dm_get_mapinfo(bio)->ptr = h;
+		h->shared_read_entry = dm_deferred_entry_inc(pool->ds);
 
-		cell_release_singleton(cell, bio);
+		cell_defer_except(tc, cell, bio);
 		remap_and_issue(tc, bio, lookup_result->block);
 	}
 }
 
 static void provision_block(struct thin_c *tc, struct bio *bio, dm_block_t block,
-			    struct cell *cell)
+			    struct dm_bio_prison_cell *cell)
 {
 	int r;
 	dm_block_t data_block;
@@ -1170,7 +1003,7 @@ static void provision_block(struct thin_c *tc, struct bio *bio, dm_block_t block
 	 * Remap empty bios (flushes) immediately, without provisioning.
 	 */
 	if (!bio->bi_size) {
-		cell_release_singleton(cell, bio);
+		cell_defer_except(tc, cell, bio);
 		remap_and_issue(tc, bio, 0);
 		return;
 	}
@@ -1180,7 +1013,7 @@ static void provision_block(struct thin_c *tc, struct bio *bio, dm_block_t block
 	 */
 	if (bio_data_dir(bio) == READ) {
 		zero_fill_bio(bio);
-		cell_release_singleton(cell, bio);
+		cell_defer_except(tc, cell, bio);
 		bio_endio(bio, 0);
 		return;
 	}
@@ -1197,7 +1030,7 @@ static void provision_block(struct thin_c *tc, struct bio *bio, dm_block_t block
 
 	default:
 		DMERR("%s: alloc_data_block() failed, error = %d", __func__, r);
-		cell_error(cell);
+		dm_cell_error(cell);
 		break;
 	}
 }
@@ -1206,8 +1039,8 @@ static void process_bio(struct thin_c *tc, struct bio *bio)
 {
 	int r;
 	dm_block_t block = get_bio_block(tc, bio);
-	struct cell *cell;
-	struct cell_key key;
+	struct dm_bio_prison_cell *cell;
+	struct dm_cell_key key;
 	struct dm_thin_lookup_result lookup_result;
 
 	/*
@@ -1215,22 +1048,18 @@ static void process_bio(struct thin_c *tc, struct bio *bio)
 	 * being provisioned so we have nothing further to do here.
 	 */
 	build_virtual_key(tc->td, block, &key);
-	if (bio_detain(tc->pool->prison, &key, bio, &cell))
+	if (dm_bio_detain(tc->pool->prison, &key, bio, &cell))
 		return;
 
 	r = dm_thin_find_block(tc->td, block, 1, &lookup_result);
 	switch (r) {
 	case 0:
 		/*
-		 * We can release this cell now.  This thread is the only
-		 * one that puts bios into a cell, and we know there were
-		 * no preceding bios.
-		 */
-		/*
-		 * TODO: this will probably have to change when discard goes
-		 * back in.
+		 * We can release this cell now.  The fast path in
+		 * thin_bio_map() may have queued more bios on it meanwhile,
+		 * so they go back on the deferred list.
 		 */
-		cell_release_singleton(cell, bio);
+		cell_defer_except(tc, cell, bio);
 
 		if (lookup_result.shared)
 			process_shared_bio(tc, bio, block, &lookup_result);
@@ -1264,7 +1093,9 @@ static void process_deferred_bios(struct pool *pool)
 	spin_unlock_irqrestore(&pool->lock, flags);
 
 	while ((bio = bio_list_pop(&bios))) {
-		struct thin_c *tc = dm_get_mapinfo(bio)->ptr;
+		struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+		struct thin_c *tc = h->tc;
+
 		/*
 		 * If we've got no free new_mapping structs, and processing
 		 * this bio might require one, we pause until there are some
@@ -1277,12 +1108,19 @@ static void process_deferred_bios(struct pool *pool)
 
 			break;
 		}
-		process_bio(tc, bio);
+
+		if (bio->bi_rw & REQ_DISCARD)
+			process_discard(tc, bio);
+		else
+			process_bio(tc, bio);
 	}
 
 	/*
 	 * If there are any deferred flush bios, we must commit
-	 * the metadata before issuing them.
+	 * the metadata before issuing them.  Unless no mappings have
+	 * changed since the last commit: blocks that have been allocated
+	 * but not yet mapped needn't survive a crash, so there's no need
+	 * to stall the flushes behind a metadata write for them.
 	 */
 	bio_list_init(&bios);
 	spin_lock_irqsave(&pool->lock, flags);
@@ -1293,13 +1131,15 @@ static void process_deferred_bios(struct pool *pool)
 	if (bio_list_empty(&bios))
 		return;
 
-	r = dm_pool_commit_metadata(pool->pmd);
-	if (r) {
-		DMERR("%s: dm_pool_commit_metadata() failed, error = %d",
-		      __func__, r);
-		while ((bio = bio_list_pop(&bios)))
-			bio_io_error(bio);
-		return;
+	if (dm_pool_changed_this_transaction(pool->pmd)) {
+		r = dm_pool_commit_metadata(pool->pmd);
+		if (r) {
+			DMERR("%s: dm_pool_commit_metadata() failed, error = %d",
+			      __func__, r);
+			while ((bio = bio_list_pop(&bios)))
+				bio_io_error(bio);
+			return;
+		}
 	}
 
 	while ((bio = bio_list_pop(&bios)))
@@ -1310,7 +1150,8 @@ static void do_worker(struct work_struct *ws)
 {
 	struct pool *pool = container_of(ws, struct pool, worker);
 
-	process_prepared_mappings(pool);
+	process_prepared(pool, &pool->prepared_mappings, process_prepared_mapping);
+	process_prepared(pool, &pool->prepared_discards, process_prepared_discard);
 	process_deferred_bios(pool);
 }
 
@@ -1335,6 +1176,49 @@ static void thin_defer_bio(struct thin_c *tc, struct bio *bio)
 	wake_worker(pool);
 }
 
+static struct endio_hook *thin_hook_bio(struct thin_c *tc)
+{
+	struct endio_hook *h = mempool_alloc(tc->pool->endio_hook_pool, GFP_NOIO);
+
+	h->tc = tc;
+	h->shared_read_entry = NULL;
+	h->all_io_entry = NULL;
+	h->mapping = NULL;
+
+	return h;
+}
+
+/*
+ * A discard of a block holds both its cells until the block has been
+ * unmapped, so the fast path has to check them too, or it could send io
+ * to a block that is being discarded.  Returns 1 if the bio has been
+ * detained and will be picked up by the worker, otherwise the bio has
+ * been counted in all_io_ds and can be remapped.
+ */
+static int detain_for_remap(struct thin_c *tc, struct bio *bio,
+			    dm_block_t block, dm_block_t data_block)
+{
+	struct pool *pool = tc->pool;
+	struct dm_bio_prison_cell *cell, *cell2;
+	struct dm_cell_key key;
+
+	build_virtual_key(tc->td, block, &key);
+	if (dm_bio_detain(pool->prison, &key, bio, &cell))
+		return 1;
+
+	build_data_key(tc->td, data_block, &key);
+	if (dm_bio_detain(pool->prison, &key, bio, &cell2)) {
+		cell_defer_except(tc, cell, bio);
+		return 1;
+	}
+
+	inc_all_io_entry(pool, bio);
+	cell_defer_except(tc, cell2, bio);
+	cell_defer_except(tc, cell, bio);
+
+	return 0;
+}
+
 /*
  * Non-blocking function called from the thin target's map function.
  */
@@ -1350,9 +1234,9 @@ static int thin_bio_map(struct dm_target *ti, struct bio *bio,
 	/*
 	 * Save the thin context for easy access from the deferred bio later.
 	 */
-	map_context->ptr = tc;
+	map_context->ptr = thin_hook_bio(tc);
 
-	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+	if (bio->bi_rw & (REQ_DISCARD | REQ_FLUSH | REQ_FUA)) {
 		thin_defer_bio(tc, bio);
 		return DM_MAPIO_SUBMITTED;
 	}
@@ -1381,7 +1265,9 @@ static int thin_bio_map(struct dm_target *ti, struct bio *bio,
 			 */
 			thin_defer_bio(tc, bio);
 			r = DM_MAPIO_SUBMITTED;
-		} else {
+		} else if (detain_for_remap(tc, bio, block, result.block))
+			r = DM_MAPIO_SUBMITTED;
+		else {
 			remap(tc, bio, result.block);
 			r = DM_MAPIO_REMAPPED;
 		}
@@ -1396,6 +1282,14 @@ static int thin_bio_map(struct dm_target *ti, struct bio *bio,
 		thin_defer_bio(tc, bio);
 		r = DM_MAPIO_SUBMITTED;
 		break;
+
+	default:
+		/*
+		 * Error the bio ourselves, so thin_endio() frees the hook.
+		 */
+		bio_io_error(bio);
+		r = DM_MAPIO_SUBMITTED;
+		break;
 	}
 
 	return r;
@@ -1435,6 +1329,8 @@ static int bind_control_target(struct pool *pool, struct dm_target *ti)
 	pool->ti = ti;
 	pool->low_water_blocks = pt->low_water_blocks;
 	pool->zero_new_blocks = pt->zero_new_blocks;
+	pool->discard_enabled = pt->discard_enabled;
+	pool->discard_passdown = pt->discard_passdown;
 
 	return 0;
 }
@@ -1455,7 +1351,7 @@ static void __pool_destroy(struct pool *pool)
 	if (dm_pool_metadata_close(pool->pmd) < 0)
 		DMWARN("%s: dm_pool_metadata_close() failed.", __func__);
 
-	prison_destroy(pool->prison);
+	dm_bio_prison_destroy(pool->prison);
 	dm_kcopyd_client_destroy(pool->copier);
 
 	if (pool->wq)
@@ -1465,6 +1361,8 @@ static void __pool_destroy(struct pool *pool)
 		mempool_free(pool->next_mapping, pool->mapping_pool);
 	mempool_destroy(pool->mapping_pool);
 	mempool_destroy(pool->endio_hook_pool);
+	dm_deferred_set_destroy(pool->all_io_ds);
+	dm_deferred_set_destroy(pool->ds);
 	kfree(pool);
 }
 
@@ -1496,7 +1394,9 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 	pool->offset_mask = block_size - 1;
 	pool->low_water_blocks = 0;
 	pool->zero_new_blocks = 1;
-	pool->prison = prison_create(PRISON_CELLS);
+	pool->discard_enabled = 1;
+	pool->discard_passdown = 1;
+	pool->prison = dm_bio_prison_create(PRISON_CELLS);
 	if (!pool->prison) {
 		*error = "Error creating pool's bio prison";
 		err_p = ERR_PTR(-ENOMEM);
@@ -1527,10 +1427,24 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 	bio_list_init(&pool->deferred_bios);
 	bio_list_init(&pool->deferred_flush_bios);
 	INIT_LIST_HEAD(&pool->prepared_mappings);
+	INIT_LIST_HEAD(&pool->prepared_discards);
 	pool->low_water_triggered = 0;
 	pool->no_free_space = 0;
 	bio_list_init(&pool->retry_on_resume_list);
-	ds_init(&pool->ds);
+
+	pool->ds = dm_deferred_set_create();
+	if (!pool->ds) {
+		*error = "Error creating pool's deferred set";
+		err_p = ERR_PTR(-ENOMEM);
+		goto bad_ds;
+	}
+
+	pool->all_io_ds = dm_deferred_set_create();
+	if (!pool->all_io_ds) {
+		*error = "Error creating pool's all io deferred set";
+		err_p = ERR_PTR(-ENOMEM);
+		goto bad_all_io_ds;
+	}
 
 	pool->next_mapping = NULL;
 	pool->mapping_pool =
@@ -1558,11 +1472,15 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 bad_endio_hook_pool:
 	mempool_destroy(pool->mapping_pool);
 bad_mapping_pool:
+	dm_deferred_set_destroy(pool->all_io_ds);
+bad_all_io_ds:
+	dm_deferred_set_destroy(pool->ds);
+bad_ds:
 	destroy_workqueue(pool->wq);
 bad_wq:
 	dm_kcopyd_client_destroy(pool->copier);
 bad_kcopyd_client:
-	prison_destroy(pool->prison);
+	dm_bio_prison_destroy(pool->prison);
 bad_prison:
 	kfree(pool);
 bad_pool:
@@ -1631,6 +1549,8 @@ static void pool_dtr(struct dm_target *ti)
 
 struct pool_features {
 	unsigned zero_new_blocks:1;
+	unsigned discard_enabled:1;
+	unsigned discard_passdown:1;
 };
 
 static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
@@ -1641,7 +1561,7 @@ static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
 	const char *arg_name;
 
 	static struct dm_arg _args[] = {
-		{0, 1, "Invalid number of pool feature arguments"},
+		{0, 3, "Invalid number of pool feature arguments"},
 	};
 
 	/*
@@ -1661,6 +1581,14 @@ static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
 		if (!strcasecmp(arg_name, "skip_block_zeroing")) {
 			pf->zero_new_blocks = 0;
 			continue;
+
+		} else if (!strcasecmp(arg_name, "ignore_discard")) {
+			pf->discard_enabled = 0;
+			continue;
+
+		} else if (!strcasecmp(arg_name, "no_discard_passdown")) {
+			pf->discard_passdown = 0;
+			continue;
 		}
 
 		ti->error = "Unrecognised pool feature requested";
@@ -1670,6 +1598,30 @@ static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
 	return r;
 }
 
+/*
+ * Returns why discards can't be passed down to the data device, or NULL
+ * if they can (see set_discard_limits()).
+ */
+static const char *discard_passdown_unsupported(struct block_device *data_bdev,
+						unsigned long block_size)
+{
+	struct request_queue *q = bdev_get_queue(data_bdev);
+	unsigned int granularity;
+
+	if (!blk_queue_discard(q))
+		return "Discard unsupported by data device";
+
+	if (q->limits.max_discard_sectors < block_size)
+		return "Data device max discard sectors smaller than a block";
+
+	granularity = q->limits.discard_granularity >> SECTOR_SHIFT;
+	if (granularity && block_size % granularity)
+		return "Data device discard granularity not a factor of "
+		       "block size";
+
+	return NULL;
+}
+
 /*
  * thin-pool <metadata dev> <data dev>
  *	     <data block size (sectors)>
@@ -1678,6 +1630,8 @@ static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
  *
  * Optional feature arguments are:
  *	     skip_block_zeroing: skips the zeroing of newly-provisioned blocks.
+ *	     ignore_discard: disable discard
+ *	     no_discard_passdown: don't pass discards down to the data device
  */
 static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
 {
@@ -1744,12 +1698,25 @@ static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	 */
 	memset(&pf, 0, sizeof(pf));
 	pf.zero_new_blocks = 1;
+	pf.discard_enabled = 1;
+	pf.discard_passdown = 1;
 
 	dm_consume_args(&as, 4);
 	r = parse_pool_features(&as, &pf, ti);
 	if (r)
 		goto out;
 
+	if (pf.discard_enabled && pf.discard_passdown) {
+		const char *reason;
+
+		reason = discard_passdown_unsupported(data_dev->bdev,
+						      block_size);
+		if (reason) {
+			DMWARN("%s: Disabling discard passdown.", reason);
+			pf.discard_passdown = 0;
+		}
+	}
+
 	pt = kzalloc(sizeof(*pt), GFP_KERNEL);
 	if (!pt) {
 		r = -ENOMEM;
@@ -1769,8 +1736,21 @@ static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	pt->data_dev = data_dev;
 	pt->low_water_blocks = low_water_blocks;
 	pt->zero_new_blocks = pf.zero_new_blocks;
+	pt->discard_enabled = pf.discard_enabled;
+	pt->discard_passdown = pf.discard_enabled && pf.discard_passdown;
 	ti->num_flush_requests = 1;
-	ti->num_discard_requests = 0;
+
+	/*
+	 * Discards sent to the pool are just remapped to the data device.
+	 * They need enabling so the thin devices can pass their discards
+	 * down through the pool; the thin devices remove the mappings.
+	 */
+	if (pt->discard_passdown) {
+		ti->num_discard_requests = 1;
+		ti->discards_supported = 1;
+	} else
+		ti->num_discard_requests = 0;
+	ti->discard_zeroes_data_unsupported = 1;
 	ti->private = pt;
 
 	pt->callbacks.congested_fn = pool_is_congested;
@@ -2130,10 +2110,17 @@ static int pool_status(struct dm_target *ti, status_type_t type,
 		       (unsigned long)pool->sectors_per_block,
 		       (unsigned long long)pt->low_water_blocks);
 
-		DMEMIT("%u ", !pool->zero_new_blocks);
+		DMEMIT("%u ", !pool->zero_new_blocks + !pool->discard_enabled +
+		       !pool->discard_passdown);
 
 		if (!pool->zero_new_blocks)
 			DMEMIT("skip_block_zeroing ");
+
+		if (!pool->discard_enabled)
+			DMEMIT("ignore_discard ");
+
+		if (!pool->discard_passdown)
+			DMEMIT("no_discard_passdown ");
 		break;
 	}
 
@@ -2162,6 +2149,18 @@ static int pool_merge(struct dm_target *ti, struct bvec_merge_data *bvm,
 	return min(max_size, q->merge_bvec_fn(q, bvm, biovec));
 }
 
+/*
+ * Discards are passed down to the data device at most a block at a time,
+ * so the limits below only hold if the data device takes a whole block
+ * in one discard and its discard granularity divides the block size.
+ * pool_ctr() checks that before enabling passdown.
+ */
+static void set_discard_limits(struct pool *pool, struct queue_limits *limits)
+{
+	limits->max_discard_sectors = pool->sectors_per_block;
+	limits->discard_granularity = pool->sectors_per_block << SECTOR_SHIFT;
+}
+
 static void pool_io_hints(struct dm_target *ti, struct queue_limits *limits)
 {
 	struct pool_c *pt = ti->private;
@@ -2169,13 +2168,16 @@ static void pool_io_hints(struct dm_target *ti, struct queue_limits *limits)
 
 	blk_limits_io_min(limits, 0);
 	blk_limits_io_opt(limits, pool->sectors_per_block << SECTOR_SHIFT);
+
+	if (pt->discard_passdown)
+		set_discard_limits(pool, limits);
 }
 
 static struct target_type pool_target = {
 	.name = "thin-pool",
 	.features = DM_TARGET_SINGLETON | DM_TARGET_ALWAYS_WRITEABLE |
 		    DM_TARGET_IMMUTABLE,
-	.version = {1, 0, 0},
+	.version = {1, 1, 0},
 	.module = THIS_MODULE,
 	.ctr = pool_ctr,
 	.dtr = pool_dtr,
@@ -2272,9 +2274,21 @@ static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	}
 
 	ti->split_io = tc->pool->sectors_per_block;
+	ti->split_discard_requests = 1;
 	ti->num_flush_requests = 1;
-	ti->num_discard_requests = 0;
-	ti->discards_supported = 0;
+
+	/*
+	 * Unmapped blocks read back as zeroes, but a discard of part of
+	 * a block is only passed down, so nothing can be promised.
+	 */
+	ti->discard_zeroes_data_unsupported = 1;
+	if (tc->pool->discard_enabled) {
+		ti->discards_supported = 1;
+		ti->num_discard_requests = 1;
+	} else {
+		ti->discards_supported = 0;
+		ti->num_discard_requests = 0;
+	}
 
 	dm_put(pool_md);
 
@@ -2304,6 +2318,45 @@ static int thin_map(struct dm_target *ti, struct bio *bio,
 	return thin_bio_map(ti, bio, map_context);
 }
 
+static int thin_endio(struct dm_target *ti, struct bio *bio, int err,
+		      union map_info *map_context)
+{
+	unsigned long flags;
+	struct endio_hook *h = map_context->ptr;
+	struct list_head work;
+	struct new_mapping *m, *tmp;
+	struct pool *pool = h->tc->pool;
+
+	if (h->shared_read_entry) {
+		INIT_LIST_HEAD(&work);
+		dm_deferred_entry_dec(h->shared_read_entry, &work);
+
+		spin_lock_irqsave(&pool->lock, flags);
+		list_for_each_entry_safe(m, tmp, &work, list) {
+			list_del(&m->list);
+			INIT_LIST_HEAD(&m->list);
+			__maybe_add_mapping(m);
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+
+	if (h->all_io_entry) {
+		INIT_LIST_HEAD(&work);
+		dm_deferred_entry_dec(h->all_io_entry, &work);
+
+		if (!list_empty(&work)) {
+			spin_lock_irqsave(&pool->lock, flags);
+			list_splice(&work, &pool->prepared_discards);
+			spin_unlock_irqrestore(&pool->lock, flags);
+			wake_worker(pool);
+		}
+	}
+
+	mempool_free(h, pool->endio_hook_pool);
+
+	return 0;
+}
+
 static void thin_postsuspend(struct dm_target *ti)
 {
 	if (dm_noflush_suspending(ti))
@@ -2380,15 +2433,19 @@ static void thin_io_hints(struct dm_target *ti, struct queue_limits *limits)
 
 	blk_limits_io_min(limits, 0);
 	blk_limits_io_opt(limits, tc->pool->sectors_per_block << SECTOR_SHIFT);
+
+	if (tc->pool->discard_enabled)
+		set_discard_limits(tc->pool, limits);
 }
 
 static struct target_type thin_target = {
 	.name = "thin",
-	.version = {1, 0, 0},
+	.version = {1, 1, 0},
 	.module	= THIS_MODULE,
 	.ctr = thin_ctr,
 	.dtr = thin_dtr,
 	.map = thin_map,
+	.end_io = thin_endio,
 	.postsuspend = thin_postsuspend,
 	.status = thin_status,
 	.iterate_devices = thin_iterate_devices,
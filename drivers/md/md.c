@@ -3821,6 +3821,42 @@ static struct md_sysfs_entry max_corr_read_errors =
 __ATTR(max_read_errors, S_IRUGO|S_IWUSR, max_corrected_read_errors_show,
 	max_corrected_read_errors_store);
 
+static const char *read_policy_names[READ_POLICY_NR] = {
+	[READ_POLICY_DISTANCE]	= "distance",
+	[READ_POLICY_PENDING]	= "pending",
+	[READ_POLICY_ADAPTIVE]	= "adaptive",
+};
+
+static ssize_t
+read_policy_show(struct mddev *mddev, char *page)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < READ_POLICY_NR; i++)
+		len += sprintf(page + len,
+			       i == mddev->read_policy ? "[%s] " : "%s ",
+			       read_policy_names[i]);
+	page[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t
+read_policy_store(struct mddev *mddev, const char *buf, size_t len)
+{
+	int i;
+
+	for (i = 0; i < READ_POLICY_NR; i++)
+		if (cmd_match(buf, read_policy_names[i])) {
+			mddev->read_policy = i;
+			return len;
+		}
+	return -EINVAL;
+}
+
+static struct md_sysfs_entry md_read_policy =
+__ATTR(read_policy, S_IRUGO|S_IWUSR, read_policy_show, read_policy_store);
+
 static ssize_t
 null_show(struct mddev *mddev, char *page)
 {
@@ -4456,6 +4492,7 @@ static struct attribute *md_default_attrs[] = {
 	&md_reshape_position.attr,
 	&md_array_size.attr,
 	&max_corr_read_errors.attr,
+	&md_read_policy.attr,
 	NULL,
 };
 
@@ -383,6 +383,8 @@ struct mddev {
 	} bitmap_info;
 
 	atomic_t 			max_corr_read_errors; /* max read retries */
+	int				read_policy;	/* READ_POLICY_*, used by
+							 * raid1 and raid10 */
 	struct list_head		all_mddevs;
 
 	struct attribute_group		*to_remove;
@@ -413,6 +415,105 @@ static inline void md_sync_acct(struct block_device *bdev, unsigned long nr_sect
         atomic_add(nr_sectors, &bdev->bd_contains->bd_disk->sync_io);
 }
 
+/*
+ * How raid1 and raid10 choose which copy to read from, set through the
+ * read_policy sysfs attribute.  Sequential reads stay on the device that
+ * is already streaming them whatever the policy.
+ */
+enum {
+	READ_POLICY_DISTANCE,	/* closest head position, or an idle device */
+	READ_POLICY_PENDING,	/* fewest requests in flight */
+	READ_POLICY_ADAPTIVE,	/* fewest in flight, favouring non-rotational
+				 * devices; by distance if all of them rotate */
+	READ_POLICY_NR
+};
+
+/*
+ * A request queued to a rotating device is counted as this many queued to
+ * a non-rotational one, as it will usually have to wait for a seek.
+ */
+#define READ_POLICY_ROTATIONAL_WEIGHT	4
+
+/*
+ * The state of a read_balance() scan.  Each usable copy is passed to
+ * read_balance_consider(); read_balance_choice() then gives the best one,
+ * or -1 if none was considered.  Copies are identified by whatever index
+ * the caller uses.
+ */
+struct read_balance {
+	int		policy;
+	int		has_nonrot;
+	int		idle;		/* first copy with nothing pending */
+	int		best_dist_idx;
+	sector_t	best_dist;
+	int		best_load_idx;
+	unsigned int	best_load;
+	sector_t	best_load_dist;
+};
+
+static inline void read_balance_init(struct read_balance *rb,
+				     struct mddev *mddev)
+{
+	rb->policy = ACCESS_ONCE(mddev->read_policy);
+	rb->has_nonrot = 0;
+	rb->idle = -1;
+	rb->best_dist_idx = -1;
+	rb->best_dist = MaxSector;
+	rb->best_load_idx = -1;
+	rb->best_load = UINT_MAX;
+	rb->best_load_dist = MaxSector;
+}
+
+/*
+ * Considers reading from copy @idx on @rdev, @dist sectors away from where
+ * the last request there ended.  Returns 1 if nothing can be better, so
+ * the caller should use @idx without looking further.
+ */
+static inline int read_balance_consider(struct read_balance *rb, int idx,
+					struct md_rdev *rdev, sector_t dist)
+{
+	unsigned int pending = atomic_read(&rdev->nr_pending);
+	unsigned int load = pending;
+
+	if (rb->policy == READ_POLICY_ADAPTIVE) {
+		if (blk_queue_nonrot(bdev_get_queue(rdev->bdev)))
+			rb->has_nonrot = 1;
+		else
+			load = (pending + 1) * READ_POLICY_ROTATIONAL_WEIGHT;
+	}
+
+	if (!pending && rb->idle < 0)
+		rb->idle = idx;
+	if (dist < rb->best_dist) {
+		rb->best_dist = dist;
+		rb->best_dist_idx = idx;
+	}
+	if (load < rb->best_load ||
+	    (load == rb->best_load && dist < rb->best_load_dist)) {
+		rb->best_load = load;
+		rb->best_load_dist = dist;
+		rb->best_load_idx = idx;
+	}
+
+	return rb->policy != READ_POLICY_DISTANCE && load == 0;
+}
+
+static inline int read_balance_choice(struct read_balance *rb)
+{
+	switch (rb->policy) {
+	case READ_POLICY_PENDING:
+		return rb->best_load_idx;
+	case READ_POLICY_ADAPTIVE:
+		if (rb->has_nonrot)
+			return rb->best_load_idx;
+		if (rb->idle >= 0)
+			return rb->idle;
+		/* fall through */
+	default:
+		return rb->best_dist_idx;
+	}
+}
+
 struct md_personality
 {
 	char *name;
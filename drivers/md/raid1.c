@@ -460,12 +460,13 @@ static void raid1_end_write_request(struct bio *bio, int error)
 
 /*
  * This routine returns the disk from which the requested read should
- * be done. There is a per-array 'next expected sequential IO' sector
- * number - if this matches on the next IO then we use the last disk.
+ * be done. There is a per-disk 'next expected sequential IO' sector
+ * number - if this matches on the next IO then we use that disk again.
  * There is also a per-disk 'last know head position' sector that is
  * maintained from IRQ contexts, both the normal and the resync IO
  * completion handlers update this position correctly. If there is no
- * perfect sequential match then we pick the disk whose head is closest.
+ * sequential match then the array's read_policy decides, see
+ * read_balance_choice().
  *
  * If there are 2 mirrors in the same 2 devices, performance degrades
  * because position is mirror, not device based.
@@ -480,7 +481,7 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
 	int start_disk;
 	int best_disk;
 	int i;
-	sector_t best_dist;
+	struct read_balance rb;
 	struct md_rdev *rdev;
 	int choose_first;
 
@@ -493,7 +494,7 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
  retry:
 	sectors = r1_bio->sectors;
 	best_disk = -1;
-	best_dist = MaxSector;
+	read_balance_init(&rb, conf->mddev);
 	best_good_sectors = 0;
 
 	if (conf->mddev->recovery_cp < MaxSector &&
@@ -534,7 +535,7 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
 		 */
 		if (is_badblock(rdev, this_sector, sectors,
 				&first_bad, &bad_sectors)) {
-			if (best_dist < MaxSector)
+			if (rb.best_dist < MaxSector)
 				/* already have a better device */
 				continue;
 			if (first_bad <= this_sector) {
@@ -564,18 +565,18 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
 		dist = abs(this_sector - conf->mirrors[disk].head_position);
 		if (choose_first
 		    /* Don't change to another disk for sequential reads */
-		    || conf->next_seq_sect == this_sector
+		    || conf->mirrors[disk].next_seq_sect == this_sector
 		    || dist == 0
 		    /* If device is idle, use it */
-		    || atomic_read(&rdev->nr_pending) == 0) {
+		    || (rb.policy == READ_POLICY_DISTANCE &&
+			atomic_read(&rdev->nr_pending) == 0)
+		    || read_balance_consider(&rb, disk, rdev, dist)) {
 			best_disk = disk;
 			break;
 		}
-		if (dist < best_dist) {
-			best_dist = dist;
-			best_disk = disk;
-		}
 	}
+	if (i == conf->raid_disks && read_balance_choice(&rb) >= 0)
+		best_disk = read_balance_choice(&rb);
 
 	if (best_disk >= 0) {
 		rdev = rcu_dereference(conf->mirrors[best_disk].rdev);
@@ -590,7 +591,7 @@ static int read_balance(struct r1conf *conf, struct r1bio *r1_bio, int *max_sect
 			goto retry;
 		}
 		sectors = best_good_sectors;
-		conf->next_seq_sect = this_sector + sectors;
+		conf->mirrors[best_disk].next_seq_sect = this_sector + sectors;
 		conf->last_used = best_disk;
 	}
 	rcu_read_unlock();
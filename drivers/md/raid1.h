@@ -4,6 +4,7 @@
 struct mirror_info {
 	struct md_rdev	*rdev;
 	sector_t	head_position;
+	sector_t	next_seq_sect;	/* where the last read we sent ended */
 };
 
 /*
@@ -26,10 +27,10 @@ struct r1conf {
 
 	/* When choose the best device for a read (read_balance())
 	 * we try to keep sequential reads one the same device
-	 * using 'last_used' and 'next_seq_sect'
+	 * using 'next_seq_sect' in each mirror, and start looking
+	 * at 'last_used'
 	 */
 	int			last_used;
-	sector_t		next_seq_sect;
 	/* During resync, read_balancing is only allowed on the part
 	 * of the array that has been resynced.  'next_resync' tells us
 	 * where that is.
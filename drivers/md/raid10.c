@@ -550,7 +550,9 @@ static int raid10_mergeable_bvec(struct request_queue *q,
  * There is also a per-disk 'last know head position' sector that is
  * maintained from IRQ contexts, both the normal and the resync IO
  * completion handlers update this position correctly. If there is no
- * perfect sequential match then we pick the disk whose head is closest.
+ * perfect sequential match then the array's read_policy decides, see
+ * read_balance_choice().  The 'distance' policy keeps to the lowest
+ * address on 'far' arrays and doesn't look for sequential reads.
  *
  * If there are 2 mirrors in the same 2 devices, performance degrades
  * because position is mirror, not device based.
@@ -568,7 +570,8 @@ static int read_balance(struct r10conf *conf, struct r10bio *r10_bio, int *max_s
 	int disk, slot;
 	int sectors = r10_bio->sectors;
 	int best_good_sectors;
-	sector_t new_distance, best_dist;
+	sector_t new_distance;
+	struct read_balance rb;
 	struct md_rdev *rdev;
 	int do_balance;
 	int best_slot;
@@ -578,7 +581,7 @@ static int read_balance(struct r10conf *conf, struct r10bio *r10_bio, int *max_s
 retry:
 	sectors = r10_bio->sectors;
 	best_slot = -1;
-	best_dist = MaxSector;
+	read_balance_init(&rb, conf->mddev);
 	best_good_sectors = 0;
 	do_balance = 1;
 	/*
@@ -608,7 +611,7 @@ retry:
 		dev_sector = r10_bio->devs[slot].addr;
 		if (is_badblock(rdev, dev_sector, sectors,
 				&first_bad, &bad_sectors)) {
-			if (best_dist < MaxSector)
+			if (rb.best_dist < MaxSector)
 				/* Already have a better slot */
 				continue;
 			if (first_bad <= dev_sector) {
@@ -639,11 +642,16 @@ retry:
 		if (!do_balance)
 			break;
 
+		if (rb.policy != READ_POLICY_DISTANCE &&
+		    conf->mirrors[disk].next_seq_sect == dev_sector)
+			break;
+
 		/* This optimisation is debatable, and completely destroys
 		 * sequential read speed for 'far copies' arrays.  So only
 		 * keep it for 'near' arrays, and review those later.
 		 */
-		if (conf->near_copies > 1 && !atomic_read(&rdev->nr_pending))
+		if (rb.policy == READ_POLICY_DISTANCE &&
+		    conf->near_copies > 1 && !atomic_read(&rdev->nr_pending))
 			break;
 
 		/* for far > 1 always use the lowest address */
@@ -652,13 +660,14 @@ retry:
 		else
 			new_distance = abs(r10_bio->devs[slot].addr -
 					   conf->mirrors[disk].head_position);
-		if (new_distance < best_dist) {
-			best_dist = new_distance;
-			best_slot = slot;
-		}
+		if (read_balance_consider(&rb, slot, rdev, new_distance))
+			break;
 	}
-	if (slot == conf->copies)
+	if (slot == conf->copies) {
 		slot = best_slot;
+		if (read_balance_choice(&rb) >= 0)
+			slot = read_balance_choice(&rb);
+	}
 
 	if (slot >= 0) {
 		disk = r10_bio->devs[slot].devnum;
@@ -674,6 +683,8 @@ retry:
 			goto retry;
 		}
 		r10_bio->read_slot = slot;
+		conf->mirrors[disk].next_seq_sect =
+			r10_bio->devs[slot].addr + best_good_sectors;
 	} else
 		disk = -1;
 	rcu_read_unlock();
@@ -4,6 +4,7 @@
 struct mirror_info {
 	struct md_rdev	*rdev;
 	sector_t	head_position;
+	sector_t	next_seq_sect;	/* where the last read we sent ended */
 	int		recovery_disabled;	/* matches
 						 * mddev->recovery_disabled
 						 * when we shouldn't try
@@ -92,8 +92,12 @@
  * not hashed must be on the inactive_list, and will normally be at
  * the front.  All stripes start life this way.
  *
- * The inactive_list, handle_list and hash bucket lists are all protected by the
- * device_lock.
+ * The handle_list is protected by the device_lock.  The stripe cache is
+ * split into NR_STRIPE_HASH_LOCKS groups by sector, each with its own
+ * hash_lock, inactive_list and share of the hash buckets, so that looking
+ * up or allocating a stripe doesn't need the device_lock.  A stripe always
+ * stays in the group it was created in (sh->hash_lock_index).  When both
+ * are needed, the hash_lock is taken before the device_lock.
  *  - stripes have a reference counter. If count==0, they are on a list.
  *  - If a stripe might need handling, STRIPE_HANDLE is set.
  *  - When refcount reaches zero, then if STRIPE_HANDLE it is put on
@@ -107,9 +111,9 @@
  *
  * The possible transitions are:
  *  activate an unhashed/inactive stripe (get_active_stripe())
- *     lockdev check-hash unlink-stripe cnt++ clean-stripe hash-stripe unlockdev
+ *     lockhash check-hash unlink-stripe cnt++ clean-stripe hash-stripe unlockhash
  *  activate a hashed, possibly active stripe (get_active_stripe())
- *     lockdev check-hash if(!cnt++)unlink-stripe unlockdev
+ *     lockhash check-hash if(!cnt++) { lockdev unlink-stripe unlockdev } unlockhash
  *  attach a request to an active stripe (add_stripe_bh())
  *     lockdev attach-buffer unlockdev
  *  handle a stripe (handle_stripe())
@@ -118,7 +122,8 @@
  *		change-state ..
  *		record io/ops needed clearSTRIPE_ACTIVE schedule io/ops
  *  release an active stripe (release_stripe())
- *     lockdev if (!--cnt) { if  STRIPE_HANDLE, add to handle_list else add to inactive-list } unlockdev
+ *     lockdev if (!--cnt) { if  STRIPE_HANDLE, add to handle_list else add to temp list } unlockdev
+ *     lockhash move temp list to inactive-list unlockhash
  *
  * The refcount counts each thread that have activated the stripe,
  * plus raid5d if it is handling it, plus one for each active request
@@ -198,6 +203,7 @@ struct stripe_head {
 	struct hlist_node	hash;
 	struct list_head	lru;	      /* inactive_list or handle_list */
 	struct r5conf		*raid_conf;
+	int			hash_lock_index;
 	short			generation;	/* increments with every
 						 * reshape */
 	sector_t		sector;		/* sector of this row */
@@ -347,6 +353,19 @@ struct disk_info {
 	struct md_rdev	*rdev;
 };
 
+/*
+ * The stripe cache is split into this many groups, each with its own lock.
+ * Must divide the number of hash buckets.
+ */
+#define NR_STRIPE_HASH_LOCKS 8
+#define STRIPE_HASH_LOCKS_MASK (NR_STRIPE_HASH_LOCKS - 1)
+
+struct r5worker {
+	struct work_struct	work;
+	struct r5conf		*conf;
+	int			working;	/* queued or running */
+};
+
 struct r5conf {
 	struct hlist_head	*stripe_hashtbl;
 	struct mddev		*mddev;
@@ -410,6 +429,8 @@ struct r5conf {
 					      * lists and performing address
 					      * conversions
 					      */
+		unsigned long	stripe_cache_hits;   /* get_active_stripe found */
+		unsigned long	stripe_cache_misses; /* ... had to init one */
 	} __percpu *percpu;
 	size_t			scribble_len; /* size of scribble region must be
 					       * associated with conf to handle
@@ -423,7 +444,8 @@ struct r5conf {
 	 * Free stripes pool
 	 */
 	atomic_t		active_stripes;
-	struct list_head	inactive_list;
+	struct list_head	inactive_list[NR_STRIPE_HASH_LOCKS];
+	spinlock_t		hash_locks[NR_STRIPE_HASH_LOCKS];
 	wait_queue_head_t	wait_for_stripe;
 	wait_queue_head_t	wait_for_overlap;
 	int			inactive_blocked;	/* release of inactive stripes blocked,
@@ -433,6 +455,12 @@ struct r5conf {
 	spinlock_t		device_lock;
 	struct disk_info	*disks;
 
+	/* Optional pool of workers handling stripes alongside raid5d,
+	 * see group_thread_cnt.  Protected by device_lock.
+	 */
+	struct r5worker		*workers;
+	int			worker_cnt;
+
 	/* When taking over an array from a different personality, we store
 	 * the new thread here until we fully activate the array.
 	 */
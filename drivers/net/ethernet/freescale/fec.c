@@ -41,6 +41,7 @@
 #include <linux/io.h>
 #include <linux/irq.h>
 #include <linux/clk.h>
+#include <linux/hrtimer.h>
 #include <linux/platform_device.h>
 #include <linux/phy.h>
 #include <linux/fec.h>
@@ -48,6 +49,8 @@
 #include <linux/of_device.h>
 #include <linux/of_gpio.h>
 #include <linux/of_net.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
 
 #include <asm/cacheflush.h>
 
@@ -74,6 +77,10 @@
 #define FEC_QUIRK_USE_GASKET		(1 << 2)
 /* Controller has GBIT support */
 #define FEC_QUIRK_HAS_GBIT		(1 << 3)
+/* Controller has extend desc buffer */
+#define FEC_QUIRK_HAS_BUFDESC_EX	(1 << 4)
+/* Controller can insert IP and TCP/UDP checksums */
+#define FEC_QUIRK_HAS_CSUM		(1 << 5)
 
 static struct platform_device_id fec_devtype[] = {
 	{
@@ -91,7 +98,8 @@ static struct platform_device_id fec_devtype[] = {
 		.driver_data = FEC_QUIRK_ENET_MAC | FEC_QUIRK_SWAP_FRAME,
 	}, {
 		.name = "imx6q-fec",
-		.driver_data = FEC_QUIRK_ENET_MAC | FEC_QUIRK_HAS_GBIT,
+		.driver_data = FEC_QUIRK_ENET_MAC | FEC_QUIRK_HAS_GBIT |
+				FEC_QUIRK_HAS_BUFDESC_EX | FEC_QUIRK_HAS_CSUM,
 	}, {
 		/* sentinel */
 	}
@@ -118,6 +126,11 @@ static unsigned char macaddr[ETH_ALEN];
 module_param_array(macaddr, byte, NULL, 0);
 MODULE_PARM_DESC(macaddr, "FEC Ethernet MAC address");
 
+static unsigned int rx_copybreak = 256;
+module_param(rx_copybreak, uint, 0644);
+MODULE_PARM_DESC(rx_copybreak,
+	"Copy received frames shorter than this, pass larger ones up in place");
+
 #if defined(CONFIG_M5272)
 /*
  * Some hardware gets it MAC address out of local flash memory.
@@ -150,12 +163,18 @@ MODULE_PARM_DESC(macaddr, "FEC Ethernet MAC address");
 #define RX_RING_SIZE		(FEC_ENET_RX_FRPPG * FEC_ENET_RX_PAGES)
 #define FEC_ENET_TX_FRSIZE	2048
 #define FEC_ENET_TX_FRPPG	(PAGE_SIZE / FEC_ENET_TX_FRSIZE)
-#define TX_RING_SIZE		16	/* Must be power of two */
-#define TX_RING_MOD_MASK	15	/*   for this to work */
+#define TX_RING_SIZE		128	/* Must be power of two */
+#define TX_RING_MOD_MASK	127	/*   for this to work */
 
-#if (((RX_RING_SIZE + TX_RING_SIZE) * 8) > PAGE_SIZE)
-#error "FEC: descriptor ring size constants too large"
-#endif
+/*
+ * Longest descriptor chain a single frame may occupy.  The queue is
+ * stopped while fewer descriptors than this are free, so a frame that
+ * passes the check in fec_enet_start_xmit() always fits.
+ */
+#define FEC_TX_MAX_DESCS	(TX_RING_SIZE / 2)
+
+/* Per-descriptor slot for the headers of a software TSO segment */
+#define FEC_TSO_HDR_SIZE	256
 
 /* Interrupt events/masks. */
 #define FEC_ENET_HBERR	((uint)0x80000000)	/* Heartbeat error */
@@ -170,6 +189,13 @@ MODULE_PARM_DESC(macaddr, "FEC Ethernet MAC address");
 #define FEC_ENET_EBERR	((uint)0x00400000)	/* SDMA bus error */
 
 #define FEC_DEFAULT_IMASK (FEC_ENET_TXF | FEC_ENET_RXF | FEC_ENET_MII)
+/* Mask used while NAPI owns the rings: only MII completions interrupt */
+#define FEC_NAPI_IMASK	(FEC_DEFAULT_IMASK & ~(FEC_ENET_TXF | FEC_ENET_RXF))
+
+/* Frames handed up per NAPI poll */
+#define FEC_NAPI_WEIGHT		64
+/* Upper bound for the software interrupt holdoff (ethtool -C rx-usecs) */
+#define FEC_MAX_HOLDOFF_USECS	10000
 
 /* The FEC stores dest/src/type, data, and checksum for receive packets.
  */
@@ -196,9 +222,9 @@ MODULE_PARM_DESC(macaddr, "FEC Ethernet MAC address");
  * tx_bd_base always point to the base of the buffer descriptors.  The
  * cur_rx and cur_tx point to the currently available buffer.
  * The dirty_tx tracks the current buffer that is being sent by the
- * controller.  The cur_tx and dirty_tx are equal under both completely
- * empty and completely full conditions.  The empty/ready indicator in
- * the buffer descriptor determines the actual condition.
+ * controller.  The cur_tx and dirty_tx are equal when the ring is
+ * empty; one descriptor is always left unused so that a full ring
+ * looks different.
  */
 struct fec_enet_private {
 	/* Hardware registers of the FEC device */
@@ -210,10 +236,13 @@ struct fec_enet_private {
 
 	/* The saved address of a sent-in-place packet/buffer, for skfree(). */
 	unsigned char *tx_bounce[TX_RING_SIZE];
+	/* Indexed by the last descriptor of each frame */
 	struct	sk_buff* tx_skbuff[TX_RING_SIZE];
 	struct	sk_buff* rx_skbuff[RX_RING_SIZE];
-	ushort	skb_cur;
-	ushort	skb_dirty;
+
+	/* Segment headers built for software TSO, one slot per descriptor */
+	void	*tso_hdrs;
+	dma_addr_t tso_hdrs_dma;
 
 	/* CPM dual port RAM relative addresses */
 	dma_addr_t	bd_dma;
@@ -224,13 +253,21 @@ struct fec_enet_private {
 	struct bufdesc	*cur_rx, *cur_tx;
 	/* The ring entries to be free()ed */
 	struct bufdesc	*dirty_tx;
-
-	uint	tx_full;
+	/* Size of one descriptor: struct bufdesc or struct bufdesc_ex */
+	int	bufdesc_size;
+	int	bufdesc_ex;
 	/* hold while accessing the HW like ringbuffer for tx/rx but not MAC */
 	spinlock_t hw_lock;
 
 	struct	platform_device *pdev;
 
+	struct	napi_struct napi;
+	/* Transmitted skbs kept for refilling the receive ring */
+	struct	sk_buff_head rx_recycle;
+	/* Keeps RX/TX interrupts masked for a while after a busy poll */
+	struct	hrtimer holdoff_timer;
+	u32	holdoff_usecs;
+
 	int	opened;
 	int	dev_id;
 
@@ -271,104 +308,392 @@ static void *swap_buffer(void *bufaddr, int len)
 	return bufaddr;
 }
 
-static netdev_tx_t
-fec_enet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
+/*
+ * Ring helpers.  Descriptors are either struct bufdesc or, when the
+ * controller runs with enhanced descriptors, struct bufdesc_ex; walk the
+ * rings in units of fep->bufdesc_size.
+ */
+static inline struct bufdesc *
+fec_enet_next_bd(struct bufdesc *bdp, struct bufdesc *base,
+		 struct fec_enet_private *fep)
+{
+	if (bdp->cbd_sc & BD_SC_WRAP)
+		return base;
+	return (struct bufdesc *)((void *)bdp + fep->bufdesc_size);
+}
+
+static inline struct bufdesc *
+fec_enet_bd(struct bufdesc *base, int index, struct fec_enet_private *fep)
+{
+	return (struct bufdesc *)((void *)base + index * fep->bufdesc_size);
+}
+
+static inline int
+fec_enet_bd_index(struct bufdesc *bdp, struct bufdesc *base,
+		  struct fec_enet_private *fep)
+{
+	return ((void *)bdp - (void *)base) / fep->bufdesc_size;
+}
+
+/* Free transmit descriptors; one is always kept back to tell full from empty */
+static inline int fec_enet_tx_free(struct fec_enet_private *fep)
+{
+	int cur = fec_enet_bd_index(fep->cur_tx, fep->tx_bd_base, fep);
+	int dirty = fec_enet_bd_index(fep->dirty_tx, fep->tx_bd_base, fep);
+
+	return (dirty - cur - 1) & TX_RING_MOD_MASK;
+}
+
+static inline bool
+fec_enet_is_tso_hdr(struct fec_enet_private *fep, dma_addr_t addr)
+{
+	return fep->tso_hdrs && addr >= fep->tso_hdrs_dma &&
+	       addr < fep->tso_hdrs_dma + TX_RING_SIZE * FEC_TSO_HDR_SIZE;
+}
+
+/*
+ * Point a transmit descriptor at @len bytes of @data.  On some FEC
+ * implementations data must be aligned on 4-byte (16-byte on i.MX)
+ * boundaries, and some designs made an incorrect assumption on the
+ * endian mode of the system, so the driver has to swap every frame going
+ * to the controller.  Either way the data goes through the descriptor's
+ * bounce buffer; the skb itself is never modified.
+ */
+static int
+fec_enet_tx_map(struct net_device *ndev, struct bufdesc *bdp,
+		void *data, unsigned int len)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
 	const struct platform_device_id *id_entry =
 				platform_get_device_id(fep->pdev);
+	bool swap = id_entry->driver_data & FEC_QUIRK_SWAP_FRAME;
+	dma_addr_t addr;
+
+	if ((((unsigned long) data) & FEC_ALIGNMENT) || swap) {
+		int index = fec_enet_bd_index(bdp, fep->tx_bd_base, fep);
+
+		memcpy(fep->tx_bounce[index], data, len);
+		data = fep->tx_bounce[index];
+		if (swap)
+			swap_buffer(data, len);
+	}
+
+	addr = dma_map_single(&fep->pdev->dev, data, len, DMA_TO_DEVICE);
+	if (dma_mapping_error(&fep->pdev->dev, addr))
+		return -ENOMEM;
+
+	bdp->cbd_bufaddr = addr;
+	bdp->cbd_datlen = len;
+
+	return 0;
+}
+
+/*
+ * Fill in the control bits of a transmit descriptor.  The first
+ * descriptor of a chain is made ready by the caller once the rest of the
+ * chain has been written, so the controller never sees a partial frame.
+ */
+static void
+fec_enet_tx_set_status(struct fec_enet_private *fep, struct bufdesc *bdp,
+		       unsigned short status, unsigned long estatus,
+		       bool first)
+{
+	status |= bdp->cbd_sc & BD_ENET_TX_WRAP;
+	if (!first)
+		status |= BD_ENET_TX_READY;
+
+	if (fep->bufdesc_ex) {
+		struct bufdesc_ex *ebdp = (struct bufdesc_ex *)bdp;
+
+		ebdp->cbd_esc = estatus;
+		ebdp->cbd_bdu = 0;
+	}
+
+	bdp->cbd_sc = status;
+}
+
+/* Undo a partly built chain, from @first up to (not including) @last */
+static void
+fec_enet_tx_unwind(struct fec_enet_private *fep, struct bufdesc *first,
+		   struct bufdesc *last)
+{
 	struct bufdesc *bdp;
-	void *bufaddr;
-	unsigned short	status;
-	unsigned long flags;
 
-	if (!fep->link) {
-		/* Link is down or autonegotiation is in progress. */
-		return NETDEV_TX_BUSY;
+	for (bdp = first; bdp != last;
+	     bdp = fec_enet_next_bd(bdp, fep->tx_bd_base, fep)) {
+		if (!fec_enet_is_tso_hdr(fep, bdp->cbd_bufaddr))
+			dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
+					bdp->cbd_datlen, DMA_TO_DEVICE);
+		bdp->cbd_bufaddr = 0;
+		bdp->cbd_sc &= BD_ENET_TX_WRAP;
 	}
+}
 
-	spin_lock_irqsave(&fep->hw_lock, flags);
-	/* Fill in a Tx ring entry */
-	bdp = fep->cur_tx;
+/*
+ * The checksum accelerator computes the protocol checksum, pseudo header
+ * included, into a field that must start out as zero.
+ */
+static int fec_enet_clear_csum(struct sk_buff *skb)
+{
+	if (skb->ip_summed != CHECKSUM_PARTIAL)
+		return 0;
+
+	if (unlikely(skb_cow_head(skb, 0)))
+		return -ENOMEM;
 
-	status = bdp->cbd_sc;
+	*(__sum16 *)(skb->head + skb->csum_start + skb->csum_offset) = 0;
 
-	if (status & BD_ENET_TX_READY) {
-		/* Ooops.  All transmit buffers are full.  Bail out.
-		 * This should not happen, since ndev->tbusy should be set.
-		 */
+	return 0;
+}
+
+/*
+ * Queue an ordinary frame: the linear part and every page fragment get a
+ * descriptor of their own.  Called with hw_lock held.
+ */
+static int
+fec_enet_txq_submit_skb(struct sk_buff *skb, struct net_device *ndev)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	int nr_frags = skb_shinfo(skb)->nr_frags;
+	struct bufdesc *bdp, *first;
+	unsigned long estatus = 0;
+	int i;
+
+	if (fec_enet_tx_free(fep) < nr_frags + 1) {
 		printk("%s: tx queue full!.\n", ndev->name);
-		spin_unlock_irqrestore(&fep->hw_lock, flags);
 		return NETDEV_TX_BUSY;
 	}
 
-	/* Clear all of the status flags */
-	status &= ~BD_ENET_TX_STATS;
+	if (fec_enet_clear_csum(skb))
+		goto drop;
+	if (skb->ip_summed == CHECKSUM_PARTIAL)
+		estatus |= BD_ENET_TX_PINS | BD_ENET_TX_IINS;
 
-	/* Set buffer length and buffer pointer */
-	bufaddr = skb->data;
-	bdp->cbd_datlen = skb->len;
+	first = bdp = fep->cur_tx;
+	if (fec_enet_tx_map(ndev, bdp, skb->data, skb_headlen(skb)))
+		goto unwind;
 
-	/*
-	 * On some FEC implementations data must be aligned on
-	 * 4-byte boundaries. Use bounce buffers to copy data
-	 * and get it aligned. Ugh.
-	 */
-	if (((unsigned long) bufaddr) & FEC_ALIGNMENT) {
-		unsigned int index;
-		index = bdp - fep->tx_bd_base;
-		memcpy(fep->tx_bounce[index], skb->data, skb->len);
-		bufaddr = fep->tx_bounce[index];
+	for (i = 0; i < nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+		fec_enet_tx_set_status(fep, bdp, 0, estatus, bdp == first);
+		bdp = fec_enet_next_bd(bdp, fep->tx_bd_base, fep);
+		if (fec_enet_tx_map(ndev, bdp, skb_frag_address(frag),
+				    skb_frag_size(frag)))
+			goto unwind;
 	}
 
-	/*
-	 * Some design made an incorrect assumption on endian mode of
-	 * the system that it's running on. As the result, driver has to
-	 * swap every frame going to and coming from the controller.
+	/* Tell FEC to interrupt when done, that this is the last BD of
+	 * the frame, and to put the CRC on the end.
 	 */
-	if (id_entry->driver_data & FEC_QUIRK_SWAP_FRAME)
-		swap_buffer(bufaddr, skb->len);
-
-	/* Save skb pointer */
-	fep->tx_skbuff[fep->skb_cur] = skb;
+	fec_enet_tx_set_status(fep, bdp,
+			BD_ENET_TX_INTR | BD_ENET_TX_LAST | BD_ENET_TX_TC,
+			estatus | BD_ENET_TX_INT, bdp == first);
 
+	fep->tx_skbuff[fec_enet_bd_index(bdp, fep->tx_bd_base, fep)] = skb;
 	ndev->stats.tx_bytes += skb->len;
-	fep->skb_cur = (fep->skb_cur+1) & TX_RING_MOD_MASK;
+	fep->cur_tx = fec_enet_next_bd(bdp, fep->tx_bd_base, fep);
 
-	/* Push the data cache so the CPM does not get stale memory
-	 * data.
-	 */
-	bdp->cbd_bufaddr = dma_map_single(&fep->pdev->dev, bufaddr,
-			FEC_ENET_TX_FRSIZE, DMA_TO_DEVICE);
+	skb_tx_timestamp(skb);
 
-	/* Send it on its way.  Tell FEC it's ready, interrupt when done,
-	 * it's the last BD of the frame, and to put the CRC on the end.
-	 */
-	status |= (BD_ENET_TX_READY | BD_ENET_TX_INTR
-			| BD_ENET_TX_LAST | BD_ENET_TX_TC);
-	bdp->cbd_sc = status;
+	wmb();
+	first->cbd_sc |= BD_ENET_TX_READY;
 
-	/* Trigger transmission start */
-	writel(0, fep->hwp + FEC_X_DES_ACTIVE);
+	return NETDEV_TX_OK;
 
-	/* If this was the last BD in the ring, start at the beginning again. */
-	if (status & BD_ENET_TX_WRAP)
-		bdp = fep->tx_bd_base;
-	else
-		bdp++;
+unwind:
+	fec_enet_tx_unwind(fep, first, bdp);
+drop:
+	dev_kfree_skb_any(skb);
+	ndev->stats.tx_dropped++;
+	return NETDEV_TX_OK;
+}
 
-	if (bdp == fep->dirty_tx) {
-		fep->tx_full = 1;
-		netif_stop_queue(ndev);
+/* Worst case descriptor count of a TSO frame: header plus data pieces */
+static inline int fec_enet_tso_descs(struct sk_buff *skb)
+{
+	return skb_shinfo(skb)->gso_segs * 2 + skb_shinfo(skb)->nr_frags + 1;
+}
+
+/*
+ * Software TSO.  Every segment is sent as a freshly built header
+ * followed by descriptors pointing straight into the payload of the
+ * original skb; the checksum accelerator fills in the IP and TCP
+ * checksums of each segment.  Called with hw_lock held.
+ */
+static int
+fec_enet_txq_submit_tso(struct sk_buff *skb, struct net_device *ndev)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	int hdr_len = skb_transport_offset(skb) + tcp_hdrlen(skb);
+	int mss = skb_shinfo(skb)->gso_size;
+	int total_len = skb->len - hdr_len;
+	unsigned long estatus = BD_ENET_TX_PINS | BD_ENET_TX_IINS;
+	struct bufdesc *bdp, *first;
+	u16 ip_id = ntohs(ip_hdr(skb)->id);
+	u32 tcp_seq = ntohl(tcp_hdr(skb)->seq);
+	void *data = skb->data + hdr_len;
+	int avail = skb_headlen(skb) - hdr_len;
+	int frag_idx = 0;
+
+	if (fec_enet_tx_free(fep) < fec_enet_tso_descs(skb)) {
+		printk("%s: tx queue full!.\n", ndev->name);
+		return NETDEV_TX_BUSY;
 	}
 
-	fep->cur_tx = bdp;
+	first = bdp = fep->cur_tx;
+
+	while (total_len > 0) {
+		int seg_len = min(mss, total_len);
+		int index = fec_enet_bd_index(bdp, fep->tx_bd_base, fep);
+		void *hdr = fep->tso_hdrs + index * FEC_TSO_HDR_SIZE;
+		struct iphdr *iph;
+		struct tcphdr *th;
+		int left;
+
+		total_len -= seg_len;
+
+		/* Build this segment's headers */
+		memcpy(hdr, skb->data, hdr_len);
+		iph = hdr + skb_network_offset(skb);
+		iph->id = htons(ip_id++);
+		iph->tot_len = htons(hdr_len - skb_network_offset(skb) +
+				     seg_len);
+		iph->check = 0;
+		th = hdr + skb_transport_offset(skb);
+		th->seq = htonl(tcp_seq);
+		th->check = 0;
+		if (bdp != first)
+			th->cwr = 0;
+		if (total_len)
+			th->fin = th->psh = 0;
+		tcp_seq += seg_len;
+
+		bdp->cbd_bufaddr = fep->tso_hdrs_dma + index * FEC_TSO_HDR_SIZE;
+		bdp->cbd_datlen = hdr_len;
+		fec_enet_tx_set_status(fep, bdp, 0, estatus, bdp == first);
+
+		/* ...and point the following descriptors at its payload */
+		for (left = seg_len; left > 0; ) {
+			int size;
+
+			while (!avail) {
+				skb_frag_t *frag =
+					&skb_shinfo(skb)->frags[frag_idx++];
+
+				data = skb_frag_address(frag);
+				avail = skb_frag_size(frag);
+			}
+			size = min(avail, left);
+
+			bdp = fec_enet_next_bd(bdp, fep->tx_bd_base, fep);
+			if (fec_enet_tx_map(ndev, bdp, data, size))
+				goto unwind;
+
+			data += size;
+			avail -= size;
+			left -= size;
+
+			if (left)
+				fec_enet_tx_set_status(fep, bdp, 0, estatus,
+						       false);
+			else
+				fec_enet_tx_set_status(fep, bdp,
+					BD_ENET_TX_LAST | BD_ENET_TX_TC |
+					(total_len ? 0 : BD_ENET_TX_INTR),
+					estatus |
+					(total_len ? 0 : BD_ENET_TX_INT),
+					false);
+		}
+
+		if (total_len)
+			bdp = fec_enet_next_bd(bdp, fep->tx_bd_base, fep);
+	}
+
+	fep->tx_skbuff[fec_enet_bd_index(bdp, fep->tx_bd_base, fep)] = skb;
+	ndev->stats.tx_bytes += skb->len;
+	fep->cur_tx = fec_enet_next_bd(bdp, fep->tx_bd_base, fep);
 
 	skb_tx_timestamp(skb);
 
-	spin_unlock_irqrestore(&fep->hw_lock, flags);
+	wmb();
+	first->cbd_sc |= BD_ENET_TX_READY;
 
 	return NETDEV_TX_OK;
+
+unwind:
+	fec_enet_tx_unwind(fep, first, bdp);
+	dev_kfree_skb_any(skb);
+	ndev->stats.tx_dropped++;
+	return NETDEV_TX_OK;
+}
+
+static netdev_tx_t fec_enet_start_xmit(struct sk_buff *skb,
+				       struct net_device *ndev);
+
+/*
+ * A TSO frame that would not fit in the ring even when it is empty (tiny
+ * MSS, or headers too big for a header slot) is segmented in software
+ * and sent one segment at a time.
+ */
+static netdev_tx_t
+fec_enet_tso_fallback(struct sk_buff *skb, struct net_device *ndev)
+{
+	struct sk_buff *segs, *nskb;
+
+	segs = skb_gso_segment(skb, ndev->features & ~NETIF_F_TSO);
+	if (IS_ERR(segs))
+		goto out;
+
+	do {
+		nskb = segs;
+		segs = segs->next;
+		nskb->next = NULL;
+		if (fec_enet_start_xmit(nskb, ndev) != NETDEV_TX_OK) {
+			dev_kfree_skb(nskb);
+			ndev->stats.tx_dropped++;
+		}
+	} while (segs);
+
+out:
+	dev_kfree_skb(skb);
+	return NETDEV_TX_OK;
+}
+
+static netdev_tx_t
+fec_enet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	unsigned long flags;
+	int ret;
+
+	if (!fep->link) {
+		/* Link is down or autonegotiation is in progress. */
+		return NETDEV_TX_BUSY;
+	}
+
+	if (skb_is_gso(skb) &&
+	    (fec_enet_tso_descs(skb) > FEC_TX_MAX_DESCS ||
+	     skb_transport_offset(skb) + tcp_hdrlen(skb) > FEC_TSO_HDR_SIZE))
+		return fec_enet_tso_fallback(skb, ndev);
+
+	spin_lock_irqsave(&fep->hw_lock, flags);
+
+	if (skb_is_gso(skb))
+		ret = fec_enet_txq_submit_tso(skb, ndev);
+	else
+		ret = fec_enet_txq_submit_skb(skb, ndev);
+
+	/* Trigger transmission start */
+	if (ret == NETDEV_TX_OK)
+		writel(0, fep->hwp + FEC_X_DES_ACTIVE);
+
+	if (fec_enet_tx_free(fep) < FEC_TX_MAX_DESCS)
+		netif_stop_queue(ndev);
+
+	spin_unlock_irqrestore(&fep->hw_lock, flags);
+
+	return ret;
 }
 
 /* This function is called to start or restart the FEC during a link
@@ -381,6 +706,7 @@ fec_restart(struct net_device *ndev, int duplex)
 	struct fec_enet_private *fep = netdev_priv(ndev);
 	const struct platform_device_id *id_entry =
 				platform_get_device_id(fep->pdev);
+	struct bufdesc *bdp;
 	int i;
 	u32 temp_mac[2];
 	u32 rcntl = OPT_FRAME_SIZE | 0x04;
@@ -416,15 +742,21 @@ fec_restart(struct net_device *ndev, int duplex)
 
 	/* Set receive and transmit descriptor base. */
 	writel(fep->bd_dma, fep->hwp + FEC_R_DES_START);
-	writel((unsigned long)fep->bd_dma + sizeof(struct bufdesc) * RX_RING_SIZE,
+	writel((unsigned long)fep->bd_dma + fep->bufdesc_size * RX_RING_SIZE,
 			fep->hwp + FEC_X_DES_START);
 
 	fep->dirty_tx = fep->cur_tx = fep->tx_bd_base;
 	fep->cur_rx = fep->rx_bd_base;
 
-	/* Reset SKB transmit buffers. */
-	fep->skb_cur = fep->skb_dirty = 0;
-	for (i = 0; i <= TX_RING_MOD_MASK; i++) {
+	/* Reset SKB transmit buffers and the descriptors pointing at them. */
+	for (i = 0; i < TX_RING_SIZE; i++) {
+		bdp = fec_enet_bd(fep->tx_bd_base, i, fep);
+		if (bdp->cbd_bufaddr &&
+		    !fec_enet_is_tso_hdr(fep, bdp->cbd_bufaddr))
+			dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
+					bdp->cbd_datlen, DMA_TO_DEVICE);
+		bdp->cbd_bufaddr = 0;
+		bdp->cbd_sc &= BD_ENET_TX_WRAP;
 		if (fep->tx_skbuff[i]) {
 			dev_kfree_skb_any(fep->tx_skbuff[i]);
 			fep->tx_skbuff[i] = NULL;
@@ -454,6 +786,9 @@ fec_restart(struct net_device *ndev, int duplex)
 		/* Enable flow control and length check */
 		rcntl |= 0x40000000 | 0x00000020;
 
+		/* Align the IP header of received frames, see fec_enet_rx() */
+		writel(FEC_RACC_SHIFT16, fep->hwp + FEC_RACC);
+
 		/* RGMII, RMII or MII */
 		if (fep->phy_interface == PHY_INTERFACE_MODE_RGMII)
 			rcntl |= (1 << 6);
@@ -502,6 +837,10 @@ fec_restart(struct net_device *ndev, int duplex)
 		writel(1 << 8, fep->hwp + FEC_X_WMRK);
 	}
 
+	/* Enhanced descriptors (EN1588) */
+	if (fep->bufdesc_ex)
+		ecntl |= (1 << 4);
+
 	/* And last, enable the transmit and receive processing */
 	writel(ecntl, fep->hwp + FEC_ECNTRL);
 	writel(0, fep->hwp + FEC_R_DES_ACTIVE);
@@ -555,20 +894,28 @@ fec_enet_tx(struct net_device *ndev)
 	struct bufdesc *bdp;
 	unsigned short status;
 	struct	sk_buff	*skb;
+	int	index;
 
 	fep = netdev_priv(ndev);
 	spin_lock(&fep->hw_lock);
 	bdp = fep->dirty_tx;
 
-	while (((status = bdp->cbd_sc) & BD_ENET_TX_READY) == 0) {
-		if (bdp == fep->cur_tx && fep->tx_full == 0)
+	while (bdp != fep->cur_tx) {
+		status = bdp->cbd_sc;
+		if (status & BD_ENET_TX_READY)
 			break;
 
-		dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
-				FEC_ENET_TX_FRSIZE, DMA_TO_DEVICE);
+		if (!fec_enet_is_tso_hdr(fep, bdp->cbd_bufaddr))
+			dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
+					bdp->cbd_datlen, DMA_TO_DEVICE);
 		bdp->cbd_bufaddr = 0;
 
-		skb = fep->tx_skbuff[fep->skb_dirty];
+		/* Only the last descriptor of a frame carries its skb */
+		index = fec_enet_bd_index(bdp, fep->tx_bd_base, fep);
+		skb = fep->tx_skbuff[index];
+		if (!skb)
+			goto next;
+
 		/* Check for errors. */
 		if (status & (BD_ENET_TX_HB | BD_ENET_TX_LC |
 				   BD_ENET_TX_RL | BD_ENET_TX_UN |
@@ -588,60 +935,91 @@ fec_enet_tx(struct net_device *ndev)
 			ndev->stats.tx_packets++;
 		}
 
-		if (status & BD_ENET_TX_READY)
-			printk("HEY! Enet xmit interrupt and TX_READY.\n");
-
 		/* Deferred means some collisions occurred during transmit,
 		 * but we eventually sent the packet OK.
 		 */
 		if (status & BD_ENET_TX_DEF)
 			ndev->stats.collisions++;
 
-		/* Free the sk buffer associated with this last transmit */
-		dev_kfree_skb_any(skb);
-		fep->tx_skbuff[fep->skb_dirty] = NULL;
-		fep->skb_dirty = (fep->skb_dirty + 1) & TX_RING_MOD_MASK;
-
-		/* Update pointer to next buffer descriptor to be transmitted */
-		if (status & BD_ENET_TX_WRAP)
-			bdp = fep->tx_bd_base;
-		else
-			bdp++;
-
-		/* Since we have freed up a buffer, the ring is no longer full
+		/* Free the sk buffer associated with this last transmit,
+		 * or keep it to refill the receive ring if it is big enough.
 		 */
-		if (fep->tx_full) {
-			fep->tx_full = 0;
-			if (netif_queue_stopped(ndev))
-				netif_wake_queue(ndev);
-		}
+		if (skb_queue_len(&fep->rx_recycle) < RX_RING_SIZE &&
+		    skb_recycle_check(skb, FEC_ENET_RX_FRSIZE))
+			__skb_queue_head(&fep->rx_recycle, skb);
+		else
+			dev_kfree_skb_any(skb);
+		fep->tx_skbuff[index] = NULL;
+next:
+		/* Update pointer to next buffer descriptor to be transmitted */
+		bdp = fec_enet_next_bd(bdp, fep->tx_bd_base, fep);
 	}
 	fep->dirty_tx = bdp;
+
+	/* Wake the queue once the longest chain fits again */
+	if (netif_queue_stopped(ndev) &&
+	    fec_enet_tx_free(fep) >= FEC_TX_MAX_DESCS)
+		netif_wake_queue(ndev);
+
 	spin_unlock(&fep->hw_lock);
 }
 
 
+/*
+ * Get a buffer for the receive ring, preferably one recycled from the
+ * transmit path.
+ */
+static struct sk_buff *fec_enet_rx_alloc_skb(struct net_device *ndev)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct sk_buff *skb;
+
+	skb = __skb_dequeue(&fep->rx_recycle);
+	if (!skb)
+		skb = netdev_alloc_skb(ndev, FEC_ENET_RX_FRSIZE);
+
+	return skb;
+}
+
 /* During a receive, the cur_rx points to the current incoming buffer.
  * When we update through the ring, if the next incoming buffer has
  * not been given to the system, we just set the empty indicator,
  * effectively tossing the packet.
+ *
+ * Frames of rx_copybreak bytes and more are passed up in the ring buffer
+ * they were received into, and the slot is refilled with a fresh one.
+ * Shorter frames are copied so that their ring buffer can be reused
+ * straight away.  Only ENET-MAC can do without the copy: it is set up to
+ * put two bytes of padding in front of each frame, which aligns the IP
+ * header like NET_IP_ALIGN.  The older FEC can not, so every frame is
+ * copied there.
+ *
+ * Called from NAPI context; at most @budget frames are handed up.  The
+ * ring is walked under hw_lock, but the frames are only passed to GRO
+ * once the lock is dropped, since the stack may transmit on this very
+ * device while processing them.
  */
-static void
-fec_enet_rx(struct net_device *ndev)
+static int
+fec_enet_rx(struct net_device *ndev, int budget)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
 	const struct platform_device_id *id_entry =
 				platform_get_device_id(fep->pdev);
 	struct bufdesc *bdp;
 	unsigned short status;
-	struct	sk_buff	*skb;
+	struct	sk_buff	*skb, *new_skb;
+	struct	sk_buff_head rxq;
 	ushort	pkt_len;
 	__u8 *data;
+	int index;
+	int pkt_received = 0;
 
 #ifdef CONFIG_M532x
 	flush_cache_all();
 #endif
 
+	__skb_queue_head_init(&rxq);
+
 	spin_lock(&fep->hw_lock);
 
 	/* First, grab all of the stats for the incoming packet.
@@ -651,6 +1029,10 @@ fec_enet_rx(struct net_device *ndev)
 
 	while (!((status = bdp->cbd_sc) & BD_ENET_RX_EMPTY)) {
 
+		if (pkt_received >= budget)
+			break;
+		pkt_received++;
+
 		/* Since we have allocated space to hold a complete frame,
 		 * the last indicator should be set.
 		 */
@@ -689,50 +1071,91 @@ fec_enet_rx(struct net_device *ndev)
 		/* Process the incoming frame. */
 		ndev->stats.rx_packets++;
 		pkt_len = bdp->cbd_datlen;
-		ndev->stats.rx_bytes += pkt_len;
-		data = (__u8*)__va(bdp->cbd_bufaddr);
+		index = fec_enet_bd_index(bdp, fep->rx_bd_base, fep);
+		data = fep->rx_skbuff[index]->data;
 
-		dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
-				FEC_ENET_TX_FRSIZE, DMA_FROM_DEVICE);
+		dma_sync_single_for_cpu(&fep->pdev->dev, bdp->cbd_bufaddr,
+				pkt_len, DMA_FROM_DEVICE);
 
 		if (id_entry->driver_data & FEC_QUIRK_SWAP_FRAME)
 			swap_buffer(data, pkt_len);
 
-		/* This does 16 byte alignment, exactly what we need.
-		 * The packet length includes FCS, but we don't want to
+		if (id_entry->driver_data & FEC_QUIRK_ENET_MAC) {
+			/* SHIFT16 padding, counted in cbd_datlen */
+			data += 2;
+			pkt_len -= 2;
+		}
+		ndev->stats.rx_bytes += pkt_len;
+
+		/* The packet length includes FCS, but we don't want to
 		 * include that when passing upstream as it messes up
 		 * bridging applications.
 		 */
-		skb = dev_alloc_skb(pkt_len - 4 + NET_IP_ALIGN);
+		pkt_len -= 4;
+
+		if (pkt_len < rx_copybreak ||
+		    !(id_entry->driver_data & FEC_QUIRK_ENET_MAC)) {
+			skb = netdev_alloc_skb_ip_align(ndev, pkt_len);
+			if (skb) {
+				skb_put(skb, pkt_len);
+				skb_copy_to_linear_data(skb, data, pkt_len);
+			}
+			/* The ring buffer goes back to the FEC as is */
+			dma_sync_single_for_device(&fep->pdev->dev,
+					bdp->cbd_bufaddr, bdp->cbd_datlen,
+					DMA_FROM_DEVICE);
+		} else {
+			new_skb = fec_enet_rx_alloc_skb(ndev);
+			if (new_skb) {
+				skb = fep->rx_skbuff[index];
+				dma_unmap_single(&fep->pdev->dev,
+						bdp->cbd_bufaddr,
+						FEC_ENET_RX_FRSIZE,
+						DMA_FROM_DEVICE);
+				skb_reserve(skb, 2);
+				skb_put(skb, pkt_len);
+
+				fep->rx_skbuff[index] = new_skb;
+				bdp->cbd_bufaddr = dma_map_single(
+						&fep->pdev->dev, new_skb->data,
+						FEC_ENET_RX_FRSIZE,
+						DMA_FROM_DEVICE);
+			} else {
+				skb = NULL;
+				dma_sync_single_for_device(&fep->pdev->dev,
+						bdp->cbd_bufaddr,
+						bdp->cbd_datlen,
+						DMA_FROM_DEVICE);
+			}
+		}
 
 		if (unlikely(!skb)) {
 			printk("%s: Memory squeeze, dropping packet.\n",
 					ndev->name);
 			ndev->stats.rx_dropped++;
 		} else {
-			skb_reserve(skb, NET_IP_ALIGN);
-			skb_put(skb, pkt_len - 4);	/* Make room */
-			skb_copy_to_linear_data(skb, data, pkt_len - 4);
 			skb->protocol = eth_type_trans(skb, ndev);
 			if (!skb_defer_rx_timestamp(skb))
-				netif_rx(skb);
+				__skb_queue_tail(&rxq, skb);
 		}
-
-		bdp->cbd_bufaddr = dma_map_single(&fep->pdev->dev, data,
-				FEC_ENET_TX_FRSIZE, DMA_FROM_DEVICE);
 rx_processing_done:
 		/* Clear the status flags for this buffer */
 		status &= ~BD_ENET_RX_STATS;
 
+		if (fep->bufdesc_ex) {
+			struct bufdesc_ex *ebdp = (struct bufdesc_ex *)bdp;
+
+			ebdp->cbd_esc = BD_ENET_RX_INT;
+			ebdp->cbd_prot = 0;
+			ebdp->cbd_bdu = 0;
+		}
+
 		/* Mark the buffer empty */
 		status |= BD_ENET_RX_EMPTY;
 		bdp->cbd_sc = status;
 
 		/* Update BD pointer to next entry */
-		if (status & BD_ENET_RX_WRAP)
-			bdp = fep->rx_bd_base;
-		else
-			bdp++;
+		bdp = fec_enet_next_bd(bdp, fep->rx_bd_base, fep);
 		/* Doing this here will keep the FEC running while we process
 		 * incoming frames.  On a heavily loaded network, we should be
 		 * able to keep up at the expense of system resources.
@@ -742,6 +1165,55 @@ rx_processing_done:
 	fep->cur_rx = bdp;
 
 	spin_unlock(&fep->hw_lock);
+
+	while ((skb = __skb_dequeue(&rxq)) != NULL)
+		napi_gro_receive(&fep->napi, skb);
+
+	return pkt_received;
+}
+
+/*
+ * NAPI poll: reap TX completions, then receive up to @budget frames.
+ * RX and TX interrupts stay masked until the rings are drained; with an
+ * interrupt holdoff configured they stay masked a little longer, so that
+ * a busy link is serviced by a few polls instead of an interrupt per
+ * frame.
+ */
+static int
+fec_enet_rx_napi(struct napi_struct *napi, int budget)
+{
+	struct net_device *ndev = napi->dev;
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	int pkts;
+
+	fec_enet_tx(ndev);
+	pkts = fec_enet_rx(ndev, budget);
+
+	if (pkts < budget) {
+		napi_complete(napi);
+		if (pkts && fep->holdoff_usecs)
+			hrtimer_start(&fep->holdoff_timer,
+				ns_to_ktime(fep->holdoff_usecs * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+		else
+			writel(FEC_DEFAULT_IMASK, fep->hwp + FEC_IMASK);
+	}
+
+	return pkts;
+}
+
+/*
+ * The holdoff has expired: poll once more.  Interrupts are re-enabled by
+ * that poll if it finds the rings idle.
+ */
+static enum hrtimer_restart fec_enet_holdoff_timer(struct hrtimer *timer)
+{
+	struct fec_enet_private *fep =
+		container_of(timer, struct fec_enet_private, holdoff_timer);
+
+	napi_schedule(&fep->napi);
+
+	return HRTIMER_NORESTART;
 }
 
 static irqreturn_t
@@ -752,29 +1224,33 @@ fec_enet_interrupt(int irq, void *dev_id)
 	uint int_events;
 	irqreturn_t ret = IRQ_NONE;
 
-	do {
-		int_events = readl(fep->hwp + FEC_IEVENT);
-		writel(int_events, fep->hwp + FEC_IEVENT);
-
-		if (int_events & FEC_ENET_RXF) {
-			ret = IRQ_HANDLED;
-			fec_enet_rx(ndev);
-		}
+	/*
+	 * Acknowledge and handle everything pending in one pass.  With NAPI
+	 * running, frames keep arriving while RX/TX are masked, so looping
+	 * until IEVENT reads back empty could keep us here indefinitely;
+	 * anything raised after the read stays latched and re-asserts the
+	 * interrupt if it is unmasked.
+	 */
+	int_events = readl(fep->hwp + FEC_IEVENT);
+	writel(int_events, fep->hwp + FEC_IEVENT);
 
-		/* Transmit OK, or non-fatal error. Update the buffer
-		 * descriptors. FEC handles all errors, we just discover
-		 * them as part of the transmit process.
-		 */
-		if (int_events & FEC_ENET_TXF) {
-			ret = IRQ_HANDLED;
-			fec_enet_tx(ndev);
+	/* Received a frame, or transmit OK or non-fatal error.
+	 * Both rings are serviced from the NAPI poll; FEC handles
+	 * all transmit errors, we just discover them as part of
+	 * reaping the buffer descriptors.
+	 */
+	if (int_events & (FEC_ENET_RXF | FEC_ENET_TXF)) {
+		ret = IRQ_HANDLED;
+		if (napi_schedule_prep(&fep->napi)) {
+			writel(FEC_NAPI_IMASK, fep->hwp + FEC_IMASK);
+			__napi_schedule(&fep->napi);
 		}
+	}
 
-		if (int_events & FEC_ENET_MII) {
-			ret = IRQ_HANDLED;
-			complete(&fep->mdio_done);
-		}
-	} while (int_events);
+	if (int_events & FEC_ENET_MII) {
+		ret = IRQ_HANDLED;
+		complete(&fep->mdio_done);
+	}
 
 	return ret;
 }
@@ -1137,11 +1613,43 @@ static void fec_enet_get_drvinfo(struct net_device *ndev,
 	strcpy(info->bus_info, dev_name(&ndev->dev));
 }
 
+/*
+ * The FEC raises one interrupt for both directions, so coalescing is a
+ * single software holdoff applied after every poll that found work.
+ * rx-usecs sets it; there is no separate transmit holdoff, so tx-usecs
+ * reads as zero and may not be set to anything else.
+ */
+static int fec_enet_get_coalesce(struct net_device *ndev,
+				 struct ethtool_coalesce *ec)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+
+	ec->rx_coalesce_usecs = fep->holdoff_usecs;
+
+	return 0;
+}
+
+static int fec_enet_set_coalesce(struct net_device *ndev,
+				 struct ethtool_coalesce *ec)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+
+	if (ec->rx_coalesce_usecs > FEC_MAX_HOLDOFF_USECS ||
+	    ec->tx_coalesce_usecs)
+		return -EINVAL;
+
+	fep->holdoff_usecs = ec->rx_coalesce_usecs;
+
+	return 0;
+}
+
 static struct ethtool_ops fec_enet_ethtool_ops = {
 	.get_settings		= fec_enet_get_settings,
 	.set_settings		= fec_enet_set_settings,
 	.get_drvinfo		= fec_enet_get_drvinfo,
 	.get_link		= ethtool_op_get_link,
+	.get_coalesce		= fec_enet_get_coalesce,
+	.set_coalesce		= fec_enet_set_coalesce,
 };
 
 static int fec_enet_ioctl(struct net_device *ndev, struct ifreq *rq, int cmd)
@@ -1165,8 +1673,8 @@ static void fec_enet_free_buffers(struct net_device *ndev)
 	struct sk_buff *skb;
 	struct bufdesc	*bdp;
 
-	bdp = fep->rx_bd_base;
 	for (i = 0; i < RX_RING_SIZE; i++) {
+		bdp = fec_enet_bd(fep->rx_bd_base, i, fep);
 		skb = fep->rx_skbuff[i];
 
 		if (bdp->cbd_bufaddr)
@@ -1174,12 +1682,22 @@ static void fec_enet_free_buffers(struct net_device *ndev)
 					FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
 		if (skb)
 			dev_kfree_skb(skb);
-		bdp++;
+		fep->rx_skbuff[i] = NULL;
+		bdp->cbd_bufaddr = 0;
 	}
+	skb_queue_purge(&fep->rx_recycle);
 
-	bdp = fep->tx_bd_base;
-	for (i = 0; i < TX_RING_SIZE; i++)
+	for (i = 0; i < TX_RING_SIZE; i++) {
 		kfree(fep->tx_bounce[i]);
+		fep->tx_bounce[i] = NULL;
+	}
+
+	if (fep->tso_hdrs) {
+		dma_free_coherent(&fep->pdev->dev,
+				TX_RING_SIZE * FEC_TSO_HDR_SIZE,
+				fep->tso_hdrs, fep->tso_hdrs_dma);
+		fep->tso_hdrs = NULL;
+	}
 }
 
 static int fec_enet_alloc_buffers(struct net_device *ndev)
@@ -1189,39 +1707,53 @@ static int fec_enet_alloc_buffers(struct net_device *ndev)
 	struct sk_buff *skb;
 	struct bufdesc	*bdp;
 
-	bdp = fep->rx_bd_base;
 	for (i = 0; i < RX_RING_SIZE; i++) {
-		skb = dev_alloc_skb(FEC_ENET_RX_FRSIZE);
-		if (!skb) {
-			fec_enet_free_buffers(ndev);
-			return -ENOMEM;
-		}
+		bdp = fec_enet_bd(fep->rx_bd_base, i, fep);
+		skb = fec_enet_rx_alloc_skb(ndev);
+		if (!skb)
+			goto err_alloc;
 		fep->rx_skbuff[i] = skb;
 
 		bdp->cbd_bufaddr = dma_map_single(&fep->pdev->dev, skb->data,
 				FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
 		bdp->cbd_sc = BD_ENET_RX_EMPTY;
-		bdp++;
+
+		if (fep->bufdesc_ex) {
+			struct bufdesc_ex *ebdp = (struct bufdesc_ex *)bdp;
+
+			ebdp->cbd_esc = BD_ENET_RX_INT;
+		}
 	}
 
 	/* Set the last buffer to wrap. */
-	bdp--;
 	bdp->cbd_sc |= BD_SC_WRAP;
 
-	bdp = fep->tx_bd_base;
 	for (i = 0; i < TX_RING_SIZE; i++) {
+		bdp = fec_enet_bd(fep->tx_bd_base, i, fep);
 		fep->tx_bounce[i] = kmalloc(FEC_ENET_TX_FRSIZE, GFP_KERNEL);
+		if (!fep->tx_bounce[i])
+			goto err_alloc;
 
 		bdp->cbd_sc = 0;
 		bdp->cbd_bufaddr = 0;
-		bdp++;
 	}
 
 	/* Set the last buffer to wrap. */
-	bdp--;
 	bdp->cbd_sc |= BD_SC_WRAP;
 
+	if (ndev->hw_features & NETIF_F_TSO) {
+		fep->tso_hdrs = dma_alloc_coherent(&fep->pdev->dev,
+				TX_RING_SIZE * FEC_TSO_HDR_SIZE,
+				&fep->tso_hdrs_dma, GFP_KERNEL);
+		if (!fep->tso_hdrs)
+			goto err_alloc;
+	}
+
 	return 0;
+
+err_alloc:
+	fec_enet_free_buffers(ndev);
+	return -ENOMEM;
 }
 
 static int
@@ -1244,6 +1776,7 @@ fec_enet_open(struct net_device *ndev)
 		fec_enet_free_buffers(ndev);
 		return ret;
 	}
+	napi_enable(&fep->napi);
 	phy_start(fep->phy_dev);
 	netif_start_queue(ndev);
 	fep->opened = 1;
@@ -1258,6 +1791,8 @@ fec_enet_close(struct net_device *ndev)
 	/* Don't know what to do yet. */
 	fep->opened = 0;
 	netif_stop_queue(ndev);
+	napi_disable(&fep->napi);
+	hrtimer_cancel(&fep->holdoff_timer);
 	fec_stop(ndev);
 
 	if (fep->phy_dev) {
@@ -1410,13 +1945,24 @@ static const struct net_device_ops fec_netdev_ops = {
 static int fec_enet_init(struct net_device *ndev)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
+	const struct platform_device_id *id_entry =
+				platform_get_device_id(fep->pdev);
 	struct bufdesc *cbd_base;
 	struct bufdesc *bdp;
 	int i;
 
+	if (id_entry->driver_data & FEC_QUIRK_HAS_BUFDESC_EX) {
+		fep->bufdesc_ex = 1;
+		fep->bufdesc_size = sizeof(struct bufdesc_ex);
+	} else {
+		fep->bufdesc_size = sizeof(struct bufdesc);
+	}
+
 	/* Allocate memory for buffer descriptors. */
-	cbd_base = dma_alloc_coherent(NULL, PAGE_SIZE, &fep->bd_dma,
-			GFP_KERNEL);
+	cbd_base = dma_alloc_coherent(NULL,
+			PAGE_ALIGN((RX_RING_SIZE + TX_RING_SIZE) *
+				   fep->bufdesc_size),
+			&fep->bd_dma, GFP_KERNEL);
 	if (!cbd_base) {
 		printk("FEC: allocate descriptor memory failed?\n");
 		return -ENOMEM;
@@ -1431,38 +1977,49 @@ static int fec_enet_init(struct net_device *ndev)
 
 	/* Set receive and transmit descriptor base. */
 	fep->rx_bd_base = cbd_base;
-	fep->tx_bd_base = cbd_base + RX_RING_SIZE;
+	fep->tx_bd_base = fec_enet_bd(cbd_base, RX_RING_SIZE, fep);
 
 	/* The FEC Ethernet specific entries in the device structure */
 	ndev->watchdog_timeo = TX_TIMEOUT;
 	ndev->netdev_ops = &fec_netdev_ops;
 	ndev->ethtool_ops = &fec_enet_ethtool_ops;
 
+	/*
+	 * The checksum accelerator needs the enhanced descriptors to be
+	 * told which frames to work on.  Frames are built from several
+	 * descriptors only when it is there to checksum them.
+	 */
+	if (fep->bufdesc_ex && (id_entry->driver_data & FEC_QUIRK_HAS_CSUM)) {
+		ndev->hw_features = NETIF_F_SG | NETIF_F_IP_CSUM | NETIF_F_TSO;
+		ndev->features |= ndev->hw_features;
+	}
+
+	skb_queue_head_init(&fep->rx_recycle);
+	netif_napi_add(ndev, &fep->napi, fec_enet_rx_napi, FEC_NAPI_WEIGHT);
+	hrtimer_init(&fep->holdoff_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	fep->holdoff_timer.function = fec_enet_holdoff_timer;
+
 	/* Initialize the receive buffer descriptors. */
-	bdp = fep->rx_bd_base;
 	for (i = 0; i < RX_RING_SIZE; i++) {
+		bdp = fec_enet_bd(fep->rx_bd_base, i, fep);
 
 		/* Initialize the BD for every fragment in the page. */
 		bdp->cbd_sc = 0;
-		bdp++;
 	}
 
 	/* Set the last buffer to wrap */
-	bdp--;
 	bdp->cbd_sc |= BD_SC_WRAP;
 
 	/* ...and the same for transmit */
-	bdp = fep->tx_bd_base;
 	for (i = 0; i < TX_RING_SIZE; i++) {
+		bdp = fec_enet_bd(fep->tx_bd_base, i, fep);
 
 		/* Initialize the BD for every fragment in the page. */
 		bdp->cbd_sc = 0;
 		bdp->cbd_bufaddr = 0;
-		bdp++;
 	}
 
 	/* Set the last buffer to wrap */
-	bdp--;
 	bdp->cbd_sc |= BD_SC_WRAP;
 
 	fec_restart(ndev, 0);
@@ -44,6 +44,8 @@
 #define FEC_R_DES_START		0x180 /* Receive descriptor ring */
 #define FEC_X_DES_START		0x184 /* Transmit descriptor ring */
 #define FEC_R_BUFF_SIZE		0x188 /* Maximum receive buff size */
+#define FEC_RACC		0x1c4 /* Receive accelerator function */
+#define FEC_RACC_SHIFT16	(1 << 7) /* Pad rx frames by 2 bytes */
 #define FEC_MIIGSK_CFGR		0x300 /* MIIGSK Configuration reg */
 #define FEC_MIIGSK_ENR		0x308 /* MIIGSK Enable reg */
 
@@ -93,6 +95,19 @@ struct bufdesc {
 };
 #endif
 
+/*
+ *	Enhanced buffer descriptor of the ENET-MAC, used when ECR[EN1588]
+ *	is set.  The legacy descriptor is its first half.
+ */
+struct bufdesc_ex {
+	struct bufdesc desc;
+	unsigned long cbd_esc;		/* Enhanced status/control */
+	unsigned long cbd_prot;		/* Protocol specific info */
+	unsigned long cbd_bdu;		/* Descriptor update done */
+	unsigned long ts;		/* Timestamp */
+	unsigned short res0[4];
+};
+
 /*
  *	The following definitions courtesy of commproc.h, which where
  *	Copyright (c) 1997 Dan Malek (dmalek@jlc.net).
@@ -143,6 +158,15 @@ struct bufdesc {
 #define BD_ENET_TX_CSL          ((ushort)0x0001)
 #define BD_ENET_TX_STATS        ((ushort)0x03ff)        /* All status bits */
 
+/* Enhanced buffer descriptor control/status used by Ethernet receive. */
+#define BD_ENET_RX_INT          0x00800000
+
+/* Enhanced buffer descriptor control/status used by Ethernet transmit. */
+#define BD_ENET_TX_INT          0x40000000
+#define BD_ENET_TX_TS           0x20000000
+#define BD_ENET_TX_PINS         0x10000000	/* Insert protocol checksum */
+#define BD_ENET_TX_IINS         0x08000000	/* Insert IP header checksum */
+
 
 /****************************************************************************/
 #endif /* FEC_H */
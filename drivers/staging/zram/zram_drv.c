@@ -28,10 +28,11 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -42,33 +43,87 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 unsigned int zram_num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static void zram_stat64_add(atomic64_t *v, u64 inc)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	atomic64_add(inc, v);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static void zram_stat64_sub(atomic64_t *v, u64 dec)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	atomic64_sub(dec, v);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_stat64_inc(atomic64_t *v)
 {
-	zram_stat64_add(zram, v, 1);
+	atomic64_inc(v);
+}
+
+static rwlock_t *zram_table_lock(struct zram *zram, u32 index)
+{
+	return &zram->table_lock[index & (ZRAM_TABLE_LOCKS - 1)];
+}
+
+static void zram_lock_read(struct zram *zram, u32 index)
+{
+	rwlock_t *lock = zram_table_lock(zram, index);
+
+	if (unlikely(!read_trylock(lock))) {
+		zram_stat64_inc(&zram->stats.lock_contended);
+		read_lock(lock);
+	}
+}
+
+static void zram_unlock_read(struct zram *zram, u32 index)
+{
+	read_unlock(zram_table_lock(zram, index));
+}
+
+static void zram_lock_write(struct zram *zram, u32 index)
+{
+	rwlock_t *lock = zram_table_lock(zram, index);
+
+	if (unlikely(!write_trylock(lock))) {
+		zram_stat64_inc(&zram->stats.lock_contended);
+		write_lock(lock);
+	}
+}
+
+static void zram_unlock_write(struct zram *zram, u32 index)
+{
+	write_unlock(zram_table_lock(zram, index));
+}
+
+/*
+ * Take the compression stream of the current cpu.  The stream is held
+ * across zs_malloc(), which may sleep and let us migrate, so another
+ * writer can find it busy; it then waits on the stream's mutex.
+ */
+static struct zram_comp_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_comp_stream *zstrm;
+
+	zstrm = per_cpu_ptr(zram->comp, raw_smp_processor_id());
+	if (unlikely(!mutex_trylock(&zstrm->lock))) {
+		zram_stat64_inc(&zram->stats.lock_contended);
+		mutex_lock(&zstrm->lock);
+	}
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram_comp_stream *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
 }
 
 static int zram_test_flag(struct zram *zram, u32 index,
@@ -89,6 +144,237 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
+/*
+ * Writes compress without holding the table lock, so two writes to the
+ * same page would only meet when they publish their result; a partial
+ * write must not read the old page, merge into it and publish while
+ * another write slips in between.  Writers of a page therefore take turns,
+ * marking it ZRAM_BUSY for the whole write.
+ */
+static void zram_slot_claim(struct zram *zram, u32 index)
+{
+	wait_queue_head_t *wq;
+
+	wq = &zram->table_wait[index & (ZRAM_TABLE_LOCKS - 1)];
+	for (;;) {
+		zram_lock_write(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_BUSY)) {
+			zram_set_flag(zram, index, ZRAM_BUSY);
+			zram_unlock_write(zram, index);
+			return;
+		}
+		zram_unlock_write(zram, index);
+
+		zram_stat64_inc(&zram->stats.lock_contended);
+		wait_event(*wq, !zram_test_flag(zram, index, ZRAM_BUSY));
+	}
+}
+
+static void zram_slot_release(struct zram *zram, u32 index)
+{
+	zram_lock_write(zram, index);
+	zram_clear_flag(zram, index, ZRAM_BUSY);
+	zram_unlock_write(zram, index);
+
+	wake_up(&zram->table_wait[index & (ZRAM_TABLE_LOCKS - 1)]);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static struct workqueue_struct *zram_wb_wq;
+
+static u32 zram_now(void)
+{
+	u64 now = get_jiffies_64();
+
+	do_div(now, HZ);
+	return now;
+}
+
+/* Called with the table lock of @index held */
+static void zram_accessed(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = zram_now();
+}
+
+static int zram_alloc_blk(struct zram *zram, unsigned long *blk)
+{
+	int ret = -ENOSPC;
+
+	spin_lock(&zram->bitmap_lock);
+	*blk = find_first_zero_bit(zram->bitmap, zram->nr_blks);
+	if (*blk < zram->nr_blks) {
+		__set_bit(*blk, zram->bitmap);
+		ret = 0;
+	}
+	spin_unlock(&zram->bitmap_lock);
+
+	return ret;
+}
+
+static void zram_free_blk(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bitmap_lock);
+	__clear_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int __zram_bdev_rw(struct zram *zram, int rw, unsigned long blk,
+			  struct page *page)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(wait);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = (sector_t)blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &wait;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&wait);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	if (!ret)
+		zram_stat64_inc(rw == READ ? &zram->stats.bd_reads :
+					     &zram->stats.bd_writes);
+	return ret;
+}
+
+struct zram_bdev_io {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int rw;
+	int ret;
+};
+
+static void zram_bdev_io_fn(struct work_struct *work)
+{
+	struct zram_bdev_io *io = container_of(work, struct zram_bdev_io,
+					       work);
+
+	io->ret = __zram_bdev_rw(io->zram, io->rw, io->blk, io->page);
+}
+
+/*
+ * Synchronous I/O of one page to the backing device.  Bios submitted
+ * from within zram_make_request() are only issued once it returns, so
+ * waiting for one there would never finish; hand the I/O to a worker.
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, unsigned long blk,
+			struct page *page)
+{
+	struct zram_bdev_io io;
+
+	if (!current->bio_list)
+		return __zram_bdev_rw(zram, rw, blk, page);
+
+	io.zram = zram;
+	io.page = page;
+	io.blk = blk;
+	io.rw = rw;
+	INIT_WORK_ONSTACK(&io.work, zram_bdev_io_fn);
+	queue_work(zram_wb_wq, &io.work);
+	flush_work(&io.work);
+	destroy_work_on_stack(&io.work);
+
+	return io.ret;
+}
+
+/* Read a page from the backing device into @mem */
+static int zram_bdev_read(struct zram *zram, unsigned long blk, void *mem)
+{
+	int ret;
+	void *src;
+	struct page *page;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_rw(zram, READ, blk, page);
+	if (!ret) {
+		src = kmap_atomic(page, KM_USER0);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER0);
+	}
+
+	__free_page(page);
+	return ret;
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	kfree(zram->backing_dev);
+	zram->backing_dev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_blks = 0;
+}
+
+static int __init zram_wb_init(void)
+{
+	zram_wb_wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM, 0);
+
+	return zram_wb_wq ? 0 : -ENOMEM;
+}
+
+static void zram_wb_exit(void)
+{
+	destroy_workqueue(zram_wb_wq);
+}
+#else
+static void zram_accessed(struct zram *zram, u32 index)
+{
+}
+
+static void zram_free_blk(struct zram *zram, unsigned long blk)
+{
+}
+
+static int zram_bdev_rw(struct zram *zram, int rw, unsigned long blk,
+			struct page *page)
+{
+	return -EIO;
+}
+
+static int zram_bdev_read(struct zram *zram, unsigned long blk, void *mem)
+{
+	return -EIO;
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+}
+
+static int __init zram_wb_init(void)
+{
+	return 0;
+}
+
+static void zram_wb_exit(void)
+{
+}
+#endif
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -133,14 +419,27 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/* Must be called with the table lock of @index held for writing */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	struct zobj_header *zheader;
 
 	struct page *page = zram->table[index].page;
 	u32 offset = zram->table[index].offset;
 
+	/* Tell a writeback of this page in progress that it is stale */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_blk(zram, zram->table[index].blk);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat64_sub(&zram->stats.bd_count, 1);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].page = NULL;
+		return;
+	}
+
 	if (unlikely(!page)) {
 		/*
 		 * No memory is allocated for zero filled pages.
@@ -161,16 +460,16 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	zheader = zs_map_object(zram->mem_pool, page, offset, ZS_MM_RO);
+	clen = zheader->size;
+	zs_unmap_object(zram->mem_pool, page, offset, zheader);
 
-	xv_free(zram->mem_pool, page, offset);
+	zs_free(zram->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	zram_stat64_sub(&zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
 	zram->table[index].page = NULL;
@@ -210,20 +509,114 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+/*
+ * The table lock can't be held across I/O to the backing device, so once
+ * a ZRAM_WB page has been read check that it is still on @blk: if it was
+ * rewritten or freed meanwhile, writeback may have reused the block for
+ * another page and what was read isn't ours.
+ */
+static int zram_blk_still_valid(struct zram *zram, u32 index,
+				unsigned long blk)
+{
+	int ret;
+
+	zram_lock_read(zram, index);
+	ret = zram_test_flag(zram, index, ZRAM_WB) &&
+	      zram->table[index].blk == blk;
+	zram_unlock_read(zram, index);
+
+	return ret;
+}
+
+static int zram_read_from_bdev(struct zram *zram, unsigned long blk,
+			       struct bio_vec *bvec, int offset,
+			       unsigned char *uncmem)
+{
+	int ret;
+	struct page *page = bvec->bv_page;
+	unsigned char *user_mem;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_bdev_rw(zram, READ, blk, page);
+	} else {
+		ret = zram_bdev_read(zram, blk, uncmem);
+		if (!ret) {
+			user_mem = kmap_atomic(page, KM_USER0);
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
+			kunmap_atomic(user_mem, KM_USER0);
+		}
+	}
+
+	if (!ret)
+		flush_dcache_page(page);
+
+	return ret;
+}
+
+/*
+ * Decompress the object of a compressed page into @mem.  Called with the
+ * table lock of @index held.
+ */
+static int zram_decompress(struct zram *zram, struct zram_comp_stream *zstrm,
+			   u32 index, unsigned char *mem)
+{
+	int ret;
+	unsigned int clen = PAGE_SIZE;
+	struct zobj_header *zheader;
+	struct page *page = zram->table[index].page;
+	u32 offset = zram->table[index].offset;
+
+	zheader = zs_map_object(zram->mem_pool, page, offset, ZS_MM_RO);
+	ret = crypto_comp_decompress(zstrm->tfm, (u8 *)(zheader + 1),
+				     zheader->size, mem, &clen);
+	zs_unmap_object(zram->mem_pool, page, offset, zheader);
+
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EIO;
+
+	return ret;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
-	int ret;
-	size_t clen;
+	int ret = 0;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	struct zram_comp_stream *zstrm;
+	unsigned char *user_mem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
+	if (is_partial_io(bvec)) {
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+again:
+	zstrm = zram_stream_get(zram);
+	zram_lock_read(zram, index);
+	zram_accessed(zram, index);
+
+	/* The lock can't be held across I/O to the backing device */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		unsigned long blk = zram->table[index].blk;
+
+		zram_unlock_read(zram, index);
+		zram_stream_put(zstrm);
+		ret = zram_read_from_bdev(zram, blk, bvec, offset, uncmem);
+		if (!ret && !zram_blk_still_valid(zram, index, blk))
+			goto again;
+		goto out_free;
+	}
+
 	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 		handle_zero_page(bvec);
-		return 0;
+		goto out;
 	}
 
 	/* Requested page is not present in compressed area */
@@ -231,107 +624,111 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
 		handle_zero_page(bvec);
-		return 0;
+		goto out;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
-	}
-
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
+		goto out;
 	}
 
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	ret = zram_decompress(zram, zstrm, index, uncmem);
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
-
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec))
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
 
+	if (likely(!ret))
+		flush_dcache_page(page);
+
+out:
+	zram_unlock_read(zram, index);
+	zram_stream_put(zstrm);
+out_free:
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (unlikely(ret)) {
+		pr_err("Read failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(&zram->stats.failed_reads);
 		return ret;
 	}
 
-	flush_dcache_page(page);
-
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+static int zram_read_before_write(struct zram *zram, unsigned char *mem,
+				  u32 index)
 {
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	int ret = 0;
 	unsigned char *cmem;
+	struct zram_comp_stream *zstrm;
+
+again:
+	zstrm = zram_stream_get(zram);
+	zram_lock_read(zram, index);
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		unsigned long blk = zram->table[index].blk;
+
+		zram_unlock_read(zram, index);
+		zram_stream_put(zstrm);
+		ret = zram_bdev_read(zram, blk, mem);
+		if (!ret && !zram_blk_still_valid(zram, index, blk))
+			goto again;
+		goto out_err;
+	}
 
 	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
 	    !zram->table[index].page) {
 		memset(mem, 0, PAGE_SIZE);
-		return 0;
+		goto out;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
-		return 0;
+		goto out;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	ret = zram_decompress(zram, zstrm, index, mem);
 
+out:
+	zram_unlock_read(zram, index);
+	zram_stream_put(zstrm);
+out_err:
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (unlikely(ret)) {
+		pr_err("Read failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(&zram->stats.failed_reads);
 		return ret;
 	}
 
 	return 0;
 }
 
-static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
-			   int offset)
+static int __zram_bvec_write(struct zram *zram, struct bio_vec *bvec,
+			     u32 index, int offset)
 {
 	int ret;
 	u32 store_offset;
-	size_t clen;
+	unsigned int clen;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct zram_comp_stream *zstrm;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -352,12 +749,11 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 
 	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
+	 * Compress and store the page without holding the table lock, so
+	 * that writers of other pages only meet when they publish the result.
 	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	zstrm = zram_stream_get(zram);
+	src = zstrm->buffer;
 
 	user_mem = kmap_atomic(page, KM_USER0);
 
@@ -371,22 +767,28 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		kunmap_atomic(user_mem, KM_USER0);
 		if (is_partial_io(bvec))
 			kfree(uncmem);
+		zram_stream_put(zstrm);
+
+		zram_lock_write(zram, index);
+		zram_free_page(zram, index);
 		zram_stat_inc(&zram->stats.pages_zero);
 		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
-		goto out;
+		zram_accessed(zram, index);
+		zram_unlock_write(zram, index);
+		return 0;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	/* The buffer is two pages, the worst case for any compressor */
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(zstrm->tfm, uncmem, PAGE_SIZE, src, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	if (is_partial_io(bvec))
-			kfree(uncmem);
+		kfree(uncmem);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
-		goto out;
+		goto out_put;
 	}
 
 	/*
@@ -401,79 +803,89 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
-			goto out;
+			goto out_put;
 		}
 
 		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
 		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
-	}
-
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
-	}
-
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+	} else {
+		if (zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+			      &page_store, &store_offset,
+			      GFP_NOIO | __GFP_HIGHMEM)) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%u\n", index, clen);
+			ret = -ENOMEM;
+			goto out_put;
+		}
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
+		/* Back-reference needed for memory defragmentation */
+		zheader = zs_map_object(zram->mem_pool, page_store,
+					store_offset, ZS_MM_WO);
 		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+		zheader->size = clen;
+		memcpy(zheader + 1, src, clen);
+		zs_unmap_object(zram->mem_pool, page_store, store_offset,
+				zheader);
 	}
-#endif
 
-	memcpy(cmem, src, clen);
+	zram_stream_put(zstrm);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector and publish the new object.
+	 */
+	zram_lock_write(zram, index);
+	zram_free_page(zram, index);
+	zram->table[index].page = page_store;
+	zram->table[index].offset = store_offset;
+	if (unlikely(clen == PAGE_SIZE)) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	}
+	zram_accessed(zram, index);
+	zram_unlock_write(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	zram_stat64_add(&zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
 	return 0;
 
+out_put:
+	zram_stream_put(zstrm);
 out:
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		zram_stat64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
+			   int offset)
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
+	zram_slot_claim(zram, index);
+	ret = __zram_bvec_write(zram, bvec, index, offset);
+	zram_slot_release(zram, index);
 
 	return ret;
 }
 
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, int rw)
+{
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	return zram_bvec_write(zram, bvec, index, offset);
+}
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -489,10 +901,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		zram_stat64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		zram_stat64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -568,7 +980,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		zram_stat64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -583,6 +995,54 @@ error:
 	bio_io_error(bio);
 }
 
+static void zram_free_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->comp)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_stream *zstrm = per_cpu_ptr(zram->comp, cpu);
+
+		if (zstrm->tfm)
+			crypto_free_comp(zstrm->tfm);
+		free_pages((unsigned long)zstrm->buffer, 1);
+	}
+
+	free_percpu(zram->comp);
+	zram->comp = NULL;
+}
+
+static int zram_alloc_streams(struct zram *zram)
+{
+	int cpu;
+
+	zram->comp = alloc_percpu(struct zram_comp_stream);
+	if (!zram->comp)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_stream *zstrm = per_cpu_ptr(zram->comp, cpu);
+
+		mutex_init(&zstrm->lock);
+		zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							 __GFP_ZERO, 1);
+		if (!zstrm->buffer)
+			return -ENOMEM;
+
+		zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(zstrm->tfm)) {
+			int ret = PTR_ERR(zstrm->tfm);
+
+			zstrm->tfm = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -590,35 +1050,28 @@ void __zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	zram_free_streams(zram);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
-
-	/* Free all pages that are still in this zram device */
+	/*
+	 * Free all incompressible pages that are still in this zram
+	 * device; compressed pages go with the pool.
+	 */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		struct page *page = zram->table[index].page;
 
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+		if (page && zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
 			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_reset_bdev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -646,17 +1099,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_streams(zram);
+	if (ret) {
+		pr_err("Error allocating %s compression streams!\n",
+			zram->compressor);
 		goto fail_no_table;
 	}
 
@@ -673,7 +1119,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -696,14 +1142,259 @@ fail:
 	return ret;
 }
 
+/*
+ * Called by zs_compact() for each object of a run it is emptying.  The
+ * object may have been freed or replaced since, in which case the table
+ * no longer points at it and it is left alone.
+ */
+static int zram_relocate(void *priv, struct page *page, u32 offset)
+{
+	int ret = 0;
+	u32 index, new_offset;
+	struct page *new_page;
+	struct zobj_header *zheader;
+	struct zram *zram = priv;
+
+	zheader = zs_map_object(zram->mem_pool, page, offset, ZS_MM_RO);
+	index = zheader->table_idx;
+	zs_unmap_object(zram->mem_pool, page, offset, zheader);
+
+	if (index >= zram->disksize >> PAGE_SHIFT)
+		return 0;
+
+	zram_lock_write(zram, index);
+
+	if (zram->table[index].page == page &&
+	    zram->table[index].offset == offset &&
+	    !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) &&
+	    !zram_test_flag(zram, index, ZRAM_WB)) {
+		new_page = page;
+		new_offset = offset;
+		ret = zs_migrate(zram->mem_pool, &new_page, &new_offset);
+		if (!ret) {
+			zram->table[index].page = new_page;
+			zram->table[index].offset = new_offset;
+			zram_stat64_inc(&zram->stats.num_migrated);
+		}
+	}
+
+	zram_unlock_write(zram, index);
+
+	return ret;
+}
+
+/* Must be called with init_lock held and the device initialized */
+void zram_compact(struct zram *zram)
+{
+	unsigned long pages;
+
+	pages = zs_compact(zram->mem_pool, zram_relocate, zram);
+	zram_stat64_add(&zram->stats.pages_compacted, pages);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Must be called with init_lock held for writing, before init */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	unsigned long nr_blks;
+	unsigned long *bitmap;
+	struct block_device *bdev;
+	char *name;
+
+	zram_reset_bdev(zram);
+
+	if (!*path || !strcmp(path, "none"))
+		return 0;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto free_name;
+	}
+
+	nr_blks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!nr_blks) {
+		ret = -EINVAL;
+		goto put_bdev;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blks) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto put_bdev;
+	}
+
+	zram->bdev = bdev;
+	zram->backing_dev = name;
+	zram->bitmap = bitmap;
+	zram->nr_blks = nr_blks;
+
+	pr_info("Using %s as backing device, %lu pages\n", name, nr_blks);
+	return 0;
+
+put_bdev:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+free_name:
+	kfree(name);
+	return ret;
+}
+
+/* Called with the table lock of @index held */
+static int zram_wb_candidate(struct zram *zram, u32 index,
+			     enum zram_wb_mode mode)
+{
+	if (!zram->table[index].page ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+	    zram_test_flag(zram, index, ZRAM_ZERO))
+		return 0;
+
+	if (mode == ZRAM_WB_INCOMPRESSIBLE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return zram_now() - zram->table[index].ac_time >= zram->idle_secs;
+}
+
+/*
+ * Copy out a page that is to be written back, and mark it so that we can
+ * tell whether it was rewritten or freed while the write was in flight.
+ * Returns 1 if the page was copied, 0 if it isn't a candidate.
+ */
+static int zram_wb_prepare(struct zram *zram, u32 index,
+			   enum zram_wb_mode mode, struct page *page)
+{
+	int ret = 1;
+	unsigned char *mem, *cmem;
+	struct zram_comp_stream *zstrm;
+
+	zstrm = zram_stream_get(zram);
+	zram_lock_write(zram, index);
+
+	if (!zram_wb_candidate(zram, index, mode)) {
+		ret = 0;
+		goto out;
+	}
+
+	mem = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else if (zram_decompress(zram, zstrm, index, mem)) {
+		ret = 0;
+	}
+	kunmap_atomic(mem, KM_USER0);
+
+	if (ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+out:
+	zram_unlock_write(zram, index);
+	zram_stream_put(zstrm);
+
+	return ret;
+}
+
+/*
+ * Write back pages of the given kind to the backing device and free the
+ * memory they take.  Must be called with init_lock held and the device
+ * initialized.  Returns 0, or an error if the backing device is full or
+ * failed.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0;
+	u32 index;
+	unsigned long blk;
+	struct page *page;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	mutex_lock(&zram->wb_lock);
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		cond_resched();
+
+		if (!zram_wb_prepare(zram, index, mode, page))
+			continue;
+
+		ret = zram_alloc_blk(zram, &blk);
+		if (!ret) {
+			ret = zram_bdev_rw(zram, WRITE, blk, page);
+			if (ret)
+				zram_free_blk(zram, blk);
+		}
+
+		zram_lock_write(zram, index);
+
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			/* Failed, or rewritten or freed in the meantime */
+			if (!ret)
+				zram_free_blk(zram, blk);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_write(zram, index);
+			if (ret)
+				break;
+			continue;
+		}
+
+		/* Keeps the access time, so the page stays idle */
+		zram_free_page(zram, index);
+		zram->table[index].blk = blk;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat64_inc(&zram->stats.bd_count);
+
+		zram_unlock_write(zram, index);
+	}
+
+	mutex_unlock(&zram->wb_lock);
+	__free_page(page);
+
+	return ret;
+}
+
+/*
+ * Number of pages held in memory that have not been accessed for
+ * idle_secs.  Must be called with init_lock held and the device
+ * initialized.
+ */
+unsigned long zram_idle_pages(struct zram *zram)
+{
+	u32 index;
+	unsigned long count = 0;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_read(zram, index);
+		if (zram_wb_candidate(zram, index, ZRAM_WB_IDLE))
+			count++;
+		zram_unlock_read(zram, index);
+	}
+
+	return count;
+}
+#endif
+
 static void zram_slot_free_notify(struct block_device *bdev,
 				unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_write(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_write(zram, index);
+	zram_stat64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -713,11 +1404,20 @@ static const struct block_device_operations zram_devops = {
 
 static int create_device(struct zram *zram, int device_id)
 {
-	int ret = 0;
+	int i, ret = 0;
 
-	init_rwsem(&zram->lock);
+	for (i = 0; i < ZRAM_TABLE_LOCKS; i++) {
+		rwlock_init(&zram->table_lock[i]);
+		init_waitqueue_head(&zram->table_wait[i]);
+	}
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+	mutex_init(&zram->wb_lock);
+	zram->idle_secs = default_idle_secs;
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -800,11 +1500,15 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zram_wb_init();
+	if (ret)
+		goto out;
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto wb_exit;
 	}
 
 	if (!zram_num_devices) {
@@ -834,6 +1538,8 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+wb_exit:
+	zram_wb_exit();
 out:
 	return ret;
 }
@@ -849,9 +1555,12 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		else
+			zram_reset_bdev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	zram_wb_exit();
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
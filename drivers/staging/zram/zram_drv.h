@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/crypto.h>
 
-#include "xvmalloc.h"
+#include "zsalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -31,11 +34,12 @@ static const unsigned max_num_devices = 32;
  *
  * It stores back-reference to table entry which points to this
  * object. This is required to support memory defragmentation.
+ * Objects are rounded up to a size class, so the compressed
+ * size is kept as well.
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
+	u32 size;
 };
 
 /*-- Configurable parameters */
@@ -43,16 +47,30 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compressor, can be changed through sysfs before init */
+static const char default_compressor[] = "lzo";
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Pages not accessed for this long are written back by "idle" writeback */
+static const u32 default_idle_secs = 3600;
+#endif
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
  */
 static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/*
+ * Number of locks the table is striped over (must be a power of two).
+ * Neighbouring pages map to different locks.
+ */
+#define ZRAM_TABLE_LOCKS	64
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -74,6 +92,15 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is stored on the backing device, at table[page_no].blk */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* A write to the page is in progress, other writers wait for it */
+	ZRAM_BUSY,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -81,34 +108,53 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		unsigned long blk;	/* ZRAM_WB pages */
+	};
 	u16 offset;
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;	/* last access, in seconds since boot */
+#endif
 } __attribute__((aligned(4)));
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic64_t compr_size;	/* compressed size of pages stored */
+	atomic64_t num_reads;	/* failed + successful */
+	atomic64_t num_writes;	/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
+	atomic64_t notify_free;	/* no. of swap slot free notifications */
+	atomic64_t lock_contended;	/* waits for a table lock or stream */
+	atomic64_t num_migrated;	/* objects moved by compaction */
+	atomic64_t pages_compacted;	/* pages freed by compaction */
+	atomic64_t bd_count;	/* pages on the backing device */
+	atomic64_t bd_reads;	/* pages read from the backing device */
+	atomic64_t bd_writes;	/* pages written to the backing device */
+	atomic_t pages_zero;		/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+};
+
+/* Compressor transform and output buffer, one set per cpu */
+struct zram_comp_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	void *buffer;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_comp_stream __percpu *comp;
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	/* protect table entries against concurrent read and writes */
+	rwlock_t table_lock[ZRAM_TABLE_LOCKS];
+	/* writers waiting for a ZRAM_BUSY page, striped like table_lock */
+	wait_queue_head_t table_wait[ZRAM_TABLE_LOCKS];
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +165,17 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* crypto API name of the compression algorithm */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct block_device *bdev;
+	char *backing_dev;	/* path bdev was opened by */
+	unsigned long *bitmap;	/* blocks of bdev in use */
+	unsigned long nr_blks;
+	spinlock_t bitmap_lock;
+	struct mutex wb_lock;	/* serialise writeback */
+	u32 idle_secs;
+#endif
 
 	struct zram_stats stats;
 };
@@ -131,5 +188,17 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+extern void zram_compact(struct zram *zram);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+enum zram_wb_mode {
+	ZRAM_WB_INCOMPRESSIBLE,
+	ZRAM_WB_IDLE,
+};
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+extern unsigned long zram_idle_pages(struct zram *zram);
+#endif
 
 #endif
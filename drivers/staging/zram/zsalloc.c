@@ -0,0 +1,585 @@
+/*
+ * zsalloc: size class memory allocator for compressed pages
+ *
+ * Objects are rounded up to one of a set of size classes, and each class
+ * packs its objects into runs of a few pages.  Objects may straddle two
+ * pages of a run; zs_map_object() hides this by bouncing them through a
+ * per-cpu buffer.  Unlike xvmalloc, objects can be moved: zs_compact()
+ * empties sparsely used runs into the others of their class and frees
+ * them.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsalloc.h"
+#include "zsalloc_int.h"
+
+static struct zs_run *get_run(struct page *page)
+{
+	return (struct zs_run *)page_private(page);
+}
+
+static struct page *next_run_page(struct page *page)
+{
+	return get_run(page)->pages[page->index + 1];
+}
+
+static struct zs_size_class *get_size_class(struct zs_pool *pool, u32 size)
+{
+	if (size < ZS_MIN_ALLOC_SIZE)
+		size = ZS_MIN_ALLOC_SIZE;
+
+	return &pool->classes[DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+					   ZS_SIZE_CLASS_DELTA)];
+}
+
+/*
+ * Pick the run length, in pages, that wastes the least space at the end
+ * of the run for objects of the given size.
+ */
+static int get_pages_per_run(u32 size)
+{
+	int i, best = 1;
+	u32 usage, best_usage = 0;
+
+	for (i = 1; i <= ZS_MAX_RUN_PAGES; i++) {
+		u32 run_size = i * PAGE_SIZE;
+
+		usage = (run_size / size) * size * 100 / run_size;
+		if (usage > best_usage) {
+			best_usage = usage;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void obj_location(struct zs_size_class *class, struct zs_run *run,
+			unsigned int idx, struct page **page, u32 *offset)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+
+	*page = run->pages[off >> PAGE_SHIFT];
+	*offset = off & ~PAGE_MASK;
+}
+
+static unsigned int obj_index(struct zs_size_class *class,
+			struct page *page, u32 offset)
+{
+	return ((page->index << PAGE_SHIFT) + offset) / class->size;
+}
+
+static void free_run(struct zs_run *run)
+{
+	int i;
+
+	for (i = 0; i < run->class->pages_per_run; i++) {
+		struct page *page = run->pages[i];
+
+		if (!page)
+			break;
+		set_page_private(page, 0);
+		page->index = 0;
+		__free_page(page);
+	}
+
+	kfree(run);
+}
+
+static struct zs_run *alloc_run(struct zs_size_class *class, gfp_t flags)
+{
+	int i;
+	struct zs_run *run;
+
+	run = kzalloc(sizeof(*run), flags & ~__GFP_HIGHMEM);
+	if (unlikely(!run))
+		return NULL;
+
+	run->class = class;
+	INIT_LIST_HEAD(&run->list);
+
+	for (i = 0; i < class->pages_per_run; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (unlikely(!page)) {
+			free_run(run);
+			return NULL;
+		}
+		set_page_private(page, (unsigned long)run);
+		page->index = i;
+		run->pages[i] = page;
+	}
+
+	return run;
+}
+
+/*
+ * Take a free object from the first partial run of the class.  Runs
+ * coming back from the full list go to the head of the partial list and
+ * new runs to its tail, so the fullest runs fill up first and the
+ * emptiest are left for zs_compact().  Called with class->lock held.
+ */
+static int alloc_obj(struct zs_size_class *class, struct page **page,
+			u32 *offset)
+{
+	unsigned int idx;
+	struct zs_run *run;
+
+	if (list_empty(&class->partial))
+		return -ENOSPC;
+
+	run = list_first_entry(&class->partial, struct zs_run, list);
+	idx = find_first_zero_bit(run->used, class->objs_per_run);
+	__set_bit(idx, run->used);
+	run->inuse++;
+	class->nr_objs++;
+
+	if (run->inuse == class->objs_per_run) {
+		list_move(&run->list, &class->full);
+		class->nr_partial--;
+	}
+
+	obj_location(class, run, idx, page, offset);
+	return 0;
+}
+
+/*
+ * Copy an object to or from a bounce buffer when it straddles the
+ * boundary between two pages of its run.
+ */
+static void copy_split_obj(char *buf, struct page *page, u32 offset,
+			u32 size, int to_pages)
+{
+	u32 first = PAGE_SIZE - offset;
+	char *addr;
+
+	addr = kmap_atomic(page, KM_USER1);
+	if (to_pages)
+		memcpy(addr + offset, buf, first);
+	else
+		memcpy(buf, addr + offset, first);
+	kunmap_atomic(addr, KM_USER1);
+
+	addr = kmap_atomic(next_run_page(page), KM_USER1);
+	if (to_pages)
+		memcpy(addr, buf + first, size - first);
+	else
+		memcpy(buf + first, addr, size - first);
+	kunmap_atomic(addr, KM_USER1);
+}
+
+static void copy_obj(u32 size, struct page *d_page, u32 d_off,
+			struct page *s_page, u32 s_off)
+{
+	while (size) {
+		u32 len = min3(size, (u32)PAGE_SIZE - d_off,
+			       (u32)PAGE_SIZE - s_off);
+		char *d, *s;
+
+		s = kmap_atomic(s_page, KM_USER0);
+		d = kmap_atomic(d_page, KM_USER1);
+		memcpy(d + d_off, s + s_off, len);
+		kunmap_atomic(d, KM_USER1);
+		kunmap_atomic(s, KM_USER0);
+
+		size -= len;
+		if (!size)
+			break;
+
+		d_off += len;
+		s_off += len;
+		if (d_off == PAGE_SIZE) {
+			d_page = next_run_page(d_page);
+			d_off = 0;
+		}
+		if (s_off == PAGE_SIZE) {
+			s_page = next_run_page(s_page);
+			s_off = 0;
+		}
+	}
+}
+
+/**
+ * zs_create_pool - Create a memory pool.
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_run = get_pages_per_run(class->size);
+		class->objs_per_run = class->pages_per_run * PAGE_SIZE /
+					class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	mutex_init(&pool->compact_lock);
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+		struct zs_run *run, *tmp;
+
+		list_for_each_entry_safe(run, tmp, &class->partial, list)
+			free_run(run);
+		list_for_each_entry_safe(run, tmp, &class->full, list)
+			free_run(run);
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate an object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @page: page no. that holds the start of the object
+ * @offset: location of object within page
+ * @flags: gfp flags used if the pool has to grow
+ *
+ * On success, <page, offset> identifies the object.  It must only be
+ * accessed through zs_map_object().
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	struct zs_run *run;
+	struct zs_size_class *class;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	class = get_size_class(pool, size);
+
+	spin_lock(&class->lock);
+	if (!alloc_obj(class, page, offset)) {
+		spin_unlock(&class->lock);
+		return 0;
+	}
+	spin_unlock(&class->lock);
+
+	run = alloc_run(class, flags);
+	if (unlikely(!run))
+		return -ENOMEM;
+
+	atomic_long_add(class->pages_per_run, &pool->total_pages);
+
+	spin_lock(&class->lock);
+	list_add_tail(&run->list, &class->partial);
+	class->nr_partial++;
+	alloc_obj(class, page, offset);
+	spin_unlock(&class->lock);
+
+	return 0;
+}
+
+/*
+ * zs_free - Free an object allocated with zs_malloc()
+ */
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset)
+{
+	int was_full;
+	struct zs_run *run = get_run(page);
+	struct zs_size_class *class = run->class;
+
+	spin_lock(&class->lock);
+
+	__clear_bit(obj_index(class, page, offset), run->used);
+	was_full = run->inuse == class->objs_per_run;
+	run->inuse--;
+	class->nr_objs--;
+
+	/* zs_compact() puts the run back when it is done with it */
+	if (run->isolated) {
+		spin_unlock(&class->lock);
+		return;
+	}
+
+	if (!run->inuse) {
+		list_del(&run->list);
+		if (!was_full)
+			class->nr_partial--;
+		spin_unlock(&class->lock);
+
+		atomic_long_sub(class->pages_per_run, &pool->total_pages);
+		free_run(run);
+		return;
+	}
+
+	if (was_full) {
+		list_move(&run->list, &class->partial);
+		class->nr_partial++;
+	}
+
+	spin_unlock(&class->lock);
+}
+
+/**
+ * zs_map_object - Get a pointer to an object
+ * @pool: pool the object was allocated from
+ * @page, @offset: the object, as returned by zs_malloc()
+ * @mm: whether the object is read or written through the mapping
+ *
+ * The mapping is atomic: the caller must not sleep until it calls
+ * zs_unmap_object(), and may only have one object mapped at a time.
+ */
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum zs_mapmode mm)
+{
+	u32 size = get_run(page)->class->size;
+	struct zs_map_area *area;
+
+	if (offset + size <= PAGE_SIZE)
+		return kmap_atomic(page, KM_USER1) + offset;
+
+	area = per_cpu_ptr(pool->map_area, get_cpu());
+	area->mm = mm;
+	if (mm != ZS_MM_WO)
+		copy_split_obj(area->buf, page, offset, size, 0);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 offset,
+			void *obj)
+{
+	u32 size = get_run(page)->class->size;
+	struct zs_map_area *area;
+
+	if (offset + size <= PAGE_SIZE) {
+		kunmap_atomic(obj, KM_USER1);
+		return;
+	}
+
+	area = this_cpu_ptr(pool->map_area);
+	if (area->mm != ZS_MM_RO)
+		copy_split_obj(area->buf, page, offset, size, 1);
+	put_cpu();
+}
+
+/**
+ * zs_migrate - Move an object to another run of its size class
+ * @pool: pool the object was allocated from
+ * @page, @offset: the object; updated to its new location
+ *
+ * Only runs that already have room are used, so this never sleeps.  The
+ * caller must make sure nobody accesses the object while it moves.
+ *
+ * Returns 0 on success, -ENOSPC if the class has no free object.
+ */
+int zs_migrate(struct zs_pool *pool, struct page **page, u32 *offset)
+{
+	int ret;
+	u32 new_offset;
+	struct page *new_page;
+	struct zs_size_class *class = get_run(*page)->class;
+
+	spin_lock(&class->lock);
+	ret = alloc_obj(class, &new_page, &new_offset);
+	spin_unlock(&class->lock);
+	if (ret)
+		return ret;
+
+	copy_obj(class->size, new_page, new_offset, *page, *offset);
+	zs_free(pool, *page, *offset);
+
+	*page = new_page;
+	*offset = new_offset;
+	return 0;
+}
+
+/*
+ * Take the emptiest partial run of the class off its list, provided the
+ * other partial runs have room for all of its objects.
+ */
+static struct zs_run *isolate_source_run(struct zs_size_class *class)
+{
+	unsigned long nr_free = 0;
+	struct zs_run *run, *src = NULL;
+
+	spin_lock(&class->lock);
+
+	if (class->nr_partial < 2)
+		goto out;
+
+	list_for_each_entry(run, &class->partial, list) {
+		nr_free += class->objs_per_run - run->inuse;
+		if (!src || run->inuse < src->inuse)
+			src = run;
+	}
+
+	nr_free -= class->objs_per_run - src->inuse;
+	if (nr_free < src->inuse) {
+		src = NULL;
+		goto out;
+	}
+
+	list_del(&src->list);
+	class->nr_partial--;
+	src->isolated = 1;
+out:
+	spin_unlock(&class->lock);
+	return src;
+}
+
+/*
+ * Return an isolated run to its class, or free it if it was emptied.
+ * Returns the number of pages freed.
+ */
+static unsigned long putback_run(struct zs_pool *pool,
+			struct zs_size_class *class, struct zs_run *run)
+{
+	spin_lock(&class->lock);
+	run->isolated = 0;
+
+	if (!run->inuse) {
+		spin_unlock(&class->lock);
+		atomic_long_sub(class->pages_per_run, &pool->total_pages);
+		free_run(run);
+		return class->pages_per_run;
+	}
+
+	if (run->inuse == class->objs_per_run) {
+		list_add(&run->list, &class->full);
+	} else {
+		list_add_tail(&run->list, &class->partial);
+		class->nr_partial++;
+	}
+
+	spin_unlock(&class->lock);
+	return 0;
+}
+
+/**
+ * zs_compact - Free pages by moving objects out of sparse runs
+ * @pool: pool to compact
+ * @fn: called for each object to move, see zs_relocate_fn
+ * @priv: passed to @fn
+ *
+ * May sleep.  Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool, zs_relocate_fn fn, void *priv)
+{
+	int i;
+	unsigned long freed, pages_freed = 0;
+
+	mutex_lock(&pool->compact_lock);
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+		struct zs_run *run;
+
+		while ((run = isolate_source_run(class))) {
+			unsigned int idx;
+
+			for (idx = 0; idx < class->objs_per_run; idx++) {
+				struct page *page;
+				u32 offset;
+				int live;
+
+				spin_lock(&class->lock);
+				live = test_bit(idx, run->used);
+				spin_unlock(&class->lock);
+				if (!live)
+					continue;
+
+				obj_location(class, run, idx, &page, &offset);
+				if (fn(priv, page, offset))
+					break;
+				cond_resched();
+			}
+
+			freed = putback_run(pool, class, run);
+			if (!freed)
+				break;
+			pages_freed += freed;
+		}
+	}
+
+	mutex_unlock(&pool->compact_lock);
+
+	return pages_freed;
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->total_pages) << PAGE_SHIFT;
+}
+
+/*
+ * Bytes taken by allocated objects, rounded up to their size class.
+ * The rest of zs_get_total_size_bytes() is free space in partially
+ * used runs and the tail of each run.
+ */
+u64 zs_get_used_size_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 used = 0;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		used += class->nr_objs * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	return used;
+}
@@ -0,0 +1,50 @@
+/*
+ * zsalloc: size class memory allocator for compressed pages
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef _ZS_ALLOC_H_
+#define _ZS_ALLOC_H_
+
+#include <linux/types.h>
+
+struct zs_pool;
+
+/*
+ * How an object is going to be accessed through zs_map_object():
+ * ZS_MM_RO objects are not written back, ZS_MM_WO objects are not
+ * read in first.
+ */
+enum zs_mapmode {
+	ZS_MM_RO,
+	ZS_MM_WO,
+};
+
+/*
+ * Called by zs_compact() for each object in a page run being emptied.
+ * The owner should zs_migrate() the object if it still refers to it and
+ * return 0, or return non-zero to stop compacting the size class.
+ */
+typedef int (*zs_relocate_fn)(void *priv, struct page *page, u32 offset);
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+			u32 *offset, gfp_t flags);
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset);
+
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 offset,
+			void *obj);
+
+int zs_migrate(struct zs_pool *pool, struct page **page, u32 *offset);
+unsigned long zs_compact(struct zs_pool *pool, zs_relocate_fn fn,
+			void *priv);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+u64 zs_get_used_size_bytes(struct zs_pool *pool);
+
+#endif
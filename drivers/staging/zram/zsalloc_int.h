@@ -0,0 +1,78 @@
+/*
+ * zsalloc: size class memory allocator for compressed pages
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef _ZS_ALLOC_INT_H_
+#define _ZS_ALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/* Object sizes are rounded up to a multiple of this */
+#define ZS_SIZE_CLASS_DELTA	16
+
+/* Must be a multiple of ZS_SIZE_CLASS_DELTA */
+#define ZS_MIN_ALLOC_SIZE	32
+
+/*
+ * Objects of a size class are packed into runs of up to this many
+ * pages, and may straddle the boundary between two pages of a run.
+ * Longer runs waste less space at the end of the run but take longer
+ * to empty when compacting.
+ */
+#define ZS_MAX_RUN_PAGES	4
+
+/* End of user params */
+
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_NR_CLASSES	\
+	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / ZS_SIZE_CLASS_DELTA + 1)
+#define ZS_MAX_RUN_OBJS	\
+	(ZS_MAX_RUN_PAGES * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+/*
+ * A run of pages holding objects of one size class.  Each of its pages
+ * points back to it through page->private, and page->index gives the
+ * page's position in the run.
+ */
+struct zs_run {
+	struct list_head list;	/* on class partial or full list */
+	struct zs_size_class *class;
+	u16 inuse;		/* objects allocated */
+	u8 isolated;		/* being emptied by zs_compact() */
+	struct page *pages[ZS_MAX_RUN_PAGES];
+	unsigned long used[BITS_TO_LONGS(ZS_MAX_RUN_OBJS)];
+};
+
+struct zs_size_class {
+	spinlock_t lock;
+	u32 size;
+	u16 pages_per_run;
+	u16 objs_per_run;
+	struct list_head partial;	/* runs with free objects */
+	struct list_head full;
+	u32 nr_partial;
+	u64 nr_objs;			/* objects allocated */
+};
+
+/* Bounce buffer for objects that straddle two pages */
+struct zs_map_area {
+	char *buf;
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct zs_size_class classes[ZS_NR_CLASSES];
+	struct zs_map_area __percpu *map_area;
+	struct mutex compact_lock;
+	atomic_long_t total_pages;
+};
+
+#endif
@@ -1346,6 +1346,89 @@ static void n_tty_write_wakeup(struct tty_struct *tty)
 		kill_fasync(&tty->fasync, SIGIO, POLL_OUT);
 }
 
+/**
+ *	n_tty_receive_run	-	queue characters verbatim
+ *	@tty: terminal device
+ *	@cp: characters
+ *	@count: number of characters
+ *	@limit: fill level the read buffer may reach
+ *
+ *	Copy a run of characters that need no processing straight into
+ *	the read buffer, taking the read_lock once for the whole run.
+ *	Characters that do not fit are dropped, as they would be one at a
+ *	time.
+ *
+ *	Locking: read_lock
+ */
+
+static void n_tty_receive_run(struct tty_struct *tty, const unsigned char *cp,
+			      int count, int limit)
+{
+	unsigned long cpuflags;
+	int i;
+
+	spin_lock_irqsave(&tty->read_lock, cpuflags);
+	i = min(limit - tty->read_cnt, N_TTY_BUF_SIZE - tty->read_head);
+	i = min(count, i);
+	if (i > 0) {
+		memcpy(tty->read_buf + tty->read_head, cp, i);
+		tty->read_head = (tty->read_head + i) & (N_TTY_BUF_SIZE-1);
+		tty->read_cnt += i;
+		cp += i;
+		count -= i;
+
+		i = min(limit - tty->read_cnt, N_TTY_BUF_SIZE - tty->read_head);
+		i = min(count, i);
+		if (i > 0) {
+			memcpy(tty->read_buf + tty->read_head, cp, i);
+			tty->read_head = (tty->read_head + i) &
+					 (N_TTY_BUF_SIZE-1);
+			tty->read_cnt += i;
+		}
+	}
+	spin_unlock_irqrestore(&tty->read_lock, cpuflags);
+}
+
+/**
+ *	n_tty_plain_run		-	find characters needing no processing
+ *	@tty: terminal device
+ *	@cp: characters
+ *	@fp: flags, may be NULL
+ *	@count: number of characters
+ *
+ *	Return how many of the leading characters n_tty_receive_char()
+ *	would simply queue, without echoing or interpreting them, so that
+ *	they can be copied as a block. The termios state is checked again
+ *	for every run, as a special character handled in between may have
+ *	changed it.
+ */
+
+static int n_tty_plain_run(struct tty_struct *tty, const unsigned char *cp,
+			   char *fp, int count)
+{
+	int n;
+
+	if (!tty->raw) {
+		if (L_ECHO(tty) || I_ISTRIP(tty) ||
+		    (I_IUCLC(tty) && L_IEXTEN(tty)) || L_EXTPROC(tty) ||
+		    tty->closing || tty->lnext ||
+		    (tty->stopped && I_IXON(tty) && I_IXANY(tty)))
+			return 0;
+	}
+
+	for (n = 0; n < count; n++) {
+		if (fp && fp[n] != TTY_NORMAL)
+			break;
+		if (tty->raw)
+			continue;
+		if (test_bit(cp[n], tty->process_char_map))
+			break;
+		if (cp[n] == (unsigned char) '\377' && I_PARMRK(tty))
+			break;
+	}
+	return n;
+}
+
 /**
  *	n_tty_receive_buf	-	data receive
  *	@tty: terminal device
@@ -1362,47 +1445,46 @@ static void n_tty_write_wakeup(struct tty_struct *tty)
 static void n_tty_receive_buf(struct tty_struct *tty, const unsigned char *cp,
 			      char *fp, int count)
 {
-	const unsigned char *p;
-	char *f, flags = TTY_NORMAL;
+	char flags = TTY_NORMAL;
 	int	i;
 	char	buf[64];
-	unsigned long cpuflags;
 
 	if (!tty->read_buf)
 		return;
 
 	if (tty->real_raw) {
-		spin_lock_irqsave(&tty->read_lock, cpuflags);
-		i = min(N_TTY_BUF_SIZE - tty->read_cnt,
-			N_TTY_BUF_SIZE - tty->read_head);
-		i = min(count, i);
-		memcpy(tty->read_buf + tty->read_head, cp, i);
-		tty->read_head = (tty->read_head + i) & (N_TTY_BUF_SIZE-1);
-		tty->read_cnt += i;
-		cp += i;
-		count -= i;
-
-		i = min(N_TTY_BUF_SIZE - tty->read_cnt,
-			N_TTY_BUF_SIZE - tty->read_head);
-		i = min(count, i);
-		memcpy(tty->read_buf + tty->read_head, cp, i);
-		tty->read_head = (tty->read_head + i) & (N_TTY_BUF_SIZE-1);
-		tty->read_cnt += i;
-		spin_unlock_irqrestore(&tty->read_lock, cpuflags);
+		n_tty_receive_run(tty, cp, count, N_TTY_BUF_SIZE);
 	} else {
-		for (i = count, p = cp, f = fp; i; i--, p++) {
-			if (f)
-				flags = *f++;
+		while (count) {
+			/*
+			 * Runs of characters that would only be queued
+			 * are copied in one go; put_tty_queue() fills the
+			 * buffer up in raw mode, the shortcut path of
+			 * n_tty_receive_char() leaves one byte free.
+			 */
+			i = n_tty_plain_run(tty, cp, fp, count);
+			if (i) {
+				n_tty_receive_run(tty, cp, i, tty->raw ?
+					N_TTY_BUF_SIZE : N_TTY_BUF_SIZE - 1);
+				cp += i;
+				if (fp)
+					fp += i;
+				count -= i;
+				continue;
+			}
+
+			if (fp)
+				flags = *fp++;
 			switch (flags) {
 			case TTY_NORMAL:
-				n_tty_receive_char(tty, *p);
+				n_tty_receive_char(tty, *cp);
 				break;
 			case TTY_BREAK:
 				n_tty_receive_break(tty);
 				break;
 			case TTY_PARITY:
 			case TTY_FRAME:
-				n_tty_receive_parity_error(tty, *p);
+				n_tty_receive_parity_error(tty, *cp);
 				break;
 			case TTY_OVERRUN:
 				n_tty_receive_overrun(tty);
@@ -1412,6 +1494,8 @@ static void n_tty_receive_buf(struct tty_struct *tty, const unsigned char *cp,
 				       tty_name(tty, buf), flags);
 				break;
 			}
+			cp++;
+			count--;
 		}
 		if (tty->ops->flush_chars)
 			tty->ops->flush_chars(tty);
@@ -130,6 +130,10 @@ struct dio {
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
 
+	/* last bio submitted, for blk_poll() by a sync waiter */
+	struct request_queue *bio_queue;
+	blk_qc_t bio_cookie;
+
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
 	ssize_t result;                 /* IO result */
@@ -411,6 +415,7 @@ dio_bio_alloc(struct dio *dio, struct dio_submit *sdio,
 static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 {
 	struct bio *bio = sdio->bio;
+	struct request_queue *q = bdev_get_queue(bio->bi_bdev);
 	unsigned long flags;
 
 	bio->bi_private = dio;
@@ -428,6 +433,12 @@ static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 	else
 		submit_bio(dio->rw, bio);
 
+	/* a sync dio's bios stay around until we reap them */
+	if (!dio->is_async) {
+		dio->bio_queue = q;
+		dio->bio_cookie = bio->bi_cookie;
+	}
+
 	sdio->bio = NULL;
 	sdio->boundary = 0;
 	sdio->logical_offset_in_bio = 0;
@@ -465,7 +476,9 @@ static struct bio *dio_await_one(struct dio *dio)
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		dio->waiter = current;
 		spin_unlock_irqrestore(&dio->bio_lock, flags);
-		io_schedule();
+		if (!dio->bio_queue ||
+		    !blk_poll(dio->bio_queue, dio->bio_cookie))
+			io_schedule();
 		/* wake up sets us TASK_RUNNING */
 		spin_lock_irqsave(&dio->bio_lock, flags);
 		dio->waiter = NULL;
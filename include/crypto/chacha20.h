@@ -0,0 +1,16 @@
+/*
+ * Common values for the ChaCha20 algorithm
+ */
+
+#ifndef _CRYPTO_CHACHA20_H
+#define _CRYPTO_CHACHA20_H
+
+#include <linux/types.h>
+
+#define CHACHA20_KEY_SIZE	32
+#define CHACHA20_BLOCK_SIZE	64
+#define CHACHA20_STATE_WORDS	16
+
+void chacha20_block(u32 *state, void *stream);
+
+#endif
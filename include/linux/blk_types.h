@@ -17,6 +17,35 @@ struct block_device;
 typedef void (bio_end_io_t) (struct bio *, int);
 typedef void (bio_destructor_t) (struct bio *);
 
+/*
+ * Identifies the request a bio was queued as, for blk_poll().  Zero if the
+ * bio did not get a request of its own, e.g. because it was merged.
+ */
+typedef unsigned int blk_qc_t;
+#define BLK_QC_T_NONE		0U
+#define BLK_QC_T_VALID		(1U << 31)
+#define BLK_QC_T_SHIFT		16
+
+static inline bool blk_qc_t_valid(blk_qc_t cookie)
+{
+	return cookie & BLK_QC_T_VALID;
+}
+
+static inline blk_qc_t blk_tag_to_qc_t(unsigned int tag, unsigned int queue_num)
+{
+	return BLK_QC_T_VALID | (queue_num << BLK_QC_T_SHIFT) | tag;
+}
+
+static inline unsigned int blk_qc_t_to_queue_num(blk_qc_t cookie)
+{
+	return (cookie & ~BLK_QC_T_VALID) >> BLK_QC_T_SHIFT;
+}
+
+static inline unsigned int blk_qc_t_to_tag(blk_qc_t cookie)
+{
+	return cookie & ((1U << BLK_QC_T_SHIFT) - 1);
+}
+
 /*
  * was unsigned short, but we might as well be ready for > 64kB I/O pages
  */
@@ -61,6 +90,8 @@ struct bio {
 
 	atomic_t		bi_cnt;		/* pin count */
 
+	blk_qc_t		bi_cookie;	/* set by blk-mq, for blk_poll() */
+
 	struct bio_vec		*bi_io_vec;	/* the actual vec list */
 
 	bio_end_io_t		*bi_end_io;
@@ -150,6 +181,7 @@ enum rq_flag_bits {
 	__REQ_FLUSH_SEQ,	/* request for flush sequence */
 	__REQ_IO_STAT,		/* account I/O stat */
 	__REQ_MIXED_MERGE,	/* merge of different types, fail separately */
+	__REQ_POLL_SLEPT,	/* blk_poll() has slept on this request */
 	__REQ_NR_BITS,		/* stops here */
 };
 
@@ -190,6 +222,7 @@ enum rq_flag_bits {
 #define REQ_FLUSH_SEQ		(1 << __REQ_FLUSH_SEQ)
 #define REQ_IO_STAT		(1 << __REQ_IO_STAT)
 #define REQ_MIXED_MERGE		(1 << __REQ_MIXED_MERGE)
+#define REQ_POLL_SLEPT		(1 << __REQ_POLL_SLEPT)
 #define REQ_SECURE		(1 << __REQ_SECURE)
 
 #endif /* __LINUX_BLK_TYPES_H */
@@ -223,6 +223,12 @@ struct dm_target {
 	 * Set if this target does not return zeroes on discarded blocks.
 	 */
 	unsigned discard_zeroes_data_unsupported:1;
+
+	/*
+	 * Set if discards must be split on split_io boundaries like other
+	 * io, rather than only on target boundaries.
+	 */
+	unsigned split_discard_requests:1;
 };
 
 /* Each target can link one of these into the table */
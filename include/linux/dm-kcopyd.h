@@ -57,6 +57,12 @@ void *dm_kcopyd_prepare_callback(struct dm_kcopyd_client *kc,
 				 dm_kcopyd_notify_fn fn, void *context);
 void dm_kcopyd_do_callback(void *job, int read_err, unsigned long write_err);
 
+/*
+ * Zero the destination regions.  If every destination guarantees that
+ * discarded sectors read back as zeroes, the regions are discarded
+ * rather than written, falling back to writing zeroes if the discard
+ * fails.
+ */
 int dm_kcopyd_zero(struct dm_kcopyd_client *kc,
 		   unsigned num_dests, struct dm_io_region *dests,
 		   unsigned flags, dm_kcopyd_notify_fn fn, void *context);
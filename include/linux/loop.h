@@ -28,6 +28,16 @@ enum {
 
 struct loop_func_table;
 
+/*
+ * A run of the backing file that sits in one piece on lo_dio_bdev, used
+ * to send direct I/O straight to the filesystem's device.
+ */
+struct loop_extent {
+	loff_t		pos;		/* file offset, bytes */
+	loff_t		len;		/* bytes */
+	sector_t	sector;		/* start on lo_dio_bdev */
+};
+
 struct loop_device {
 	int		lo_number;
 	int		lo_refcnt;
@@ -64,6 +74,12 @@ struct loop_device {
 
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
+
+	/* LO_FLAGS_DIRECT_IO state, see loop_dio_enable() */
+	struct loop_extent	*lo_extents;
+	unsigned int		lo_nr_extents;
+	struct block_device	*lo_dio_bdev;
+	atomic_t		lo_dio_pending;
 };
 
 #endif /* __KERNEL__ */
@@ -75,6 +91,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_AUTOCLEAR	= 4,
 	LO_FLAGS_PARTSCAN	= 8,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -159,6 +176,7 @@ int loop_unregister_transfer(int number);
 #define LOOP_GET_STATUS64	0x4C05
 #define LOOP_CHANGE_FD		0x4C06
 #define LOOP_SET_CAPACITY	0x4C07
+#define LOOP_SET_DIRECT_IO	0x4C08
 
 /* /dev/loop-control interface */
 #define LOOP_CTL_ADD		0x4C80
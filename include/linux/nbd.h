@@ -27,6 +27,7 @@
 #define NBD_SET_SIZE_BLOCKS	_IO( 0xab, 7 )
 #define NBD_DISCONNECT  _IO( 0xab, 8 )
 #define NBD_SET_TIMEOUT _IO( 0xab, 9 )
+#define NBD_ADD_SOCK	_IO( 0xab, 10 )
 
 enum {
 	NBD_CMD_READ = 0,
@@ -46,23 +47,43 @@ enum {
 #define NBD_READ_ONLY 0x0001
 #define NBD_WRITE_NOCHK 0x0002
 
+#define NBD_MAX_SOCKS	16	/* connections per device */
+#define NBD_QUEUE_DEPTH	256	/* requests sent and awaiting a reply */
+
 struct request;
+struct nbd_device;
+
+/*
+ * One connection to the server.  Each has its own sender thread, and
+ * replies are read by nbd_do_it() for the first one and by a receiver
+ * thread for the others.
+ */
+struct nbd_sock {
+	struct nbd_device *lo;
+	struct socket * sock;	/* NULL once shut down or cleared	*/
+	struct file * file;
+	struct mutex tx_lock;	/* serialises sends on this socket	*/
+	struct request *active_req;	/* being sent */
+	struct task_struct *send_task;
+	struct task_struct *recv_task;
+};
 
 struct nbd_device {
 	int flags;
 	int harderror;		/* Code of hard error			*/
-	struct socket * sock;
-	struct file * file; 	/* If == NULL, device is not ready, yet	*/
+	struct nbd_sock *socks;
+	int num_socks;		/* If == 0, device is not ready, yet	*/
 	int magic;
 
 	spinlock_t queue_lock;
-	struct list_head queue_head;	/* Requests waiting result */
-	struct request *active_req;
+	struct request **inflight;	/* Requests waiting result, by tag */
+	DECLARE_BITMAP(tag_map, NBD_QUEUE_DEPTH);	/* under nbd_lock */
+	int tag_starved;
 	wait_queue_head_t active_wq;
 	struct list_head waiting_queue;	/* Requests to be sent */
 	wait_queue_head_t waiting_wq;
 
-	struct mutex tx_lock;
+	struct mutex tx_lock;	/* ioctls, socket setup and teardown	*/
 	struct gendisk *disk;
 	int blksize;
 	u64 bytesize;
@@ -0,0 +1,57 @@
+/*
+ * ChaCha20 256-bit cipher algorithm, RFC7539
+ *
+ * Based on the public domain reference implementation by D. J. Bernstein.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bitops.h>
+#include <asm/unaligned.h>
+#include <crypto/chacha20.h>
+
+#define QUARTERROUND(a, b, c, d)			\
+	do {						\
+		x[a] += x[b]; x[d] = rol32(x[d] ^ x[a], 16);	\
+		x[c] += x[d]; x[b] = rol32(x[b] ^ x[c], 12);	\
+		x[a] += x[b]; x[d] = rol32(x[d] ^ x[a], 8);	\
+		x[c] += x[d]; x[b] = rol32(x[b] ^ x[c], 7);	\
+	} while (0)
+
+/**
+ * chacha20_block - generate one keystream block
+ * @state: 16 word input state; the block counter in word 12 is advanced
+ * @stream: output for 64 bytes of keystream, need not be aligned
+ */
+void chacha20_block(u32 *state, void *stream)
+{
+	u32 x[CHACHA20_STATE_WORDS];
+	u8 *out = stream;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(x); i++)
+		x[i] = state[i];
+
+	for (i = 0; i < 20; i += 2) {
+		QUARTERROUND(0, 4,  8, 12);
+		QUARTERROUND(1, 5,  9, 13);
+		QUARTERROUND(2, 6, 10, 14);
+		QUARTERROUND(3, 7, 11, 15);
+
+		QUARTERROUND(0, 5, 10, 15);
+		QUARTERROUND(1, 6, 11, 12);
+		QUARTERROUND(2, 7,  8, 13);
+		QUARTERROUND(3, 4,  9, 14);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(x); i++)
+		put_unaligned_le32(x[i] + state[i], out + i * sizeof(u32));
+
+	state[12]++;
+}
+EXPORT_SYMBOL(chacha20_block);
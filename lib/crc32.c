@@ -27,6 +27,13 @@
 #include <linux/types.h>
 #include <linux/init.h>
 #include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/hrtimer.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/slab.h>
 #include "crc32defs.h"
 #if CRC_LE_BITS == 8
 # define tole(x) __constant_cpu_to_le32(x)
@@ -47,24 +54,35 @@ MODULE_LICENSE("GPL");
 
 #if CRC_LE_BITS == 8 || CRC_BE_BITS == 8
 
+/*
+ * Table-driven CRC of a buffer, four (slice-by-4) or eight (slice-by-8)
+ * bytes per step.  Slice-by-8 needs half as many dependent steps but
+ * twice the table footprint, which does not pay off on every CPU, so
+ * both are built.  Slice-by-8 is used unless CONFIG_CRC32_SELFTEST lets
+ * crc32_init() time them at boot.
+ */
 static inline u32
-crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
+crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256],
+	   const int slices)
 {
 # ifdef __LITTLE_ENDIAN
-#  define DO_CRC(x) crc = tab[0][(crc ^ (x)) & 255] ^ (crc >> 8)
-#  define DO_CRC4 crc = tab[3][(crc) & 255] ^ \
-		tab[2][(crc >> 8) & 255] ^ \
-		tab[1][(crc >> 16) & 255] ^ \
-		tab[0][(crc >> 24) & 255]
+#  define DO_CRC(x) crc = t0[(crc ^ (x)) & 255] ^ (crc >> 8)
+#  define DO_CRC4 (t3[(q) & 255] ^ t2[(q >> 8) & 255] ^ \
+		   t1[(q >> 16) & 255] ^ t0[(q >> 24) & 255])
+#  define DO_CRC8 (t7[(q) & 255] ^ t6[(q >> 8) & 255] ^ \
+		   t5[(q >> 16) & 255] ^ t4[(q >> 24) & 255])
 # else
-#  define DO_CRC(x) crc = tab[0][((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
-#  define DO_CRC4 crc = tab[0][(crc) & 255] ^ \
-		tab[1][(crc >> 8) & 255] ^ \
-		tab[2][(crc >> 16) & 255] ^ \
-		tab[3][(crc >> 24) & 255]
+#  define DO_CRC(x) crc = t0[((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
+#  define DO_CRC4 (t0[(q) & 255] ^ t1[(q >> 8) & 255] ^ \
+		   t2[(q >> 16) & 255] ^ t3[(q >> 24) & 255])
+#  define DO_CRC8 (t4[(q) & 255] ^ t5[(q >> 8) & 255] ^ \
+		   t6[(q >> 16) & 255] ^ t7[(q >> 24) & 255])
 # endif
 	const u32 *b;
 	size_t    rem_len;
+	const u32 *t0 = tab[0], *t1 = tab[1], *t2 = tab[2], *t3 = tab[3];
+	const u32 *t4 = tab[4], *t5 = tab[5], *t6 = tab[6], *t7 = tab[7];
+	u32 q;
 
 	/* Align it */
 	if (unlikely((long)buf & 3 && len)) {
@@ -72,13 +90,25 @@ crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
 			DO_CRC(*buf++);
 		} while ((--len) && ((long)buf)&3);
 	}
-	rem_len = len & 3;
+
+	if (slices == 8) {
+		rem_len = len & 7;
+		len = len >> 3;
+	} else {
+		rem_len = len & 3;
+		len = len >> 2;
+	}
 	/* load data 32 bits wide, xor data 32 bits wide. */
-	len = len >> 2;
 	b = (const u32 *)buf;
 	for (--b; len; --len) {
-		crc ^= *++b; /* use pre increment for speed */
-		DO_CRC4;
+		q = crc ^ *++b; /* use pre increment for speed */
+		if (slices == 8) {
+			crc = DO_CRC8;
+			q = *++b;
+			crc ^= DO_CRC4;
+		} else {
+			crc = DO_CRC4;
+		}
 	}
 	len = rem_len;
 	/* And the last few bytes */
@@ -91,80 +121,141 @@ crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
 	return crc;
 #undef DO_CRC
 #undef DO_CRC4
+#undef DO_CRC8
 }
-#endif
-/**
- * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
- * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
- *	other uses, or the previous crc32 value if computing incrementally.
- * @p: pointer to buffer over which CRC is run
- * @len: length of buffer @p
- */
-u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len);
-
-#if CRC_LE_BITS == 1
-/*
- * In fact, the table-based code will work in this case, but it can be
- * simplified by inlining the table in ?: form.
- */
 
-u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
+static u32 crc32_body_sb4(u32 crc, unsigned char const *buf, size_t len,
+			  const u32 (*tab)[256])
 {
-	int i;
-	while (len--) {
-		crc ^= *p++;
-		for (i = 0; i < 8; i++)
-			crc = (crc >> 1) ^ ((crc & 1) ? CRCPOLY_LE : 0);
-	}
-	return crc;
+	return crc32_body(crc, buf, len, tab, 4);
 }
-#else				/* Table-based approach */
 
-u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
+static u32 crc32_body_sb8(u32 crc, unsigned char const *buf, size_t len,
+			  const u32 (*tab)[256])
 {
-# if CRC_LE_BITS == 8
-	const u32      (*tab)[] = crc32table_le;
+	return crc32_body(crc, buf, len, tab, 8);
+}
+
+struct crc32_impl {
+	const char *name;
+	u32 (*body)(u32 crc, unsigned char const *buf, size_t len,
+		    const u32 (*tab)[256]);
+};
+
+static const struct crc32_impl crc32_impls[] = {
+	{ "slice-by-8", crc32_body_sb8 },
+	{ "slice-by-4", crc32_body_sb4 },
+};
+
+/* the long-standing slice-by-4 code, fallen back to if a self test fails */
+#define CRC32_IMPL_GENERIC	1
+#define CRC32_IMPL_BIT(impl)	(1UL << ((impl) - crc32_impls))
+
+static const struct crc32_impl *crc32_impl __read_mostly = &crc32_impls[0];
 
+#if CRC_LE_BITS == 8
+static inline u32 crc32_le_impl(const struct crc32_impl *impl, u32 crc,
+				unsigned char const *p, size_t len,
+				const u32 (*tab)[256])
+{
 	crc = __cpu_to_le32(crc);
-	crc = crc32_body(crc, p, len, tab);
+	crc = impl->body(crc, p, len, tab);
 	return __le32_to_cpu(crc);
-# elif CRC_LE_BITS == 4
+}
+#endif
+
+#if CRC_BE_BITS == 8
+static inline u32 crc32_be_impl(const struct crc32_impl *impl, u32 crc,
+				unsigned char const *p, size_t len)
+{
+	crc = __cpu_to_be32(crc);
+	crc = impl->body(crc, p, len, crc32table_be);
+	return __be32_to_cpu(crc);
+}
+#endif
+#endif
+
+static inline u32 __pure crc32_le_generic(u32 crc, unsigned char const *p,
+					  size_t len, const u32 (*tab)[256],
+					  u32 polynomial)
+{
+#if CRC_LE_BITS == 1
+	int i;
 	while (len--) {
 		crc ^= *p++;
-		crc = (crc >> 4) ^ crc32table_le[crc & 15];
-		crc = (crc >> 4) ^ crc32table_le[crc & 15];
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
 	}
-	return crc;
 # elif CRC_LE_BITS == 2
 	while (len--) {
 		crc ^= *p++;
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
+		crc = (crc >> 2) ^ tab[0][crc & 3];
+		crc = (crc >> 2) ^ tab[0][crc & 3];
+		crc = (crc >> 2) ^ tab[0][crc & 3];
+		crc = (crc >> 2) ^ tab[0][crc & 3];
+	}
+# elif CRC_LE_BITS == 4
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ tab[0][crc & 15];
+		crc = (crc >> 4) ^ tab[0][crc & 15];
 	}
+# elif CRC_LE_BITS == 8
+	crc = crc32_le_impl(crc32_impl, crc, p, len, tab);
+#endif
 	return crc;
-# endif
 }
-#endif
 
 /**
- * crc32_be() - Calculate bitwise big-endian Ethernet AUTODIN II CRC32
+ * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
  * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
  *	other uses, or the previous crc32 value if computing incrementally.
  * @p: pointer to buffer over which CRC is run
  * @len: length of buffer @p
  */
-u32 __pure crc32_be(u32 crc, unsigned char const *p, size_t len);
+u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len);
 
-#if CRC_BE_BITS == 1
-/*
- * In fact, the table-based code will work in this case, but it can be
- * simplified by inlining the table in ?: form.
+/**
+ * __crc32c_le() - Calculate the little-endian Castagnoli CRC32c
+ * @crc: seed value for computation, or the previous crc32c value if
+ *	computing incrementally.  Neither inverted on entry nor on exit.
+ * @p: pointer to buffer over which CRC is run
+ * @len: length of buffer @p
  */
+u32 __pure __crc32c_le(u32 crc, unsigned char const *p, size_t len);
+
+#if CRC_LE_BITS == 1
+u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32_le_generic(crc, p, len, NULL, CRCPOLY_LE);
+}
+u32 __pure __crc32c_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32_le_generic(crc, p, len, NULL, CRC32C_POLY_LE);
+}
+#else
+u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32_le_generic(crc, p, len, crc32table_le, CRCPOLY_LE);
+}
+u32 __pure __crc32c_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32_le_generic(crc, p, len, crc32ctable_le, CRC32C_POLY_LE);
+}
+#endif
+EXPORT_SYMBOL(crc32_le);
+EXPORT_SYMBOL(__crc32c_le);
 
+/**
+ * crc32_be() - Calculate bitwise big-endian Ethernet AUTODIN II CRC32
+ * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
+ *	other uses, or the previous crc32 value if computing incrementally.
+ * @p: pointer to buffer over which CRC is run
+ * @len: length of buffer @p
+ */
 u32 __pure crc32_be(u32 crc, unsigned char const *p, size_t len)
 {
+#if CRC_BE_BITS == 1
 	int i;
 	while (len--) {
 		crc ^= *p++ << 24;
@@ -173,40 +264,243 @@ u32 __pure crc32_be(u32 crc, unsigned char const *p, size_t len)
 			    (crc << 1) ^ ((crc & 0x80000000) ? CRCPOLY_BE :
 					  0);
 	}
+# elif CRC_BE_BITS == 2
+	while (len--) {
+		crc ^= *p++ << 24;
+		crc = (crc << 2) ^ crc32table_be[0][crc >> 30];
+		crc = (crc << 2) ^ crc32table_be[0][crc >> 30];
+		crc = (crc << 2) ^ crc32table_be[0][crc >> 30];
+		crc = (crc << 2) ^ crc32table_be[0][crc >> 30];
+	}
+# elif CRC_BE_BITS == 4
+	while (len--) {
+		crc ^= *p++ << 24;
+		crc = (crc << 4) ^ crc32table_be[0][crc >> 28];
+		crc = (crc << 4) ^ crc32table_be[0][crc >> 28];
+	}
+# elif CRC_BE_BITS == 8
+	crc = crc32_be_impl(crc32_impl, crc, p, len);
+# endif
 	return crc;
 }
+EXPORT_SYMBOL(crc32_be);
 
-#else				/* Table-based approach */
-u32 __pure crc32_be(u32 crc, unsigned char const *p, size_t len)
+#if (CRC_LE_BITS == 8 || CRC_BE_BITS == 8) && defined(CONFIG_CRC32_SELFTEST)
+
+#define CRC32_BENCH_SIZE	4096
+#define CRC32_TEST_SIZE		16384
+
+/*
+ * Count the number of buffers checksummed during a whole jiffy, like the
+ * xor_blocks calibration does, and return the best of two runs.
+ */
+static unsigned long __init crc32_bench(const struct crc32_impl *impl,
+					const u8 *buf)
 {
-# if CRC_BE_BITS == 8
-	const u32      (*tab)[] = crc32table_be;
+	unsigned long now, count, max = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		now = jiffies;
+		while (jiffies == now)
+			cpu_relax();
+		now = jiffies;
+		count = 0;
+		while (jiffies == now) {
+			mb(); /* prevent loop optimzation */
+			impl->body(0, buf, CRC32_BENCH_SIZE, crc32table_le);
+			mb();
+			count++;
+		}
+		if (count > max)
+			max = count;
+	}
+	return max;
+}
+
+/*
+ * Pick the fastest implementation not set in @bad; if there is none,
+ * leave crc32_impl alone.
+ */
+static void __init crc32_select_impl(const u8 *buf, unsigned long bad)
+{
+	const struct crc32_impl *impl, *best = NULL;
+	unsigned long count, best_count = 0;
+
+	for (impl = crc32_impls; impl < crc32_impls + ARRAY_SIZE(crc32_impls);
+	     impl++) {
+		if (bad & CRC32_IMPL_BIT(impl))
+			continue;
+		count = crc32_bench(impl, buf);
+		printk(KERN_INFO "crc32: %-10s: %5lu MB/sec\n", impl->name,
+		       (count * HZ * CRC32_BENCH_SIZE) >> 20);
+		if (count > best_count) {
+			best = impl;
+			best_count = count;
+		}
+	}
+	if (best)
+		crc32_impl = best;
+	printk(KERN_INFO "crc32: using %s\n", crc32_impl->name);
+}
+
+static u32 __init crc32_le_ref(u32 crc, const u8 *p, size_t len, u32 poly)
+{
+	int i;
 
-	crc = __cpu_to_be32(crc);
-	crc = crc32_body(crc, p, len, tab);
-	return __be32_to_cpu(crc);
-# elif CRC_BE_BITS == 4
 	while (len--) {
-		crc ^= *p++ << 24;
-		crc = (crc << 4) ^ crc32table_be[crc >> 28];
-		crc = (crc << 4) ^ crc32table_be[crc >> 28];
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
 	}
 	return crc;
-# elif CRC_BE_BITS == 2
+}
+
+static u32 __init crc32_be_ref(u32 crc, const u8 *p, size_t len)
+{
+	int i;
+
 	while (len--) {
 		crc ^= *p++ << 24;
-		crc = (crc << 2) ^ crc32table_be[crc >> 30];
-		crc = (crc << 2) ^ crc32table_be[crc >> 30];
-		crc = (crc << 2) ^ crc32table_be[crc >> 30];
-		crc = (crc << 2) ^ crc32table_be[crc >> 30];
+		for (i = 0; i < 8; i++)
+			crc = (crc << 1) ^
+			      ((crc & 0x80000000) ? CRCPOLY_BE : 0);
 	}
 	return crc;
-# endif
 }
+
+/*
+ * Compare every implementation against the bitwise reference for all
+ * lengths up to 256 bytes and all offsets modulo 8.  Returns a mask of
+ * CRC32_IMPL_BIT()s of the implementations that failed.  The candidates
+ * are called directly, crc32_impl keeps serving everybody else.
+ */
+static unsigned long __init crc32_selftest(const u8 *buf)
+{
+	const struct crc32_impl *impl;
+	unsigned long bad = 0;
+	size_t len, off;
+	int errors;
+	u32 seed;
+
+	for (impl = crc32_impls; impl < crc32_impls + ARRAY_SIZE(crc32_impls);
+	     impl++) {
+		errors = 0;
+		for (off = 0; off < 8; off++) {
+			for (len = 0; len <= 256; len++) {
+				const u8 *p = buf + off;
+
+				seed = random32();
+#if CRC_LE_BITS == 8
+				if (crc32_le_impl(impl, seed, p, len,
+						  crc32table_le) !=
+				    crc32_le_ref(seed, p, len, CRCPOLY_LE))
+					errors++;
+				if (crc32_le_impl(impl, seed, p, len,
+						  crc32ctable_le) !=
+				    crc32_le_ref(seed, p, len, CRC32C_POLY_LE))
+					errors++;
+#endif
+#if CRC_BE_BITS == 8
+				if (crc32_be_impl(impl, seed, p, len) !=
+				    crc32_be_ref(seed, p, len))
+					errors++;
 #endif
+			}
+		}
+		if (errors) {
+			printk(KERN_ERR "crc32: %s: self test failed, "
+			       "%d errors\n", impl->name, errors);
+			bad |= CRC32_IMPL_BIT(impl);
+		}
+	}
+	return bad;
+}
 
-EXPORT_SYMBOL(crc32_le);
-EXPORT_SYMBOL(crc32_be);
+static const size_t crc32_test_sizes[] __initconst = {
+	64, 256, 1024, 4096, 16384,
+};
+
+/* keeps the timed calls from being optimized away */
+static volatile u32 crc32_sink;
+
+/*
+ * Report the throughput of every implementation in MB/s, one line per
+ * buffer alignment with one column per buffer size.
+ */
+static void __init crc32_throughput(const u8 *buf)
+{
+	const struct crc32_impl *impl;
+	size_t off, i, done;
+	char line[80];
+	int n;
+
+	for (impl = crc32_impls; impl < crc32_impls + ARRAY_SIZE(crc32_impls);
+	     impl++) {
+		n = snprintf(line, sizeof(line), "%-10s", impl->name);
+		for (i = 0; i < ARRAY_SIZE(crc32_test_sizes); i++)
+			n += snprintf(line + n, sizeof(line) - n, " %7zu",
+				      crc32_test_sizes[i]);
+		printk(KERN_INFO "crc32: %s\n", line);
+
+		for (off = 0; off < 4; off++) {
+			n = snprintf(line, sizeof(line), "  align %zu:", off);
+			for (i = 0; i < ARRAY_SIZE(crc32_test_sizes); i++) {
+				size_t size = crc32_test_sizes[i];
+				u32 crc = ~0;
+				ktime_t start;
+				s64 nsec;
+
+				start = ktime_get();
+				for (done = 0; done < (1 << 20); done += size)
+					crc = impl->body(crc, buf + off, size,
+							 crc32table_le);
+				nsec = ktime_to_ns(ktime_sub(ktime_get(),
+							     start));
+				crc32_sink = crc;
+				n += snprintf(line + n, sizeof(line) - n,
+					      " %7lld", nsec ?
+					      div64_s64(1000000000LL, nsec) :
+					      0LL);
+			}
+			printk(KERN_INFO "crc32: %s\n", line);
+		}
+	}
+}
+
+static int __init crc32_init(void)
+{
+	const size_t size = CRC32_TEST_SIZE + 8;
+	unsigned long bad, generic;
+	size_t i;
+	u8 *buf;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return 0;	/* keep the default implementation */
+
+	for (i = 0; i < size; i++)
+		buf[i] = random32();
+	bad = crc32_selftest(buf);
+	generic = CRC32_IMPL_BIT(&crc32_impls[CRC32_IMPL_GENERIC]);
+	if (!bad)
+		crc32_throughput(buf);
+	else if (!(bad & generic))
+		/* something is off, trust only the generic code */
+		bad = ~generic;
+	crc32_select_impl(buf, bad);
+
+	kfree(buf);
+	return 0;
+}
+
+static void __exit crc32_exit(void)
+{
+}
+
+module_init(crc32_init);
+module_exit(crc32_exit);
+#endif
 
 /*
  * A brief CRC tutorial.
@@ -6,6 +6,20 @@
 #define CRCPOLY_LE 0xedb88320
 #define CRCPOLY_BE 0x04c11db7
 
+/*
+ * This is the CRC32c polynomial, as outlined by Castagnoli.
+ * x^32+x^28+x^27+x^26+x^25+x^23+x^22+x^20+x^19+x^18+x^14+x^13+x^11+x^10+x^9+
+ * x^8+x^6+x^0
+ */
+#define CRC32C_POLY_LE 0x82f63b78
+
+/*
+ * Number of 256-entry tables generated for the table-driven code: enough
+ * for slice-by-8, which processes 8 bytes per step.  Slice-by-4 only uses
+ * the first four.
+ */
+#define CRC_SLICES 8
+
 /* How many bits at a time to use.  Requires a table of 4<<CRC_xx_BITS bytes. */
 /* For less performance-sensitive, use 4 */
 #ifndef CRC_LE_BITS 
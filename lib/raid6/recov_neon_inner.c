@@ -0,0 +1,104 @@
+/*
+ * linux/lib/raid6/recov_neon_inner.c - RAID6 recovery using ARM NEON
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <arm_neon.h>
+
+/*
+ * The multiplication tables from raid6_vgfmul hold the products of the
+ * low nibble in the first 16 bytes and of the high nibble in the last
+ * 16.  Each one is looked up with a 16 byte table lookup, which on
+ * 32-bit ARM takes a pair of vtbl.8 instructions.
+ */
+static inline uint8x8x2_t load_tbl(const uint8_t *tbl)
+{
+	uint8x8x2_t t;
+
+	t.val[0] = vld1_u8(tbl);
+	t.val[1] = vld1_u8(tbl + 8);
+	return t;
+}
+
+static inline uint8x16_t lookup(uint8x8x2_t tbl, uint8x16_t idx)
+{
+	return vcombine_u8(vtbl2_u8(tbl, vget_low_u8(idx)),
+			   vtbl2_u8(tbl, vget_high_u8(idx)));
+}
+
+/* Multiply each byte of @v by the constant the tables were built for */
+static inline uint8x16_t gfmul(uint8x8x2_t lo, uint8x8x2_t hi, uint8x16_t v)
+{
+	const uint8x16_t x0f = vdupq_n_u8(0x0f);
+
+	return veorq_u8(lookup(lo, vandq_u8(v, x0f)),
+			lookup(hi, vshrq_n_u8(v, 4)));
+}
+
+void __raid6_2data_recov_neon(int bytes, uint8_t *p, uint8_t *q, uint8_t *dp,
+			      uint8_t *dq, const uint8_t *pbmul,
+			      const uint8_t *qmul)
+{
+	uint8x8x2_t pm0 = load_tbl(pbmul);
+	uint8x8x2_t pm1 = load_tbl(pbmul + 16);
+	uint8x8x2_t qm0 = load_tbl(qmul);
+	uint8x8x2_t qm1 = load_tbl(qmul + 16);
+
+	/*
+	 * while ( bytes-- ) {
+	 *	uint8_t px, qx, db;
+	 *
+	 *	px    = *p ^ *dp;
+	 *	qx    = qmul[*q ^ *dq];
+	 *	*dq++ = db = pbmul[px] ^ qx;
+	 *	*dp++ = db ^ px;
+	 *	p++; q++;
+	 * }
+	 */
+	while (bytes) {
+		uint8x16_t px, qx, db;
+
+		px = veorq_u8(vld1q_u8(p), vld1q_u8(dp));
+		qx = gfmul(qm0, qm1, veorq_u8(vld1q_u8(q), vld1q_u8(dq)));
+		db = veorq_u8(gfmul(pm0, pm1, px), qx);
+
+		vst1q_u8(dq, db);
+		vst1q_u8(dp, veorq_u8(db, px));
+
+		bytes -= 16;
+		p += 16;
+		q += 16;
+		dp += 16;
+		dq += 16;
+	}
+}
+
+void __raid6_datap_recov_neon(int bytes, uint8_t *p, uint8_t *q, uint8_t *dq,
+			      const uint8_t *qmul)
+{
+	uint8x8x2_t qm0 = load_tbl(qmul);
+	uint8x8x2_t qm1 = load_tbl(qmul + 16);
+
+	/*
+	 * while (bytes--) {
+	 *	*p++ ^= *dq = qmul[*q ^ *dq];
+	 *	q++; dq++;
+	 * }
+	 */
+	while (bytes) {
+		uint8x16_t vx;
+
+		vx = gfmul(qm0, qm1, veorq_u8(vld1q_u8(q), vld1q_u8(dq)));
+
+		vst1q_u8(dq, vx);
+		vst1q_u8(p, veorq_u8(vx, vld1q_u8(p)));
+
+		bytes -= 16;
+		p += 16;
+		q += 16;
+		dq += 16;
+	}
+}
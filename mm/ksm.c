@@ -78,6 +78,22 @@
  *    take 10 attempts to find a page in the unstable tree, once it is found,
  *    it is secured in the stable tree.  (When we scan a new page, we first
  *    compare it against the stable tree, and then against the unstable tree.)
+ *
+ * Both trees are sorted by a hash of a sample of each page's contents first,
+ * and by the full contents only among pages with the same hash: most steps
+ * of a search then cost a comparison of two hashes rather than of two pages.
+ * In the unstable tree, this also means a node's position no longer depends
+ * on contents which might have changed since it was inserted.
+ *
+ * There is a stable and an unstable tree for each NUMA node, and a page is
+ * only ever merged with pages on its own node: a ksm page shared from a
+ * remote node would slow down every access to it.
+ *
+ * Several ksmd threads may scan at once.  Each claims one mm_slot at a time
+ * from the list, so they share out the mms between them, and one tree lock
+ * per node serializes their searches and merges.  A thread holding a tree
+ * lock takes the mmap_sem of other mms, so the tree locks are never taken
+ * while holding an mmap_sem.
  */
 
 /**
@@ -86,28 +102,46 @@
  * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
  * @rmap_list: head for this mm_slot's singly-linked list of rmap_items
  * @mm: the mm that this information is valid for
+ * @scanning: set while a ksmd thread has claimed this mm_slot
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct rmap_item *rmap_list;
 	struct mm_struct *mm;
+	int scanning;
 };
 
 /**
  * struct ksm_scan - cursor for scanning
- * @mm_slot: the current mm_slot we are scanning
+ * @mm_slot: the mm_slot being scanned, or NULL between mm_slots
  * @address: the next address inside that to be scanned
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
- * @seqnr: count of completed full scans (needed when removing unstable node)
+ * @stale: rmap_items dropped from the mm_slot under mmap_sem, linked by
+ *         their rmap_list, which still have to be taken out of the trees
+ * @thread: the ksmd thread this cursor belongs to
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is one ksm_scan for each ksmd thread.
  */
 struct ksm_scan {
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item **rmap_list;
-	unsigned long seqnr;
+	struct rmap_item *stale;
+	struct task_struct *thread;
+};
+
+/**
+ * struct ksm_node - the trees of a NUMA node
+ * @stable_tree: ksm pages on this node
+ * @unstable_tree: pages on this node found unchanged during this full scan
+ * @lock: protects both trees, and the hlists of the stable tree's nodes
+ *        along with the ksm page lock
+ */
+struct ksm_node {
+	struct rb_root stable_tree;
+	struct rb_root unstable_tree;
+	struct mutex lock;
 };
 
 /**
@@ -115,11 +149,15 @@ struct ksm_scan {
  * @node: rb node of this ksm page in the stable tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page
+ * @checksum: sampled hash of the ksm page, the first key of the tree
+ * @nid: NUMA node of the stable tree this node is in
  */
 struct stable_node {
 	struct rb_node node;
 	struct hlist_head hlist;
 	unsigned long kpfn;
+	unsigned int checksum;
+	int nid;
 };
 
 /**
@@ -128,7 +166,9 @@ struct stable_node {
  * @anon_vma: pointer to anon_vma for this mm,address, when in stable tree
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
- * @oldchecksum: previous checksum of the page at that virtual address
+ * @oldchecksum: previous full-page checksum of the page at that virtual
+ *	address, and the first key of the unstable tree
+ * @nid: NUMA node of the tree this rmap_item was last put in, else NUMA_NO_NODE
  * @node: rb node of this rmap_item in the unstable tree
  * @head: pointer to stable_node heading this list in the stable tree
  * @hlist: link into hlist of rmap_items hanging off that stable_node
@@ -139,6 +179,7 @@ struct rmap_item {
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
 	unsigned int oldchecksum;	/* when unstable */
+	int nid;
 	union {
 		struct rb_node node;	/* when node of unstable tree */
 		struct {		/* when listed from stable tree */
@@ -152,9 +193,8 @@ struct rmap_item {
 #define UNSTABLE_FLAG	0x100	/* is a node of the unstable tree */
 #define STABLE_FLAG	0x200	/* is listed from the stable tree */
 
-/* The stable and unstable tree heads */
-static struct rb_root root_stable_tree = RB_ROOT;
-static struct rb_root root_unstable_tree = RB_ROOT;
+/* The stable and unstable trees, indexed by node id */
+static struct ksm_node *ksm_nodes;
 
 #define MM_SLOTS_HASH_SHIFT 10
 #define MM_SLOTS_HASH_HEADS (1 << MM_SLOTS_HASH_SHIFT)
@@ -163,27 +203,55 @@ static struct hlist_head mm_slots_hash[MM_SLOTS_HASH_HEADS];
 static struct mm_slot ksm_mm_head = {
 	.mm_list = LIST_HEAD_INIT(ksm_mm_head.mm_list),
 };
-static struct ksm_scan ksm_scan = {
-	.mm_slot = &ksm_mm_head,
-};
+
+/*
+ * The next mm_slot for a ksmd thread to claim; &ksm_mm_head once every
+ * mm_slot has been claimed in this full scan.  The scan is complete when
+ * the last claimed mm_slot is done with.
+ */
+static struct mm_slot *ksm_mm_next = &ksm_mm_head;
+
+/* The number of ksmd threads holding an mm_slot */
+static int ksm_nr_scanning;
+
+/* Count of completed full scans (needed when removing unstable node) */
+static unsigned long ksm_seqnr;
+
+#define KSM_MAX_THREADS	32
+static struct ksm_scan ksm_scans[KSM_MAX_THREADS];
+static unsigned int ksm_nr_threads;
 
 static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
 static struct kmem_cache *mm_slot_cache;
 
 /* The number of nodes in the stable tree */
-static unsigned long ksm_pages_shared;
+static atomic_long_t ksm_pages_shared = ATOMIC_LONG_INIT(0);
 
 /* The number of page slots additionally sharing those nodes */
-static unsigned long ksm_pages_sharing;
+static atomic_long_t ksm_pages_sharing = ATOMIC_LONG_INIT(0);
 
 /* The number of nodes in the unstable tree */
-static unsigned long ksm_pages_unshared;
+static atomic_long_t ksm_pages_unshared = ATOMIC_LONG_INIT(0);
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items = ATOMIC_LONG_INIT(0);
 
-/* Number of pages ksmd should scan in one batch */
+/* The number of pages scanned, and merged into ksm pages, ever */
+static atomic_long_t ksm_pages_scanned = ATOMIC_LONG_INIT(0);
+static atomic_long_t ksm_pages_merged = ATOMIC_LONG_INIT(0);
+
+/*
+ * Pages scanned and merged per second over the last full scan, and what
+ * they are worked out from; under ksm_mmlist_lock.
+ */
+static unsigned long ksm_scan_rate;
+static unsigned long ksm_merge_rate;
+static unsigned long ksm_pass_start;
+static unsigned long ksm_pass_scanned;
+static unsigned long ksm_pass_merged;
+
+/* Number of pages each ksmd thread should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
 
 /* Milliseconds ksmd should sleep between batches */
@@ -194,8 +262,13 @@ static unsigned int ksm_thread_sleep_millisecs = 20;
 #define KSM_RUN_UNMERGE	2
 static unsigned int ksm_run = KSM_RUN_STOP;
 
+/*
+ * ksmd threads hold ksm_thread_sem for read while they scan, so that
+ * unmerging everything and memory hotremove can lock them all out.
+ */
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+static DECLARE_RWSEM(ksm_thread_sem);
+static DEFINE_MUTEX(ksm_threads_mutex);	/* serializes nr_threads changes */
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
@@ -239,14 +312,16 @@ static inline struct rmap_item *alloc_rmap_item(void)
 	struct rmap_item *rmap_item;
 
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
-	if (rmap_item)
-		ksm_rmap_items++;
+	if (rmap_item) {
+		rmap_item->nid = NUMA_NO_NODE;
+		atomic_long_inc(&ksm_rmap_items);
+	}
 	return rmap_item;
 }
 
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -450,15 +525,15 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
 
 	hlist_for_each_entry(rmap_item, hlist, &stable_node->hlist, hlist) {
 		if (rmap_item->hlist.next)
-			ksm_pages_sharing--;
+			atomic_long_dec(&ksm_pages_sharing);
 		else
-			ksm_pages_shared--;
+			atomic_long_dec(&ksm_pages_shared);
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
 		cond_resched();
 	}
 
-	rb_erase(&stable_node->node, &root_stable_tree);
+	rb_erase(&stable_node->node, &ksm_nodes[stable_node->nid].stable_tree);
 	free_stable_node(stable_node);
 }
 
@@ -480,7 +555,7 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
  * a page to put something that might look like our key in page->mapping.
  *
  * include/linux/pagemap.h page_cache_get_speculative() is a good reference,
- * but this is different - made simpler by ksm_thread_mutex being held, but
+ * but this is different - made simpler by the tree lock being held, but
  * interesting for assuming that no other use of the struct page could ever
  * put our expected_mapping into page->mapping (or a field of the union which
  * coincides with page->mapping).  The RCU calls are not for KSM at all, but
@@ -519,8 +594,9 @@ stale:
 /*
  * Removing rmap_item from stable or unstable tree.
  * This function will clean the information from the stable/unstable tree.
+ * Called with the lock of the rmap_item's node held.
  */
-static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+static void __remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 {
 	if (rmap_item->address & STABLE_FLAG) {
 		struct stable_node *stable_node;
@@ -537,9 +613,9 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		put_page(page);
 
 		if (stable_node->hlist.first)
-			ksm_pages_sharing--;
+			atomic_long_dec(&ksm_pages_sharing);
 		else
-			ksm_pages_shared--;
+			atomic_long_dec(&ksm_pages_shared);
 
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
@@ -548,23 +624,52 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		unsigned char age;
 		/*
 		 * Usually ksmd can and must skip the rb_erase, because
-		 * root_unstable_tree was already reset to RB_ROOT.
+		 * the unstable tree was already reset to RB_ROOT.
 		 * But be careful when an mm is exiting: do the rb_erase
 		 * if this rmap_item was inserted by this scan, rather
 		 * than left over from before.
 		 */
-		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
+		age = (unsigned char)(ksm_seqnr - rmap_item->address);
 		BUG_ON(age > 1);
 		if (!age)
-			rb_erase(&rmap_item->node, &root_unstable_tree);
+			rb_erase(&rmap_item->node,
+				 &ksm_nodes[rmap_item->nid].unstable_tree);
 
-		ksm_pages_unshared--;
+		atomic_long_dec(&ksm_pages_unshared);
 		rmap_item->address &= PAGE_MASK;
 	}
 out:
 	cond_resched();		/* we're called from many long loops */
 }
 
+/*
+ * Another ksmd thread may be moving this rmap_item from the unstable tree
+ * to the stable tree, clearing its flags on the way: so whether it is in
+ * a tree can only be told under the tree lock.  But an rmap_item which
+ * has not been put in a tree since it was last removed, so has no nid,
+ * cannot be found by any other thread.
+ */
+static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+{
+	struct ksm_node *node;
+
+	if (rmap_item->nid == NUMA_NO_NODE) {
+		cond_resched();
+		return;
+	}
+
+	node = &ksm_nodes[rmap_item->nid];
+	mutex_lock(&node->lock);
+	__remove_rmap_item_from_tree(rmap_item);
+	rmap_item->nid = NUMA_NO_NODE;
+	mutex_unlock(&node->lock);
+}
+
+/*
+ * Only called with ksm_thread_sem held for write, when no ksmd thread can
+ * hold a tree lock: otherwise rmap_items found under mmap_sem must go
+ * through stale_rmap_item() instead.
+ */
 static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
 				       struct rmap_item **rmap_list)
 {
@@ -576,6 +681,36 @@ static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
 	}
 }
 
+/*
+ * Unlinks the rmap_item at *rmap_list from its mm_slot and puts it on the
+ * stale list of scan.  ksmd finds rmap_items to drop while holding the
+ * mmap_sem of their mm, but can't take a tree lock there: another ksmd
+ * thread might hold it while waiting for that same mmap_sem.
+ */
+static void stale_rmap_item(struct ksm_scan *scan,
+			    struct rmap_item **rmap_list)
+{
+	struct rmap_item *rmap_item = *rmap_list;
+
+	*rmap_list = rmap_item->rmap_list;
+	rmap_item->rmap_list = scan->stale;
+	scan->stale = rmap_item;
+}
+
+/*
+ * Removes the stale rmap_items of scan from the trees and frees them.
+ * Called without mmap_sem, but before the mm they point to may be freed.
+ */
+static void free_stale_rmap_items(struct ksm_scan *scan)
+{
+	while (scan->stale) {
+		struct rmap_item *rmap_item = scan->stale;
+		scan->stale = rmap_item->rmap_list;
+		remove_rmap_item_from_tree(rmap_item);
+		free_rmap_item(rmap_item);
+	}
+}
+
 /*
  * Though it's very tempting to unmerge in_stable_tree(rmap_item)s rather
  * than check every pte of a given vma, the locking doesn't quite work for
@@ -608,7 +743,9 @@ static int unmerge_ksm_pages(struct vm_area_struct *vma,
 
 #ifdef CONFIG_SYSFS
 /*
- * Only called through the sysfs control interface:
+ * Only called through the sysfs control interface, with ksm_thread_sem
+ * held for write: the ksmd threads forget where they were, and will start
+ * a new full scan when they run again.
  */
 static int unmerge_and_remove_all_rmap_items(void)
 {
@@ -616,14 +753,23 @@ static int unmerge_and_remove_all_rmap_items(void)
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
 	int err = 0;
+	int i;
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		mm_slot = ksm_scans[i].mm_slot;
+		if (mm_slot) {
+			mm_slot->scanning = 0;
+			ksm_scans[i].mm_slot = NULL;
+		}
+	}
+	ksm_nr_scanning = 0;
+	ksm_mm_next = list_entry(ksm_mm_head.mm_list.next,
 						struct mm_slot, mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
-	for (mm_slot = ksm_scan.mm_slot;
-			mm_slot != &ksm_mm_head; mm_slot = ksm_scan.mm_slot) {
+	for (mm_slot = ksm_mm_next;
+			mm_slot != &ksm_mm_head; mm_slot = ksm_mm_next) {
 		mm = mm_slot->mm;
 		down_read(&mm->mmap_sem);
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
@@ -640,7 +786,7 @@ static int unmerge_and_remove_all_rmap_items(void)
 		remove_trailing_rmap_items(mm_slot, &mm_slot->rmap_list);
 
 		spin_lock(&ksm_mmlist_lock);
-		ksm_scan.mm_slot = list_entry(mm_slot->mm_list.next,
+		ksm_mm_next = list_entry(mm_slot->mm_list.next,
 						struct mm_slot, mm_list);
 		if (ksm_test_exit(mm)) {
 			hlist_del(&mm_slot->link);
@@ -657,22 +803,53 @@ static int unmerge_and_remove_all_rmap_items(void)
 		}
 	}
 
-	ksm_scan.seqnr = 0;
+	ksm_seqnr = 0;
 	return 0;
 
 error:
 	up_read(&mm->mmap_sem);
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = &ksm_mm_head;
+	ksm_mm_next = &ksm_mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 	return err;
 }
 #endif /* CONFIG_SYSFS */
 
+/*
+ * The checksum hashes KSM_HASH_SAMPLES words spread over the page, not all
+ * of it.  It only has to tell most different pages apart cheaply: pages
+ * with the same checksum are still compared in full before being merged.
+ * It keys the stable tree, which every scanned page is looked up in.
+ */
+#define KSM_HASH_SAMPLES	128
+#define KSM_HASH_STRIDE		(PAGE_SIZE / sizeof(u32) / KSM_HASH_SAMPLES)
+/* Vary the offset within each stride, not to sample a fixed field */
+#define KSM_HASH_WORD(i)	((i) * KSM_HASH_STRIDE + (i) % KSM_HASH_STRIDE)
+
 static u32 calc_checksum(struct page *page)
+{
+	u32 checksum = 17;
+	u32 *addr = kmap_atomic(page, KM_USER0);
+	int i;
+
+	for (i = 0; i < KSM_HASH_SAMPLES; i += 2)
+		checksum = jhash_2words(addr[KSM_HASH_WORD(i)],
+					addr[KSM_HASH_WORD(i + 1)], checksum);
+	kunmap_atomic(addr, KM_USER0);
+	return checksum;
+}
+
+/*
+ * Whether a page has changed since the last scan must not depend on where
+ * it was written, so the volatility check, and with it the unstable tree,
+ * goes by a hash of the whole page.  Only pages not found in the stable
+ * tree need it.
+ */
+static u32 calc_full_checksum(struct page *page)
 {
 	u32 checksum;
 	void *addr = kmap_atomic(page, KM_USER0);
+
 	checksum = jhash2(addr, PAGE_SIZE / 4, 17);
 	kunmap_atomic(addr, KM_USER0);
 	return checksum;
@@ -977,15 +1154,17 @@ static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
 /*
  * stable_tree_search - search for page inside the stable tree
  *
- * This function checks if there is a page inside the stable tree
- * with identical content to the page that we are scanning right now.
+ * This function checks if there is a page inside the stable tree of node
+ * nid with identical content to the page that we are scanning right now,
+ * whose checksum is given.
  *
  * This function returns the stable tree node of identical content if found,
  * NULL otherwise.
  */
-static struct page *stable_tree_search(struct page *page)
+static struct page *stable_tree_search(struct page *page, int nid,
+				       unsigned int checksum)
 {
-	struct rb_node *node = root_stable_tree.rb_node;
+	struct rb_node *node = ksm_nodes[nid].stable_tree.rb_node;
 	struct stable_node *stable_node;
 
 	stable_node = page_stable_node(page);
@@ -1000,11 +1179,25 @@ static struct page *stable_tree_search(struct page *page)
 
 		cond_resched();
 		stable_node = rb_entry(node, struct stable_node, node);
+		if (checksum != stable_node->checksum) {
+			if (checksum < stable_node->checksum)
+				node = node->rb_left;
+			else
+				node = node->rb_right;
+			continue;
+		}
+
 		tree_page = get_ksm_page(stable_node);
 		if (!tree_page)
 			return NULL;
 
 		ret = memcmp_pages(page, tree_page);
+		/*
+		 * A ksm page migrated off this node stays in its tree; skip
+		 * it the way stable_tree_insert() places a replacement.
+		 */
+		if (!ret && page_to_nid(tree_page) != nid)
+			ret = 1;
 
 		if (ret < 0) {
 			put_page(tree_page);
@@ -1021,16 +1214,23 @@ static struct page *stable_tree_search(struct page *page)
 
 /*
  * stable_tree_insert - insert rmap_item pointing to new ksm page
- * into the stable tree.
+ * into the stable tree of node nid.
  *
  * This function returns the stable tree node just allocated on success,
  * NULL otherwise.
  */
-static struct stable_node *stable_tree_insert(struct page *kpage)
+static struct stable_node *stable_tree_insert(struct page *kpage, int nid)
 {
-	struct rb_node **new = &root_stable_tree.rb_node;
+	struct rb_node **new = &ksm_nodes[nid].stable_tree.rb_node;
 	struct rb_node *parent = NULL;
 	struct stable_node *stable_node;
+	unsigned int checksum;
+
+	/*
+	 * Now kpage is write-protected its checksum can't change: it may
+	 * differ from the one we searched with, if it changed before that.
+	 */
+	checksum = calc_checksum(kpage);
 
 	while (*new) {
 		struct page *tree_page;
@@ -1038,12 +1238,19 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 
 		cond_resched();
 		stable_node = rb_entry(*new, struct stable_node, node);
-		tree_page = get_ksm_page(stable_node);
-		if (!tree_page)
-			return NULL;
+		if (checksum != stable_node->checksum) {
+			ret = checksum < stable_node->checksum ? -1 : 1;
+		} else {
+			tree_page = get_ksm_page(stable_node);
+			if (!tree_page)
+				return NULL;
 
-		ret = memcmp_pages(kpage, tree_page);
-		put_page(tree_page);
+			ret = memcmp_pages(kpage, tree_page);
+			/* identical but migrated off this node: go past it */
+			if (!ret && page_to_nid(tree_page) != nid)
+				ret = 1;
+			put_page(tree_page);
+		}
 
 		parent = *new;
 		if (ret < 0)
@@ -1065,11 +1272,13 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 		return NULL;
 
 	rb_link_node(&stable_node->node, parent, new);
-	rb_insert_color(&stable_node->node, &root_stable_tree);
+	rb_insert_color(&stable_node->node, &ksm_nodes[nid].stable_tree);
 
 	INIT_HLIST_HEAD(&stable_node->hlist);
 
 	stable_node->kpfn = page_to_pfn(kpage);
+	stable_node->checksum = checksum;
+	stable_node->nid = nid;
 	set_page_stable_node(kpage, stable_node);
 
 	return stable_node;
@@ -1079,9 +1288,10 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
  * unstable_tree_search_insert - search for identical page,
  * else insert rmap_item into the unstable tree.
  *
- * This function searches for a page in the unstable tree identical to the
- * page currently being scanned; and if no identical page is found in the
- * tree, we insert rmap_item as a new object into the unstable tree.
+ * This function searches for a page in the unstable tree of node nid
+ * identical to the page currently being scanned, keyed first by the
+ * checksum in rmap_item->oldchecksum; and if no identical page is found in
+ * the tree, we insert rmap_item as a new object into the unstable tree.
  *
  * This function returns pointer to rmap_item found to be identical
  * to the currently scanned page, NULL otherwise.
@@ -1091,12 +1301,14 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
  */
 static
 struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
-					      struct page *page,
+					      struct page *page, int nid,
 					      struct page **tree_pagep)
 
 {
-	struct rb_node **new = &root_unstable_tree.rb_node;
+	struct rb_root *root = &ksm_nodes[nid].unstable_tree;
+	struct rb_node **new = &root->rb_node;
 	struct rb_node *parent = NULL;
+	unsigned int checksum = rmap_item->oldchecksum;
 
 	while (*new) {
 		struct rmap_item *tree_rmap_item;
@@ -1105,6 +1317,15 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 
 		cond_resched();
 		tree_rmap_item = rb_entry(*new, struct rmap_item, node);
+		parent = *new;
+		if (checksum != tree_rmap_item->oldchecksum) {
+			if (checksum < tree_rmap_item->oldchecksum)
+				new = &parent->rb_left;
+			else
+				new = &parent->rb_right;
+			continue;
+		}
+
 		tree_page = get_mergeable_page(tree_rmap_item);
 		if (IS_ERR_OR_NULL(tree_page))
 			return NULL;
@@ -1119,7 +1340,6 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 
 		ret = memcmp_pages(page, tree_page);
 
-		parent = *new;
 		if (ret < 0) {
 			put_page(tree_page);
 			new = &parent->rb_left;
@@ -1133,11 +1353,12 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 	}
 
 	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->address |= (ksm_seqnr & SEQNR_MASK);
+	rmap_item->nid = nid;
 	rb_link_node(&rmap_item->node, parent, new);
-	rb_insert_color(&rmap_item->node, &root_unstable_tree);
+	rb_insert_color(&rmap_item->node, root);
 
-	ksm_pages_unshared++;
+	atomic_long_inc(&ksm_pages_unshared);
 	return NULL;
 }
 
@@ -1151,12 +1372,14 @@ static void stable_tree_append(struct rmap_item *rmap_item,
 {
 	rmap_item->head = stable_node;
 	rmap_item->address |= STABLE_FLAG;
+	rmap_item->nid = stable_node->nid;
 	hlist_add_head(&rmap_item->hlist, &stable_node->hlist);
 
 	if (rmap_item->hlist.next)
-		ksm_pages_sharing++;
+		atomic_long_inc(&ksm_pages_sharing);
 	else
-		ksm_pages_shared++;
+		atomic_long_inc(&ksm_pages_shared);
+	atomic_long_inc(&ksm_pages_merged);
 }
 
 /*
@@ -1173,14 +1396,26 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	struct rmap_item *tree_rmap_item;
 	struct page *tree_page = NULL;
 	struct stable_node *stable_node;
+	struct ksm_node *node;
 	struct page *kpage;
 	unsigned int checksum;
-	int err;
+	int nid, err;
 
 	remove_rmap_item_from_tree(rmap_item);
 
+	/*
+	 * A ksm page forked into this mm belongs to the trees of its
+	 * stable node, any other page to those of the node it is on.
+	 */
+	stable_node = page_stable_node(page);
+	nid = stable_node ? stable_node->nid : page_to_nid(page);
+	node = &ksm_nodes[nid];
+	checksum = calc_checksum(page);
+
+	mutex_lock(&node->lock);
+
 	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(page);
+	kpage = stable_tree_search(page, nid, checksum);
 	if (kpage) {
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
@@ -1193,7 +1428,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			unlock_page(kpage);
 		}
 		put_page(kpage);
-		return;
+		goto out;
 	}
 
 	/*
@@ -1202,14 +1437,14 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
 	 */
-	checksum = calc_checksum(page);
+	checksum = calc_full_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
-		return;
+		goto out;
 	}
 
 	tree_rmap_item =
-		unstable_tree_search_insert(rmap_item, page, &tree_page);
+		unstable_tree_search_insert(rmap_item, page, nid, &tree_page);
 	if (tree_rmap_item) {
 		kpage = try_to_merge_two_pages(rmap_item, page,
 						tree_rmap_item, tree_page);
@@ -1220,10 +1455,10 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 		 * tree, and insert it instead as new node in the stable tree.
 		 */
 		if (kpage) {
-			remove_rmap_item_from_tree(tree_rmap_item);
+			__remove_rmap_item_from_tree(tree_rmap_item);
 
 			lock_page(kpage);
-			stable_node = stable_tree_insert(kpage);
+			stable_node = stable_tree_insert(kpage, nid);
 			if (stable_node) {
 				stable_tree_append(tree_rmap_item, stable_node);
 				stable_tree_append(rmap_item, stable_node);
@@ -1242,9 +1477,12 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			}
 		}
 	}
+out:
+	mutex_unlock(&node->lock);
 }
 
-static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
+static struct rmap_item *get_next_rmap_item(struct ksm_scan *scan,
+					    struct mm_slot *mm_slot,
 					    struct rmap_item **rmap_list,
 					    unsigned long addr)
 {
@@ -1256,9 +1494,7 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 			return rmap_item;
 		if (rmap_item->address > addr)
 			break;
-		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		stale_rmap_item(scan, rmap_list);
 	}
 
 	rmap_item = alloc_rmap_item();
@@ -1272,45 +1508,116 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+static void ksm_reset_unstable_trees(void)
+{
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		ksm_nodes[nid].unstable_tree = RB_ROOT;
+}
+
+/*
+ * Claims the next mm_slot for scan, starting a new full scan if the last
+ * one is complete; or returns NULL if other threads are still finishing
+ * their mm_slots of this one.  Called with ksm_mmlist_lock held.
+ */
+static struct mm_slot *ksm_claim_mm_slot(struct ksm_scan *scan,
+					 bool *new_scan)
+{
+	struct mm_slot *slot;
+
+	*new_scan = false;
+	if (ksm_mm_next == &ksm_mm_head) {
+		if (ksm_nr_scanning)
+			return NULL;
+		ksm_reset_unstable_trees();
+		ksm_pass_start = jiffies;
+		ksm_pass_scanned = atomic_long_read(&ksm_pages_scanned);
+		ksm_pass_merged = atomic_long_read(&ksm_pages_merged);
+		ksm_mm_next = list_entry(ksm_mm_head.mm_list.next,
+						struct mm_slot, mm_list);
+		*new_scan = true;
+		/*
+		 * Although our caller tested list_empty(), a racing __ksm_exit
+		 * of the last mm on the list may have removed it since then.
+		 */
+		if (ksm_mm_next == &ksm_mm_head)
+			return NULL;
+	}
+
+	slot = ksm_mm_next;
+	ksm_mm_next = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
+	slot->scanning = 1;
+	ksm_nr_scanning++;
+	scan->mm_slot = slot;
+	return slot;
+}
+
+/*
+ * Lets go of the mm_slot of scan; completes the full scan if that was the
+ * last one.  Called with ksm_mmlist_lock held.
+ */
+static void ksm_release_mm_slot(struct ksm_scan *scan)
+{
+	unsigned long scanned, merged;
+	unsigned int msecs;
+
+	scan->mm_slot->scanning = 0;
+	scan->mm_slot = NULL;
+	if (--ksm_nr_scanning || ksm_mm_next != &ksm_mm_head)
+		return;
+
+	ksm_reset_unstable_trees();
+	ksm_seqnr++;
+
+	msecs = jiffies_to_msecs(jiffies - ksm_pass_start);
+	if (msecs) {
+		scanned = atomic_long_read(&ksm_pages_scanned);
+		merged = atomic_long_read(&ksm_pages_merged);
+		scanned -= ksm_pass_scanned;
+		merged -= ksm_pass_merged;
+		ksm_scan_rate = div_u64((u64)scanned * MSEC_PER_SEC, msecs);
+		ksm_merge_rate = div_u64((u64)merged * MSEC_PER_SEC, msecs);
+	}
+}
+
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_scan *scan,
+						 struct page **page)
 {
 	struct mm_struct *mm;
 	struct mm_slot *slot;
 	struct vm_area_struct *vma;
 	struct rmap_item *rmap_item;
+	bool new_scan;
 
 	if (list_empty(&ksm_mm_head.mm_list))
 		return NULL;
 
-	slot = ksm_scan.mm_slot;
-	if (slot == &ksm_mm_head) {
-		/*
-		 * A number of pages can hang around indefinitely on per-cpu
-		 * pagevecs, raised page count preventing write_protect_page
-		 * from merging them.  Though it doesn't really matter much,
-		 * it is puzzling to see some stuck in pages_volatile until
-		 * other activity jostles them out, and they also prevented
-		 * LTP's KSM test from succeeding deterministically; so drain
-		 * them here (here rather than on entry to ksm_do_scan(),
-		 * so we don't IPI too often when pages_to_scan is set low).
-		 */
-		lru_add_drain_all();
-
-		root_unstable_tree = RB_ROOT;
-
+	slot = scan->mm_slot;
+	if (!slot) {
+next_mm:
 		spin_lock(&ksm_mmlist_lock);
-		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
+		slot = ksm_claim_mm_slot(scan, &new_scan);
 		spin_unlock(&ksm_mmlist_lock);
-		/*
-		 * Although we tested list_empty() above, a racing __ksm_exit
-		 * of the last mm on the list may have removed it since then.
-		 */
-		if (slot == &ksm_mm_head)
+		if (!slot)
 			return NULL;
-next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		if (new_scan) {
+			/*
+			 * A number of pages can hang around indefinitely on
+			 * per-cpu pagevecs, raised page count preventing
+			 * write_protect_page from merging them.  Though it
+			 * doesn't really matter much, it is puzzling to see
+			 * some stuck in pages_volatile until other activity
+			 * jostles them out, and they also prevented LTP's KSM
+			 * test from succeeding deterministically; so drain
+			 * them here (here rather than on entry to
+			 * ksm_do_scan(), so we don't IPI too often when
+			 * pages_to_scan is set low).
+			 */
+			lru_add_drain_all();
+		}
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -1318,60 +1625,59 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, scan->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (scan->address < vma->vm_start)
+			scan->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			scan->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (scan->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			*page = follow_page(vma, scan->address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				scan->address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
 			if (PageAnon(*page) ||
 			    page_trans_compound_anon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+				flush_anon_page(vma, *page, scan->address);
 				flush_dcache_page(*page);
-				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+				rmap_item = get_next_rmap_item(scan, slot,
+					scan->rmap_list, scan->address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
+					scan->rmap_list =
 							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					scan->address += PAGE_SIZE;
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
+				free_stale_rmap_items(scan);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			scan->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	while (*scan->rmap_list)
+		stale_rmap_item(scan, scan->rmap_list);
 
-	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
-						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	if (scan->address == 0) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -1381,46 +1687,57 @@ next_mm:
 		 * or when all VM_MERGEABLE areas have been unmapped (and
 		 * mmap_sem then protects against race with MADV_MERGEABLE).
 		 */
+		spin_lock(&ksm_mmlist_lock);
 		hlist_del(&slot->link);
 		list_del(&slot->mm_list);
 		spin_unlock(&ksm_mmlist_lock);
 
-		free_mm_slot(slot);
 		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
-		up_read(&mm->mmap_sem);
+	}
+	up_read(&mm->mmap_sem);
+
+	/*
+	 * Keep the mm_slot claimed until its stale rmap_items are out of
+	 * the trees, so that this full scan can't end with them still in
+	 * the unstable tree.
+	 */
+	free_stale_rmap_items(scan);
+
+	spin_lock(&ksm_mmlist_lock);
+	ksm_release_mm_slot(scan);
+	spin_unlock(&ksm_mmlist_lock);
+
+	if (scan->address == 0) {
+		free_mm_slot(slot);
 		mmdrop(mm);
-	} else {
-		spin_unlock(&ksm_mmlist_lock);
-		up_read(&mm->mmap_sem);
 	}
 
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
-		goto next_mm;
-
-	ksm_scan.seqnr++;
-	return NULL;
+	goto next_mm;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @scan - the cursor of this ksmd thread.
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_scan *scan, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
+	unsigned int scanned = 0;
 
-	while (scan_npages-- && likely(!freezing(current))) {
+	while (scanned < scan_npages && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(scan, &page);
 		if (!rmap_item)
-			return;
+			break;
 		if (!PageKsm(page) || !in_stable_tree(rmap_item))
 			cmp_and_merge_page(page, rmap_item);
 		put_page(page);
+		scanned++;
 	}
+	atomic_long_add(scanned, &ksm_pages_scanned);
 }
 
 static int ksmd_should_run(void)
@@ -1428,16 +1745,38 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+/*
+ * A ksmd thread being stopped hands the rest of its mm_slot back, to be
+ * claimed next by another thread.
+ */
+static void ksm_stop_scan(struct ksm_scan *scan)
 {
+	struct mm_slot *slot;
+
+	down_read(&ksm_thread_sem);
+	spin_lock(&ksm_mmlist_lock);
+	slot = scan->mm_slot;
+	if (slot) {
+		list_move_tail(&slot->mm_list, &ksm_mm_next->mm_list);
+		ksm_mm_next = slot;
+		ksm_release_mm_slot(scan);
+	}
+	spin_unlock(&ksm_mmlist_lock);
+	up_read(&ksm_thread_sem);
+}
+
+static int ksm_scan_thread(void *data)
+{
+	struct ksm_scan *scan = data;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
+		down_read(&ksm_thread_sem);
 		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+			ksm_do_scan(scan, ksm_thread_pages_to_scan);
+		up_read(&ksm_thread_sem);
 
 		try_to_freeze();
 
@@ -1449,9 +1788,44 @@ static int ksm_scan_thread(void *nothing)
 				ksmd_should_run() || kthread_should_stop());
 		}
 	}
+	ksm_stop_scan(scan);
 	return 0;
 }
 
+/*
+ * Starts or stops ksmd threads until there are nr of them.
+ */
+static int ksm_set_nr_threads(unsigned int nr)
+{
+	struct ksm_scan *scan;
+	struct task_struct *thread;
+	int err = 0;
+
+	mutex_lock(&ksm_threads_mutex);
+	while (ksm_nr_threads < nr) {
+		scan = &ksm_scans[ksm_nr_threads];
+		if (ksm_nr_threads)
+			thread = kthread_run(ksm_scan_thread, scan, "ksmd/%u",
+					     ksm_nr_threads);
+		else
+			thread = kthread_run(ksm_scan_thread, scan, "ksmd");
+		if (IS_ERR(thread)) {
+			printk(KERN_ERR "ksm: creating kthread failed\n");
+			err = PTR_ERR(thread);
+			break;
+		}
+		scan->thread = thread;
+		ksm_nr_threads++;
+	}
+	while (ksm_nr_threads > nr) {
+		scan = &ksm_scans[--ksm_nr_threads];
+		kthread_stop(scan->thread);
+		scan->thread = NULL;
+	}
+	mutex_unlock(&ksm_threads_mutex);
+	return err;
+}
+
 int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 		unsigned long end, int advice, unsigned long *vm_flags)
 {
@@ -1514,7 +1888,7 @@ int __ksm_enter(struct mm_struct *mm)
 	 * down a little; when fork is followed by immediate exec, we don't
 	 * want ksmd to waste time setting up and tearing down an rmap_list.
 	 */
-	list_add_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+	list_add_tail(&mm_slot->mm_list, &ksm_mm_next->mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
@@ -1534,22 +1908,24 @@ void __ksm_exit(struct mm_struct *mm)
 	/*
 	 * This process is exiting: if it's straightforward (as is the
 	 * case when ksmd was never running), free mm_slot immediately.
-	 * But if it's at the cursor or has rmap_items linked to it, use
-	 * mmap_sem to synchronize with any break_cows before pagetables
-	 * are freed, and leave the mm_slot on the list for ksmd to free.
+	 * But if it's at the cursor, being scanned, or has rmap_items linked
+	 * to it, use mmap_sem to synchronize with any break_cows before
+	 * pagetables are freed, and leave the mm_slot on the list for ksmd
+	 * to free: next in line, if it isn't being scanned already.
 	 * Beware: ksm may already have noticed it exiting and freed the slot.
 	 */
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && ksm_mm_next != mm_slot && !mm_slot->scanning) {
 		if (!mm_slot->rmap_list) {
 			hlist_del(&mm_slot->link);
 			list_del(&mm_slot->mm_list);
 			easy_to_free = 1;
 		} else {
-			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+			list_move_tail(&mm_slot->mm_list,
+				       &ksm_mm_next->mm_list);
+			ksm_mm_next = mm_slot;
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -1743,6 +2119,13 @@ out:
 	return ret;
 }
 
+/*
+ * The stable node stays in the tree it was inserted in even if @newpage is
+ * on another NUMA node: moving it would need that tree's lock, which ranks
+ * above the page lock held here.  stable_tree_search() won't merge into it
+ * there, and stable_tree_insert() lets a page still on the node in beside
+ * it.
+ */
 void ksm_migrate_page(struct page *newpage, struct page *oldpage)
 {
 	struct stable_node *stable_node;
@@ -1764,14 +2147,18 @@ static struct stable_node *ksm_check_stable_tree(unsigned long start_pfn,
 						 unsigned long end_pfn)
 {
 	struct rb_node *node;
+	int nid;
 
-	for (node = rb_first(&root_stable_tree); node; node = rb_next(node)) {
-		struct stable_node *stable_node;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		for (node = rb_first(&ksm_nodes[nid].stable_tree); node;
+		     node = rb_next(node)) {
+			struct stable_node *stable_node;
 
-		stable_node = rb_entry(node, struct stable_node, node);
-		if (stable_node->kpfn >= start_pfn &&
-		    stable_node->kpfn < end_pfn)
-			return stable_node;
+			stable_node = rb_entry(node, struct stable_node, node);
+			if (stable_node->kpfn >= start_pfn &&
+			    stable_node->kpfn < end_pfn)
+				return stable_node;
+		}
 	}
 	return NULL;
 }
@@ -1787,13 +2174,13 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/*
 		 * Keep it very simple for now: just lock out ksmd and
 		 * MADV_UNMERGEABLE while any memory is going offline.
-		 * mutex_lock_nested() is necessary because lockdep was alarmed
-		 * that here we take ksm_thread_mutex inside notifier chain
+		 * down_write_nested() is necessary because lockdep was alarmed
+		 * that here we take ksm_thread_sem inside notifier chain
 		 * mutex, and later take notifier chain mutex inside
-		 * ksm_thread_mutex to unlock it.   But that's safe because both
+		 * ksm_thread_sem to unlock it.   But that's safe because both
 		 * are inside mem_hotplug_mutex.
 		 */
-		mutex_lock_nested(&ksm_thread_mutex, SINGLE_DEPTH_NESTING);
+		down_write_nested(&ksm_thread_sem, SINGLE_DEPTH_NESTING);
 		break;
 
 	case MEM_OFFLINE:
@@ -1808,7 +2195,7 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 	}
 	return NOTIFY_OK;
@@ -1897,7 +2284,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	if (ksm_run != flags) {
 		ksm_run = flags;
 		if (flags & KSM_RUN_UNMERGE) {
@@ -1913,7 +2300,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -1925,21 +2312,21 @@ KSM_ATTR(run);
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_shared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_shared));
 }
 KSM_ATTR_RO(pages_shared);
 
 static ssize_t pages_sharing_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_sharing));
 }
 KSM_ATTR_RO(pages_sharing);
 
 static ssize_t pages_unshared_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_unshared));
 }
 KSM_ATTR_RO(pages_unshared);
 
@@ -1948,8 +2335,10 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items)
+				- atomic_long_read(&ksm_pages_shared)
+				- atomic_long_read(&ksm_pages_sharing)
+				- atomic_long_read(&ksm_pages_unshared);
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -1963,10 +2352,63 @@ KSM_ATTR_RO(pages_volatile);
 static ssize_t full_scans_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_scan.seqnr);
+	return sprintf(buf, "%lu\n", ksm_seqnr);
 }
 KSM_ATTR_RO(full_scans);
 
+static ssize_t nr_threads_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_nr_threads);
+}
+
+static ssize_t nr_threads_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long nr;
+	int err;
+
+	err = strict_strtoul(buf, 10, &nr);
+	if (err || !nr || nr > KSM_MAX_THREADS)
+		return -EINVAL;
+
+	err = ksm_set_nr_threads(nr);
+	if (err)
+		return err;
+
+	return count;
+}
+KSM_ATTR(nr_threads);
+
+static ssize_t pages_scanned_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_scanned));
+}
+KSM_ATTR_RO(pages_scanned);
+
+static ssize_t pages_merged_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_merged));
+}
+KSM_ATTR_RO(pages_merged);
+
+static ssize_t scan_rate_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_scan_rate);
+}
+KSM_ATTR_RO(scan_rate);
+
+static ssize_t merge_rate_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_merge_rate);
+}
+KSM_ATTR_RO(merge_rate);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
@@ -1976,6 +2418,11 @@ static struct attribute *ksm_attrs[] = {
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&nr_threads_attr.attr,
+	&pages_scanned_attr.attr,
+	&pages_merged_attr.attr,
+	&scan_rate_attr.attr,
+	&merge_rate_attr.attr,
 	NULL,
 };
 
@@ -1987,26 +2434,33 @@ static struct attribute_group ksm_attr_group = {
 
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
 	int err;
+	int nid;
 
 	err = ksm_slab_init();
 	if (err)
 		goto out;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
-		printk(KERN_ERR "ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
+	err = -ENOMEM;
+	ksm_nodes = kcalloc(nr_node_ids, sizeof(*ksm_nodes), GFP_KERNEL);
+	if (!ksm_nodes)
 		goto out_free;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		ksm_nodes[nid].stable_tree = RB_ROOT;
+		ksm_nodes[nid].unstable_tree = RB_ROOT;
+		mutex_init(&ksm_nodes[nid].lock);
 	}
 
+	err = ksm_set_nr_threads(1);
+	if (err)
+		goto out_free_nodes;
+
 #ifdef CONFIG_SYSFS
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
-		goto out_free;
+		ksm_set_nr_threads(0);
+		goto out_free_nodes;
 	}
 #else
 	ksm_run = KSM_RUN_MERGE;	/* no way for user to start it */
@@ -2015,13 +2469,15 @@ static int __init ksm_init(void)
 
 #ifdef CONFIG_MEMORY_HOTREMOVE
 	/*
-	 * Choose a high priority since the callback takes ksm_thread_mutex:
+	 * Choose a high priority since the callback takes ksm_thread_sem:
 	 * later callbacks could only be taking locks which nest within that.
 	 */
 	hotplug_memory_notifier(ksm_memory_callback, 100);
 #endif
 	return 0;
 
+out_free_nodes:
+	kfree(ksm_nodes);
 out_free:
 	ksm_slab_free();
 out:
@@ -0,0 +1,666 @@
+/*
+ * zswap.c - compressed cache for swap pages
+ *
+ * Pages on their way out to a swap device are compressed and kept in RAM
+ * instead, as long as they compress well and the pool stays under its
+ * size limit.  Reading them back is a decompression rather than a disk
+ * read.  Once the pool is full, the least recently used entries of the
+ * swap device being written to are decompressed and written back to it
+ * to make room.
+ *
+ * Compressed pages are kept in size classes a sixty-fourth of a page
+ * apart.  Each class carves whole pages into slots of its size and gives
+ * a page back as soon as its last slot is freed, so the size limit is
+ * checked against the pages the pool really holds.
+ *
+ * This file is released under the GPL.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/crypto.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/debugfs.h>
+#include <linux/zswap.h>
+
+static bool zswap_enabled;
+module_param_named(enabled, zswap_enabled, bool, 0644);
+
+static char *zswap_compressor = "lzo";
+module_param_named(compressor, zswap_compressor, charp, 0444);
+
+/* The pool may use at most this share of RAM. */
+static unsigned int zswap_max_pool_percent = 20;
+module_param_named(max_pool_percent, zswap_max_pool_percent, uint, 0644);
+
+/* Entries written back per store once the pool is full. */
+#define ZSWAP_WRITEBACK_BATCH	16
+
+/*
+ * Compressed sizes are rounded up to a multiple of ZSWAP_CLASS_SIZE.
+ * Pages compressing to more than ZSWAP_MAX_SIZE aren't worth keeping.
+ */
+#define ZSWAP_CLASS_SIZE	(PAGE_SIZE / 64)
+#define ZSWAP_MAX_SIZE		(PAGE_SIZE * 3 / 4)
+#define ZSWAP_NR_CLASSES	(ZSWAP_MAX_SIZE / ZSWAP_CLASS_SIZE)
+
+/*
+ * Statistics.  The counters without an atomic type are only for
+ * debugfs and are updated without locking.
+ */
+static atomic_t zswap_stored_pages = ATOMIC_INIT(0);
+static atomic_long_t zswap_pool_pages = ATOMIC_LONG_INIT(0);
+static u64 zswap_written_back_pages;
+static u64 zswap_writeback_skipped;
+static u64 zswap_reject_pool_limit;
+static u64 zswap_reject_compress_poor;
+static u64 zswap_reject_alloc_fail;
+
+/*
+ * One entry per stored page.  The tree holds a reference on every entry
+ * in it; loads and writeback take another while they use the data, so an
+ * entry invalidated meanwhile is only freed once they are done.
+ */
+struct zswap_entry {
+	struct rb_node rbnode;
+	struct list_head lru;
+	pgoff_t offset;
+	int refcount;
+	unsigned int length;
+	void *data;
+};
+
+/*
+ * One tree per swap device, indexed by swap offset, with its entries on
+ * an LRU list, least recently used first.  The lock protects the tree,
+ * the list and the entries' refcounts.
+ */
+struct zswap_tree {
+	struct rb_root rbroot;
+	struct list_head lru;
+	spinlock_t lock;
+};
+
+static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
+static bool zswap_initialized;
+
+static struct kmem_cache *zswap_entry_cache;
+
+/*
+ * The pages of a class with free slots are on its partial list, full ones
+ * are on no list.  The free slots of a page are chained through their
+ * first word; page->index is the offset of the first free slot and
+ * page_private() the number of slots in use.
+ */
+struct zswap_class {
+	spinlock_t lock;
+	struct list_head partial;
+};
+
+static struct zswap_class zswap_classes[ZSWAP_NR_CLASSES];
+
+/*
+ * Compression happens with preemption disabled, into a per-cpu buffer
+ * large enough for the worst case expansion of a page.
+ */
+static DEFINE_PER_CPU(struct crypto_comp *, zswap_tfm);
+static DEFINE_PER_CPU(u8 *, zswap_dstmem);
+
+static inline int zswap_class(unsigned int length)
+{
+	return DIV_ROUND_UP(length, ZSWAP_CLASS_SIZE) - 1;
+}
+
+static inline unsigned int zswap_class_size(int class)
+{
+	return (class + 1) * ZSWAP_CLASS_SIZE;
+}
+
+static inline unsigned int zswap_class_slots(int class)
+{
+	return PAGE_SIZE / zswap_class_size(class);
+}
+
+static bool zswap_is_full(void)
+{
+	return atomic_long_read(&zswap_pool_pages) >
+		totalram_pages * zswap_max_pool_percent / 100;
+}
+
+/*********************************
+* size class allocator
+**********************************/
+static void *zswap_class_alloc(int class, gfp_t gfp)
+{
+	struct zswap_class *c = &zswap_classes[class];
+	unsigned int size = zswap_class_size(class);
+	unsigned int off;
+	struct page *page;
+	void *obj;
+
+	spin_lock(&c->lock);
+	if (list_empty(&c->partial)) {
+		spin_unlock(&c->lock);
+		page = alloc_page(gfp);
+		if (!page)
+			return NULL;
+		obj = page_address(page);
+		for (off = 0; off + size <= PAGE_SIZE; off += size)
+			*(unsigned int *)(obj + off) = off + size;
+		page->index = 0;
+		set_page_private(page, 0);
+		atomic_long_inc(&zswap_pool_pages);
+
+		spin_lock(&c->lock);
+		list_add(&page->lru, &c->partial);
+	}
+	page = list_first_entry(&c->partial, struct page, lru);
+	obj = page_address(page) + page->index;
+	page->index = *(unsigned int *)obj;
+	set_page_private(page, page_private(page) + 1);
+	if (page_private(page) == zswap_class_slots(class))
+		list_del(&page->lru);
+	spin_unlock(&c->lock);
+	return obj;
+}
+
+static void zswap_class_free(int class, void *obj)
+{
+	struct zswap_class *c = &zswap_classes[class];
+	struct page *page = virt_to_page(obj);
+
+	spin_lock(&c->lock);
+	if (page_private(page) == zswap_class_slots(class))
+		list_add(&page->lru, &c->partial);
+	*(unsigned int *)obj = page->index;
+	page->index = obj - page_address(page);
+	set_page_private(page, page_private(page) - 1);
+	if (page_private(page)) {
+		spin_unlock(&c->lock);
+		return;
+	}
+	list_del(&page->lru);
+	spin_unlock(&c->lock);
+
+	__free_page(page);
+	atomic_long_dec(&zswap_pool_pages);
+}
+
+/*********************************
+* rbtree and entry functions
+**********************************/
+static struct zswap_entry *zswap_rb_search(struct rb_root *root,
+					   pgoff_t offset)
+{
+	struct rb_node *node = root->rb_node;
+	struct zswap_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		if (offset < entry->offset)
+			node = node->rb_left;
+		else if (offset > entry->offset)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Returns -EEXIST, with the entry in the way in @dupentry, if the offset
+ * is already taken.
+ */
+static int zswap_rb_insert(struct rb_root *root, struct zswap_entry *entry,
+			   struct zswap_entry **dupentry)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct zswap_entry *myentry;
+
+	while (*link) {
+		parent = *link;
+		myentry = rb_entry(parent, struct zswap_entry, rbnode);
+		if (entry->offset < myentry->offset)
+			link = &parent->rb_left;
+		else if (entry->offset > myentry->offset)
+			link = &parent->rb_right;
+		else {
+			*dupentry = myentry;
+			return -EEXIST;
+		}
+	}
+	rb_link_node(&entry->rbnode, parent, link);
+	rb_insert_color(&entry->rbnode, root);
+	return 0;
+}
+
+static void zswap_free_entry(struct zswap_entry *entry)
+{
+	int class = zswap_class(entry->length);
+
+	zswap_class_free(class, entry->data);
+	atomic_dec(&zswap_stored_pages);
+	kmem_cache_free(zswap_entry_cache, entry);
+}
+
+/* Called with the tree lock held. */
+static void zswap_entry_put(struct zswap_entry *entry)
+{
+	if (--entry->refcount == 0)
+		zswap_free_entry(entry);
+}
+
+/* Called with the tree lock held. */
+static void zswap_erase(struct zswap_tree *tree, struct zswap_entry *entry)
+{
+	rb_erase(&entry->rbnode, &tree->rbroot);
+	list_del(&entry->lru);
+	zswap_entry_put(entry);
+}
+
+static void zswap_decompress(struct zswap_entry *entry, struct page *page)
+{
+	struct crypto_comp *tfm;
+	unsigned int dlen = PAGE_SIZE;
+	u8 *dst;
+	int ret;
+
+	tfm = get_cpu_var(zswap_tfm);
+	dst = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_decompress(tfm, entry->data, entry->length,
+				     dst, &dlen);
+	kunmap_atomic(dst, KM_USER0);
+	put_cpu_var(zswap_tfm);
+	BUG_ON(ret || dlen != PAGE_SIZE);
+}
+
+/*********************************
+* writeback
+**********************************/
+/*
+ * Decompresses @entry into a new swap cache page and writes that to the
+ * swap device, then drops the entry: the swap cache has the data now.
+ * The caller holds a reference on @entry.
+ *
+ * Returns -EEXIST if the page is in the swap cache already, so reclaim
+ * will deal with it, or if the slot has been freed and reused since the
+ * entry was picked.
+ */
+static int zswap_writeback_entry(struct zswap_tree *tree, unsigned type,
+				 struct zswap_entry *entry)
+{
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+	struct page *page;
+	bool page_was_allocated;
+
+	page = __read_swap_cache_async(swp_entry(type, entry->offset),
+				       GFP_NOIO, NULL, 0, &page_was_allocated);
+	if (!page)
+		return -ENOMEM;
+	if (!page_was_allocated) {
+		page_cache_release(page);
+		return -EEXIST;
+	}
+
+	/*
+	 * The new page pins the slot, so once the entry is seen to be still
+	 * current it stays so until the page leaves the swap cache.
+	 */
+	spin_lock(&tree->lock);
+	if (zswap_rb_search(&tree->rbroot, entry->offset) != entry) {
+		spin_unlock(&tree->lock);
+		delete_from_swap_cache(page);
+		unlock_page(page);
+		page_cache_release(page);
+		return -EEXIST;
+	}
+	spin_unlock(&tree->lock);
+
+	zswap_decompress(entry, page);
+	SetPageUptodate(page);
+	/* Rotate it to the tail of the inactive list once it is written. */
+	SetPageReclaim(page);
+	__swap_writepage(page, &wbc);
+	page_cache_release(page);
+
+	spin_lock(&tree->lock);
+	if (zswap_rb_search(&tree->rbroot, entry->offset) == entry)
+		zswap_erase(tree, entry);
+	spin_unlock(&tree->lock);
+	return 0;
+}
+
+/*
+ * Writes back entries from the head of @tree's LRU until the pool is
+ * below its limit, at most ZSWAP_WRITEBACK_BATCH of them.
+ */
+static void zswap_writeback(struct zswap_tree *tree, unsigned type)
+{
+	struct zswap_entry *entry;
+	int i;
+
+	for (i = 0; i < ZSWAP_WRITEBACK_BATCH && zswap_is_full(); i++) {
+		spin_lock(&tree->lock);
+		if (list_empty(&tree->lru)) {
+			spin_unlock(&tree->lock);
+			break;
+		}
+		entry = list_first_entry(&tree->lru, struct zswap_entry, lru);
+		/* Rotate it, so a skipped entry isn't picked again soon. */
+		list_move_tail(&entry->lru, &tree->lru);
+		entry->refcount++;
+		spin_unlock(&tree->lock);
+
+		if (zswap_writeback_entry(tree, type, entry))
+			zswap_writeback_skipped++;
+		else
+			zswap_written_back_pages++;
+
+		spin_lock(&tree->lock);
+		zswap_entry_put(entry);
+		spin_unlock(&tree->lock);
+	}
+}
+
+/*********************************
+* swap hooks
+**********************************/
+/*
+ * Called from swap_writepage() with @page locked and in the swap cache.
+ * Returns 0 if the page was stored, in which case it must not be written
+ * to the swap device.
+ */
+int zswap_store(struct page *page)
+{
+	swp_entry_t swpentry = { .val = page_private(page) };
+	unsigned type = swp_type(swpentry);
+	pgoff_t offset = swp_offset(swpentry);
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry, *dupentry;
+	struct crypto_comp *tfm;
+	unsigned int dlen = PAGE_SIZE * 2;
+	u8 *src, *dst;
+	int class, ret;
+
+	if (!tree)
+		return -ENODEV;
+
+	/*
+	 * A copy from an earlier store of this page must not survive it:
+	 * if the page goes to the swap device this time, the copy is stale.
+	 */
+	zswap_invalidate_page(type, offset);
+	if (!zswap_enabled)
+		return -ENODEV;
+
+	if (zswap_is_full()) {
+		zswap_writeback(tree, type);
+		if (zswap_is_full()) {
+			zswap_reject_pool_limit++;
+			return -ENOMEM;
+		}
+	}
+
+	entry = kmem_cache_alloc(zswap_entry_cache,
+				 GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+	if (!entry) {
+		zswap_reject_alloc_fail++;
+		return -ENOMEM;
+	}
+
+	tfm = get_cpu_var(zswap_tfm);
+	dst = __get_cpu_var(zswap_dstmem);
+	src = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(tfm, src, PAGE_SIZE, dst, &dlen);
+	kunmap_atomic(src, KM_USER0);
+	if (ret || dlen > ZSWAP_MAX_SIZE) {
+		put_cpu_var(zswap_tfm);
+		zswap_reject_compress_poor++;
+		ret = -E2BIG;
+		goto free_entry;
+	}
+
+	class = zswap_class(dlen);
+	entry->data = zswap_class_alloc(class,
+				GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN);
+	if (!entry->data) {
+		put_cpu_var(zswap_tfm);
+		zswap_reject_alloc_fail++;
+		ret = -ENOMEM;
+		goto free_entry;
+	}
+	memcpy(entry->data, dst, dlen);
+	put_cpu_var(zswap_tfm);
+
+	entry->offset = offset;
+	entry->length = dlen;
+	entry->refcount = 1;
+	atomic_inc(&zswap_stored_pages);
+
+	spin_lock(&tree->lock);
+	while (zswap_rb_insert(&tree->rbroot, entry, &dupentry) == -EEXIST)
+		zswap_erase(tree, dupentry);
+	list_add_tail(&entry->lru, &tree->lru);
+	spin_unlock(&tree->lock);
+	return 0;
+
+free_entry:
+	kmem_cache_free(zswap_entry_cache, entry);
+	return ret;
+}
+
+/*
+ * Called from swap_readpage() with @page locked and in the swap cache.
+ * Returns 0 if the page was filled from the pool.  The entry stays, as
+ * the page may be reclaimed again without being written.
+ */
+int zswap_load(struct page *page)
+{
+	swp_entry_t swpentry = { .val = page_private(page) };
+	pgoff_t offset = swp_offset(swpentry);
+	struct zswap_tree *tree = zswap_trees[swp_type(swpentry)];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return -ENOENT;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (!entry) {
+		spin_unlock(&tree->lock);
+		return -ENOENT;
+	}
+	entry->refcount++;
+	list_move_tail(&entry->lru, &tree->lru);
+	spin_unlock(&tree->lock);
+
+	zswap_decompress(entry, page);
+
+	spin_lock(&tree->lock);
+	zswap_entry_put(entry);
+	spin_unlock(&tree->lock);
+	return 0;
+}
+
+/*
+ * Called when a swap slot is freed, with swap_lock held.
+ */
+void zswap_invalidate_page(unsigned type, pgoff_t offset)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (entry)
+		zswap_erase(tree, entry);
+	spin_unlock(&tree->lock);
+}
+
+void zswap_init_area(unsigned type)
+{
+	struct zswap_tree *tree;
+
+	if (!zswap_initialized)
+		return;
+
+	tree = kzalloc(sizeof(*tree), GFP_KERNEL);
+	if (!tree) {
+		pr_err("no memory for swap device %u\n", type);
+		return;
+	}
+	tree->rbroot = RB_ROOT;
+	INIT_LIST_HEAD(&tree->lru);
+	spin_lock_init(&tree->lock);
+	zswap_trees[type] = tree;
+}
+
+/*
+ * Called on swapoff, once every page has been read back in, with
+ * swapon_mutex and swap_lock held so that swapon can't reuse @type yet.
+ */
+void zswap_invalidate_area(unsigned type)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry, *n;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	list_for_each_entry_safe(entry, n, &tree->lru, lru)
+		zswap_erase(tree, entry);
+	spin_unlock(&tree->lock);
+	zswap_trees[type] = NULL;
+	kfree(tree);
+}
+
+/*********************************
+* debugfs
+**********************************/
+#ifdef CONFIG_DEBUG_FS
+static int zswap_stored_pages_get(void *data, u64 *val)
+{
+	*val = atomic_read(&zswap_stored_pages);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_stored_pages_fops, zswap_stored_pages_get,
+			NULL, "%llu\n");
+
+static int zswap_pool_bytes_get(void *data, u64 *val)
+{
+	*val = (u64)atomic_long_read(&zswap_pool_pages) << PAGE_SHIFT;
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_pool_bytes_fops, zswap_pool_bytes_get,
+			NULL, "%llu\n");
+
+static void __init zswap_debugfs_init(void)
+{
+	struct dentry *root;
+
+	root = debugfs_create_dir("zswap", NULL);
+	if (IS_ERR_OR_NULL(root))
+		return;
+
+	debugfs_create_file("stored_pages", S_IRUGO, root, NULL,
+			    &zswap_stored_pages_fops);
+	debugfs_create_file("pool_total_size", S_IRUGO, root, NULL,
+			    &zswap_pool_bytes_fops);
+	debugfs_create_u64("written_back_pages", S_IRUGO, root,
+			   &zswap_written_back_pages);
+	debugfs_create_u64("writeback_skipped", S_IRUGO, root,
+			   &zswap_writeback_skipped);
+	debugfs_create_u64("reject_pool_limit", S_IRUGO, root,
+			   &zswap_reject_pool_limit);
+	debugfs_create_u64("reject_compress_poor", S_IRUGO, root,
+			   &zswap_reject_compress_poor);
+	debugfs_create_u64("reject_alloc_fail", S_IRUGO, root,
+			   &zswap_reject_alloc_fail);
+}
+#else
+static inline void zswap_debugfs_init(void)
+{
+}
+#endif
+
+/*********************************
+* init
+**********************************/
+static void zswap_free_percpu(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm = per_cpu(zswap_tfm, cpu);
+
+		if (tfm)
+			crypto_free_comp(tfm);
+		per_cpu(zswap_tfm, cpu) = NULL;
+		kfree(per_cpu(zswap_dstmem, cpu));
+		per_cpu(zswap_dstmem, cpu) = NULL;
+	}
+}
+
+
+/*
+ * A late initcall, so that a built-in compressor has registered itself.
+ */
+static int __init zswap_init(void)
+{
+	struct crypto_comp *tfm;
+	int cpu, i;
+
+	zswap_entry_cache = KMEM_CACHE(zswap_entry, 0);
+	if (!zswap_entry_cache)
+		goto nomem;
+	for (i = 0; i < ZSWAP_NR_CLASSES; i++) {
+		spin_lock_init(&zswap_classes[i].lock);
+		INIT_LIST_HEAD(&zswap_classes[i].partial);
+	}
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(zswap_compressor, 0, 0);
+		if (IS_ERR(tfm)) {
+			pr_err("compressor %s not available\n",
+			       zswap_compressor);
+			goto error;
+		}
+		per_cpu(zswap_tfm, cpu) = tfm;
+		per_cpu(zswap_dstmem, cpu) = kmalloc_node(PAGE_SIZE * 2,
+						GFP_KERNEL, cpu_to_node(cpu));
+		if (!per_cpu(zswap_dstmem, cpu))
+			goto nomem;
+	}
+
+	zswap_debugfs_init();
+	zswap_initialized = true;
+	pr_info("using %s compressor, %s\n", zswap_compressor,
+		zswap_enabled ? "enabled" : "disabled");
+	return 0;
+
+nomem:
+	pr_err("no memory for the pool\n");
+error:
+	zswap_free_percpu();
+	if (zswap_entry_cache)
+		kmem_cache_destroy(zswap_entry_cache);
+	return -ENOMEM;
+}
+late_initcall(zswap_init);
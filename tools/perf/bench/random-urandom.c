@@ -0,0 +1,163 @@
+/*
+ *
+ * random-urandom.c
+ *
+ * urandom: Benchmark for read() on /dev/urandom
+ *
+ * A number of threads read /dev/urandom in parallel for a fixed time,
+ * by default once for each power of two up to the number of online
+ * CPUs, so that scaling across CPUs shows up directly.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define BLOCK_SIZE_DEFAULT	4096
+#define RUNTIME_DEFAULT		1
+
+static int nr_threads;
+static int block_size = BLOCK_SIZE_DEFAULT;
+static int runtime = RUNTIME_DEFAULT;
+
+static const struct option options[] = {
+	OPT_INTEGER('t', "threads", &nr_threads,
+		    "Specify number of threads (default: sweep up to nr CPUs)"),
+	OPT_INTEGER('b', "block-size", &block_size,
+		    "Specify size of each read in bytes"),
+	OPT_INTEGER('r', "runtime", &runtime,
+		    "Specify seconds to run each thread count for"),
+	OPT_END()
+};
+
+static const char * const bench_random_urandom_usage[] = {
+	"perf bench random urandom <options>",
+	NULL
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned long long bytes;
+};
+
+static volatile int done;
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	char *buf;
+	ssize_t ret;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	assert(fd >= 0);
+	buf = malloc(block_size);
+	assert(buf);
+
+	while (!done) {
+		ret = read(fd, buf, block_size);
+		assert(ret > 0);
+		w->bytes += ret;
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static double run(int threads)
+{
+	struct timeval start, stop, diff;
+	struct worker *workers;
+	unsigned long long total = 0;
+	int i;
+
+	workers = calloc(threads, sizeof(*workers));
+	assert(workers);
+
+	done = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++)
+		assert(!pthread_create(&workers[i].thread, NULL,
+				       worker_fn, &workers[i]));
+
+	sleep(runtime);
+	done = 1;
+
+	for (i = 0; i < threads; i++) {
+		assert(!pthread_join(workers[i].thread, NULL));
+		total += workers[i].bytes;
+	}
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+	free(workers);
+
+	return (double)total /
+		((double)diff.tv_sec * 1000000 + diff.tv_usec);
+}
+
+static void report(int threads, double mbps)
+{
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf(" %8d thread%s: %12.3f MB/sec\n",
+		       threads, threads == 1 ? " " : "s", mbps);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%d %.3f\n", threads, mbps);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+}
+
+int bench_random_urandom(int argc, const char **argv,
+			 const char *prefix __used)
+{
+	int threads, max_threads;
+
+	argc = parse_options(argc, argv, options,
+			     bench_random_urandom_usage, 0);
+
+	if (nr_threads < 0 || block_size <= 0 || runtime <= 0) {
+		fprintf(stderr, "Invalid thread count, block size or runtime\n");
+		return 1;
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# Reading /dev/urandom in %d byte blocks, %d sec per run\n\n",
+		       block_size, runtime);
+
+	if (nr_threads) {
+		report(nr_threads, run(nr_threads));
+		return 0;
+	}
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 1)
+		max_threads = 1;
+
+	for (threads = 1; threads < max_threads; threads *= 2)
+		report(threads, run(threads));
+	report(max_threads, run(max_threads));
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ *
+ * sched-sem.c
+ *
+ * sem: Benchmark for semop() scalability
+ *
+ * A number of threads share one SysV semaphore array with one semaphore
+ * per thread, the way database backends typically use it, and each
+ * thread increments and decrements its own semaphore for a fixed time.
+ * By default it runs once for each power of two up to the number of
+ * online CPUs.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+
+#define RUNTIME_DEFAULT		1
+
+static int nr_threads;
+static int runtime = RUNTIME_DEFAULT;
+static bool single_sem;
+static bool complex_ops;
+
+static const struct option options[] = {
+	OPT_INTEGER('t', "threads", &nr_threads,
+		    "Specify number of threads (default: sweep up to nr CPUs)"),
+	OPT_INTEGER('r', "runtime", &runtime,
+		    "Specify seconds to run each thread count for"),
+	OPT_BOOLEAN('s', "single", &single_sem,
+		    "All threads operate on the same semaphore"),
+	OPT_BOOLEAN('c', "complex", &complex_ops,
+		    "Increment and decrement in one two-sop semop() call"),
+	OPT_END()
+};
+
+static const char * const bench_sched_sem_usage[] = {
+	"perf bench sched sem <options>",
+	NULL
+};
+
+struct worker {
+	pthread_t thread;
+	int semid;
+	unsigned short semnum;
+	unsigned long long ops;
+};
+
+static volatile int done;
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct sembuf up = { w->semnum, 1, 0 };
+	struct sembuf down = { w->semnum, -1, 0 };
+	struct sembuf both[2] = { up, down };
+
+	while (!done) {
+		if (complex_ops) {
+			assert(!semop(w->semid, both, 2));
+			w->ops++;
+		} else {
+			assert(!semop(w->semid, &up, 1));
+			assert(!semop(w->semid, &down, 1));
+			w->ops += 2;
+		}
+	}
+
+	return NULL;
+}
+
+static double run(int threads)
+{
+	struct timeval start, stop, diff;
+	struct worker *workers;
+	unsigned long long total = 0;
+	int semid, i;
+
+	semid = semget(IPC_PRIVATE, single_sem ? 1 : threads, IPC_CREAT | 0600);
+	if (semid < 0)
+		die("semget");
+
+	workers = calloc(threads, sizeof(*workers));
+	assert(workers);
+
+	done = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++) {
+		workers[i].semid = semid;
+		workers[i].semnum = single_sem ? 0 : i;
+		assert(!pthread_create(&workers[i].thread, NULL,
+				       worker_fn, &workers[i]));
+	}
+
+	sleep(runtime);
+	done = 1;
+
+	for (i = 0; i < threads; i++) {
+		assert(!pthread_join(workers[i].thread, NULL));
+		total += workers[i].ops;
+	}
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+	free(workers);
+	semctl(semid, 0, IPC_RMID);
+
+	return (double)total * 1000000 /
+		((double)diff.tv_sec * 1000000 + diff.tv_usec);
+}
+
+static void report(int threads, double ops)
+{
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf(" %8d thread%s: %14.0f ops/sec\n",
+		       threads, threads == 1 ? " " : "s", ops);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%d %.0f\n", threads, ops);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+}
+
+int bench_sched_sem(int argc, const char **argv,
+		    const char *prefix __used)
+{
+	int threads, max_threads;
+
+	argc = parse_options(argc, argv, options,
+			     bench_sched_sem_usage, 0);
+
+	if (nr_threads < 0 || runtime <= 0) {
+		fprintf(stderr, "Invalid thread count or runtime\n");
+		return 1;
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# %s semop() on %s, %d sec per run\n\n",
+		       complex_ops ? "Two-sop" : "Single-sop",
+		       single_sem ? "one shared semaphore" :
+		       "one semaphore per thread", runtime);
+
+	if (nr_threads) {
+		report(nr_threads, run(nr_threads));
+		return 0;
+	}
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 1)
+		max_threads = 1;
+
+	for (threads = 1; threads < max_threads; threads *= 2)
+		report(threads, run(threads));
+	report(max_threads, run(max_threads));
+
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ *
+ * tty-pty.c
+ *
+ * pty: Benchmark for bulk input through a pseudo terminal
+ *
+ * The parent writes to the master side of a pty while a child reads
+ * from the slave, so every byte passes through the slave's line
+ * discipline.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LOOPS_DEFAULT		16384
+#define BLOCK_SIZE_DEFAULT	4096
+
+static int loops = LOOPS_DEFAULT;
+static int block_size = BLOCK_SIZE_DEFAULT;
+static bool cooked;
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of blocks to write"),
+	OPT_INTEGER('b', "block-size", &block_size,
+		    "Specify size of each write in bytes"),
+	OPT_BOOLEAN('c', "cooked", &cooked,
+		    "Non-canonical mode with input processing, instead of raw"),
+	OPT_END()
+};
+
+static const char * const bench_tty_pty_usage[] = {
+	"perf bench tty pty <options>",
+	NULL
+};
+
+static void setup_slave(int fd)
+{
+	struct termios tio;
+
+	assert(!tcgetattr(fd, &tio));
+	if (cooked) {
+		/* what a typical full screen application asks for */
+		tio.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHOK | ECHONL);
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+	} else {
+		cfmakeraw(&tio);
+	}
+	assert(!tcsetattr(fd, TCSANOW, &tio));
+}
+
+int bench_tty_pty(int argc, const char **argv,
+		  const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	unsigned long long total, done = 0;
+	unsigned long long result_usec;
+	int master, slave, i, wait_stat;
+	pid_t pid, retpid;
+	ssize_t ret;
+	char *buf;
+
+	argc = parse_options(argc, argv, options,
+			     bench_tty_pty_usage, 0);
+
+	if (loops <= 0 || block_size <= 0) {
+		fprintf(stderr, "Invalid loop count or block size\n");
+		return 1;
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	assert(master >= 0);
+	assert(!grantpt(master));
+	assert(!unlockpt(master));
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	assert(slave >= 0);
+	setup_slave(slave);
+
+	buf = malloc(block_size);
+	assert(buf);
+	/* printable data, none of it special to the line discipline */
+	for (i = 0; i < block_size; i++)
+		buf[i] = 'a' + i % 26;
+
+	total = (unsigned long long)loops * block_size;
+
+	pid = fork();
+	assert(pid >= 0);
+
+	if (!pid) {
+		while (done < total) {
+			ret = read(slave, buf, block_size);
+			assert(ret > 0);
+			done += ret;
+		}
+		exit(0);
+	}
+
+	/* keep the master open until the reader is done, or it hangs up */
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < loops; i++) {
+		char *p = buf;
+		int left = block_size;
+
+		while (left) {
+			ret = write(master, p, left);
+			assert(ret > 0);
+			p += ret;
+			left -= ret;
+		}
+	}
+
+	retpid = waitpid(pid, &wait_stat, 0);
+	assert((retpid == pid) && WIFEXITED(wait_stat));
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	close(slave);
+	close(master);
+	free(buf);
+
+	result_usec = diff.tv_sec * 1000000;
+	result_usec += diff.tv_usec;
+	if (!result_usec)
+		result_usec = 1;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# Transferred %llu bytes through a pty (%s mode)\n\n",
+		       total, cooked ? "cooked" : "raw");
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf MB/sec\n",
+		       (double)total / (double)result_usec);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -13,6 +13,8 @@
  * Available subsystem list:
  *  sched ... scheduler and IPC mechanism
  *  mem   ... memory access performance
+ *  tty   ... terminal input processing
+ *  random ... random number generation
  *
  */
 
@@ -42,6 +44,9 @@ static struct bench_suite sched_suites[] = {
 	{ "pipe",
 	  "Flood of communication over pipe() between two processes",
 	  bench_sched_pipe      },
+	{ "sem",
+	  "semop() scalability on one SysV semaphore array",
+	  bench_sched_sem       },
 	suite_all,
 	{ NULL,
 	  NULL,
@@ -58,6 +63,26 @@ static struct bench_suite mem_suites[] = {
 	  NULL             }
 };
 
+static struct bench_suite tty_suites[] = {
+	{ "pty",
+	  "Bulk input through a pseudo terminal",
+	  bench_tty_pty },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL          }
+};
+
+static struct bench_suite random_suites[] = {
+	{ "urandom",
+	  "Parallel reads from /dev/urandom",
+	  bench_random_urandom },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL                 }
+};
+
 struct bench_subsys {
 	const char *name;
 	const char *summary;
@@ -71,6 +96,12 @@ static struct bench_subsys subsystems[] = {
 	{ "mem",
 	  "memory access performance",
 	  mem_suites },
+	{ "tty",
+	  "terminal input processing",
+	  tty_suites },
+	{ "random",
+	  "random number generation",
+	  random_suites },
 	{ "all",		/* sentinel: easy for help */
 	  "test all subsystem (pseudo subsystem)",
 	  NULL },
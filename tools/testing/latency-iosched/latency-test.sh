@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Reproducer for the latency io scheduler: one random reader with a
+# completion latency target shares a device with bulk readers that have
+# none.  With "latency" the hi job's completion latencies should stay near
+# the target; compare with deadline or cfq.
+#
+# usage: latency-test.sh [-s scheduler] [-t target_usec] [-r runtime] [dev]
+#
+# Without a device, scsi_debug is loaded with a one jiffy delay to stand in
+# for a fast device.  brd can't be used, it doesn't go through an io
+# scheduler.
+#
+# Needs root, fio and CONFIG_BLK_CGROUP.
+
+SCHED=latency
+TARGET=2000
+RUNTIME=30
+HERE=$(dirname "$0")
+
+while getopts s:t:r: opt; do
+	case $opt in
+	s) SCHED=$OPTARG ;;
+	t) TARGET=$OPTARG ;;
+	r) RUNTIME=$OPTARG ;;
+	*) sed -n 's/^# usage: /usage: /p' "$0"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+DEV=$1
+
+die() {
+	echo "$*" >&2
+	exit 1
+}
+
+if [ -z "$DEV" ]; then
+	modprobe scsi_debug delay=1 max_queue=128 dev_size_mb=1024 ||
+		die "can't load scsi_debug"
+	udevadm settle 2>/dev/null
+	for b in /sys/bus/pseudo/drivers/scsi_debug/adapter*/host*/target*/*/block/*; do
+		DEV=/dev/$(basename "$b")
+	done
+	[ -b "$DEV" ] || die "no scsi_debug disk found"
+fi
+
+NAME=$(basename "$(readlink -f "$DEV")")
+echo "$SCHED" > /sys/block/$NAME/queue/scheduler ||
+	die "can't select $SCHED for $NAME"
+
+CG=$(awk '$3 == "cgroup" && $4 ~ /blkio/ { print $2; exit }' /proc/mounts)
+if [ -z "$CG" ]; then
+	CG=/cgroup/blkio
+	mkdir -p $CG
+	mount -t cgroup -o blkio none $CG || die "can't mount blkio cgroup"
+fi
+
+mkdir -p $CG/lat-hi $CG/lat-lo
+if [ -e $CG/lat-hi/blkio.latency.target_device ]; then
+	echo "$(cat /sys/block/$NAME/dev) $TARGET" > \
+		$CG/lat-hi/blkio.latency.target_device
+fi
+
+echo "$NAME: scheduler $SCHED, target ${TARGET}us, ${RUNTIME}s"
+DEV=$DEV RUNTIME=$RUNTIME fio "$HERE/latency.fio"
+
+rmdir $CG/lat-hi $CG/lat-lo